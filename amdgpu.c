@@ -7,6 +7,7 @@
 #include <amdgpu.h>
 #include <amdgpu_drm.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,6 +30,12 @@
 struct amdgpu_priv {
 	struct dri_driver dri;
 	int drm_version;
+	/*
+	 * Loading radeonsi and creating its screen is deferred until a tiled buffer needs it, as
+	 * many processes only ever touch linear ones. 0 until tried, then 1 or a negative errno.
+	 */
+	int dri_status;
+	pthread_mutex_t dri_lock;
 };
 
 const static uint32_t render_target_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMAT_ARGB8888,
@@ -39,6 +46,38 @@ const static uint32_t texture_source_formats[] = { DRM_FORMAT_GR88,	      DRM_FO
 						   DRM_FORMAT_NV21,	      DRM_FORMAT_NV12,
 						   DRM_FORMAT_YVU420_ANDROID, DRM_FORMAT_YVU420 };
 
+/*
+ * Sets up the DRI driver on first use. Safe to call from any thread; only the first call does
+ * any work, and a failure is remembered rather than retried.
+ */
+static int amdgpu_dri_init(struct driver *drv)
+{
+	struct amdgpu_priv *priv = drv->priv;
+	int status = __atomic_load_n(&priv->dri_status, __ATOMIC_ACQUIRE);
+
+	if (status)
+		return status < 0 ? status : 0;
+
+	pthread_mutex_lock(&priv->dri_lock);
+	status = priv->dri_status;
+	if (!status) {
+		status = dri_init(drv, DRI_PATH, "radeonsi") ? -ENODEV : 1;
+		if (status < 0)
+			drv_log("Failed to load %s\n", DRI_PATH);
+		__atomic_store_n(&priv->dri_status, status, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&priv->dri_lock);
+
+	return status < 0 ? status : 0;
+}
+
+static bool amdgpu_dri_loaded(struct driver *drv)
+{
+	struct amdgpu_priv *priv = drv->priv;
+
+	return __atomic_load_n(&priv->dri_status, __ATOMIC_ACQUIRE) > 0;
+}
+
 static int amdgpu_init(struct driver *drv)
 {
 	struct amdgpu_priv *priv;
@@ -59,14 +98,13 @@ static int amdgpu_init(struct driver *drv)
 	priv->drm_version = drm_version->version_minor;
 	drmFreeVersion(drm_version);
 
+	/*
+	 * The DRI driver is only loaded once a tiled combination needs it. If that fails, those
+	 * combinations are allocated linear instead, so init doesn't depend on it.
+	 */
+	pthread_mutex_init(&priv->dri_lock, NULL);
 	drv->priv = priv;
 
-	if (dri_init(drv, DRI_PATH, "radeonsi")) {
-		free(priv);
-		drv->priv = NULL;
-		return -ENODEV;
-	}
-
 	metadata.tiling = TILE_TYPE_LINEAR;
 	metadata.priority = 1;
 	metadata.modifier = DRM_FORMAT_MOD_LINEAR;
@@ -133,7 +171,12 @@ static int amdgpu_init(struct driver *drv)
 
 static void amdgpu_close(struct driver *drv)
 {
-	dri_close(drv);
+	struct amdgpu_priv *priv = drv->priv;
+
+	if (amdgpu_dri_loaded(drv))
+		dri_close(drv);
+
+	pthread_mutex_destroy(&priv->dri_lock);
 	free(drv->priv);
 	drv->priv = NULL;
 }
@@ -168,10 +211,15 @@ static int amdgpu_create_bo_linear(struct bo *bo, uint32_t width, uint32_t heigh
 	if (ret < 0)
 		return ret;
 
-	for (plane = 0; plane < bo->meta.num_planes; plane++)
+	/*
+	 * Tiled combinations fall back to this too, so the layout is recorded explicitly: importers
+	 * go by it rather than by the combination.
+	 */
+	bo->meta.tiling = TILE_TYPE_LINEAR;
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
 		bo->handles[plane].u32 = gem_create.out.handle;
-
-	bo->meta.format_modifiers[0] = DRM_FORMAT_MOD_LINEAR;
+		bo->meta.format_modifiers[plane] = DRM_FORMAT_MOD_LINEAR;
+	}
 
 	return 0;
 }
@@ -179,6 +227,7 @@ static int amdgpu_create_bo_linear(struct bo *bo, uint32_t width, uint32_t heigh
 static int amdgpu_create_bo(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 			    uint64_t use_flags)
 {
+	int ret;
 	struct combination *combo;
 
 	combo = drv_get_combination(bo->drv, format, use_flags);
@@ -207,7 +256,10 @@ static int amdgpu_create_bo(struct bo *bo, uint32_t width, uint32_t height, uint
 			width = ALIGN(width, 256 / bytes_per_pixel);
 		}
 
-		return dri_bo_create(bo, width, height, format, use_flags);
+		/* Without a working DRI driver, tiled combinations degrade to linear ones. */
+		ret = amdgpu_dri_init(bo->drv);
+		if (!ret)
+			return dri_bo_create(bo, width, height, format, use_flags);
 	}
 
 	return amdgpu_create_bo_linear(bo, width, height, format, use_flags);
@@ -217,15 +269,27 @@ static int amdgpu_create_bo_with_modifiers(struct bo *bo, uint32_t width, uint32
 					   uint32_t format, const uint64_t *modifiers,
 					   uint32_t count)
 {
+	int ret;
 	bool only_use_linear = true;
+	bool has_linear = false;
 
-	for (uint32_t i = 0; i < count; ++i)
+	for (uint32_t i = 0; i < count; ++i) {
 		if (modifiers[i] != DRM_FORMAT_MOD_LINEAR)
 			only_use_linear = false;
+		else
+			has_linear = true;
+	}
 
 	if (only_use_linear)
 		return amdgpu_create_bo_linear(bo, width, height, format, BO_USE_SCANOUT);
 
+	ret = amdgpu_dri_init(bo->drv);
+	if (ret) {
+		if (has_linear)
+			return amdgpu_create_bo_linear(bo, width, height, format, BO_USE_SCANOUT);
+		return ret;
+	}
+
 	return dri_bo_create_with_modifiers(bo, width, height, format, modifiers, count);
 }
 
@@ -241,10 +305,19 @@ static int amdgpu_import_bo(struct bo *bo, struct drv_import_fd_data *data)
 		dri_tiling = combo->metadata.tiling == TILE_TYPE_DRI;
 	}
 
-	if (dri_tiling)
+	if (dri_tiling) {
+		/*
+		 * Linear fallbacks carry DRM_FORMAT_MOD_LINEAR. Anything else may be tiled, and
+		 * without the DRI driver its layout can't be reproduced.
+		 */
+		int ret = amdgpu_dri_init(bo->drv);
+		if (ret)
+			return ret;
+
 		return dri_bo_import(bo, data);
-	else
-		return drv_prime_bo_import(bo, data);
+	}
+
+	return drv_prime_bo_import(bo, data);
 }
 
 static int amdgpu_destroy_bo(struct bo *bo)
@@ -294,6 +367,16 @@ static int amdgpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
 	if (bo->priv)
 		return 0;
 
+	/* Poll first; only block if the buffer is actually busy. */
+	memset(&wait_idle, 0, sizeof(wait_idle));
+	wait_idle.in.handle = bo->handles[0].u32;
+	wait_idle.in.timeout = 0;
+
+	ret = drmCommandWriteRead(bo->drv->fd, DRM_AMDGPU_GEM_WAIT_IDLE, &wait_idle,
+				  sizeof(wait_idle));
+	if (ret == 0 && !wait_idle.out.status)
+		return 0;
+
 	memset(&wait_idle, 0, sizeof(wait_idle));
 	wait_idle.in.handle = bo->handles[0].u32;
 	wait_idle.in.timeout = AMDGPU_TIMEOUT_INFINITE;
@@ -312,6 +395,26 @@ static int amdgpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
 	return 0;
 }
 
+static size_t amdgpu_num_planes_from_modifier(struct driver *drv, uint32_t format,
+					      uint64_t modifier)
+{
+	/*
+	 * gbm asks this right before importing a buffer with the same modifier, which loads the
+	 * DRI driver anyway. If that fails, the import has to be linear too.
+	 */
+	if (modifier == DRM_FORMAT_MOD_LINEAR || amdgpu_dri_init(drv))
+		return drv_num_planes_from_format(format);
+
+	return dri_num_planes_from_modifier(drv, format, modifier);
+}
+
+static void amdgpu_flush_queued(struct driver *drv)
+{
+	/* Nothing can be queued before the first tiled buffer. */
+	if (amdgpu_dri_loaded(drv))
+		dri_flush_queued(drv);
+}
+
 static uint32_t amdgpu_resolve_format(struct driver *drv, uint32_t format, uint64_t use_flags)
 {
 	switch (format) {
@@ -340,7 +443,9 @@ const struct backend backend_amdgpu = {
 	.bo_unmap = amdgpu_unmap_bo,
 	.bo_invalidate = amdgpu_bo_invalidate,
 	.resolve_format = amdgpu_resolve_format,
-	.num_planes_from_modifier = dri_num_planes_from_modifier,
+	.num_planes_from_modifier = amdgpu_num_planes_from_modifier,
+	.flush_queued = amdgpu_flush_queued,
+	.map_unlocked = true,
 };
 
 #endif
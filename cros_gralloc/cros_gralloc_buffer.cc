@@ -13,8 +13,8 @@ cros_gralloc_buffer::cros_gralloc_buffer(uint32_t id, struct bo *acquire_bo,
 					 struct cros_gralloc_handle *acquire_handle,
 					 int32_t reserved_region_fd, uint64_t reserved_region_size)
     : id_(id), bo_(acquire_bo), hnd_(acquire_handle), refcount_(1), lockcount_(0),
-      reserved_region_fd_(reserved_region_fd), reserved_region_size_(reserved_region_size),
-      reserved_region_addr_(nullptr)
+      has_resource_info_(false), reserved_region_fd_(reserved_region_fd),
+      reserved_region_size_(reserved_region_size), reserved_region_addr_(nullptr)
 {
 	assert(bo_);
 	num_planes_ = drv_bo_get_num_planes(bo_);
@@ -51,7 +51,7 @@ int32_t cros_gralloc_buffer::decrease_refcount()
 }
 
 int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_flags,
-				  uint8_t *addr[DRV_MAX_PLANES])
+				  uint8_t *addr[DRV_MAX_PLANES], bool sync)
 {
 	void *vaddr = nullptr;
 
@@ -67,28 +67,49 @@ int32_t cros_gralloc_buffer::lock(const struct rectangle *rect, uint32_t map_fla
 	}
 
 	if (map_flags) {
+		struct rectangle r = *rect;
+
+		if (!r.width && !r.height && !r.x && !r.y) {
+			/*
+			 * Android IMapper.hal: An accessRegion of all-zeros means the
+			 * entire buffer.
+			 */
+			r.width = drv_bo_get_width(bo_);
+			r.height = drv_bo_get_height(bo_);
+		}
+
 		if (lock_data_[0]) {
-			drv_bo_invalidate(bo_, lock_data_[0]);
-			vaddr = lock_data_[0]->vma->addr;
-		} else {
-			struct rectangle r = *rect;
-
-			if (!r.width && !r.height && !r.x && !r.y) {
-				/*
-				 * Android IMapper.hal: An accessRegion of all-zeros means the
-				 * entire buffer.
-				 */
-				r.width = drv_bo_get_width(bo_);
-				r.height = drv_bo_get_height(bo_);
+			struct vma *vma = lock_data_[0]->vma;
+
+			/* The first lock may have mapped only its own access region. */
+			if (vma->partial &&
+			    (r.x < vma->rect.x || r.y < vma->rect.y ||
+			     r.x + r.width > vma->rect.x + vma->rect.width ||
+			     r.y + r.height > vma->rect.y + vma->rect.height)) {
+				drv_log("Access region is outside that of the outstanding lock.\n");
+				return -EINVAL;
 			}
 
+			if (sync)
+				drv_bo_invalidate(bo_, lock_data_[0]);
+			vaddr = vma->addr;
+		} else if (sync) {
 			vaddr = drv_bo_map(bo_, &r, map_flags, &lock_data_[0], 0);
+		} else {
+			vaddr = drv_bo_map_unsynced(bo_, &r, map_flags, &lock_data_[0], 0);
 		}
 
 		if (vaddr == MAP_FAILED) {
 			drv_log("Mapping failed.\n");
 			return -EFAULT;
 		}
+
+		/*
+		 * Clients only write inside their access region, so the flush on unlock only has
+		 * to push back the regions of the write locks sharing the mapping.
+		 */
+		if (map_flags & BO_MAP_WRITE)
+			drv_bo_add_dirty_rect(bo_, lock_data_[0], &r);
 	}
 
 	for (uint32_t plane = 0; plane < num_planes_; plane++)
@@ -146,7 +167,7 @@ int32_t cros_gralloc_buffer::lock(uint32_t map_flags, uint8_t *addr[DRV_MAX_PLAN
 }
 #endif
 
-int32_t cros_gralloc_buffer::unlock()
+int32_t cros_gralloc_buffer::unlock(int32_t *release_fence)
 {
 	if (lockcount_ <= 0) {
 		drv_log("Buffer was not locked.\n");
@@ -155,7 +176,7 @@ int32_t cros_gralloc_buffer::unlock()
 
 	if (!--lockcount_) {
 		if (lock_data_[0]) {
-			drv_bo_flush_or_unmap(bo_, lock_data_[0]);
+			drv_bo_flush_or_unmap_fenced(bo_, lock_data_[0], release_fence);
 			lock_data_[0] = nullptr;
 		}
 	}
@@ -166,7 +187,27 @@ int32_t cros_gralloc_buffer::unlock()
 int32_t cros_gralloc_buffer::resource_info(uint32_t strides[DRV_MAX_PLANES],
 					   uint32_t offsets[DRV_MAX_PLANES])
 {
-	return drv_resource_info(bo_, strides, offsets);
+	if (!has_resource_info_.load(std::memory_order_acquire)) {
+		std::lock_guard<std::mutex> lock(resource_info_mutex_);
+		if (!has_resource_info_.load(std::memory_order_relaxed)) {
+			memset(resource_strides_, 0, sizeof(resource_strides_));
+			memset(resource_offsets_, 0, sizeof(resource_offsets_));
+			int32_t ret = drv_resource_info(bo_, resource_strides_, resource_offsets_);
+			if (ret)
+				return ret;
+
+			has_resource_info_.store(true, std::memory_order_release);
+		}
+	}
+
+	memcpy(strides, resource_strides_, sizeof(resource_strides_));
+	memcpy(offsets, resource_offsets_, sizeof(resource_offsets_));
+	return 0;
+}
+
+int32_t cros_gralloc_buffer::get_acquire_fence(int32_t acquire_fence, uint32_t map_flags)
+{
+	return drv_bo_get_acquire_fence(bo_, acquire_fence, map_flags);
 }
 
 int32_t cros_gralloc_buffer::invalidate()
@@ -183,7 +224,7 @@ int32_t cros_gralloc_buffer::invalidate()
 	return 0;
 }
 
-int32_t cros_gralloc_buffer::flush()
+int32_t cros_gralloc_buffer::flush(int32_t *release_fence, const struct rectangle *rect)
 {
 	if (lockcount_ <= 0) {
 		drv_log("Buffer was not locked.\n");
@@ -191,7 +232,10 @@ int32_t cros_gralloc_buffer::flush()
 	}
 
 	if (lock_data_[0]) {
-		return drv_bo_flush(bo_, lock_data_[0]);
+		if (rect)
+			drv_bo_add_dirty_rect(bo_, lock_data_[0], rect);
+
+		return drv_bo_flush_fenced(bo_, lock_data_[0], release_fence);
 	}
 
 	return 0;
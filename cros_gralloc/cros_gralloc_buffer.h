@@ -10,6 +10,9 @@
 #include "../drv.h"
 #include "cros_gralloc_helpers.h"
 
+#include <atomic>
+#include <mutex>
+
 class cros_gralloc_buffer
 {
       public:
@@ -24,16 +27,30 @@ class cros_gralloc_buffer
 	int32_t increase_refcount();
 	int32_t decrease_refcount();
 
+	/*
+	 * Without sync, the mapping isn't invalidated and mustn't be read until invalidate() has
+	 * been called, for when the buffer still has writes pending.
+	 */
 	int32_t lock(const struct rectangle *rect, uint32_t map_flags,
-		     uint8_t *addr[DRV_MAX_PLANES]);
+		     uint8_t *addr[DRV_MAX_PLANES], bool sync = true);
 #ifdef USE_GRALLOC1
 	int32_t lock(uint32_t map_flags, uint8_t *addr[DRV_MAX_PLANES]);
 #endif
-	int32_t unlock();
+	int32_t unlock(int32_t *release_fence);
 	int32_t resource_info(uint32_t strides[DRV_MAX_PLANES], uint32_t offsets[DRV_MAX_PLANES]);
 
+	/*
+	 * Takes ownership of acquire_fence and returns one that also covers device work the
+	 * buffer is implicitly synchronised with, or -1 if nothing is pending.
+	 */
+	int32_t get_acquire_fence(int32_t acquire_fence, uint32_t map_flags);
 	int32_t invalidate();
-	int32_t flush();
+
+	/*
+	 * With a rect, only the part of the locked region the caller wrote is pushed back to the
+	 * device. Without one, all of it is.
+	 */
+	int32_t flush(int32_t *release_fence, const struct rectangle *rect = nullptr);
 
 	int32_t get_reserved_region(void **reserved_region_addr, uint64_t *reserved_region_size);
 
@@ -53,6 +70,15 @@ class cros_gralloc_buffer
 
 	struct mapping *lock_data_[DRV_MAX_PLANES];
 
+	/*
+	 * The layout doesn't change after allocation, so the backend is only asked once. Queries
+	 * don't hold the driver's mutex, see cros_gralloc_driver::resource_info().
+	 */
+	std::mutex resource_info_mutex_;
+	std::atomic<bool> has_resource_info_;
+	uint32_t resource_strides_[DRV_MAX_PLANES];
+	uint32_t resource_offsets_[DRV_MAX_PLANES];
+
 	/* Optional additional shared memory region attached to some gralloc4 buffers. */
 	int32_t reserved_region_fd_;
 	uint64_t reserved_region_size_;
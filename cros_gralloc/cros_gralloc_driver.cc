@@ -394,11 +394,26 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	hnd->base.numFds = num_fds;
 	hnd->base.numInts = num_ints;
 	hnd->num_planes = num_planes;
+	/*
+	 * native_handle_close() closes every fd slot on its own, so planes that share a buffer still
+	 * need distinct fds. Duplicate the fd of an earlier plane with the same handle rather than
+	 * exporting it again.
+	 */
 	for (size_t plane = 0; plane < num_planes; plane++) {
-		hnd->fds[plane] = drv_bo_get_plane_fd(bo, plane);
+		size_t prev;
+		for (prev = 0; prev < plane; prev++)
+			if (drv_bo_get_plane_handle(bo, prev).u32 ==
+			    drv_bo_get_plane_handle(bo, plane).u32)
+				break;
+
+		if (prev < plane && hnd->fds[prev] >= 0)
+			hnd->fds[plane] = fcntl(hnd->fds[prev], F_DUPFD_CLOEXEC, 0);
+		else
+			hnd->fds[plane] = drv_bo_get_plane_fd(bo, plane);
 		hnd->strides[plane] = drv_bo_get_plane_stride(bo, plane);
 		hnd->offsets[plane] = drv_bo_get_plane_offset(bo, plane);
 		hnd->sizes[plane] = drv_bo_get_plane_size(bo, plane);
+		hnd->plane_modifiers[plane] = drv_bo_get_plane_format_modifier(bo, plane);
 #ifdef USE_GRALLOC1
 		mod = drv_bo_get_plane_format_modifier(bo, plane);
 		hnd->format_modifiers[2 * plane] = static_cast<uint32_t>(mod >> 32);
@@ -431,17 +446,30 @@ int32_t cros_gralloc_driver::allocate(const struct cros_gralloc_buffer_descripto
 	hnd->droid_format = descriptor->droid_format;
 #endif
 	hnd->total_size = descriptor->reserved_region_size + bo->meta.total_size;
+	hnd->layout_version = cros_gralloc_layout_version;
+	hnd->tiling = bo->meta.tiling;
+	hnd->blob_flags = bo->meta.blob_flags;
+	hnd->bo_total_size = bo->meta.total_size;
 	hnd->name_offset = handle_data_size;
 
 	name = (char *)(&hnd->base.data[hnd->name_offset]);
 	snprintf(name, descriptor->name.size() + 1, "%s", descriptor->name.c_str());
 
+	buffer_key key;
+	if (get_buffer_key(hnd, &key)) {
+		native_handle_close(&hnd->base);
+		delete hnd;
+		drv_bo_destroy(bo);
+		return -EINVAL;
+	}
+
 	id = drv_bo_get_plane_handle(bo, 0).u32;
 	auto buffer = new cros_gralloc_buffer(id, bo, hnd, hnd->fds[hnd->num_planes],
 					      hnd->reserved_region_size);
 
 	std::lock_guard<std::mutex> lock(mutex_);
-	buffers_.emplace(id, buffer);
+	std::lock_guard<std::shared_timed_mutex> handles_lock(handles_mutex_);
+	buffers_[drv][key] = buffer;
 	handles_.emplace(hnd, std::make_pair(buffer, 1));
 	*out_handle = reinterpret_cast<buffer_handle_t>(hnd);
 	return 0;
@@ -459,26 +487,31 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 		return -EINVAL;
 	}
 
-	drv = (hnd->from_kms) ? drv_kms_ : drv_render_;
+	drv = get_driver(hnd);
 
 	auto buffer = get_buffer(hnd);
 	if (buffer) {
+		std::lock_guard<std::shared_timed_mutex> handles_lock(handles_mutex_);
 		handles_[hnd].second++;
 		buffer->increase_refcount();
 		return 0;
 	}
 
-	if (drmPrimeFDToHandle(drv_get_fd(drv), hnd->fds[0], &id)) {
-		drv_log("drmPrimeFDToHandle failed.\n");
-		return -errno;
-	}
+	buffer_key key;
+	int ret = get_buffer_key(hnd, &key);
+	if (ret)
+		return ret;
 
-	if (buffers_.count(id)) {
-		buffer = buffers_[id];
+	/* Another handle of a dma-buf this device already has only needs a reference. */
+	auto &device_buffers = buffers_[drv];
+	auto known = device_buffers.find(key);
+	if (known != device_buffers.end()) {
+		buffer = known->second;
 		buffer->increase_refcount();
 	} else {
 		struct bo *bo;
 		struct drv_import_fd_data data;
+		memset(&data, 0, sizeof(data));
 		data.format = hnd->format;
 
 		data.width = hnd->width;
@@ -488,8 +521,18 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 		memcpy(data.fds, hnd->fds, sizeof(data.fds));
 		memcpy(data.strides, hnd->strides, sizeof(data.strides));
 		memcpy(data.offsets, hnd->offsets, sizeof(data.offsets));
-		for (uint32_t plane = 0; plane < DRV_MAX_PLANES; plane++) {
-			data.format_modifiers[plane] = hnd->format_modifier;
+		if (hnd->layout_version == cros_gralloc_layout_version) {
+			data.has_layout = true;
+			data.tiling = hnd->tiling;
+			data.blob_flags = hnd->blob_flags;
+			data.total_size = hnd->bo_total_size;
+			memcpy(data.sizes, hnd->sizes, sizeof(data.sizes));
+			memcpy(data.format_modifiers, hnd->plane_modifiers,
+			       sizeof(data.format_modifiers));
+		} else {
+			for (uint32_t plane = 0; plane < DRV_MAX_PLANES; plane++) {
+				data.format_modifiers[plane] = hnd->format_modifier;
+			}
 		}
 
 		bo = drv_bo_import(drv, &data);
@@ -500,9 +543,10 @@ int32_t cros_gralloc_driver::retain(buffer_handle_t handle)
 
 		buffer = new cros_gralloc_buffer(id, bo, nullptr, hnd->fds[hnd->num_planes],
 						 hnd->reserved_region_size);
-		buffers_.emplace(id, buffer);
+		device_buffers.emplace(key, buffer);
 	}
 
+	std::lock_guard<std::shared_timed_mutex> handles_lock(handles_mutex_);
 	handles_.emplace(hnd, std::make_pair(buffer, 1));
 	return 0;
 }
@@ -523,11 +567,21 @@ int32_t cros_gralloc_driver::release(buffer_handle_t handle)
 		return -EINVAL;
 	}
 
-	if (!--handles_[hnd].second)
-		handles_.erase(hnd);
+	{
+		std::lock_guard<std::shared_timed_mutex> handles_lock(handles_mutex_);
+		if (!--handles_[hnd].second)
+			handles_.erase(hnd);
+	}
 
 	if (buffer->decrease_refcount() == 0) {
-		buffers_.erase(buffer->get_id());
+		/* Only the device the buffer was added to forgets it; the other keeps its own. */
+		auto &device_buffers = buffers_[get_driver(hnd)];
+		for (auto it = device_buffers.begin(); it != device_buffers.end(); ++it) {
+			if (it->second == buffer) {
+				device_buffers.erase(it);
+				break;
+			}
+		}
 		delete buffer;
 	}
 
@@ -538,24 +592,65 @@ int32_t cros_gralloc_driver::lock(buffer_handle_t handle, int32_t acquire_fence,
 				  bool close_acquire_fence, const struct rectangle *rect,
 				  uint32_t map_flags, uint8_t *addr[DRV_MAX_PLANES])
 {
-	int32_t ret = cros_gralloc_sync_wait(acquire_fence, close_acquire_fence);
-	if (ret)
-		return ret;
+	int32_t ret, sync_ret, release_fence;
 
-	std::lock_guard<std::mutex> lock(mutex_);
-	auto hnd = cros_gralloc_convert_handle(handle);
-	if (!hnd) {
-		drv_log("Invalid handle.\n");
-		return -EINVAL;
+	if (acquire_fence >= 0 && !close_acquire_fence) {
+		acquire_fence = fcntl(acquire_fence, F_DUPFD_CLOEXEC, 0);
+		if (acquire_fence < 0) {
+			drv_log("Unable to dup acquire fence, err = %s\n", strerror(errno));
+			return -errno;
+		}
 	}
 
-	auto buffer = get_buffer(hnd);
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto hnd = cros_gralloc_convert_handle(handle);
+		auto buffer = hnd ? get_buffer(hnd) : nullptr;
+		if (!buffer) {
+			drv_log("Invalid handle or reference.\n");
+			if (acquire_fence >= 0)
+				close(acquire_fence);
+			return -EINVAL;
+		}
+
+		/* A single wait then covers writers that only sync implicitly too. */
+		acquire_fence = buffer->get_acquire_fence(acquire_fence, map_flags);
+
+		/*
+		 * The buffer is mapped while the fence is still pending, so that only syncing the
+		 * mapping waits for it and the two latencies don't add up.
+		 */
+		ret = buffer->lock(rect, map_flags, addr, acquire_fence < 0);
+		if (ret || acquire_fence < 0) {
+			if (acquire_fence >= 0)
+				close(acquire_fence);
+			return ret;
+		}
+	}
+
+	ret = cros_gralloc_sync_wait(acquire_fence, /*close_fence=*/false);
+	close(acquire_fence);
+
+	/*
+	 * The contents may be incomplete if the fence failed, but the mapping is synced regardless
+	 * so that unlocking it again doesn't write stale data back.
+	 */
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto hnd = cros_gralloc_convert_handle(handle);
+	auto buffer = hnd ? get_buffer(hnd) : nullptr;
 	if (!buffer) {
-		drv_log("Invalid Reference.\n");
+		drv_log("Buffer released while locking.\n");
 		return -EINVAL;
 	}
 
-	return buffer->lock(rect, map_flags, addr);
+	sync_ret = buffer->invalidate();
+	if (!ret)
+		ret = sync_ret;
+
+	if (ret && !buffer->unlock(&release_fence) && release_fence >= 0)
+		close(release_fence);
+
+	return ret;
 }
 
 #ifdef USE_GRALLOC1
@@ -604,9 +699,11 @@ int32_t cros_gralloc_driver::unlock(buffer_handle_t handle, int32_t *release_fen
 	 *
 	 * "A value of -1 indicates that the caller may access the buffer immediately without
 	 * waiting on a fence."
+	 *
+	 * Otherwise it signals once the CPU's writes have reached the buffer.
 	 */
 	*release_fence = -1;
-	return buffer->unlock();
+	return buffer->unlock(release_fence);
 }
 
 int32_t cros_gralloc_driver::invalidate(buffer_handle_t handle)
@@ -628,7 +725,8 @@ int32_t cros_gralloc_driver::invalidate(buffer_handle_t handle)
 	return buffer->invalidate();
 }
 
-int32_t cros_gralloc_driver::flush(buffer_handle_t handle, int32_t *release_fence)
+int32_t cros_gralloc_driver::flush(buffer_handle_t handle, int32_t *release_fence,
+				   const struct rectangle *rect)
 {
 	std::lock_guard<std::mutex> lock(mutex_);
 
@@ -649,9 +747,11 @@ int32_t cros_gralloc_driver::flush(buffer_handle_t handle, int32_t *release_fenc
 	 *
 	 * "A value of -1 indicates that the caller may access the buffer immediately without
 	 * waiting on a fence."
+	 *
+	 * Otherwise it signals once the CPU's writes have reached the buffer.
 	 */
 	*release_fence = -1;
-	return buffer->flush();
+	return buffer->flush(release_fence, rect);
 }
 
 int32_t cros_gralloc_driver::get_backing_store(buffer_handle_t handle, uint64_t *out_store)
@@ -674,6 +774,9 @@ int32_t cros_gralloc_driver::get_backing_store(buffer_handle_t handle, uint64_t
 	}
 
 	*out_store = static_cast<uint64_t>(buffer->get_id());
+	/* Keep the stores of buffers on different devices apart. */
+	if (is_kmsro_enabled() && hnd->from_kms)
+		*out_store |= 1ull << 32;
 #endif
 	return 0;
 }
@@ -681,7 +784,8 @@ int32_t cros_gralloc_driver::get_backing_store(buffer_handle_t handle, uint64_t
 int32_t cros_gralloc_driver::resource_info(buffer_handle_t handle, uint32_t strides[DRV_MAX_PLANES],
 					   uint32_t offsets[DRV_MAX_PLANES])
 {
-	std::lock_guard<std::mutex> lock(mutex_);
+	/* Queried per frame by some clients, so it doesn't wait behind locks of other buffers. */
+	std::shared_lock<std::shared_timed_mutex> handles_lock(handles_mutex_);
 
 	auto hnd = cros_gralloc_convert_handle(handle);
 	if (!hnd) {
@@ -689,13 +793,13 @@ int32_t cros_gralloc_driver::resource_info(buffer_handle_t handle, uint32_t stri
 		return -EINVAL;
 	}
 
-	auto buffer = get_buffer(hnd);
-	if (!buffer) {
+	auto entry = handles_.find(hnd);
+	if (entry == handles_.end()) {
 		drv_log("Invalid Reference.\n");
 		return -EINVAL;
 	}
 
-	return buffer->resource_info(strides, offsets);
+	return entry->second.first->resource_info(strides, offsets);
 }
 
 int32_t cros_gralloc_driver::get_reserved_region(buffer_handle_t handle,
@@ -735,6 +839,25 @@ cros_gralloc_buffer *cros_gralloc_driver::get_buffer(cros_gralloc_handle_t hnd)
 	return nullptr;
 }
 
+struct driver *cros_gralloc_driver::get_driver(cros_gralloc_handle_t hnd)
+{
+	/* Buffers are allocated, and imported, on the device that displays them or renders them. */
+	return (hnd->from_kms) ? drv_kms_ : drv_render_;
+}
+
+int32_t cros_gralloc_driver::get_buffer_key(cros_gralloc_handle_t hnd, buffer_key *key)
+{
+	struct stat st;
+
+	if (fstat(hnd->fds[0], &st)) {
+		drv_log("Failed to stat the buffer's dma-buf: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	*key = std::make_pair(st.st_dev, st.st_ino);
+	return 0;
+}
+
 void cros_gralloc_driver::for_each_handle(
     const std::function<void(cros_gralloc_handle_t)> &function)
 {
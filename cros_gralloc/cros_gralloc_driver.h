@@ -10,8 +10,12 @@
 #include "cros_gralloc_buffer.h"
 
 #include <functional>
+#include <map>
 #include <mutex>
+#include <shared_mutex>
+#include <sys/stat.h>
 #include <unordered_map>
+#include <utility>
 
 class cros_gralloc_driver
 {
@@ -27,6 +31,10 @@ class cros_gralloc_driver
 	int32_t retain(buffer_handle_t handle);
 	int32_t release(buffer_handle_t handle);
 
+	/*
+	 * Maps the buffer while acquire_fence is still pending, and returns once it has signalled
+	 * and the mapping has been synced.
+	 */
 	int32_t lock(buffer_handle_t handle, int32_t acquire_fence, bool close_acquire_fence,
 		     const struct rectangle *rect, uint32_t map_flags,
 		     uint8_t *addr[DRV_MAX_PLANES]);
@@ -37,7 +45,9 @@ class cros_gralloc_driver
 	int32_t unlock(buffer_handle_t handle, int32_t *release_fence);
 
 	int32_t invalidate(buffer_handle_t handle);
-	int32_t flush(buffer_handle_t handle, int32_t *release_fence);
+	/* See cros_gralloc_buffer::flush() for rect. */
+	int32_t flush(buffer_handle_t handle, int32_t *release_fence,
+		      const struct rectangle *rect = nullptr);
 
 	int32_t get_backing_store(buffer_handle_t handle, uint64_t *out_store);
 	int32_t resource_info(buffer_handle_t handle, uint32_t strides[DRV_MAX_PLANES],
@@ -59,12 +69,27 @@ class cros_gralloc_driver
       private:
 	cros_gralloc_driver(cros_gralloc_driver const &);
 	cros_gralloc_driver operator=(cros_gralloc_driver const &);
+	/* Identifies a dma-buf whichever fd of it a handle carries, see drv_import_entry. */
+	using buffer_key = std::pair<dev_t, ino_t>;
+
 	cros_gralloc_buffer *get_buffer(cros_gralloc_handle_t hnd);
+	struct driver *get_driver(cros_gralloc_handle_t hnd);
+	int32_t get_buffer_key(cros_gralloc_handle_t hnd, buffer_key *key);
 
 	struct driver *drv_kms_;
 	struct driver *drv_render_;
 	std::mutex mutex_;
-	std::unordered_map<uint32_t, cros_gralloc_buffer *> buffers_;
+	/*
+	 * resource_info() only looks its buffer up, so it takes this instead of mutex_. Changes to
+	 * handles_ hold both, and buffers are deleted only after their last handle is erased.
+	 */
+	std::shared_timed_mutex handles_mutex_;
+	/*
+	 * Buffers per device, by dma-buf. With kmsro a dma-buf known to both the display and the
+	 * render device has an entry, and a GEM handle, on each. Retaining another handle of a
+	 * dma-buf the device already has doesn't import it again.
+	 */
+	std::unordered_map<struct driver *, std::map<buffer_key, cros_gralloc_buffer *>> buffers_;
 	std::unordered_map<cros_gralloc_handle_t, std::pair<cros_gralloc_buffer *, int32_t>>
 	    handles_;
 };
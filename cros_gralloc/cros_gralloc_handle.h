@@ -41,6 +41,15 @@ struct cros_gralloc_handle {
 	uint32_t num_planes;
 	uint64_t reserved_region_size;
 	uint64_t total_size; /* Total allocation size */
+	/*
+	 * The rest of the buffer's layout, so importers don't have to ask the kernel for it. Only
+	 * valid if layout_version is cros_gralloc_layout_version.
+	 */
+	uint32_t layout_version;
+	uint32_t tiling;
+	uint32_t blob_flags;
+	uint64_t plane_modifiers[DRV_MAX_PLANES];
+	uint64_t bo_total_size; /* Excludes the reserved region */
 	/*
 	 * Name is a null terminated char array located at handle->base.data[handle->name_offset].
 	 */
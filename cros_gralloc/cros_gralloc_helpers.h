@@ -15,6 +15,7 @@
 #include <system/window.h>
 
 constexpr uint32_t cros_gralloc_magic = 0xABCDDCBA;
+constexpr uint32_t cros_gralloc_layout_version = 2;
 constexpr uint32_t handle_data_size =
     ((sizeof(struct cros_gralloc_handle) - offsetof(cros_gralloc_handle, fds[0])) / sizeof(int));
 
@@ -9,6 +9,7 @@
 
 #include <cassert>
 #include <hardware/gralloc.h>
+#include <memory>
 #include <memory.h>
 
 struct gralloc0_module {
@@ -15,6 +15,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <cutils/native_handle.h>
@@ -24,6 +27,9 @@
 
 #define ALIGN(A, B) (((A) + (B)-1) / (B) * (B))
 #define ARRAY_SIZE(A) (sizeof(A) / sizeof(*(A)))
+#define MAX_HANDLE_FDS 8
+#define MAX_HANDLE_INTS 256
+#define RETAIN_ITERATIONS 100
 
 #define CHECK(cond)                                                                                \
 	do {                                                                                       \
@@ -633,6 +639,150 @@ static int test_async(struct gralloctest_context *ctx)
 	return 1;
 }
 
+/* Sends a buffer handle to another process, like binder does. */
+static int send_handle(int sock, buffer_handle_t handle)
+{
+	int header[2] = { handle->numFds, handle->numInts };
+	char control[CMSG_SPACE(sizeof(int) * MAX_HANDLE_FDS)];
+	struct iovec iov[2] = {
+		{ .iov_base = header, .iov_len = sizeof(header) },
+		{ .iov_base = (void *)(handle->data + handle->numFds),
+		  .iov_len = sizeof(int) * handle->numInts },
+	};
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+	struct cmsghdr *cmsg;
+
+	CHECK(handle->numFds > 0 && handle->numFds <= MAX_HANDLE_FDS);
+	CHECK(handle->numInts <= MAX_HANDLE_INTS);
+
+	memset(control, 0, sizeof(control));
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * handle->numFds);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * handle->numFds);
+	memcpy(CMSG_DATA(cmsg), handle->data, sizeof(int) * handle->numFds);
+
+	CHECK(sendmsg(sock, &msg, 0) ==
+	      (ssize_t)(sizeof(header) + sizeof(int) * handle->numInts));
+	return 1;
+}
+
+static native_handle_t *receive_handle(int sock)
+{
+	int header[2];
+	int ints[MAX_HANDLE_INTS];
+	char control[CMSG_SPACE(sizeof(int) * MAX_HANDLE_FDS)];
+	struct iovec iov[2] = {
+		{ .iov_base = header, .iov_len = sizeof(header) },
+		{ .iov_base = ints, .iov_len = sizeof(ints) },
+	};
+	struct msghdr msg = { .msg_iov = iov,
+			      .msg_iovlen = 2,
+			      .msg_control = control,
+			      .msg_controllen = sizeof(control) };
+	struct cmsghdr *cmsg;
+	native_handle_t *hnd;
+
+	if (recvmsg(sock, &msg, 0) < (ssize_t)sizeof(header))
+		return NULL;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int) * header[0]))
+		return NULL;
+
+	hnd = native_handle_create(header[0], header[1]);
+	if (hnd == NULL)
+		return NULL;
+
+	memcpy(hnd->data, CMSG_DATA(cmsg), sizeof(int) * header[0]);
+	memcpy(hnd->data + header[0], ints, sizeof(int) * header[1]);
+	return hnd;
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+/*
+ * Runs in a process that never saw the buffer: registers the received handle and unregisters it
+ * again, so that every registration imports the buffer afresh, and reports the average time a
+ * registration took, or a negative value on failure.
+ */
+static void retain_in_child(struct gralloctest_context *ctx, int sock)
+{
+	int i;
+	double start, total = 0, average = -1;
+	struct grallocinfo info;
+
+	grallocinfo_init(&info, 0, 0, 0, 0);
+	info.handle = receive_handle(sock);
+
+	for (i = 0; info.handle && i < RETAIN_ITERATIONS; i++) {
+		start = now_us();
+		if (!register_buffer(ctx->module, &info))
+			break;
+		total += now_us() - start;
+
+		if (!unregister_buffer(ctx->module, &info))
+			break;
+	}
+
+	if (info.handle && i == RETAIN_ITERATIONS)
+		average = total / RETAIN_ITERATIONS;
+
+	if (write(sock, &average, sizeof(average)) != sizeof(average))
+		_exit(1);
+
+	_exit(0);
+}
+
+/*
+ * This function measures how long registering a buffer allocated in another process takes,
+ * which is the cost of importing it.
+ */
+static int test_retain_latency(struct gralloctest_context *ctx)
+{
+	int status, socks[2];
+	pid_t pid;
+	double average;
+	struct grallocinfo info;
+
+	grallocinfo_init(&info, 512, 512, HAL_PIXEL_FORMAT_BGRA_8888,
+			 GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_SW_READ_RARELY);
+
+	CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) == 0);
+
+	/* Forked before allocating, so the child's gralloc hasn't seen the buffer. */
+	pid = fork();
+	CHECK(pid >= 0);
+	if (pid == 0) {
+		close(socks[0]);
+		retain_in_child(ctx, socks[1]);
+	}
+
+	close(socks[1]);
+	CHECK(allocate(ctx->device, &info));
+	CHECK(send_handle(socks[0], info.handle));
+	CHECK(read(socks[0], &average, sizeof(average)) == sizeof(average));
+	CHECK(waitpid(pid, &status, 0) == pid);
+	CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	close(socks[0]);
+
+	CHECK(average >= 0);
+	printf("retain of a buffer from another process: %.1f us average over %d\n", average,
+	       RETAIN_ITERATIONS);
+
+	CHECK(deallocate(ctx->device, &info));
+
+	return 1;
+}
+
 static const struct gralloc_testcase tests[] = {
 	{ "alloc_varying_sizes", test_alloc_varying_sizes, 1 },
 	{ "alloc_combinations", test_alloc_combinations, 1 },
@@ -643,6 +793,7 @@ static const struct gralloc_testcase tests[] = {
 	{ "ycbcr", test_ycbcr, 2 },
 	{ "yuv_info", test_yuv_info, 2 },
 	{ "async", test_async, 3 },
+	{ "retain_latency", test_retain_latency, 1 },
 };
 
 static void print_help(const char *argv0)
@@ -12,6 +12,7 @@
 #include <aidl/android/hardware/graphics/common/Rect.h>
 #include <cutils/native_handle.h>
 #include <gralloctypes/Gralloc4.h>
+#include <unistd.h>
 
 #include "cros_gralloc/gralloc4/CrosGralloc4Utils.h"
 #include "helpers.h"
@@ -337,6 +338,10 @@ Return<void> CrosGralloc4Mapper::unlock(void* rawHandle, unlock_cb hidlCb) {
     }
 
     hidlCb(Error::NONE, releaseFenceHandle);
+    // The callback sends its own copy of the fence.
+    if (releaseFenceFd >= 0) {
+        close(releaseFenceFd);
+    }
     return Void();
 }
 
@@ -354,6 +359,7 @@ Return<void> CrosGralloc4Mapper::flushLockedBuffer(void* rawHandle, flushLockedB
         return Void();
     }
 
+    // IMapper 4.0 can't say which part of the locked region was written, so all of it is flushed.
     int releaseFenceFd = -1;
     int ret = mDriver->flush(bufferHandle, &releaseFenceFd);
     if (ret) {
@@ -371,6 +377,10 @@ Return<void> CrosGralloc4Mapper::flushLockedBuffer(void* rawHandle, flushLockedB
     }
 
     hidlCb(Error::NONE, releaseFenceHandle);
+    // The callback sends its own copy of the fence.
+    if (releaseFenceFd >= 0) {
+        close(releaseFenceFd);
+    }
     return Void();
 }
 
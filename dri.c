@@ -12,6 +12,7 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -126,21 +127,17 @@ static int import_into_minigbm(struct dri_driver *dri, struct bo *bo)
 			goto cleanup;
 		}
 
-		dmabuf_sizes[i] = lseek(prime_fd, 0, SEEK_END);
-		if (dmabuf_sizes[i] == (off_t)-1) {
-			ret = -errno;
+		ret = drv_get_import_handle(bo->drv, prime_fd, &handle);
+		if (ret) {
+			drv_log("drmPrimeFDToHandle failed with %s\n", strerror(-ret));
 			close(prime_fd);
 			goto cleanup;
 		}
 
-		lseek(prime_fd, 0, SEEK_SET);
-
-		ret = drmPrimeFDToHandle(bo->drv->fd, prime_fd, &handle);
-
+		dmabuf_sizes[i] = drv_get_import_size(bo->drv, prime_fd, handle);
 		close(prime_fd);
-
-		if (ret) {
-			drv_log("drmPrimeFDToHandle failed with %s\n", strerror(errno));
+		if (dmabuf_sizes[i] == (off_t)-1) {
+			ret = -errno;
 			goto cleanup;
 		}
 
@@ -174,6 +171,7 @@ static int import_into_minigbm(struct dri_driver *dri, struct bo *bo)
 cleanup:
 	if (plane_image)
 		dri->image_extension->destroyImage(plane_image);
+	drv_import_cache_remove(bo);
 	while (--i >= 0) {
 		for (j = 0; j <= i; ++j)
 			if (bo->handles[j].u32 == bo->handles[i].u32)
@@ -191,6 +189,78 @@ cleanup:
 	return ret;
 }
 
+/*
+ * Creates the next context of the pool. The caller holds contexts_lock, or is dri_init().
+ */
+static struct dri_context *dri_add_context(struct dri_driver *dri)
+{
+	struct dri_context *ctx = &dri->contexts[dri->num_contexts];
+
+	assert(dri->num_contexts < DRI_MAX_CONTEXTS);
+
+	ctx->context = dri->dri2_extension->createNewContext(dri->device, *dri->configs, NULL, NULL);
+	if (!ctx->context)
+		return NULL;
+
+	pthread_mutex_init(&ctx->lock, NULL);
+	ctx->flush_pending = false;
+
+	/* Lock-free readers of num_contexts must see the context initialized. */
+	__atomic_store_n(&dri->num_contexts, dri->num_contexts + 1, __ATOMIC_RELEASE);
+	return ctx;
+}
+
+static void dri_destroy_contexts(struct dri_driver *dri)
+{
+	uint32_t i;
+
+	for (i = 0; i < dri->num_contexts; i++) {
+		dri->core_extension->destroyContext(dri->contexts[i].context);
+		pthread_mutex_destroy(&dri->contexts[i].lock);
+	}
+
+	dri->num_contexts = 0;
+	pthread_mutex_destroy(&dri->contexts_lock);
+}
+
+/*
+ * Returns a locked context, preferring an idle one, then a new one. Once the pool is full,
+ * threads queue on the contexts in turn.
+ */
+static struct dri_context *dri_acquire_context(struct dri_driver *dri)
+{
+	static uint32_t next;
+	struct dri_context *ctx = NULL;
+	uint32_t i, num_contexts = __atomic_load_n(&dri->num_contexts, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < num_contexts; i++) {
+		if (!pthread_mutex_trylock(&dri->contexts[i].lock))
+			return &dri->contexts[i];
+	}
+
+	pthread_mutex_lock(&dri->contexts_lock);
+	if (dri->num_contexts < DRI_MAX_CONTEXTS)
+		ctx = dri_add_context(dri);
+	num_contexts = dri->num_contexts;
+	pthread_mutex_unlock(&dri->contexts_lock);
+
+	if (!ctx)
+		ctx = &dri->contexts[__atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % num_contexts];
+
+	pthread_mutex_lock(&ctx->lock);
+	return ctx;
+}
+
+/* The caller holds ctx->lock. */
+static void dri_flush_context(struct dri_driver *dri, struct dri_context *ctx)
+{
+	if (!ctx->flush_pending)
+		return;
+
+	dri->flush_extension->flush_with_flags(ctx->context, NULL, __DRI2_FLUSH_CONTEXT, 0);
+	__atomic_store_n(&ctx->flush_pending, false, __ATOMIC_RELAXED);
+}
+
 /*
  * The caller is responsible for setting drv->priv to a structure that derives from dri_driver.
  */
@@ -233,11 +303,12 @@ int dri_init(struct driver *drv, const char *dri_so_path, const char *driver_suf
 	if (!dri->device)
 		goto free_handle;
 
-	dri->context =
-	    dri->dri2_extension->createNewContext(dri->device, *dri->configs, NULL, NULL);
-
-	if (!dri->context)
+	pthread_mutex_init(&dri->contexts_lock, NULL);
+	dri->num_contexts = 0;
+	if (!dri_add_context(dri)) {
+		pthread_mutex_destroy(&dri->contexts_lock);
 		goto free_screen;
+	}
 
 	if (!lookup_extension(dri->core_extension->getExtensions(dri->device), __DRI_IMAGE, 12,
 			      (const __DRIextension **)&dri->image_extension))
@@ -250,7 +321,7 @@ int dri_init(struct driver *drv, const char *dri_so_path, const char *driver_suf
 	return 0;
 
 free_context:
-	dri->core_extension->destroyContext(dri->context);
+	dri_destroy_contexts(dri);
 free_screen:
 	dri->core_extension->destroyScreen(dri->device);
 free_handle:
@@ -268,7 +339,7 @@ void dri_close(struct driver *drv)
 {
 	struct dri_driver *dri = drv->priv;
 
-	dri->core_extension->destroyContext(dri->context);
+	dri_destroy_contexts(dri);
 	dri->core_extension->destroyScreen(dri->device);
 	dlclose(dri->driver_handle);
 	dri->driver_handle = NULL;
@@ -402,35 +473,166 @@ int dri_bo_destroy(struct bo *bo)
 	return 0;
 }
 
+struct dri_map {
+	void *handle;
+	struct dri_context *ctx;
+	/*
+	 * For callers using the buffer's strides, a partial map is copied between the driver's
+	 * staging buffer and this buffer-sized shadow, laid out like the buffer.
+	 */
+	uint8_t *shadow;
+	uint8_t *staging;
+	uint32_t staging_stride;
+};
+
+static bool dri_other_contexts_pending(struct dri_driver *dri, struct dri_context *self)
+{
+	uint32_t i, num_contexts = __atomic_load_n(&dri->num_contexts, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < num_contexts; i++) {
+		if (&dri->contexts[i] != self &&
+		    __atomic_load_n(&dri->contexts[i].flush_pending, __ATOMIC_RELAXED))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Flushes every context with blits still queued. The caller must not hold any context lock.
+ */
+static void dri_flush_contexts(struct dri_driver *dri)
+{
+	uint32_t i, num_contexts = __atomic_load_n(&dri->num_contexts, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < num_contexts; i++) {
+		struct dri_context *ctx = &dri->contexts[i];
+
+		if (!__atomic_load_n(&ctx->flush_pending, __ATOMIC_SEQ_CST))
+			continue;
+
+		pthread_mutex_lock(&ctx->lock);
+		dri_flush_context(dri, ctx);
+		pthread_mutex_unlock(&ctx->lock);
+	}
+}
+
+/* Copies the locked rect of a partial map between the staging buffer and the shadow. */
+static void dri_copy_rect(struct bo *bo, struct dri_map *map, const struct rectangle *rect,
+			  bool to_shadow)
+{
+	uint32_t row;
+	uint32_t bpp = drv_bytes_per_pixel_from_format(bo->meta.format, 0);
+	uint32_t stride = bo->meta.strides[0];
+	uint8_t *shadow = map->shadow + bo->meta.offsets[0] + rect->y * stride + rect->x * bpp;
+	uint8_t *staging = map->staging;
+
+	for (row = 0; row < rect->height; row++) {
+		if (to_shadow)
+			memcpy(shadow, staging, rect->width * bpp);
+		else
+			memcpy(staging, shadow, rect->width * bpp);
+
+		shadow += stride;
+		staging += map->staging_stride;
+	}
+}
+
 /*
  * Map an image plane.
  *
  * This relies on the underlying driver to do a decompressing and/or de-tiling
- * blit if necessary,
+ * blit if necessary, so single plane images only map the rect being locked. Callers
+ * that index the map with the map's own stride (BO_MAP_STRIDED) get the driver's
+ * staging buffer; others get the rect copied into a shadow laid out like the buffer.
  *
- * This function itself is not thread-safe; we rely on the fact that the caller
- * locks a per-driver mutex.
+ * Maps run on a context from the pool, so maps of different buffers don't wait for each
+ * other; the vma remembers the context so the unmap can use it too.
  */
 void *dri_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
+	uint8_t *addr;
+	uint32_t dri_flags = map_flags & BO_MAP_READ_WRITE;
+	struct dri_map *map;
+	struct rectangle rect = { 0, 0, bo->meta.width, bo->meta.height };
 	struct dri_driver *dri = bo->drv->priv;
 
-	/* GBM flags and DRI flags are the same. */
-	vma->addr = dri->image_extension->mapImage(dri->context, bo->priv, 0, 0, bo->meta.width,
-						   bo->meta.height, map_flags,
-						   (int *)&vma->map_strides[plane], &vma->priv);
-	if (!vma->addr)
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		return MAP_FAILED;
+
+	/* Planes of a partial map wouldn't be at their usual offsets from each other. */
+	vma->partial = bo->meta.num_planes == 1 && vma->rect.width && vma->rect.height &&
+		       (vma->rect.width < rect.width || vma->rect.height < rect.height);
+	if (vma->partial)
+		rect = vma->rect;
+
+	/*
+	 * The staging buffer of a partial map has its own pitch, so callers using the buffer's
+	 * strides would index outside it. Their shadow is written back whole on unmap, so it
+	 * starts out with the buffer's contents even for write-only maps.
+	 */
+	if (vma->partial && !(map_flags & BO_MAP_STRIDED)) {
+		map->shadow = drv_shadow_alloc(bo->drv, bo->meta.total_size);
+		if (!map->shadow) {
+			free(map);
+			return MAP_FAILED;
+		}
+
+		dri_flags |= BO_MAP_READ;
+	}
+
+	/*
+	 * Work on one context is ordered, but blits queued on the others may have written this
+	 * buffer, and flushing them can't wait while a context is held.
+	 */
+	map->ctx = dri_acquire_context(dri);
+	if (dri_other_contexts_pending(dri, map->ctx)) {
+		pthread_mutex_unlock(&map->ctx->lock);
+		dri_flush_contexts(dri);
+		map->ctx = dri_acquire_context(dri);
+	}
+
+	/* GBM flags and DRI flags are the same for reads and writes. */
+	addr = dri->image_extension->mapImage(map->ctx->context, bo->priv, rect.x, rect.y,
+					      rect.width, rect.height, dri_flags,
+					      (int *)&vma->map_strides[plane], &map->handle);
+	pthread_mutex_unlock(&map->ctx->lock);
+
+	if (!addr) {
+		if (map->shadow)
+			drv_shadow_free(bo->drv, map->shadow, bo->meta.total_size);
+		free(map);
 		return MAP_FAILED;
+	}
+
+	vma->priv = map;
 
-	return vma->addr;
+	if (map->shadow) {
+		map->staging = addr;
+		map->staging_stride = vma->map_strides[plane];
+		dri_copy_rect(bo, map, &rect, true);
+		vma->map_strides[plane] = bo->meta.strides[plane];
+		return map->shadow;
+	}
+
+	/* Callers offset from the start of the buffer, using the stride of the map. */
+	addr -= rect.y * vma->map_strides[plane] +
+		rect.x * drv_bytes_per_pixel_from_format(bo->meta.format, plane);
+	return addr;
 }
 
 int dri_bo_unmap(struct bo *bo, struct vma *vma)
 {
+	struct dri_map *map = vma->priv;
 	struct dri_driver *dri = bo->drv->priv;
 
-	assert(vma->priv);
-	dri->image_extension->unmapImage(dri->context, bo->priv, vma->priv);
+	assert(map);
+	if (map->shadow && (vma->map_flags & BO_MAP_WRITE))
+		dri_copy_rect(bo, map, &vma->rect, false);
+
+	pthread_mutex_lock(&map->ctx->lock);
+	dri->image_extension->unmapImage(map->ctx->context, bo->priv, map->handle);
 
 	/*
 	 * From gbm_dri.c in Mesa:
@@ -438,12 +640,37 @@ int dri_bo_unmap(struct bo *bo, struct vma *vma)
 	 * "Not all DRI drivers use direct maps. They may queue up DMA operations
 	 *  on the mapping context. Since there is no explicit gbm flush mechanism,
 	 *  we need to flush here."
+	 *
+	 * Only write maps queue a blit back on unmap. Unlike in Mesa, the blits of a buffer that
+	 * isn't device visible yet aren't flushed here: nothing but this process's CPU can see the
+	 * buffer, and maps on the same context are ordered after them. They're flushed together
+	 * with later ones when a map on another context needs them, or when the buffer is handed
+	 * out; see dri_flush_queued(). The pending flag is set before the visibility is checked,
+	 * so an unmap racing with the buffer being handed out is flushed by one side or the other.
 	 */
+	if (vma->map_flags & BO_MAP_WRITE)
+		__atomic_store_n(&map->ctx->flush_pending, true, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&bo->device_visible, __ATOMIC_SEQ_CST))
+		dri_flush_context(dri, map->ctx);
+
+	pthread_mutex_unlock(&map->ctx->lock);
 
-	dri->flush_extension->flush_with_flags(dri->context, NULL, __DRI2_FLUSH_CONTEXT, 0);
+	if (map->shadow)
+		drv_shadow_free(bo->drv, map->shadow, bo->meta.total_size);
+	free(map);
+	vma->priv = NULL;
 	return 0;
 }
 
+/*
+ * Flushes the blits queued by unmaps since the last flush, with one flush per context.
+ */
+void dri_flush_queued(struct driver *drv)
+{
+	dri_flush_contexts(drv->priv);
+}
+
 size_t dri_num_planes_from_modifier(struct driver *drv, uint32_t format, uint64_t modifier)
 {
 	struct dri_driver *dri = drv->priv;
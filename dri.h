@@ -11,13 +11,32 @@
 #include "GL/internal/dri_interface.h"
 #undef GL_GLEXT_LEGACY
 
+#include <pthread.h>
+
 #include "drv.h"
 
+/* Most contexts created for map/unmap operations, i.e. how many can run in parallel. */
+#define DRI_MAX_CONTEXTS 4
+
+struct dri_context {
+	__DRIcontext *context;
+	/* Contexts aren't thread-safe, so each call on one holds this. */
+	pthread_mutex_t lock;
+	/* Set when unmaps have queued blits on context that haven't been flushed yet. */
+	bool flush_pending;
+};
+
 struct dri_driver {
 	int fd;
 	void *driver_handle;
 	__DRIscreen *device;
-	__DRIcontext *context; /* Needed for map/unmap operations. */
+	/*
+	 * Contexts for map/unmap operations. A map uses whichever one is free, creating another
+	 * if all are busy, and is unmapped on the same one.
+	 */
+	struct dri_context contexts[DRI_MAX_CONTEXTS];
+	uint32_t num_contexts;
+	pthread_mutex_t contexts_lock;
 	const __DRIextension **extensions;
 	const __DRIcoreExtension *core_extension;
 	const __DRIdri2Extension *dri2_extension;
@@ -36,6 +55,7 @@ int dri_bo_import(struct bo *bo, struct drv_import_fd_data *data);
 int dri_bo_destroy(struct bo *bo);
 void *dri_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags);
 int dri_bo_unmap(struct bo *bo, struct vma *vma);
+void dri_flush_queued(struct driver *drv);
 size_t dri_num_planes_from_modifier(struct driver *drv, uint32_t format, uint64_t modifier);
 
 #endif
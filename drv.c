@@ -13,6 +13,7 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 
@@ -180,8 +181,18 @@ struct driver *drv_create(int fd)
 	if (!drv->combos)
 		goto free_mappings;
 
+	if (drv_shadow_pool_init(drv))
+		goto free_combos;
+
+	if (drv_import_cache_init(drv))
+		goto free_shadow_pool;
+
 	return drv;
 
+free_shadow_pool:
+	drv_shadow_pool_destroy(drv);
+free_combos:
+	drv_array_destroy(drv->combos);
 free_mappings:
 	drv_array_destroy(drv->mappings);
 free_buffer_table:
@@ -196,14 +207,28 @@ free_driver:
 int drv_init(struct driver * drv, uint32_t grp_type)
 {
 	int ret = 0;
+	struct timespec start, end;
 	assert(drv);
 	assert(drv->backend);
 
 	drv->gpu_grp_type = grp_type;
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* Without a usable cache, the backend probes everything as usual. */
+	drv_caps_cache_load(drv);
+
 	if (drv->backend->init) {
 		ret = drv->backend->init(drv);
 	}
+
+	/* The backend may have rejected the cache, see drv_caps_cache_reject(). */
+	if (!ret && !drv->init_cache_hit)
+		drv_caps_cache_store(drv);
+	drv_caps_cache_release(drv);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	drv->init_ns = (end.tv_sec - start.tv_sec) * 1000000000ull + end.tv_nsec - start.tv_nsec;
 	return ret;
 }
 
@@ -217,6 +242,8 @@ void drv_destroy(struct driver *drv)
 	drmHashDestroy(drv->buffer_table);
 	drv_array_destroy(drv->mappings);
 	drv_array_destroy(drv->combos);
+	drv_shadow_pool_destroy(drv);
+	drv_import_cache_destroy(drv);
 
 	pthread_mutex_unlock(&drv->driver_lock);
 	pthread_mutex_destroy(&drv->driver_lock);
@@ -270,6 +297,8 @@ struct bo *drv_bo_new(struct driver *drv, uint32_t width, uint32_t height, uint3
 	bo->meta.use_flags = use_flags;
 	bo->meta.num_planes = drv_num_planes_from_format(format);
 	bo->is_test_buffer = is_test_buffer;
+	/* Fresh mappings start at zero, so their first invalidate always reaches the backend. */
+	bo->sync_seqno = 1;
 
 	if (!bo->meta.num_planes) {
 		free(bo);
@@ -387,6 +416,10 @@ void drv_bo_destroy(struct bo *bo)
 		for (plane = 0; plane < bo->meta.num_planes; plane++)
 			total += drv_get_reference_count(drv, bo, plane);
 
+		/* The handles are about to be closed, so later imports must ask the kernel. */
+		if (total == 0)
+			drv_import_cache_remove(bo);
+
 		pthread_mutex_unlock(&drv->driver_lock);
 
 		if (total == 0) {
@@ -399,24 +432,61 @@ void drv_bo_destroy(struct bo *bo)
 	free(bo);
 }
 
+/*
+ * A layout that came with the import is trusted as long as every plane lies within it. Sizes
+ * that overstate the dma-buf only make the mapping fail later.
+ */
+static bool drv_import_layout_valid(struct drv_import_fd_data *data, size_t num_planes)
+{
+	size_t plane;
+
+	if (!data->total_size)
+		return false;
+
+	for (plane = 0; plane < num_planes; plane++) {
+		if (!data->sizes[plane] ||
+		    (uint64_t)data->offsets[plane] + data->sizes[plane] > data->total_size)
+			return false;
+	}
+
+	return true;
+}
+
 struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
 {
 	int ret;
 	size_t plane;
 	struct bo *bo;
-	off_t seek_end;
+	off_t seek_end = 0;
 
 	bo = drv_bo_new(drv, data->width, data->height, data->format, data->use_flags, false);
 
 	if (!bo)
 		return NULL;
 
+	if (data->has_layout && !drv_import_layout_valid(data, bo->meta.num_planes)) {
+		drv_log("Ignoring inconsistent import layout.\n");
+		data->has_layout = false;
+	}
+
+	if (data->has_layout) {
+		bo->meta.tiling = data->tiling;
+		bo->meta.blob_flags = data->blob_flags;
+	}
+
 	ret = drv->backend->bo_import(bo, data);
 	if (ret) {
+		/*
+		 * The backend may have closed handles that an earlier import cached. The dma-buf
+		 * lives on, so its next import mustn't get them back.
+		 */
+		drv_import_cache_remove(bo);
 		free(bo);
 		return NULL;
 	}
 
+	bo->device_visible = true;
+
 	for (plane = 0; plane < bo->meta.num_planes; plane++) {
 		pthread_mutex_lock(&bo->drv->driver_lock);
 		drv_increment_reference_count(bo->drv, bo, plane);
@@ -428,13 +498,19 @@ struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
 		bo->meta.offsets[plane] = data->offsets[plane];
 		bo->meta.format_modifiers[plane] = data->format_modifiers[plane];
 
-		seek_end = lseek(data->fds[plane], 0, SEEK_END);
+		if (data->has_layout) {
+			bo->meta.sizes[plane] = data->sizes[plane];
+			continue;
+		}
+
+		/* Planes in the same dma-buf have the same size. */
+		if (!plane || bo->handles[plane].u32 != bo->handles[plane - 1].u32)
+			seek_end = drv_get_import_size(drv, data->fds[plane], bo->handles[plane].u32);
 		if (seek_end == (off_t)(-1)) {
 			drv_log("lseek() failed with %s\n", strerror(errno));
 			goto destroy_bo;
 		}
 
-		lseek(data->fds[plane], 0, SEEK_SET);
 		if (plane == bo->meta.num_planes - 1 || data->offsets[plane + 1] == 0)
 			bo->meta.sizes[plane] = seek_end - data->offsets[plane];
 		else
@@ -448,6 +524,9 @@ struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data)
 		bo->meta.total_size += bo->meta.sizes[plane];
 	}
 
+	if (data->has_layout)
+		bo->meta.total_size = data->total_size;
+
 	return bo;
 
 destroy_bo:
@@ -455,11 +534,12 @@ destroy_bo:
 	return NULL;
 }
 
-void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
-		 struct mapping **map_data, size_t plane)
+static void *drv_bo_map_internal(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
+				 struct mapping **map_data, size_t plane, bool invalidate)
 {
 	uint32_t i;
 	uint8_t *addr;
+	bool wait_unlocked;
 	struct mapping mapping;
 
 	assert(rect->width >= 0);
@@ -501,14 +581,36 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 		    prior->vma->map_flags != map_flags)
 			continue;
 
+		if (prior->vma->partial && !drv_rect_contains(&prior->vma->rect, rect))
+			continue;
+
 		prior->vma->refcount++;
 		mapping.vma = prior->vma;
 		goto success;
 	}
 
 	mapping.vma = calloc(1, sizeof(*mapping.vma));
+	if (!mapping.vma) {
+		*map_data = NULL;
+		pthread_mutex_unlock(&bo->drv->driver_lock);
+		return MAP_FAILED;
+	}
+
 	memcpy(mapping.vma->map_strides, bo->meta.strides, sizeof(mapping.vma->map_strides));
+	mapping.vma->rect = *rect;
+
+	/*
+	 * Backends that allow it may block in bo_map() on a blit or a wait without maps of other
+	 * buffers queueing behind it. A racing map of the same buffer just creates a second vma.
+	 */
+	if (bo->drv->backend->map_unlocked)
+		pthread_mutex_unlock(&bo->drv->driver_lock);
+
 	addr = bo->drv->backend->bo_map(bo, mapping.vma, plane, map_flags);
+
+	if (bo->drv->backend->map_unlocked)
+		pthread_mutex_lock(&bo->drv->driver_lock);
+
 	if (addr == MAP_FAILED) {
 		*map_data = NULL;
 		free(mapping.vma);
@@ -524,27 +626,52 @@ void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags
 success:
 	*map_data = drv_array_append(bo->drv->mappings, &mapping);
 exact_match:
-	drv_bo_invalidate(bo, *map_data);
+	wait_unlocked = !bo->drv->backend->bo_invalidate || bo->drv->backend->brackets_cpu_access;
+	if (invalidate && !wait_unlocked)
+		drv_bo_invalidate(bo, *map_data);
 	addr = (uint8_t *)((*map_data)->vma->addr);
 	addr += drv_bo_get_plane_offset(bo, plane);
 	pthread_mutex_unlock(&bo->drv->driver_lock);
+
+	/*
+	 * Waits for implicit fences, which DMA_BUF_IOCTL_SYNC starts do too, block other maps for
+	 * too long to run under the lock.
+	 */
+	if (invalidate && wait_unlocked)
+		drv_bo_invalidate(bo, *map_data);
+
 	return (void *)addr;
 }
 
+void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
+		 struct mapping **map_data, size_t plane)
+{
+	return drv_bo_map_internal(bo, rect, map_flags, map_data, plane, true);
+}
+
+/*
+ * Maps the buffer without invalidating the mapping, for callers that are still waiting for
+ * pending writes to land. They must call drv_bo_invalidate() before reading through it.
+ */
+void *drv_bo_map_unsynced(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
+			  struct mapping **map_data, size_t plane)
+{
+	return drv_bo_map_internal(bo, rect, map_flags, map_data, plane, false);
+}
+
 int drv_bo_unmap(struct bo *bo, struct mapping *mapping)
 {
 	uint32_t i;
 	int ret = 0;
+	struct vma *vma = NULL;
 
 	pthread_mutex_lock(&bo->drv->driver_lock);
 
 	if (--mapping->refcount)
 		goto out;
 
-	if (!--mapping->vma->refcount) {
-		ret = bo->drv->backend->bo_unmap(bo, mapping->vma);
-		free(mapping->vma);
-	}
+	if (!--mapping->vma->refcount)
+		vma = mapping->vma;
 
 	for (i = 0; i < drv_array_size(bo->drv->mappings); i++) {
 		if (mapping == (struct mapping *)drv_array_at_idx(bo->drv->mappings, i)) {
@@ -553,11 +680,199 @@ int drv_bo_unmap(struct bo *bo, struct mapping *mapping)
 		}
 	}
 
+	if (vma && !bo->drv->backend->map_unlocked) {
+		ret = bo->drv->backend->bo_unmap(bo, vma);
+		free(vma);
+		vma = NULL;
+	}
+
 out:
 	pthread_mutex_unlock(&bo->drv->driver_lock);
+
+	/* The vma is unreachable now, so like bo_map() this may run without the lock. */
+	if (vma) {
+		ret = bo->drv->backend->bo_unmap(bo, vma);
+		free(vma);
+	}
+
+	return ret;
+}
+
+/*
+ * Returns whether plane is the first one backed by its GEM handle, so per-handle work runs once.
+ */
+static bool drv_bo_first_plane_of_handle(struct bo *bo, size_t plane)
+{
+	size_t i;
+
+	for (i = 0; i < plane; i++)
+		if (bo->handles[i].u32 == bo->handles[plane].u32)
+			return false;
+
+	return true;
+}
+
+/*
+ * Sets *fence to a fence for the implicitly synchronised work that CPU access with map_flags
+ * has to wait for, or -1 if it has all signalled already.
+ */
+static int drv_bo_export_fence(struct bo *bo, uint32_t map_flags, int *fence)
+{
+	int ret = 0;
+	size_t plane;
+
+	*fence = -1;
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		int fd, plane_fence, merged;
+
+		if (!drv_bo_first_plane_of_handle(bo, plane))
+			continue;
+
+		fd = drv_get_export_fd(bo->drv, bo->handles[plane].u32);
+		if (fd < 0) {
+			ret = fd;
+			break;
+		}
+
+		plane_fence = drv_dmabuf_export_fence(bo->drv, fd, map_flags);
+		close(fd);
+		if (plane_fence < 0) {
+			ret = plane_fence;
+			break;
+		}
+
+		if (drv_fence_signaled(plane_fence)) {
+			close(plane_fence);
+			continue;
+		}
+
+		if (*fence < 0) {
+			*fence = plane_fence;
+			continue;
+		}
+
+		merged = drv_fence_merge(*fence, plane_fence);
+		close(plane_fence);
+		if (merged < 0) {
+			ret = merged;
+			break;
+		}
+
+		close(*fence);
+		*fence = merged;
+	}
+
+	if (ret && *fence >= 0) {
+		close(*fence);
+		*fence = -1;
+	}
+
 	return ret;
 }
 
+/*
+ * Attaches fence to the buffer so implicitly synchronised users wait for it as they would for
+ * access with map_flags.
+ */
+static int drv_bo_import_fence(struct bo *bo, int fence, uint32_t map_flags)
+{
+	int ret;
+	size_t plane;
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		int fd;
+
+		if (!drv_bo_first_plane_of_handle(bo, plane))
+			continue;
+
+		fd = drv_get_export_fd(bo->drv, bo->handles[plane].u32);
+		if (fd < 0)
+			return fd;
+
+		ret = drv_dmabuf_import_fence(bo->drv, fd, fence, map_flags);
+		close(fd);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Merges fence into acquire_fence, taking ownership of both. If they can't be merged, fence is
+ * dropped: the invalidate that follows the wait for acquire_fence waits for it instead.
+ */
+static int drv_acquire_fence_add(int acquire_fence, int fence)
+{
+	int merged;
+
+	if (fence < 0)
+		return acquire_fence;
+
+	if (acquire_fence < 0)
+		return fence;
+
+	merged = drv_fence_merge(acquire_fence, fence);
+	close(fence);
+	if (merged < 0)
+		return acquire_fence;
+
+	close(acquire_fence);
+	return merged;
+}
+
+/*
+ * Returns a fence that signals once acquire_fence, the backend's own pending work and the
+ * implicitly synchronised work that CPU access with map_flags has to wait for are all done, or -1
+ * if there's nothing to wait for. Takes ownership of acquire_fence, which is only merged, never
+ * attached to the buffer: a CPU lock mustn't change what other users of the buffer synchronise
+ * with. Without kernel support, acquire_fence is returned as is.
+ */
+int drv_bo_get_acquire_fence(struct bo *bo, int acquire_fence, uint32_t map_flags)
+{
+	int fence;
+
+	if (bo->drv->backend->bo_get_acquire_fence)
+		acquire_fence = drv_acquire_fence_add(
+		    acquire_fence, bo->drv->backend->bo_get_acquire_fence(bo, map_flags));
+
+	/* Nothing else can have queued work on the buffer. */
+	if (!bo->drv->backend->implicit_sync || !bo->device_visible)
+		return acquire_fence;
+
+	if (drv_bo_export_fence(bo, map_flags, &fence))
+		return acquire_fence;
+
+	return drv_acquire_fence_add(acquire_fence, fence);
+}
+
+/*
+ * Waits for the implicitly synchronised work that CPU access with map_flags has to wait for.
+ */
+static int drv_bo_wait_implicit(struct bo *bo, uint32_t map_flags)
+{
+	int ret;
+	size_t plane;
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		int fd;
+
+		if (!drv_bo_first_plane_of_handle(bo, plane))
+			continue;
+
+		fd = drv_get_export_fd(bo->drv, bo->handles[plane].u32);
+		if (fd < 0)
+			return fd;
+
+		ret = drv_dmabuf_wait(fd, map_flags);
+		close(fd);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 int drv_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	int ret = 0;
@@ -567,13 +882,106 @@ int drv_bo_invalidate(struct bo *bo, struct mapping *mapping)
 	assert(mapping->refcount > 0);
 	assert(mapping->vma->refcount > 0);
 
-	if (bo->drv->backend->bo_invalidate)
-		ret = bo->drv->backend->bo_invalidate(bo, mapping);
+	/*
+	 * Backends that invalidate wait for device access on their own. For implicit_sync ones that
+	 * don't, wait for whatever implicitly synchronised work is pending on the buffer. That can
+	 * take a whole device job, so it mustn't be called with driver_lock held.
+	 */
+	if (!bo->drv->backend->bo_invalidate) {
+		if (!bo->drv->backend->implicit_sync || !bo->device_visible)
+			return 0;
+
+		return drv_bo_wait_implicit(bo, mapping->vma->map_flags);
+	}
+
+	/*
+	 * If nothing but this process's CPU can have touched the buffer since this mapping was
+	 * last synced, the backend's domain change, wait or shadow copy would be a no-op.
+	 */
+	if (!bo->device_visible && mapping->sync_seqno == bo->sync_seqno &&
+	    !bo->drv->backend->brackets_cpu_access) {
+		__atomic_add_fetch(&bo->drv->syncs_skipped, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	__atomic_add_fetch(&bo->drv->syncs_issued, 1, __ATOMIC_RELAXED);
+	ret = bo->drv->backend->bo_invalidate(bo, mapping);
+	if (!ret)
+		mapping->sync_seqno = bo->sync_seqno;
+
+	return ret;
+}
+
+/*
+ * Called after a flush pushed this mapping's writes to the buffer. Other mappings may see stale
+ * copies now, but this one is current.
+ */
+static void drv_bo_mark_synced(struct bo *bo, struct mapping *mapping)
+{
+	mapping->sync_seqno = ++bo->sync_seqno;
+}
+
+void drv_bo_add_dirty_rect(struct bo *bo, struct mapping *mapping, const struct rectangle *rect)
+{
+	struct rectangle dirty;
+
+	assert(mapping);
+	assert(mapping->refcount > 0);
+
+	if (!drv_rect_intersect(rect, &mapping->rect, &dirty))
+		return;
+
+	drv_rect_list_add(mapping->dirty_rects, &mapping->num_dirty_rects, DRV_MAX_DIRTY_RECTS,
+			  &dirty);
+}
+
+/*
+ * Bridges a flush's release fence with implicit sync: a fence the backend returned is attached to
+ * the buffer so implicitly synchronised users wait for it too. Without one the flush has landed,
+ * so there is nothing to attach.
+ */
+static void drv_bo_bridge_release_fence(struct bo *bo, uint32_t map_flags, int release_fence)
+{
+	if (release_fence < 0 || !bo->drv->backend->implicit_sync || !bo->device_visible ||
+	    !(map_flags & BO_MAP_WRITE))
+		return;
+
+	drv_bo_import_fence(bo, release_fence, BO_MAP_WRITE);
+}
+
+/*
+ * Without a release_fence to return, the backend has to wait for the flush itself.
+ */
+static int drv_bo_backend_flush(struct bo *bo, struct mapping *mapping, int *release_fence)
+{
+	int ret;
+
+	if (release_fence && bo->drv->backend->bo_flush_fenced)
+		ret = bo->drv->backend->bo_flush_fenced(bo, mapping, release_fence);
+	else
+		ret = bo->drv->backend->bo_flush(bo, mapping);
+
+	if (!ret) {
+		mapping->num_dirty_rects = 0;
+		drv_bo_mark_synced(bo, mapping);
+		/* The flush is still in flight, so the next invalidate has to wait for it. */
+		if (release_fence && *release_fence >= 0)
+			bo->sync_seqno++;
+	}
 
 	return ret;
 }
 
 int drv_bo_flush(struct bo *bo, struct mapping *mapping)
+{
+	return drv_bo_flush_fenced(bo, mapping, NULL);
+}
+
+/*
+ * Flushes the mapping's writes. If release_fence is given, the flush may still be in flight on
+ * return and *release_fence is a fence that signals once it's done, or -1.
+ */
+int drv_bo_flush_fenced(struct bo *bo, struct mapping *mapping, int *release_fence)
 {
 	int ret = 0;
 
@@ -582,15 +990,27 @@ int drv_bo_flush(struct bo *bo, struct mapping *mapping)
 	assert(mapping->refcount > 0);
 	assert(mapping->vma->refcount > 0);
 
+	if (release_fence)
+		*release_fence = -1;
+
 	if (bo->drv->backend->bo_flush)
-		ret = bo->drv->backend->bo_flush(bo, mapping);
+		ret = drv_bo_backend_flush(bo, mapping, release_fence);
+
+	if (release_fence && !ret)
+		drv_bo_bridge_release_fence(bo, mapping->vma->map_flags, *release_fence);
 
 	return ret;
 }
 
 int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping)
+{
+	return drv_bo_flush_or_unmap_fenced(bo, mapping, NULL);
+}
+
+int drv_bo_flush_or_unmap_fenced(struct bo *bo, struct mapping *mapping, int *release_fence)
 {
 	int ret = 0;
+	uint32_t map_flags;
 
 	assert(mapping);
 	assert(mapping->vma);
@@ -598,11 +1018,20 @@ int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping)
 	assert(mapping->vma->refcount > 0);
 	assert(!(bo->meta.use_flags & BO_USE_PROTECTED));
 
+	if (release_fence)
+		*release_fence = -1;
+
+	/* The mapping may be gone after an unmap. */
+	map_flags = mapping->vma->map_flags;
+
 	if (bo->drv->backend->bo_flush)
-		ret = bo->drv->backend->bo_flush(bo, mapping);
+		ret = drv_bo_backend_flush(bo, mapping, release_fence);
 	else
 		ret = drv_bo_unmap(bo, mapping);
 
+	if (release_fence && !ret)
+		drv_bo_bridge_release_fence(bo, map_flags, *release_fence);
+
 	return ret;
 }
 
@@ -621,32 +1050,45 @@ size_t drv_bo_get_num_planes(struct bo *bo)
 	return bo->meta.num_planes;
 }
 
+/*
+ * Called before the buffer is handed to anything but this process's CPU, which is the last point
+ * work the backend queued from earlier unmaps can wait until.
+ */
+static void drv_bo_set_device_visible(struct bo *bo)
+{
+	if (__atomic_load_n(&bo->device_visible, __ATOMIC_ACQUIRE))
+		return;
+
+	/*
+	 * Set before flushing: an unmap racing with this either sees it and flushes its own work,
+	 * or had queued that work before the flush below looks for it.
+	 */
+	__atomic_store_n(&bo->device_visible, true, __ATOMIC_SEQ_CST);
+
+	if (bo->drv->backend->flush_queued) {
+		pthread_mutex_lock(&bo->drv->driver_lock);
+		bo->drv->backend->flush_queued(bo->drv);
+		pthread_mutex_unlock(&bo->drv->driver_lock);
+	}
+}
+
 union bo_handle drv_bo_get_plane_handle(struct bo *bo, size_t plane)
 {
+	drv_bo_set_device_visible(bo);
 	return bo->handles[plane];
 }
 
-#ifndef DRM_RDWR
-#define DRM_RDWR O_RDWR
-#endif
-
 int drv_bo_get_plane_fd(struct bo *bo, size_t plane)
 {
-
-	int ret, fd;
 	assert(plane < bo->meta.num_planes);
 
 	if (bo->is_test_buffer) {
 		return -EINVAL;
 	}
 
-	ret = drmPrimeHandleToFD(bo->drv->fd, bo->handles[plane].u32, DRM_CLOEXEC | DRM_RDWR, &fd);
-
-	// Older DRM implementations blocked DRM_RDWR, but gave a read/write mapping anyways
-	if (ret)
-		ret = drmPrimeHandleToFD(bo->drv->fd, bo->handles[plane].u32, DRM_CLOEXEC, &fd);
+	drv_bo_set_device_visible(bo);
 
-	return (ret) ? ret : fd;
+	return drv_get_export_fd(bo->drv, bo->handles[plane].u32);
 }
 
 uint32_t drv_bo_get_plane_offset(struct bo *bo, size_t plane)
@@ -711,6 +1153,26 @@ uint32_t drv_num_buffers_per_bo(struct bo *bo)
 	return count;
 }
 
+/*
+ * Reports how many CPU cache/domain syncs reached the backend and how many were elided because
+ * the buffer couldn't have changed underneath the mapping.
+ */
+void drv_get_sync_stats(struct driver *drv, uint64_t *issued, uint64_t *skipped)
+{
+	*issued = __atomic_load_n(&drv->syncs_issued, __ATOMIC_RELAXED);
+	*skipped = __atomic_load_n(&drv->syncs_skipped, __ATOMIC_RELAXED);
+}
+
+/*
+ * Reports how long drv_init() took and whether it started from the capability cache, to compare
+ * cold and warm startup.
+ */
+void drv_get_init_stats(struct driver *drv, bool *cache_hit, uint64_t *init_ns)
+{
+	*cache_hit = drv->init_cache_hit;
+	*init_ns = drv->init_ns;
+}
+
 void drv_log_prefix(const char *prefix, const char *file, int line, const char *format, ...)
 {
 	char buf[50];
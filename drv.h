@@ -17,6 +17,8 @@ extern "C" {
 
 #define DRV_MAX_PLANES 4
 
+#define DRV_MAX_DIRTY_RECTS 4
+
 // clang-format off
 /* Use flags */
 #define BO_USE_NONE			0
@@ -48,6 +50,24 @@ extern "C" {
 #define BO_MAP_READ (1 << 0)
 #define BO_MAP_WRITE (1 << 1)
 #define BO_MAP_READ_WRITE (BO_MAP_READ | BO_MAP_WRITE)
+/*
+ * Backends that convert to a linear shadow (tiled layouts) may populate it page by page on first
+ * touch instead of converting the whole rect at map time. Only CPU accesses from user space are
+ * served: such a mapping must not be passed to read(), write() or ioctls.
+ */
+#define BO_MAP_LAZY (1 << 2)
+/*
+ * Shadow-backed writable mappings track which pages the CPU writes so flush only copies those
+ * back. This costs a fault per written page, so it only pays off for sparse writes to a large
+ * rect and is off unless asked for. The same restriction as for BO_MAP_LAZY applies.
+ */
+#define BO_MAP_TRACKED (1 << 3)
+/*
+ * The caller addresses the mapping with vma->map_strides rather than the buffer's strides, so
+ * backends may hand out the locked rect in a staging buffer with a pitch of its own instead of
+ * copying it into one laid out like the buffer.
+ */
+#define BO_MAP_STRIDED (1 << 4)
 
 /* This is our extension to <drm_fourcc.h>.  We need to make sure we don't step
  * on the namespace of already defined formats, which can be done by using invalid
@@ -90,6 +110,22 @@ struct drv_import_fd_data {
 	uint32_t height;
 	uint32_t format;
 	uint64_t use_flags;
+	/*
+	 * Set when the exporter also passed the rest of the layout, so the import doesn't have to
+	 * query the kernel for the tiling and plane sizes.
+	 */
+	bool has_layout;
+	uint32_t tiling;
+	uint32_t blob_flags;
+	uint32_t sizes[DRV_MAX_PLANES];
+	uint64_t total_size;
+};
+
+struct rectangle {
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
 };
 
 struct vma {
@@ -100,19 +136,35 @@ struct vma {
 	int32_t refcount;
 	uint32_t map_strides[DRV_MAX_PLANES];
 	void *priv;
-};
-
-struct rectangle {
-	uint32_t x;
-	uint32_t y;
-	uint32_t width;
-	uint32_t height;
+	/* The rect being locked when bo_map() was called. */
+	struct rectangle rect;
+	/*
+	 * Set by bo_map() when it mapped only rect. addr still points at the start of the buffer,
+	 * but nothing outside rect may be accessed, so the vma is only shared by locks within rect.
+	 */
+	bool partial;
 };
 
 struct mapping {
 	struct vma *vma;
 	struct rectangle rect;
 	uint32_t refcount;
+	/*
+	 * Parts of rect written by the CPU since the last flush. If none were reported, the whole
+	 * of rect is treated as dirty.
+	 */
+	uint32_t num_dirty_rects;
+	struct rectangle dirty_rects[DRV_MAX_DIRTY_RECTS];
+	/*
+	 * Value of bo->sync_seqno when rect was last invalidated or flushed. Backends may only
+	 * sync the part of the vma covered by rect, so this is tracked per mapping.
+	 */
+	uint32_t sync_seqno;
+	/*
+	 * Set while CPU access that the backend began through the buffer's dma-buf hasn't been
+	 * ended, so each DMA_BUF_IOCTL_SYNC start is paired with exactly one end.
+	 */
+	bool cpu_access;
 };
 
 struct driver *drv_create(int fd);
@@ -143,14 +195,31 @@ struct bo *drv_bo_import(struct driver *drv, struct drv_import_fd_data *data);
 void *drv_bo_map(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
 		 struct mapping **map_data, size_t plane);
 
+void *drv_bo_map_unsynced(struct bo *bo, const struct rectangle *rect, uint32_t map_flags,
+			  struct mapping **map_data, size_t plane);
+
 int drv_bo_unmap(struct bo *bo, struct mapping *mapping);
 
 int drv_bo_invalidate(struct bo *bo, struct mapping *mapping);
 
+int drv_bo_get_acquire_fence(struct bo *bo, int acquire_fence, uint32_t map_flags);
+
+void drv_bo_add_dirty_rect(struct bo *bo, struct mapping *mapping, const struct rectangle *rect);
+
 int drv_bo_flush(struct bo *bo, struct mapping *mapping);
 
+int drv_bo_flush_fenced(struct bo *bo, struct mapping *mapping, int *release_fence);
+
 int drv_bo_flush_or_unmap(struct bo *bo, struct mapping *mapping);
 
+int drv_bo_flush_or_unmap_fenced(struct bo *bo, struct mapping *mapping, int *release_fence);
+
+void drv_get_sync_stats(struct driver *drv, uint64_t *issued, uint64_t *skipped);
+
+void drv_get_init_stats(struct driver *drv, bool *cache_hit, uint64_t *init_ns);
+
+void drv_get_import_stats(struct driver *drv, uint64_t *hits, uint64_t *misses);
+
 uint32_t drv_bo_get_width(struct bo *bo);
 
 uint32_t drv_bo_get_height(struct bo *bo);
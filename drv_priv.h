@@ -20,6 +20,8 @@ struct bo_metadata {
 	uint32_t height;
 	uint32_t format;
 	uint32_t tiling;
+	/* Flags of the virtio-gpu blob resource backing the buffer, or 0 if it isn't one. */
+	uint32_t blob_flags;
 	size_t num_planes;
 	uint32_t offsets[DRV_MAX_PLANES];
 	uint32_t sizes[DRV_MAX_PLANES];
@@ -35,6 +37,13 @@ struct bo {
 	bool is_test_buffer;
 	union bo_handle handles[DRV_MAX_PLANES];
 	void *priv;
+	/*
+	 * Set once something other than this process's CPU may access the buffer: it was
+	 * imported, or its GEM handle or a dma-buf fd was handed out.
+	 */
+	bool device_visible;
+	/* Bumped whenever the contents seen through a CPU mapping may have gone stale. */
+	uint32_t sync_seqno;
 };
 
 struct format_metadata {
@@ -66,6 +75,28 @@ struct driver {
 	struct drv_array *mappings;
 	struct drv_array *combos;
 	pthread_mutex_t driver_lock;
+	pthread_mutex_t shadow_lock;
+	struct drv_array *shadow_buffers;
+	size_t shadow_cached_bytes;
+	uint64_t syncs_issued;
+	uint64_t syncs_skipped;
+	pthread_mutex_t import_lock;
+	struct drv_array *imports;
+	uint64_t import_hits;
+	uint64_t import_misses;
+	/* Set once the kernel rejected DRM_RDWR for a dma-buf export, so it isn't asked again. */
+	bool prime_rdwr_unsupported;
+	/* Set once the kernel turned out not to support dma-buf sync_file export and import. */
+	bool sync_file_unsupported;
+	/* Capability cache mapped while drv_init() runs, see drv_caps_cache_load(). */
+	void *caps_cache;
+	size_t caps_cache_size;
+	/* Backend capabilities probed during drv_init(), for the cache to keep. */
+	void *caps_pending;
+	size_t caps_pending_size;
+	/* Set while the backend's init uses capabilities from the cache. */
+	bool init_cache_hit;
+	uint64_t init_ns;
 };
 
 struct backend {
@@ -87,10 +118,35 @@ struct backend {
 	int (*bo_unmap)(struct bo *bo, struct vma *vma);
 	int (*bo_invalidate)(struct bo *bo, struct mapping *mapping);
 	int (*bo_flush)(struct bo *bo, struct mapping *mapping);
+	/*
+	 * Like bo_flush, but may return a fence that signals once the flush has landed rather
+	 * than waiting for it. Sets *release_fence to -1 if nothing needs waiting for.
+	 */
+	int (*bo_flush_fenced)(struct bo *bo, struct mapping *mapping, int *release_fence);
+	/*
+	 * Returns a fence that CPU access with map_flags has to wait for besides the caller's
+	 * acquire fence, e.g. for an earlier fenced flush, or -1. bo_invalidate still waits for it.
+	 */
+	int (*bo_get_acquire_fence)(struct bo *bo, uint32_t map_flags);
 	uint32_t (*resolve_format)(struct driver *drv, uint32_t format, uint64_t use_flags);
 	size_t (*num_planes_from_modifier)(struct driver *drv, uint32_t format, uint64_t modifier);
 	int (*resource_info)(struct bo *bo, uint32_t strides[DRV_MAX_PLANES],
 			     uint32_t offsets[DRV_MAX_PLANES]);
+	/* Submits device work bo_unmap() left queued, e.g. blits back from a staging buffer. */
+	void (*flush_queued)(struct driver *drv);
+	/* Set by backends whose bo_map and bo_unmap are safe to call without driver_lock. */
+	bool map_unlocked;
+	/*
+	 * Set by backends whose bo_invalidate begins CPU access that bo_flush ends, e.g. with
+	 * DMA_BUF_IOCTL_SYNC. The two have to stay paired, so invalidates are never skipped.
+	 */
+	bool brackets_cpu_access;
+	/*
+	 * Set by backends whose buffers are shared with implicitly synchronised devices. CPU
+	 * access then waits for the dma-buf's fences where bo_invalidate doesn't, acquire fences
+	 * include them, and fenced flushes attach their release fence to the dma-buf.
+	 */
+	bool implicit_sync;
 };
 
 // clang-format off
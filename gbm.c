@@ -418,6 +418,8 @@ PUBLIC void *gbm_bo_map2(struct gbm_bo *bo, uint32_t x, uint32_t y, uint32_t wid
 
 	map_flags = (transfer_flags & GBM_BO_TRANSFER_READ) ? BO_MAP_READ : BO_MAP_NONE;
 	map_flags |= (transfer_flags & GBM_BO_TRANSFER_WRITE) ? BO_MAP_WRITE : BO_MAP_NONE;
+	/* The stride returned below is the map's own. */
+	map_flags |= BO_MAP_STRIDED;
 
 	addr = drv_bo_map(bo->bo, &rect, map_flags, (struct mapping **)map_data, plane);
 	if (addr == MAP_FAILED)
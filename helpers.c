@@ -6,14 +6,30 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/dma-buf.h>
+#include <linux/sync_file.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <xf86drm.h>
 
+#if defined(__ARM_NEON) && !defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include "drv_priv.h"
 #include "helpers.h"
 #include "util.h"
@@ -22,6 +38,27 @@
 #include "i915_private.h"
 #endif
 
+#ifdef DRV_CAPS_CACHE_DIR
+#include <elf.h>
+#include <link.h>
+#endif
+
+/* Kernels before 6.0 lack these and fail them with ENOTTY. */
+#ifndef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+struct dma_buf_export_sync_file {
+	__u32 flags;
+	__s32 fd;
+};
+
+struct dma_buf_import_sync_file {
+	__u32 flags;
+	__s32 fd;
+};
+
+#define DMA_BUF_IOCTL_EXPORT_SYNC_FILE _IOWR(DMA_BUF_BASE, 2, struct dma_buf_export_sync_file)
+#define DMA_BUF_IOCTL_IMPORT_SYNC_FILE _IOW(DMA_BUF_BASE, 3, struct dma_buf_import_sync_file)
+#endif
+
 struct planar_layout {
 	size_t num_planes;
 	int horizontal_subsampling[DRV_MAX_PLANES];
@@ -259,6 +296,165 @@ uint32_t drv_size_from_format(uint32_t format, uint32_t stride, uint32_t height,
 	return stride * drv_height_from_format(format, height, plane);
 }
 
+/*
+ * Computes the part of |plane| covered by |rect|: the byte offset of its first pixel from the
+ * start of the buffer, the number of bytes it covers in each row and the number of rows.
+ * Subsampled planes are rounded outwards so that every sample touched by |rect| is included.
+ */
+int drv_bo_get_plane_rect_span(struct bo *bo, const struct rectangle *rect, size_t plane,
+			       uint32_t *offset, uint32_t *row_bytes, uint32_t *num_rows)
+{
+	const struct planar_layout *layout = layout_from_format(bo->meta.format);
+	uint32_t x0, x1, y0, y1;
+
+	if (!layout || plane >= layout->num_planes)
+		return -EINVAL;
+
+	x0 = rect->x / layout->horizontal_subsampling[plane];
+	x1 = DIV_ROUND_UP(rect->x + rect->width, layout->horizontal_subsampling[plane]);
+	y0 = rect->y / layout->vertical_subsampling[plane];
+	y1 = DIV_ROUND_UP(rect->y + rect->height, layout->vertical_subsampling[plane]);
+
+	*offset = bo->meta.offsets[plane] + y0 * bo->meta.strides[plane] +
+		  x0 * layout->bytes_per_pixel[plane];
+	*row_bytes = (x1 - x0) * layout->bytes_per_pixel[plane];
+	*num_rows = y1 - y0;
+	return 0;
+}
+
+/*
+ * Copies out of uncached or write-combined memory into a cached buffer. Such reads are only fast
+ * when issued as wide bursts, so on ARM use 64-byte NEON loads; the non-temporal load hint on
+ * arm64 also keeps the source from displacing the destination in the caches.
+ */
+static void drv_copy_from_uncached(uint8_t *dst, const uint8_t *src, size_t size)
+{
+#if defined(__aarch64__)
+	for (; size >= 64; size -= 64, src += 64, dst += 64)
+		__asm__ volatile("ldnp q0, q1, [%1]\n\t"
+				 "ldnp q2, q3, [%1, #32]\n\t"
+				 "stp q0, q1, [%0]\n\t"
+				 "stp q2, q3, [%0, #32]"
+				 :
+				 : "r"(dst), "r"(src)
+				 : "v0", "v1", "v2", "v3", "memory");
+#elif defined(__ARM_NEON)
+	for (; size >= 64; size -= 64, src += 64, dst += 64) {
+		uint8x16_t v0 = vld1q_u8(src);
+		uint8x16_t v1 = vld1q_u8(src + 16);
+		uint8x16_t v2 = vld1q_u8(src + 32);
+		uint8x16_t v3 = vld1q_u8(src + 48);
+		vst1q_u8(dst, v0);
+		vst1q_u8(dst + 16, v1);
+		vst1q_u8(dst + 32, v2);
+		vst1q_u8(dst + 48, v3);
+	}
+#endif
+	memcpy(dst, src, size);
+}
+
+/*
+ * Copies a cached buffer out to uncached or write-combined memory. The destination won't be read
+ * back by the CPU, so on arm64 use non-temporal stores that fill whole write-combining lines.
+ */
+static void drv_copy_to_uncached(uint8_t *dst, const uint8_t *src, size_t size)
+{
+#if defined(__aarch64__)
+	for (; size >= 64; size -= 64, src += 64, dst += 64)
+		__asm__ volatile("ldp q0, q1, [%1]\n\t"
+				 "ldp q2, q3, [%1, #32]\n\t"
+				 "stnp q0, q1, [%0]\n\t"
+				 "stnp q2, q3, [%0, #32]"
+				 :
+				 : "r"(dst), "r"(src)
+				 : "v0", "v1", "v2", "v3", "memory");
+#elif defined(__ARM_NEON)
+	for (; size >= 64; size -= 64, src += 64, dst += 64) {
+		uint8x16_t v0 = vld1q_u8(src);
+		uint8x16_t v1 = vld1q_u8(src + 16);
+		uint8x16_t v2 = vld1q_u8(src + 32);
+		uint8x16_t v3 = vld1q_u8(src + 48);
+		vst1q_u8(dst, v0);
+		vst1q_u8(dst + 16, v1);
+		vst1q_u8(dst + 32, v2);
+		vst1q_u8(dst + 48, v3);
+	}
+#endif
+	memcpy(dst, src, size);
+}
+
+/*
+ * Synchronizes the part of a cached shadow covered by rect with the buffer's uncached mapping,
+ * plane by plane. Both views must share the buffer's layout. Formats without a known layout copy
+ * the whole buffer.
+ */
+void drv_bo_sync_shadow_rect(struct bo *bo, const struct rectangle *rect, uint8_t *shadow,
+			     uint8_t *uncached, bool to_uncached)
+{
+	size_t plane;
+	uint32_t row, offset, row_bytes, num_rows;
+	void (*copy)(uint8_t *, const uint8_t *, size_t) =
+	    to_uncached ? drv_copy_to_uncached : drv_copy_from_uncached;
+	uint8_t *dst = to_uncached ? uncached : shadow;
+	const uint8_t *src = to_uncached ? shadow : uncached;
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		if (drv_bo_get_plane_rect_span(bo, rect, plane, &offset, &row_bytes, &num_rows)) {
+			copy(dst, src, bo->meta.total_size);
+			return;
+		}
+
+		/* Full-width rects are one contiguous range. */
+		if (row_bytes == bo->meta.strides[plane]) {
+			copy(dst + offset, src + offset, (size_t)row_bytes * num_rows);
+			continue;
+		}
+
+		for (row = 0; row < num_rows; row++, offset += bo->meta.strides[plane])
+			copy(dst + offset, src + offset, row_bytes);
+	}
+}
+
+/*
+ * Clears the part of each plane of a shadow laid out like the buffer that rect covers. Write-only
+ * locks get this instead of the buffer's contents: it's cheaper than reading them back, and a
+ * pooled shadow doesn't hand another buffer's bytes to flush for what the client left alone.
+ */
+void drv_bo_clear_shadow_rect(struct bo *bo, const struct rectangle *rect, uint8_t *shadow)
+{
+	size_t plane;
+	uint32_t row, offset, row_bytes, num_rows;
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		if (drv_bo_get_plane_rect_span(bo, rect, plane, &offset, &row_bytes, &num_rows)) {
+			memset(shadow, 0, bo->meta.total_size);
+			return;
+		}
+
+		if (row_bytes == bo->meta.strides[plane]) {
+			memset(shadow + offset, 0, (size_t)row_bytes * num_rows);
+			continue;
+		}
+
+		for (row = 0; row < num_rows; row++, offset += bo->meta.strides[plane])
+			memset(shadow + offset, 0, row_bytes);
+	}
+}
+
+/*
+ * Writes back the parts of a mapping's shadow reported dirty, or all of its rect if none were.
+ */
+void drv_bo_flush_shadow(struct bo *bo, struct mapping *mapping, uint8_t *shadow,
+			 uint8_t *uncached)
+{
+	uint32_t i, num_rects;
+	const struct rectangle *rects;
+
+	num_rects = drv_mapping_dirty_rects(mapping, &rects);
+	for (i = 0; i < num_rects; i++)
+		drv_bo_sync_shadow_rect(bo, &rects[i], shadow, uncached, true);
+}
+
 static uint32_t subsample_stride(uint32_t stride, uint32_t format, size_t plane)
 {
 	if (plane != 0) {
@@ -434,20 +630,308 @@ int drv_gem_bo_destroy(struct bo *bo)
 	return error;
 }
 
-int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data)
+/*
+ * What's known about a dma-buf imported into, or exported from, a GEM handle that is still open.
+ * A dma-buf's inode can't be reused while the handle holds a reference to it, so (dev, ino)
+ * identifies it even when it arrives as a different fd.
+ */
+struct drv_import_entry {
+	dev_t dev;
+	ino_t ino;
+	uint32_t handle;
+	/* Size of the dma-buf, or -1 until someone needed it. */
+	off_t size;
+	/* The tiling and blob flags of the buffer, once a backend needed them. */
+	bool has_layout;
+	uint32_t tiling;
+	uint32_t blob_flags;
+};
+
+int drv_import_cache_init(struct driver *drv)
+{
+	if (pthread_mutex_init(&drv->import_lock, NULL))
+		return -EINVAL;
+
+	drv->imports = drv_array_init(sizeof(struct drv_import_entry));
+	if (!drv->imports) {
+		pthread_mutex_destroy(&drv->import_lock);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void drv_import_cache_destroy(struct driver *drv)
+{
+	drv_array_destroy(drv->imports);
+	pthread_mutex_destroy(&drv->import_lock);
+}
+
+/* The caller holds import_lock. */
+static struct drv_import_entry *drv_import_cache_find(struct driver *drv, const struct stat *st,
+						      uint32_t handle)
+{
+	uint32_t i;
+
+	for (i = 0; i < drv_array_size(drv->imports); i++) {
+		struct drv_import_entry *entry = drv_array_at_idx(drv->imports, i);
+		if (st ? entry->dev == st->st_dev && entry->ino == st->st_ino
+		       : entry->handle == handle)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns the GEM handle for the dma-buf fd, reusing the one from an earlier import of the same
+ * dma-buf when it's still open rather than asking the kernel again. The caller imports it into a
+ * bo, or drops the entry with drv_import_cache_remove() if that fails.
+ */
+int drv_get_import_handle(struct driver *drv, int fd, uint32_t *handle)
 {
 	int ret;
-	size_t plane;
+	void *count;
+	uint32_t i;
+	struct stat st;
+	struct drv_import_entry entry, *cached;
 	struct drm_prime_handle prime_handle;
+	bool have_stat = !fstat(fd, &st);
+
+	if (have_stat) {
+		/* Lock order as in drv_bo_destroy(), which removes entries under driver_lock. */
+		pthread_mutex_lock(&drv->driver_lock);
+		pthread_mutex_lock(&drv->import_lock);
+		cached = drv_import_cache_find(drv, &st, 0);
+
+		/*
+		 * Only a bo keeps a handle open. An entry whose handle no bo holds was left by an
+		 * import that is still in flight or never finished, and its handle may be closed
+		 * already, so it expires. Asking the kernel again at worst returns the same handle.
+		 */
+		if (cached && (drmHashLookup(drv->buffer_table, cached->handle, &count) ||
+			       !(uintptr_t)count)) {
+			for (i = 0; drv_array_at_idx(drv->imports, i) != cached; i++)
+				;
+			drv_array_remove(drv->imports, i);
+			cached = NULL;
+		}
+
+		if (cached)
+			*handle = cached->handle;
+		pthread_mutex_unlock(&drv->import_lock);
+		pthread_mutex_unlock(&drv->driver_lock);
+
+		if (cached) {
+			__atomic_add_fetch(&drv->import_hits, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+	}
+
+	__atomic_add_fetch(&drv->import_misses, 1, __ATOMIC_RELAXED);
+
+	memset(&prime_handle, 0, sizeof(prime_handle));
+	prime_handle.fd = fd;
+	ret = drmIoctl(drv->fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime_handle);
+	if (ret)
+		return -errno;
+
+	*handle = prime_handle.handle;
+	if (!have_stat)
+		return 0;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.dev = st.st_dev;
+	entry.ino = st.st_ino;
+	entry.handle = prime_handle.handle;
+	entry.size = -1;
+
+	pthread_mutex_lock(&drv->import_lock);
+	/* Lost a race with another import of the same dma-buf, which got the same handle. */
+	if (!drv_import_cache_find(drv, &st, 0))
+		drv_array_append(drv->imports, &entry);
+	pthread_mutex_unlock(&drv->import_lock);
+
+	return 0;
+}
+
+/*
+ * Returns the size of the dma-buf behind fd, which was imported as handle.
+ */
+off_t drv_get_import_size(struct driver *drv, int fd, uint32_t handle)
+{
+	off_t size = -1;
+	struct drv_import_entry *entry;
+
+	pthread_mutex_lock(&drv->import_lock);
+	entry = drv_import_cache_find(drv, NULL, handle);
+	if (entry)
+		size = entry->size;
+	pthread_mutex_unlock(&drv->import_lock);
+
+	if (size != -1)
+		return size;
+
+	size = lseek(fd, 0, SEEK_END);
+	if (size == -1)
+		return size;
+
+	lseek(fd, 0, SEEK_SET);
+
+	pthread_mutex_lock(&drv->import_lock);
+	entry = drv_import_cache_find(drv, NULL, handle);
+	if (entry)
+		entry->size = size;
+	pthread_mutex_unlock(&drv->import_lock);
+
+	return size;
+}
+
+/*
+ * Backends that learn the tiling or blob flags of imported buffers can keep them with the import,
+ * for the next import of the same buffer, as long as they can't change while it's open. Keyed by
+ * the handle of the first plane. Returns whether bo->meta.tiling and bo->meta.blob_flags were
+ * restored.
+ */
+bool drv_import_cache_get_layout(struct bo *bo)
+{
+	struct drv_import_entry *entry;
+	bool found = false;
+
+	pthread_mutex_lock(&bo->drv->import_lock);
+	entry = drv_import_cache_find(bo->drv, NULL, bo->handles[0].u32);
+	if (entry && entry->has_layout) {
+		bo->meta.tiling = entry->tiling;
+		bo->meta.blob_flags = entry->blob_flags;
+		found = true;
+	}
+	pthread_mutex_unlock(&bo->drv->import_lock);
+
+	return found;
+}
+
+void drv_import_cache_set_layout(struct bo *bo)
+{
+	struct drv_import_entry *entry;
+
+	pthread_mutex_lock(&bo->drv->import_lock);
+	entry = drv_import_cache_find(bo->drv, NULL, bo->handles[0].u32);
+	if (entry) {
+		entry->tiling = bo->meta.tiling;
+		entry->blob_flags = bo->meta.blob_flags;
+		entry->has_layout = true;
+	}
+	pthread_mutex_unlock(&bo->drv->import_lock);
+}
+
+/*
+ * Called when the last reference to the buffer's handles is dropped, before they're closed.
+ */
+void drv_import_cache_remove(struct bo *bo)
+{
+	uint32_t i;
+	size_t plane;
+
+	pthread_mutex_lock(&bo->drv->import_lock);
+	for (i = 0; i < drv_array_size(bo->drv->imports);) {
+		struct drv_import_entry *entry = drv_array_at_idx(bo->drv->imports, i);
+
+		for (plane = 0; plane < bo->meta.num_planes; plane++)
+			if (entry->handle == bo->handles[plane].u32)
+				break;
+
+		/* This shrinks and shifts the array, so don't increment i. */
+		if (plane < bo->meta.num_planes)
+			drv_array_remove(bo->drv->imports, i);
+		else
+			i++;
+	}
+	pthread_mutex_unlock(&bo->drv->import_lock);
+}
+
+#ifndef DRM_RDWR
+#define DRM_RDWR O_RDWR
+#endif
+
+/*
+ * Returns a new dma-buf fd for the GEM handle. Nothing keeps a copy of it, but the first export
+ * of a handle records its dma-buf, so importing the fd again in this process doesn't need the
+ * kernel.
+ */
+int drv_get_export_fd(struct driver *drv, uint32_t handle)
+{
+	int ret, fd;
+	bool known;
+	struct stat st;
+	struct drv_import_entry entry;
+
+	/* Older DRM implementations blocked DRM_RDWR, but gave a read/write mapping anyways. */
+	if (!__atomic_load_n(&drv->prime_rdwr_unsupported, __ATOMIC_RELAXED)) {
+		ret = drmPrimeHandleToFD(drv->fd, handle, DRM_CLOEXEC | DRM_RDWR, &fd);
+		if (!ret)
+			goto record;
+		if (errno != EINVAL)
+			return ret;
+
+		__atomic_store_n(&drv->prime_rdwr_unsupported, true, __ATOMIC_RELAXED);
+	}
+
+	ret = drmPrimeHandleToFD(drv->fd, handle, DRM_CLOEXEC, &fd);
+	if (ret)
+		return ret;
+
+record:
+	pthread_mutex_lock(&drv->import_lock);
+	known = drv_import_cache_find(drv, NULL, handle) != NULL;
+	pthread_mutex_unlock(&drv->import_lock);
+
+	if (known || fstat(fd, &st))
+		return fd;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.dev = st.st_dev;
+	entry.ino = st.st_ino;
+	entry.handle = handle;
+	entry.size = -1;
+
+	pthread_mutex_lock(&drv->import_lock);
+	/* Lost a race with another export of the same handle. */
+	if (!drv_import_cache_find(drv, NULL, handle))
+		drv_array_append(drv->imports, &entry);
+	pthread_mutex_unlock(&drv->import_lock);
+
+	return fd;
+}
+
+/*
+ * Reports how many dma-buf imports reused a cached handle and how many had to ask the kernel.
+ */
+void drv_get_import_stats(struct driver *drv, uint64_t *hits, uint64_t *misses)
+{
+	*hits = __atomic_load_n(&drv->import_hits, __ATOMIC_RELAXED);
+	*misses = __atomic_load_n(&drv->import_misses, __ATOMIC_RELAXED);
+}
+
+int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data)
+{
+	int ret;
+	size_t plane, prev;
 
 	for (plane = 0; plane < bo->meta.num_planes; plane++) {
-		memset(&prime_handle, 0, sizeof(prime_handle));
-		prime_handle.fd = data->fds[plane];
+		/* Planes usually share one dma-buf, often through the same fd. */
+		for (prev = 0; prev < plane; prev++)
+			if (data->fds[prev] == data->fds[plane])
+				break;
+
+		if (prev < plane) {
+			bo->handles[plane].u32 = bo->handles[prev].u32;
+			continue;
+		}
 
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &prime_handle);
+		ret = drv_get_import_handle(bo->drv, data->fds[plane], &bo->handles[plane].u32);
 
 		if (ret) {
-			drv_log("DRM_IOCTL_PRIME_FD_TO_HANDLE failed (fd=%u)\n", prime_handle.fd);
+			drv_log("DRM_IOCTL_PRIME_FD_TO_HANDLE failed (fd=%u)\n", data->fds[plane]);
 
 			/*
 			 * Need to call GEM close on planes that were opened,
@@ -456,11 +940,10 @@ int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 			 * planes before that plane.
 			 */
 			bo->meta.num_planes = plane;
+			drv_import_cache_remove(bo);
 			drv_gem_bo_destroy(bo);
-			return -errno;
+			return ret;
 		}
-
-		bo->handles[plane].u32 = prime_handle.handle;
 	}
 
 	return 0;
@@ -494,109 +977,1489 @@ int drv_bo_munmap(struct bo *bo, struct vma *vma)
 	return munmap(vma->addr, vma->length);
 }
 
-int drv_mapping_destroy(struct bo *bo)
-{
-	int ret;
-	size_t plane;
-	struct mapping *mapping;
-	uint32_t idx;
-
-	/*
-	 * This function is called right before the buffer is destroyed. It will free any mappings
-	 * associated with the buffer.
-	 */
-
-	idx = 0;
-	for (plane = 0; plane < bo->meta.num_planes; plane++) {
-		while (idx < drv_array_size(bo->drv->mappings)) {
-			mapping = (struct mapping *)drv_array_at_idx(bo->drv->mappings, idx);
-			if (mapping->vma->handle != bo->handles[plane].u32) {
-				idx++;
-				continue;
-			}
+/* Idle shadow buffers kept for reuse are capped at this many bytes per driver. */
+#define DRV_SHADOW_POOL_MAX_BYTES (64 * 1024 * 1024)
+#define DRV_HUGE_PAGE_SIZE (2 * 1024 * 1024)
 
-			if (!--mapping->vma->refcount) {
-				ret = bo->drv->backend->bo_unmap(bo, mapping->vma);
-				if (ret) {
-					drv_log("munmap failed\n");
-					return ret;
-				}
+struct drv_shadow_buffer {
+	void *addr;
+	size_t size;
+};
 
-				free(mapping->vma);
-			}
+int drv_shadow_pool_init(struct driver *drv)
+{
+	if (pthread_mutex_init(&drv->shadow_lock, NULL))
+		return -EINVAL;
 
-			/* This shrinks and shifts the array, so don't increment idx. */
-			drv_array_remove(bo->drv->mappings, idx);
-		}
+	drv->shadow_buffers = drv_array_init(sizeof(struct drv_shadow_buffer));
+	if (!drv->shadow_buffers) {
+		pthread_mutex_destroy(&drv->shadow_lock);
+		return -ENOMEM;
 	}
 
+	drv->shadow_cached_bytes = 0;
 	return 0;
 }
 
-int drv_get_prot(uint32_t map_flags)
-{
-	return (BO_MAP_WRITE & map_flags) ? PROT_WRITE | PROT_READ : PROT_READ;
-}
-
-uintptr_t drv_get_reference_count(struct driver *drv, struct bo *bo, size_t plane)
+void drv_shadow_pool_destroy(struct driver *drv)
 {
-	void *count;
-	uintptr_t num = 0;
+	uint32_t i;
 
-	if (!drmHashLookup(drv->buffer_table, bo->handles[plane].u32, &count))
-		num = (uintptr_t)(count);
+	for (i = 0; i < drv_array_size(drv->shadow_buffers); i++) {
+		struct drv_shadow_buffer *buf = drv_array_at_idx(drv->shadow_buffers, i);
+		munmap(buf->addr, buf->size);
+	}
 
-	return num;
+	drv_array_destroy(drv->shadow_buffers);
+	pthread_mutex_destroy(&drv->shadow_lock);
 }
 
-void drv_increment_reference_count(struct driver *drv, struct bo *bo, size_t plane)
+/*
+ * Rounds up to one of four size classes per power of two, so buffers of similar dimensions
+ * share pool entries while wasting at most a quarter of the request.
+ */
+static size_t drv_shadow_size_class(size_t size)
 {
-	uintptr_t num = drv_get_reference_count(drv, bo, plane);
+	size_t page_size = getpagesize();
+	size_t step;
 
-	/* If a value isn't in the table, drmHashDelete is a no-op */
-	drmHashDelete(drv->buffer_table, bo->handles[plane].u32);
-	drmHashInsert(drv->buffer_table, bo->handles[plane].u32, (void *)(num + 1));
+	if (size <= page_size)
+		return page_size;
+
+	step = (size_t)(1ull << (63 - __builtin_clzll(size))) / 4;
+	return ALIGN(size, MAX(step, page_size));
 }
 
-void drv_decrement_reference_count(struct driver *drv, struct bo *bo, size_t plane)
+static void *drv_shadow_mmap(size_t size)
 {
-	uintptr_t num = drv_get_reference_count(drv, bo, plane);
+	uint8_t *addr, *aligned;
+	size_t head, tail;
 
-	drmHashDelete(drv->buffer_table, bo->handles[plane].u32);
+	if (size < DRV_HUGE_PAGE_SIZE)
+		return mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-	if (num > 0)
-		drmHashInsert(drv->buffer_table, bo->handles[plane].u32, (void *)(num - 1));
-}
+	/* Over-allocate and trim so the whole buffer can be backed by huge pages. */
+	addr = mmap(NULL, size + DRV_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		return MAP_FAILED;
 
-void drv_add_combination(struct driver *drv, const uint32_t format,
-			 struct format_metadata *metadata, uint64_t use_flags)
-{
-	struct combination combo = { .format = format,
-				     .metadata = *metadata,
-				     .use_flags = use_flags };
+	aligned = (uint8_t *)ALIGN((uintptr_t)addr, DRV_HUGE_PAGE_SIZE);
+	head = aligned - addr;
+	tail = DRV_HUGE_PAGE_SIZE - head;
+	if (head)
+		munmap(addr, head);
+	if (tail)
+		munmap(aligned + size, tail);
 
-	drv_array_append(drv->combos, &combo);
+#ifdef MADV_HUGEPAGE
+	madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+	return aligned;
 }
 
-void drv_add_combinations(struct driver *drv, const uint32_t *formats, uint32_t num_formats,
-			  struct format_metadata *metadata, uint64_t use_flags)
+/*
+ * Returns a CPU shadow buffer of at least size bytes for backends that can't expose the
+ * buffer's own memory. Pooled buffers still hold another buffer's bytes, so callers must fill
+ * every part of the buffer they may write back, clearing it for write-only locks.
+ */
+void *drv_shadow_alloc(struct driver *drv, size_t size)
 {
 	uint32_t i;
+	void *addr = NULL;
+	size_t class_size = drv_shadow_size_class(size);
+
+	/* Prefer the most recently freed buffer, which is most likely still in cache. */
+	pthread_mutex_lock(&drv->shadow_lock);
+	i = drv_array_size(drv->shadow_buffers);
+	while (i--) {
+		struct drv_shadow_buffer *buf = drv_array_at_idx(drv->shadow_buffers, i);
+		if (buf->size != class_size)
+			continue;
 
-	for (i = 0; i < num_formats; i++) {
-		struct combination combo = { .format = formats[i],
-					     .metadata = *metadata,
-					     .use_flags = use_flags };
+		addr = buf->addr;
+		drv->shadow_cached_bytes -= buf->size;
+		drv_array_remove(drv->shadow_buffers, i);
+		break;
+	}
+	pthread_mutex_unlock(&drv->shadow_lock);
 
-		drv_array_append(drv->combos, &combo);
+	if (addr)
+		return addr;
+
+	addr = drv_shadow_mmap(class_size);
+	if (addr == MAP_FAILED) {
+		drv_log("Failed to allocate %zu byte shadow buffer\n", class_size);
+		return NULL;
 	}
+
+	return addr;
 }
 
-void drv_modify_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
+/*
+ * Returns a shadow buffer to the pool. The oldest idle buffers are released once the pool
+ * grows past its cap.
+ */
+void drv_shadow_free(struct driver *drv, void *addr, size_t size)
+{
+	struct drv_shadow_buffer buf;
+
+	if (!addr)
+		return;
+
+	buf.addr = addr;
+	buf.size = drv_shadow_size_class(size);
+
+	if (buf.size > DRV_SHADOW_POOL_MAX_BYTES) {
+		munmap(buf.addr, buf.size);
+		return;
+	}
+
+	pthread_mutex_lock(&drv->shadow_lock);
+	while (drv->shadow_cached_bytes + buf.size > DRV_SHADOW_POOL_MAX_BYTES) {
+		struct drv_shadow_buffer *oldest = drv_array_at_idx(drv->shadow_buffers, 0);
+		munmap(oldest->addr, oldest->size);
+		drv->shadow_cached_bytes -= oldest->size;
+		drv_array_remove(drv->shadow_buffers, 0);
+	}
+
+	drv_array_append(drv->shadow_buffers, &buf);
+	drv->shadow_cached_bytes += buf.size;
+	pthread_mutex_unlock(&drv->shadow_lock);
+}
+
+struct drv_dmabuf_map_data {
+	int fd;
+};
+
+/*
+ * Maps a plane through a dma-buf fd of its GEM handle, so CPU access can be bracketed with
+ * DMA_BUF_IOCTL_SYNC and the exporter does whatever cache maintenance it needs. The fd is kept
+ * private to the mapping and doesn't mark the buffer as shared.
+ */
+void *drv_dmabuf_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+{
+	int fd;
+	size_t i;
+	void *addr;
+	struct drv_dmabuf_map_data *priv;
+
+	fd = drv_get_export_fd(bo->drv, bo->handles[plane].u32);
+	if (fd < 0) {
+		drv_log("Failed to export dma-buf for mapping\n");
+		return MAP_FAILED;
+	}
+
+	for (i = 0; i < bo->meta.num_planes; i++)
+		if (bo->handles[i].u32 == bo->handles[plane].u32)
+			vma->length += bo->meta.sizes[i];
+
+	addr = mmap(0, vma->length, drv_get_prot(map_flags), MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		drv_log("mmap of dma-buf failed with %s\n", strerror(errno));
+		close(fd);
+		return MAP_FAILED;
+	}
+
+	priv = calloc(1, sizeof(*priv));
+	if (!priv) {
+		munmap(addr, vma->length);
+		close(fd);
+		return MAP_FAILED;
+	}
+
+	priv->fd = fd;
+	vma->priv = priv;
+	return addr;
+}
+
+/*
+ * Maps a dumb buffer like drv_dmabuf_bo_map(), falling back to DRM_IOCTL_MODE_MAP_DUMB without
+ * the sync bracket for drivers that can't export it or can't mmap the dma-buf.
+ */
+void *drv_dumb_dmabuf_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
+{
+	void *addr = drv_dmabuf_bo_map(bo, vma, plane, map_flags);
+
+	if (addr != MAP_FAILED)
+		return addr;
+
+	vma->length = 0;
+	return drv_dumb_bo_map(bo, vma, plane, map_flags);
+}
+
+int drv_dmabuf_bo_unmap(struct bo *bo, struct vma *vma)
+{
+	struct drv_dmabuf_map_data *priv = vma->priv;
+
+	if (priv) {
+		close(priv->fd);
+		free(priv);
+		vma->priv = NULL;
+	}
+
+	return munmap(vma->addr, vma->length);
+}
+
+static int drv_dmabuf_sync(int fd, uint32_t map_flags, uint64_t sync_flags)
+{
+	struct dma_buf_sync sync;
+
+	memset(&sync, 0, sizeof(sync));
+	sync.flags = sync_flags;
+	if (map_flags & BO_MAP_READ)
+		sync.flags |= DMA_BUF_SYNC_READ;
+	if (map_flags & BO_MAP_WRITE)
+		sync.flags |= DMA_BUF_SYNC_WRITE;
+
+	/* drmIoctl() restarts on EINTR and EAGAIN, which the sync ioctl can return. */
+	if (drmIoctl(fd, DMA_BUF_IOCTL_SYNC, &sync)) {
+		drv_log("DMA_BUF_IOCTL_SYNC failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Starts CPU access to any dma-buf, waiting for outstanding device access and invalidating CPU
+ * caches as the exporter requires.
+ */
+int drv_dmabuf_begin_cpu_access(int fd, uint32_t map_flags)
+{
+	return drv_dmabuf_sync(fd, map_flags, DMA_BUF_SYNC_START);
+}
+
+/*
+ * Ends CPU access to any dma-buf, writing back CPU caches as the exporter requires.
+ */
+int drv_dmabuf_end_cpu_access(int fd, uint32_t map_flags)
+{
+	return drv_dmabuf_sync(fd, map_flags, DMA_BUF_SYNC_END);
+}
+
+/*
+ * Blocks until fd reports events, or for at most timeout milliseconds (-1 for no limit), in
+ * which case -ETIMEDOUT is returned.
+ */
+static int drv_poll_wait(int fd, short events, int timeout)
+{
+	int ret;
+	struct pollfd fds = { .fd = fd, .events = events };
+
+	do {
+		ret = poll(&fds, 1, timeout);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+	if (ret < 0)
+		return -errno;
+	if (!ret)
+		return -ETIMEDOUT;
+	if (fds.revents & (POLLERR | POLLNVAL))
+		return -EINVAL;
+
+	return 0;
+}
+
+int drv_fence_wait(int fence)
+{
+	int ret;
+
+	if (fence < 0)
+		return 0;
+
+	ret = drv_poll_wait(fence, POLLIN, -1);
+	close(fence);
+	return ret;
+}
+
+/*
+ * A lock shouldn't hang forever on a device job that never completes; it fails instead.
+ */
+#define DRV_DMABUF_WAIT_TIMEOUT_MS 1000
+
+/*
+ * Waits for the implicitly synchronised work on the dma-buf that CPU access with map_flags has
+ * to wait for. Polling the dma-buf itself needs no sync_file, so it also works on old kernels.
+ */
+int drv_dmabuf_wait(int fd, uint32_t map_flags)
+{
+	int ret;
+
+	/* POLLIN waits for the writers on the reservation, POLLOUT for everyone. */
+	ret = drv_poll_wait(fd, (map_flags & BO_MAP_WRITE) ? POLLOUT : POLLIN,
+			    DRV_DMABUF_WAIT_TIMEOUT_MS);
+	if (ret == -ETIMEDOUT)
+		drv_log("Implicit fences still pending after %d ms\n", DRV_DMABUF_WAIT_TIMEOUT_MS);
+
+	return ret;
+}
+
+/*
+ * Returns whether the sync_file fence has signalled, without blocking.
+ */
+bool drv_fence_signaled(int fence)
+{
+	struct pollfd fds = { .fd = fence, .events = POLLIN };
+
+	return poll(&fds, 1, 0) == 1 && (fds.revents & POLLIN);
+}
+
+/*
+ * Returns a new sync_file fence that signals once both fences have. Neither is closed.
+ */
+int drv_fence_merge(int fence1, int fence2)
+{
+	struct sync_merge_data merge;
+
+	memset(&merge, 0, sizeof(merge));
+	strncpy(merge.name, "minigbm", sizeof(merge.name) - 1);
+	merge.fd2 = fence2;
+
+	if (drmIoctl(fence1, SYNC_IOC_MERGE, &merge)) {
+		drv_log("SYNC_IOC_MERGE failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return merge.fence;
+}
+
+static uint32_t drv_dmabuf_sync_file_flags(uint32_t map_flags)
+{
+	/* Reads wait for the writers on the reservation, writes wait for everyone. */
+	return (map_flags & BO_MAP_WRITE) ? DMA_BUF_SYNC_WRITE : DMA_BUF_SYNC_READ;
+}
+
+/*
+ * Returns a sync_file fence for the implicitly synchronised work on the dma-buf that CPU access
+ * with map_flags would have to wait for, or a negative errno. Kernels without sync_file export
+ * fail with -ENOSYS, which is remembered so later calls don't retry the ioctl.
+ */
+int drv_dmabuf_export_fence(struct driver *drv, int fd, uint32_t map_flags)
+{
+	struct dma_buf_export_sync_file export_fence;
+
+	if (__atomic_load_n(&drv->sync_file_unsupported, __ATOMIC_RELAXED))
+		return -ENOSYS;
+
+	memset(&export_fence, 0, sizeof(export_fence));
+	export_fence.flags = drv_dmabuf_sync_file_flags(map_flags);
+	export_fence.fd = -1;
+
+	if (drmIoctl(fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &export_fence)) {
+		if (errno == ENOTTY) {
+			__atomic_store_n(&drv->sync_file_unsupported, true, __ATOMIC_RELAXED);
+			return -ENOSYS;
+		}
+
+		drv_log("DMA_BUF_IOCTL_EXPORT_SYNC_FILE failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return export_fence.fd;
+}
+
+/*
+ * Attaches the sync_file fence to the dma-buf's reservation, as a write if map_flags includes
+ * BO_MAP_WRITE, so that implicitly synchronised users of the buffer wait for it. The fence isn't
+ * closed. Fails with -ENOSYS like drv_dmabuf_export_fence().
+ */
+int drv_dmabuf_import_fence(struct driver *drv, int fd, int fence, uint32_t map_flags)
+{
+	struct dma_buf_import_sync_file import_fence;
+
+	if (__atomic_load_n(&drv->sync_file_unsupported, __ATOMIC_RELAXED))
+		return -ENOSYS;
+
+	memset(&import_fence, 0, sizeof(import_fence));
+	import_fence.flags = drv_dmabuf_sync_file_flags(map_flags);
+	import_fence.fd = fence;
+
+	if (drmIoctl(fd, DMA_BUF_IOCTL_IMPORT_SYNC_FILE, &import_fence)) {
+		if (errno == ENOTTY) {
+			__atomic_store_n(&drv->sync_file_unsupported, true, __ATOMIC_RELAXED);
+			return -ENOSYS;
+		}
+
+		drv_log("DMA_BUF_IOCTL_IMPORT_SYNC_FILE failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Begins CPU access through mapping unless it already has. A flush, or an unlock after a
+ * flush, then ends it only once.
+ */
+int drv_dmabuf_begin_mapping_access(int fd, struct mapping *mapping)
+{
+	int ret;
+
+	if (mapping->cpu_access)
+		return 0;
+
+	ret = drv_dmabuf_begin_cpu_access(fd, mapping->vma->map_flags);
+	if (!ret)
+		mapping->cpu_access = true;
+
+	return ret;
+}
+
+int drv_dmabuf_end_mapping_access(int fd, struct mapping *mapping)
+{
+	if (!mapping->cpu_access)
+		return 0;
+
+	mapping->cpu_access = false;
+	return drv_dmabuf_end_cpu_access(fd, mapping->vma->map_flags);
+}
+
+int drv_dmabuf_bo_invalidate(struct bo *bo, struct mapping *mapping)
+{
+	int fd, ret;
+	struct drv_dmabuf_map_data *priv = mapping->vma->priv;
+
+	if (priv)
+		return drv_dmabuf_begin_mapping_access(priv->fd, mapping);
+
+	/* Mapped by drv_dumb_dmabuf_bo_map() without a dma-buf: only wait for implicit fences. */
+	if (!bo->drv->backend->implicit_sync || !bo->device_visible)
+		return 0;
+
+	fd = drv_get_export_fd(bo->drv, bo->handles[0].u32);
+	if (fd < 0)
+		return fd;
+
+	ret = drv_dmabuf_wait(fd, mapping->vma->map_flags);
+	close(fd);
+	return ret;
+}
+
+int drv_dmabuf_bo_flush(struct bo *bo, struct mapping *mapping)
+{
+	struct drv_dmabuf_map_data *priv = mapping->vma->priv;
+
+	if (!priv)
+		return 0;
+
+	return drv_dmabuf_end_mapping_access(priv->fd, mapping);
+}
+
+/*
+ * Faults populate up to this many neighbouring missing pages at once, so each round trip to the
+ * fault thread converts whole rows of tiles rather than slivers of them.
+ */
+#define DRV_LAZY_FAULT_AROUND_PAGES 16
+
+enum drv_lazy_page_state {
+	DRV_LAZY_PAGE_MISSING = 0,
+	DRV_LAZY_PAGE_CLEAN,
+	DRV_LAZY_PAGE_DIRTY,
+};
+
+/*
+ * A linear CPU view of a converted (e.g. tiled) or shadowed buffer. With BO_MAP_LAZY it is
+ * populated a page at a time on first touch; otherwise invalidate fills the locked rect up front.
+ * Faults are served by a thread per view: the backend converts the rows covering the page into
+ * the staging shadow, which is then copied into place with UFFDIO_COPY. Pages are installed
+ * write-protected where the kernel supports it, so the first write to each one is seen and flush
+ * only converts back the pages that were written.
+ */
+struct drv_lazy_view {
+	struct bo *bo;
+	uint8_t *addr;
+	uint8_t *staging;
+	size_t size;
+	size_t page_size;
+	uint32_t row_align;
+	drv_lazy_transfer_t transfer;
+	void *data;
+	int uffd;
+	int stop_fd;
+	bool lazy;
+	bool writable;
+	bool write_protect;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	uint8_t *page_state;
+};
+
+/*
+ * Converts the parts of clip that fall in pages [first, first + count) from the staging shadow
+ * back into the buffer.
+ */
+static void drv_lazy_view_flush_pages(struct drv_lazy_view *view, size_t first, size_t count,
+				      const struct rectangle *clip)
+{
+	struct bo *bo = view->bo;
+	uint32_t stride = bo->meta.strides[0];
+	uint32_t bpp = drv_bytes_per_pixel_from_format(bo->meta.format, 0);
+	size_t start = first * view->page_size;
+	size_t end = start + count * view->page_size;
+	size_t row_start, x0, x1, y, y_end;
+	struct rectangle rect, clipped;
+
+	if (end <= bo->meta.offsets[0])
+		return;
+
+	start = MAX(start, bo->meta.offsets[0]) - bo->meta.offsets[0];
+	end -= bo->meta.offsets[0];
+	y_end = MIN(DIV_ROUND_UP(end, stride), bo->meta.height);
+
+	for (y = start / stride; y < y_end; y += rect.height) {
+		row_start = y * stride;
+		x0 = MAX(start, row_start) - row_start;
+		x1 = MIN(end, row_start + stride) - row_start;
+
+		rect.x = x0 / bpp;
+		rect.y = y;
+		rect.width = MIN(x1 / bpp, bo->meta.width);
+		rect.height = 1;
+		/* Rows entirely inside the range go as one rect. */
+		if (!x0 && x1 == stride)
+			rect.height = MIN((end - row_start) / stride, y_end - y);
+
+		if (rect.width <= rect.x)
+			continue;
+		rect.width -= rect.x;
+
+		if (drv_rect_intersect(&rect, clip, &clipped))
+			view->transfer(bo, view->data, &clipped, true);
+	}
+}
+
+/*
+ * Converts whole rows covering pages [first, first + count) from the buffer into the staging
+ * shadow, widened to the backend's row alignment so tiles are converted whole. Only missing pages
+ * get copied into the view, so converting more of staging than that is harmless.
+ */
+static void drv_lazy_view_fill(struct drv_lazy_view *view, size_t first, size_t count)
+{
+	struct bo *bo = view->bo;
+	uint32_t stride = bo->meta.strides[0];
+	size_t start = first * view->page_size;
+	size_t end = start + count * view->page_size;
+	struct rectangle rect;
+	uint32_t y_end;
+
+	if (end <= bo->meta.offsets[0])
+		return;
+
+	start = MAX(start, bo->meta.offsets[0]) - bo->meta.offsets[0];
+	end -= bo->meta.offsets[0];
+
+	rect.x = 0;
+	rect.y = start / stride;
+	rect.y -= rect.y % view->row_align;
+	rect.width = bo->meta.width;
+	y_end = MIN(ALIGN(DIV_ROUND_UP(end, stride), view->row_align), bo->meta.height);
+	if (rect.y >= y_end)
+		return;
+
+	rect.height = y_end - rect.y;
+	view->transfer(bo, view->data, &rect, false);
+}
+
+static void drv_lazy_view_fault(struct drv_lazy_view *view, const struct uffd_msg *msg)
+{
+	int ret;
+	uintptr_t page = msg->arg.pagefault.address & ~((uintptr_t)view->page_size - 1);
+	size_t index = (page - (uintptr_t)view->addr) / view->page_size;
+	size_t num_pages = view->size / view->page_size;
+	size_t window, first, last, i;
+	bool write = msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE;
+	struct uffdio_writeprotect wp;
+	struct uffdio_copy copy;
+	struct uffdio_range range;
+
+	pthread_mutex_lock(&view->lock);
+
+	if (msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP) {
+		/*
+		 * First write to a clean page: track it and let the write through. Writes that carry
+		 * on from a dirty page are likely streaming, so the clean pages after it in the same
+		 * window are released too rather than faulting one at a time.
+		 */
+		last = index + 1;
+		if (index && view->page_state[index - 1] == DRV_LAZY_PAGE_DIRTY) {
+			window = index - index % DRV_LAZY_FAULT_AROUND_PAGES;
+			while (last < MIN(window + DRV_LAZY_FAULT_AROUND_PAGES, num_pages) &&
+			       view->page_state[last] == DRV_LAZY_PAGE_CLEAN)
+				last++;
+		}
+
+		memset(&wp, 0, sizeof(wp));
+		wp.range.start = page;
+		wp.range.len = (last - index) * view->page_size;
+		if (ioctl(view->uffd, UFFDIO_WRITEPROTECT, &wp))
+			drv_log("UFFDIO_WRITEPROTECT failed with %s\n", strerror(errno));
+		memset(view->page_state + index, DRV_LAZY_PAGE_DIRTY, last - index);
+		goto out;
+	}
+
+	/* Populate the run of missing pages around the fault, within its aligned window. */
+	window = index - index % DRV_LAZY_FAULT_AROUND_PAGES;
+	first = index;
+	while (first > window && view->page_state[first - 1] == DRV_LAZY_PAGE_MISSING)
+		first--;
+	last = index + 1;
+	while (last < MIN(window + DRV_LAZY_FAULT_AROUND_PAGES, num_pages) &&
+	       view->page_state[last] == DRV_LAZY_PAGE_MISSING)
+		last++;
+
+	drv_lazy_view_fill(view, first, last - first);
+
+	/*
+	 * The staging shadow comes from the page-aligned shadow pool, so the copy can read up to
+	 * the end of the last page even when the buffer ends short of it. Write faults on
+	 * write-protected pages come back as a write-protect fault and are tracked then.
+	 */
+	memset(&copy, 0, sizeof(copy));
+	copy.dst = (uintptr_t)(view->addr + first * view->page_size);
+	copy.src = (uintptr_t)(view->staging + first * view->page_size);
+	copy.len = (last - first) * view->page_size;
+	if (view->write_protect)
+		copy.mode = UFFDIO_COPY_MODE_WP;
+
+	ret = ioctl(view->uffd, UFFDIO_COPY, &copy);
+	if (ret && errno == EEXIST) {
+		/* Another thread faulted on the same page first. */
+		range.start = page;
+		range.len = view->page_size;
+		ioctl(view->uffd, UFFDIO_WAKE, &range);
+	} else if (ret) {
+		drv_log("UFFDIO_COPY failed with %s\n", strerror(errno));
+	} else {
+		/* Without write protection every page of a writable view may get written. */
+		for (i = first; i < last; i++)
+			view->page_state[i] = copy.mode || !(write || view->writable) ?
+						  DRV_LAZY_PAGE_CLEAN :
+						  DRV_LAZY_PAGE_DIRTY;
+	}
+
+out:
+	pthread_mutex_unlock(&view->lock);
+}
+
+static void *drv_lazy_view_thread(void *arg)
+{
+	struct drv_lazy_view *view = arg;
+	struct uffd_msg msg;
+	struct pollfd fds[2];
+
+	fds[0].fd = view->uffd;
+	fds[0].events = POLLIN;
+	fds[1].fd = view->stop_fd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(fds, ARRAY_SIZE(fds), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[1].revents)
+			break;
+
+		if (read(view->uffd, &msg, sizeof(msg)) != sizeof(msg))
+			continue;
+
+		if (msg.event == UFFD_EVENT_PAGEFAULT)
+			drv_lazy_view_fault(view, &msg);
+	}
+
+	return NULL;
+}
+
+/* Set once creating a userfaultfd has failed, so later maps don't retry the syscall. */
+static bool drv_lazy_views_unavailable;
+
+/*
+ * Opens a userfaultfd, asking for write-protect faults when wp is set. Returns -1 if the kernel
+ * or the headers don't support the requested features.
+ */
+static int drv_lazy_view_open_uffd(bool wp)
+{
+	int fd = -1;
+	struct uffdio_api api;
+
+	if (__atomic_load_n(&drv_lazy_views_unavailable, __ATOMIC_RELAXED))
+		return -1;
+
+#ifdef UFFD_USER_MODE_ONLY
+	/* Only user mode faults are handled, which works without vm.unprivileged_userfaultfd. */
+	fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+#endif
+	if (fd < 0) {
+		/* Missing syscall, flag or permission won't change for this process. */
+		__atomic_store_n(&drv_lazy_views_unavailable, true, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	memset(&api, 0, sizeof(api));
+	api.api = UFFD_API;
+	api.features = wp ? UFFD_FEATURE_PAGEFAULT_FLAG_WP : 0;
+	if (ioctl(fd, UFFDIO_API, &api)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Creates a tracked linear view of a single plane buffer whose CPU copy lives in the page-aligned
+ * staging shadow. transfer converts a rect between the buffer and staging, and is fastest for
+ * rects starting and ending on multiples of row_align rows. Returns NULL unless the caller asked
+ * for BO_MAP_LAZY, or BO_MAP_TRACKED on a writable mapping, or when the layout or the kernel
+ * doesn't allow a view, in which case the caller should use staging directly.
+ */
+struct drv_lazy_view *drv_lazy_view_create(struct bo *bo, uint8_t *staging, uint32_t map_flags,
+					   uint32_t row_align, drv_lazy_transfer_t transfer,
+					   void *data)
+{
+	int ret;
+	struct drv_lazy_view *view;
+	struct uffdio_register reg;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	uint32_t bpp;
+
+	if (!(map_flags & BO_MAP_LAZY) &&
+	    (map_flags & (BO_MAP_TRACKED | BO_MAP_WRITE)) != (BO_MAP_TRACKED | BO_MAP_WRITE))
+		return NULL;
+
+	if (bo->meta.num_planes != 1)
+		return NULL;
+
+	/* Pages must not split pixels, so each page converts on its own. */
+	bpp = drv_bytes_per_pixel_from_format(bo->meta.format, 0);
+	if (page_size % bpp || bo->meta.strides[0] % bpp || bo->meta.offsets[0] % bpp)
+		return NULL;
+
+	view = calloc(1, sizeof(*view));
+	if (!view)
+		return NULL;
+
+	view->bo = bo;
+	view->staging = staging;
+	view->row_align = MAX(row_align, 1);
+	view->transfer = transfer;
+	view->data = data;
+	view->page_size = page_size;
+	view->size = ALIGN(bo->meta.total_size, page_size);
+	view->stop_fd = -1;
+	view->lazy = map_flags & BO_MAP_LAZY;
+	view->writable = map_flags & BO_MAP_WRITE;
+
+	view->page_state = calloc(view->size / page_size, sizeof(*view->page_state));
+	if (!view->page_state)
+		goto free_view;
+
+	view->addr = mmap(NULL, view->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+			  -1, 0);
+	if (view->addr == MAP_FAILED)
+		goto free_state;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.range.start = (uintptr_t)view->addr;
+	reg.range.len = view->size;
+
+	/* Read-only views have nothing to track. */
+	view->uffd = view->writable ? drv_lazy_view_open_uffd(true) : -1;
+	if (view->uffd >= 0) {
+		reg.mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP;
+		if (!ioctl(view->uffd, UFFDIO_REGISTER, &reg)) {
+			view->write_protect = true;
+		} else {
+			close(view->uffd);
+			view->uffd = -1;
+		}
+	}
+
+	if (view->uffd < 0) {
+		view->uffd = drv_lazy_view_open_uffd(false);
+		if (view->uffd < 0)
+			goto unmap;
+
+		reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+		if (ioctl(view->uffd, UFFDIO_REGISTER, &reg))
+			goto close_uffd;
+	}
+
+	view->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (view->stop_fd < 0)
+		goto close_uffd;
+
+	pthread_mutex_init(&view->lock, NULL);
+	ret = pthread_create(&view->thread, NULL, drv_lazy_view_thread, view);
+	if (ret) {
+		pthread_mutex_destroy(&view->lock);
+		goto close_stop;
+	}
+
+	return view;
+
+close_stop:
+	close(view->stop_fd);
+close_uffd:
+	close(view->uffd);
+unmap:
+	munmap(view->addr, view->size);
+free_state:
+	free(view->page_state);
+free_view:
+	free(view);
+	return NULL;
+}
+
+void *drv_lazy_view_addr(struct drv_lazy_view *view)
+{
+	return view->addr;
+}
+
+/*
+ * Refreshes the pages [first, last] from the buffer, keeping them tracked. Whole rows covering
+ * the pages are converted, so every byte of a page is valid afterwards, not only the locked rect:
+ * a later flush converts back the whole page.
+ */
+static void drv_lazy_view_populate(struct drv_lazy_view *view, size_t first, size_t last)
+{
+	size_t i, run, offset, len;
+	uint8_t state;
+	struct uffdio_copy copy;
+	struct uffdio_writeprotect wp;
+
+	drv_lazy_view_fill(view, first, last - first + 1);
+
+	for (i = first; i <= last; i = run) {
+		state = view->page_state[i];
+		for (run = i + 1; run <= last && view->page_state[run] == state; run++)
+			;
+
+		offset = i * view->page_size;
+		len = (run - i) * view->page_size;
+
+		switch (state) {
+		case DRV_LAZY_PAGE_MISSING:
+			memset(&copy, 0, sizeof(copy));
+			copy.dst = (uintptr_t)(view->addr + offset);
+			copy.src = (uintptr_t)(view->staging + offset);
+			copy.len = len;
+			if (view->write_protect)
+				copy.mode = UFFDIO_COPY_MODE_WP;
+			if (ioctl(view->uffd, UFFDIO_COPY, &copy)) {
+				drv_log("UFFDIO_COPY failed with %s\n", strerror(errno));
+				break;
+			}
+			memset(view->page_state + i,
+			       copy.mode || !view->writable ? DRV_LAZY_PAGE_CLEAN
+							    : DRV_LAZY_PAGE_DIRTY,
+			       run - i);
+			break;
+		case DRV_LAZY_PAGE_CLEAN:
+			/* Lift write protection around the refresh so it isn't seen as a write. */
+			memset(&wp, 0, sizeof(wp));
+			wp.range.start = (uintptr_t)(view->addr + offset);
+			wp.range.len = len;
+			if (view->write_protect)
+				ioctl(view->uffd, UFFDIO_WRITEPROTECT, &wp);
+			memcpy(view->addr + offset, view->staging + offset,
+			       MIN(len, view->bo->meta.total_size - offset));
+			wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+			if (view->write_protect)
+				ioctl(view->uffd, UFFDIO_WRITEPROTECT, &wp);
+			break;
+		default:
+			/* Dirty pages hold CPU writes that haven't been flushed yet. */
+			break;
+		}
+	}
+}
+
+/*
+ * Called from the backend's bo_invalidate. Lazy views drop the clean pages covering the mapping's
+ * rect so the next touch converts them again; eager ones refresh them right away for read
+ * mappings. Dirty pages hold CPU writes that haven't been flushed yet and are kept.
+ */
+void drv_lazy_view_invalidate(struct drv_lazy_view *view, struct mapping *mapping)
+{
+	uint32_t offset, row_bytes, num_rows;
+	size_t first, last, i;
+	struct bo *bo = view->bo;
+
+	if (drv_bo_get_plane_rect_span(bo, &mapping->rect, 0, &offset, &row_bytes, &num_rows) ||
+	    !num_rows || !row_bytes)
+		return;
+
+	first = offset / view->page_size;
+	last = (offset + (num_rows - 1) * bo->meta.strides[0] + row_bytes - 1) / view->page_size;
+
+	pthread_mutex_lock(&view->lock);
+
+	if (!view->lazy) {
+		/* Write-only mappings too: flush converts back every pixel of a dirty page. */
+		drv_lazy_view_populate(view, first, last);
+		pthread_mutex_unlock(&view->lock);
+		return;
+	}
+
+	for (i = first; i <= last; i++) {
+		if (view->page_state[i] != DRV_LAZY_PAGE_CLEAN)
+			continue;
+
+		madvise(view->addr + i * view->page_size, view->page_size, MADV_DONTNEED);
+		view->page_state[i] = DRV_LAZY_PAGE_MISSING;
+	}
+	pthread_mutex_unlock(&view->lock);
+}
+
+/*
+ * Returns whether converting rect back covered every pixel of page i.
+ */
+static bool drv_lazy_view_page_in_rect(struct drv_lazy_view *view, size_t i,
+				       const struct rectangle *rect)
+{
+	struct bo *bo = view->bo;
+	uint32_t stride = bo->meta.strides[0];
+	size_t start = i * view->page_size;
+	size_t end = start + view->page_size;
+	size_t y0, y1;
+
+	if (end <= bo->meta.offsets[0])
+		return true;
+
+	start = MAX(start, bo->meta.offsets[0]) - bo->meta.offsets[0];
+	end -= bo->meta.offsets[0];
+	y0 = start / stride;
+	y1 = MIN(DIV_ROUND_UP(end, stride), bo->meta.height);
+	if (y0 >= y1)
+		return true;
+
+	return rect->x == 0 && rect->width >= bo->meta.width && y0 >= rect->y &&
+	       y1 <= rect->y + rect->height;
+}
+
+/*
+ * Starts tracking pages [first, last) again once they have been converted back. Without write
+ * protection the pages are dropped instead, so that only pages faulted in by a write count as
+ * dirty next time.
+ */
+static void drv_lazy_view_clean_pages(struct drv_lazy_view *view, size_t first, size_t last)
+{
+	size_t offset = first * view->page_size;
+	size_t len = (last - first) * view->page_size;
+	uint8_t state = DRV_LAZY_PAGE_MISSING;
+	struct uffdio_writeprotect wp;
+
+	if (first >= last)
+		return;
+
+	if (view->write_protect) {
+		memset(&wp, 0, sizeof(wp));
+		wp.range.start = (uintptr_t)(view->addr + offset);
+		wp.range.len = len;
+		wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+		if (!ioctl(view->uffd, UFFDIO_WRITEPROTECT, &wp))
+			state = DRV_LAZY_PAGE_CLEAN;
+	}
+
+	if (state != DRV_LAZY_PAGE_CLEAN)
+		madvise(view->addr + offset, len, MADV_DONTNEED);
+
+	memset(view->page_state + first, state, last - first);
+}
+
+/*
+ * Converts the dirty pages back into the buffer, limited to the mapping's dirty rects. Only pages
+ * whose pixels all lie in the mapping's rect are clean afterwards; other mappings of the vma may
+ * have written the rest of a page, so it stays dirty for their flush.
+ */
+int drv_lazy_view_flush(struct drv_lazy_view *view, struct mapping *mapping)
+{
+	size_t i, j, first, clean_first, num_pages = view->size / view->page_size;
+	size_t offset, len;
+	uint32_t k, num_rects;
+	const struct rectangle *rects;
+
+	num_rects = drv_mapping_dirty_rects(mapping, &rects);
+
+	pthread_mutex_lock(&view->lock);
+	for (first = 0; first < num_pages; first = i) {
+		if (view->page_state[first] != DRV_LAZY_PAGE_DIRTY) {
+			i = first + 1;
+			continue;
+		}
+
+		/* Runs of dirty pages are converted back together. */
+		for (i = first; i < num_pages && view->page_state[i] == DRV_LAZY_PAGE_DIRTY; i++)
+			;
+
+		offset = first * view->page_size;
+		len = (i - first) * view->page_size;
+		memcpy(view->staging + offset, view->addr + offset,
+		       MIN(len, view->bo->meta.total_size - offset));
+		/* Written pages outside the reported dirty rects only hold what they held before. */
+		for (k = 0; k < num_rects; k++)
+			drv_lazy_view_flush_pages(view, first, i - first, &rects[k]);
+
+		for (clean_first = j = first; j < i; j++) {
+			if (drv_lazy_view_page_in_rect(view, j, &mapping->rect))
+				continue;
+
+			drv_lazy_view_clean_pages(view, clean_first, j);
+			clean_first = j + 1;
+		}
+		drv_lazy_view_clean_pages(view, clean_first, i);
+	}
+	pthread_mutex_unlock(&view->lock);
+
+	return 0;
+}
+
+void drv_lazy_view_destroy(struct drv_lazy_view *view)
+{
+	uint64_t stop = 1;
+
+	if (write(view->stop_fd, &stop, sizeof(stop)) != sizeof(stop))
+		drv_log("Failed to stop lazy view fault thread\n");
+	pthread_join(view->thread, NULL);
+
+	pthread_mutex_destroy(&view->lock);
+	close(view->stop_fd);
+	close(view->uffd);
+	munmap(view->addr, view->size);
+	free(view->page_state);
+	free(view);
+}
+
+int drv_mapping_destroy(struct bo *bo)
+{
+	int ret;
+	size_t plane;
+	struct mapping *mapping;
+	uint32_t idx;
+
+	/*
+	 * This function is called right before the buffer is destroyed. It will free any mappings
+	 * associated with the buffer.
+	 */
+
+	idx = 0;
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		while (idx < drv_array_size(bo->drv->mappings)) {
+			mapping = (struct mapping *)drv_array_at_idx(bo->drv->mappings, idx);
+			if (mapping->vma->handle != bo->handles[plane].u32) {
+				idx++;
+				continue;
+			}
+
+			if (!--mapping->vma->refcount) {
+				ret = bo->drv->backend->bo_unmap(bo, mapping->vma);
+				if (ret) {
+					drv_log("munmap failed\n");
+					return ret;
+				}
+
+				free(mapping->vma);
+			}
+
+			/* This shrinks and shifts the array, so don't increment idx. */
+			drv_array_remove(bo->drv->mappings, idx);
+		}
+	}
+
+	return 0;
+}
+
+int drv_get_prot(uint32_t map_flags)
+{
+	return (BO_MAP_WRITE & map_flags) ? PROT_WRITE | PROT_READ : PROT_READ;
+}
+
+uintptr_t drv_get_reference_count(struct driver *drv, struct bo *bo, size_t plane)
+{
+	void *count;
+	uintptr_t num = 0;
+
+	if (!drmHashLookup(drv->buffer_table, bo->handles[plane].u32, &count))
+		num = (uintptr_t)(count);
+
+	return num;
+}
+
+void drv_increment_reference_count(struct driver *drv, struct bo *bo, size_t plane)
+{
+	uintptr_t num = drv_get_reference_count(drv, bo, plane);
+
+	/* If a value isn't in the table, drmHashDelete is a no-op */
+	drmHashDelete(drv->buffer_table, bo->handles[plane].u32);
+	drmHashInsert(drv->buffer_table, bo->handles[plane].u32, (void *)(num + 1));
+}
+
+void drv_decrement_reference_count(struct driver *drv, struct bo *bo, size_t plane)
+{
+	uintptr_t num = drv_get_reference_count(drv, bo, plane);
+
+	drmHashDelete(drv->buffer_table, bo->handles[plane].u32);
+
+	if (num > 0)
+		drmHashInsert(drv->buffer_table, bo->handles[plane].u32, (void *)(num - 1));
+}
+
+#ifdef DRV_CAPS_CACHE_DIR
+#define DRV_CAPS_CACHE_MAGIC 0x43424d47 /* "GMBC" */
+#define DRV_CAPS_CACHE_VERSION 3
+#define DRV_BUILD_ID_MAX_SIZE 32
+
+/*
+ * Everything the cached probe results depend on.
+ */
+struct drv_caps_cache_key {
+	uint64_t rdev;
+	uint8_t build_id[DRV_BUILD_ID_MAX_SIZE];
+	uint32_t build_id_size;
+	char driver_name[32];
+	char driver_date[16];
+	int32_t driver_version[3];
+	uint32_t bus_type;
+	uint32_t pci_vendor_id;
+	uint32_t pci_device_id;
+	uint32_t pci_revision_id;
+	uint32_t gpu_grp_type;
+};
+
+/* The file is this header, then caps_size bytes of backend caps. */
+struct drv_caps_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	struct drv_caps_cache_key key;
+	uint32_t caps_size;
+};
+
+static int drv_caps_cache_path(struct driver *drv, char *path, size_t size)
+{
+	struct stat st;
+
+	if (fstat(drv->fd, &st))
+		return -errno;
+
+	snprintf(path, size, "%s/%s-%u-%u", DRV_CAPS_CACHE_DIR, drv->backend->name,
+		 major(st.st_rdev), minor(st.st_rdev));
+	return 0;
+}
+
+/*
+ * Only root and the owner of the cache directory write cache files, so every other user reads
+ * the same file instead of each keeping (and rewriting) its own.
+ */
+static bool drv_caps_cache_trusted(uid_t uid)
+{
+	struct stat st;
+
+	if (uid == 0)
+		return true;
+
+	return !stat(DRV_CAPS_CACHE_DIR, &st) && st.st_uid == uid;
+}
+
+/*
+ * dl_iterate_phdr() callback copying the GNU build id of the loaded object that contains this
+ * code into the key. Stops at that object whether or not it has a build id.
+ */
+static int drv_caps_cache_find_build_id(struct dl_phdr_info *info, size_t size, void *data)
+{
+	struct drv_caps_cache_key *key = data;
+	uintptr_t addr = (uintptr_t)drv_caps_cache_find_build_id;
+	const ElfW(Phdr) *phdr;
+	bool found = false;
+	int i;
+
+	for (i = 0; i < info->dlpi_phnum && !found; i++) {
+		phdr = &info->dlpi_phdr[i];
+		found = phdr->p_type == PT_LOAD && addr >= info->dlpi_addr + phdr->p_vaddr &&
+			addr < info->dlpi_addr + phdr->p_vaddr + phdr->p_memsz;
+	}
+
+	if (!found)
+		return 0;
+
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		const uint8_t *note, *end;
+
+		phdr = &info->dlpi_phdr[i];
+		if (phdr->p_type != PT_NOTE)
+			continue;
+
+		note = (const uint8_t *)(info->dlpi_addr + phdr->p_vaddr);
+		end = note + phdr->p_memsz;
+		while (note + sizeof(ElfW(Nhdr)) <= end) {
+			const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *)note;
+			const uint8_t *name = note + sizeof(*nhdr);
+			const uint8_t *desc = name + ALIGN(nhdr->n_namesz, 4);
+
+			if (desc + nhdr->n_descsz > end)
+				break;
+
+			if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == sizeof(ELF_NOTE_GNU) &&
+			    !memcmp(name, ELF_NOTE_GNU, sizeof(ELF_NOTE_GNU))) {
+				key->build_id_size = MIN(nhdr->n_descsz, sizeof(key->build_id));
+				memcpy(key->build_id, desc, key->build_id_size);
+				return 1;
+			}
+
+			note = desc + ALIGN(nhdr->n_descsz, 4);
+		}
+	}
+
+	return 1;
+}
+
+static int drv_caps_cache_get_key(struct driver *drv, struct drv_caps_cache_key *key)
+{
+	struct stat st;
+	drmVersionPtr version;
+	drmDevicePtr device;
+
+	memset(key, 0, sizeof(*key));
+	key->gpu_grp_type = drv->gpu_grp_type;
+
+	if (fstat(drv->fd, &st))
+		return -errno;
+	key->rdev = st.st_rdev;
+
+	/* Without a build id, nothing tells this build's probe results from another's. */
+	dl_iterate_phdr(drv_caps_cache_find_build_id, key);
+	if (!key->build_id_size)
+		return -ENOENT;
+
+	version = drmGetVersion(drv->fd);
+	if (!version)
+		return -ENODEV;
+	strncpy(key->driver_name, version->name, sizeof(key->driver_name) - 1);
+	strncpy(key->driver_date, version->date, sizeof(key->driver_date) - 1);
+	key->driver_version[0] = version->version_major;
+	key->driver_version[1] = version->version_minor;
+	key->driver_version[2] = version->version_patchlevel;
+	drmFreeVersion(version);
+
+	/* Virtual devices such as vgem have no bus to report. */
+	if (!drmGetDevice2(drv->fd, 0, &device)) {
+		key->bus_type = device->bustype;
+		if (device->bustype == DRM_BUS_PCI) {
+			key->pci_vendor_id = device->deviceinfo.pci->vendor_id;
+			key->pci_device_id = device->deviceinfo.pci->device_id;
+			key->pci_revision_id = device->deviceinfo.pci->revision_id;
+		}
+		drmFreeDevice(&device);
+	}
+
+	return 0;
+}
+
+/*
+ * Maps the capability cache for this device, if there's one that was written by this build of
+ * minigbm for the same device and kernel driver. The cache directory must only be writable by
+ * trusted users; files owned by anyone but root or the directory's owner are ignored.
+ */
+int drv_caps_cache_load(struct driver *drv)
+{
+	int fd;
+	char path[PATH_MAX];
+	struct stat st;
+	struct drv_caps_cache_key key;
+	const struct drv_caps_cache_header *header;
+	void *addr;
+
+	if (drv_caps_cache_path(drv, path, sizeof(path)) || drv_caps_cache_get_key(drv, &key))
+		return -ENOENT;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) || !drv_caps_cache_trusted(st.st_uid) ||
+	    (size_t)st.st_size < sizeof(*header)) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return -errno;
+
+	header = addr;
+	if (header->magic != DRV_CAPS_CACHE_MAGIC || header->version != DRV_CAPS_CACHE_VERSION ||
+	    header->header_size != sizeof(*header) || memcmp(&header->key, &key, sizeof(key)) ||
+	    (uint64_t)st.st_size != sizeof(*header) + header->caps_size) {
+		munmap(addr, st.st_size);
+		return -ESTALE;
+	}
+
+	drv->caps_cache = addr;
+	drv->caps_cache_size = st.st_size;
+	return 0;
+}
+
+/*
+ * Returns the backend capabilities from the loaded cache if they have the expected size, or
+ * NULL if the backend has to probe them.
+ */
+const void *drv_caps_cache_get(struct driver *drv, size_t size)
+{
+	const struct drv_caps_cache_header *header = drv->caps_cache;
+
+	if (!header || header->caps_size != size)
+		return NULL;
+
+	drv->init_cache_hit = true;
+	return header + 1;
+}
+
+/*
+ * Records probed backend capabilities for drv_caps_cache_store() to write out.
+ */
+void drv_caps_cache_put(struct driver *drv, const void *caps, size_t size)
+{
+	free(drv->caps_pending);
+	drv->caps_pending_size = 0;
+
+	drv->caps_pending = malloc(size);
+	if (!drv->caps_pending)
+		return;
+
+	memcpy(drv->caps_pending, caps, size);
+	drv->caps_pending_size = size;
+}
+
+/*
+ * Writes the capabilities the backend put to this device's cache file, if the caller is one of
+ * the users drv_caps_cache_load() trusts. The file is replaced atomically, so concurrent loaders
+ * see either the old contents or the new.
+ */
+void drv_caps_cache_store(struct driver *drv)
+{
+	int fd;
+	char path[PATH_MAX], tmp_path[PATH_MAX];
+	struct drv_caps_cache_header header;
+	bool ok;
+
+	if (!drv->caps_pending || !drv_caps_cache_trusted(geteuid()) ||
+	    drv_caps_cache_path(drv, path, sizeof(path)))
+		return;
+
+	memset(&header, 0, sizeof(header));
+	if (drv_caps_cache_get_key(drv, &header.key))
+		return;
+
+	header.magic = DRV_CAPS_CACHE_MAGIC;
+	header.version = DRV_CAPS_CACHE_VERSION;
+	header.header_size = sizeof(header);
+	header.caps_size = drv->caps_pending_size;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+	fd = mkostemp(tmp_path, O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	ok = !fchmod(fd, 0644) && write(fd, &header, sizeof(header)) == sizeof(header) &&
+	     write(fd, drv->caps_pending, header.caps_size) == (ssize_t)header.caps_size;
+
+	close(fd);
+	if (!ok || rename(tmp_path, path))
+		unlink(tmp_path);
+}
+
+/*
+ * Lets a backend that found the cached capabilities stale probe them again. The fresh results
+ * get stored once init is done.
+ */
+void drv_caps_cache_reject(struct driver *drv)
+{
+	if (!drv->caps_cache)
+		return;
+
+	munmap(drv->caps_cache, drv->caps_cache_size);
+	drv->caps_cache = NULL;
+	drv->caps_cache_size = 0;
+	drv->init_cache_hit = false;
+}
+
+/*
+ * Drops what drv_init() kept of the capability cache once the backend is initialized.
+ */
+void drv_caps_cache_release(struct driver *drv)
+{
+	if (drv->caps_cache)
+		munmap(drv->caps_cache, drv->caps_cache_size);
+
+	free(drv->caps_pending);
+	drv->caps_cache = NULL;
+	drv->caps_cache_size = 0;
+	drv->caps_pending = NULL;
+	drv->caps_pending_size = 0;
+}
+#else
+int drv_caps_cache_load(struct driver *drv)
+{
+	return -ENOSYS;
+}
+
+const void *drv_caps_cache_get(struct driver *drv, size_t size)
+{
+	return NULL;
+}
+
+void drv_caps_cache_put(struct driver *drv, const void *caps, size_t size)
+{
+}
+
+void drv_caps_cache_store(struct driver *drv)
+{
+}
+
+void drv_caps_cache_reject(struct driver *drv)
+{
+}
+
+void drv_caps_cache_release(struct driver *drv)
+{
+}
+#endif
+
+void drv_add_combination(struct driver *drv, const uint32_t format,
+			 struct format_metadata *metadata, uint64_t use_flags)
+{
+	struct combination combo = { .format = format,
+				     .metadata = *metadata,
+				     .use_flags = use_flags };
+
+	drv_array_append(drv->combos, &combo);
+}
+
+void drv_add_combinations(struct driver *drv, const uint32_t *formats, uint32_t num_formats,
+			  struct format_metadata *metadata, uint64_t use_flags)
+{
+	uint32_t i;
+
+	for (i = 0; i < num_formats; i++) {
+		struct combination combo = { .format = formats[i],
+					     .metadata = *metadata,
+					     .use_flags = use_flags };
+
+		drv_array_append(drv->combos, &combo);
+	}
+}
+
+void drv_modify_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
 			    uint64_t use_flags)
 {
 	uint32_t i;
 	struct combination *combo;
+
 	/* Attempts to add the specified flags to an existing combination. */
 	for (i = 0; i < drv_array_size(drv->combos); i++) {
 		combo = (struct combination *)drv_array_at_idx(drv->combos, i);
@@ -651,3 +2514,118 @@ bool drv_has_modifier(const uint64_t *list, uint32_t count, uint64_t modifier)
 
 	return false;
 }
+
+static uint64_t drv_rect_area(const struct rectangle *rect)
+{
+	return (uint64_t)rect->width * rect->height;
+}
+
+static void drv_rect_union(const struct rectangle *a, const struct rectangle *b,
+			   struct rectangle *out)
+{
+	uint32_t x0 = MIN(a->x, b->x);
+	uint32_t y0 = MIN(a->y, b->y);
+	uint32_t x1 = MAX(a->x + a->width, b->x + b->width);
+	uint32_t y1 = MAX(a->y + a->height, b->y + b->height);
+
+	out->x = x0;
+	out->y = y0;
+	out->width = x1 - x0;
+	out->height = y1 - y0;
+}
+
+/*
+ * Returns whether inner lies entirely within outer.
+ */
+bool drv_rect_contains(const struct rectangle *outer, const struct rectangle *inner)
+{
+	return inner->x >= outer->x && inner->y >= outer->y &&
+	       inner->x + inner->width <= outer->x + outer->width &&
+	       inner->y + inner->height <= outer->y + outer->height;
+}
+
+/*
+ * Computes the intersection of two rectangles. Returns false if they don't overlap.
+ */
+bool drv_rect_intersect(const struct rectangle *a, const struct rectangle *b,
+			struct rectangle *out)
+{
+	uint32_t x0 = MAX(a->x, b->x);
+	uint32_t y0 = MAX(a->y, b->y);
+	uint32_t x1 = MIN(a->x + a->width, b->x + b->width);
+	uint32_t y1 = MIN(a->y + a->height, b->y + b->height);
+
+	if (x0 >= x1 || y0 >= y1)
+		return false;
+
+	out->x = x0;
+	out->y = y0;
+	out->width = x1 - x0;
+	out->height = y1 - y0;
+	return true;
+}
+
+/*
+ * Adds a rectangle to a list of at most max_rects rectangles. The new rectangle is merged with
+ * any entry whose bounding box is no larger than the two rectangles taken separately. If the
+ * list is full, it is merged with the entry whose bounding box grows the least. The list always
+ * covers every rectangle added to it.
+ */
+void drv_rect_list_add(struct rectangle *rects, uint32_t *num_rects, uint32_t max_rects,
+		       const struct rectangle *rect)
+{
+	uint32_t i, best;
+	uint64_t cost, best_cost;
+	struct rectangle merged;
+	struct rectangle r = *rect;
+
+	assert(max_rects > 0);
+
+	if (!r.width || !r.height)
+		return;
+
+retry:
+	for (i = 0; i < *num_rects; i++) {
+		drv_rect_union(&rects[i], &r, &merged);
+		if (drv_rect_area(&merged) <= drv_rect_area(&rects[i]) + drv_rect_area(&r)) {
+			r = merged;
+			rects[i] = rects[--(*num_rects)];
+			goto retry;
+		}
+	}
+
+	if (*num_rects < max_rects) {
+		rects[(*num_rects)++] = r;
+		return;
+	}
+
+	best = 0;
+	best_cost = UINT64_MAX;
+	for (i = 0; i < *num_rects; i++) {
+		drv_rect_union(&rects[i], &r, &merged);
+		cost = drv_rect_area(&merged) - drv_rect_area(&rects[i]);
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = i;
+		}
+	}
+
+	drv_rect_union(&rects[best], &r, &r);
+	rects[best] = rects[--(*num_rects)];
+	goto retry;
+}
+
+/*
+ * Returns the parts of a mapping its flush has to write back: the dirty rects reported for it, or
+ * all of its rect if none were.
+ */
+uint32_t drv_mapping_dirty_rects(const struct mapping *mapping, const struct rectangle **rects)
+{
+	if (!mapping->num_dirty_rects) {
+		*rects = &mapping->rect;
+		return 1;
+	}
+
+	*rects = mapping->dirty_rects;
+	return mapping->num_dirty_rects;
+}
@@ -8,6 +8,7 @@
 #define HELPERS_H
 
 #include <stdbool.h>
+#include <sys/types.h>
 
 #include "drv.h"
 #include "helpers_array.h"
@@ -15,6 +16,13 @@
 uint32_t drv_height_from_format(uint32_t format, uint32_t height, size_t plane);
 uint32_t drv_vertical_subsampling_from_format(uint32_t format, size_t plane);
 uint32_t drv_size_from_format(uint32_t format, uint32_t stride, uint32_t height, size_t plane);
+int drv_bo_get_plane_rect_span(struct bo *bo, const struct rectangle *rect, size_t plane,
+			       uint32_t *offset, uint32_t *row_bytes, uint32_t *num_rows);
+void drv_bo_sync_shadow_rect(struct bo *bo, const struct rectangle *rect, uint8_t *shadow,
+			     uint8_t *uncached, bool to_uncached);
+void drv_bo_clear_shadow_rect(struct bo *bo, const struct rectangle *rect, uint8_t *shadow);
+void drv_bo_flush_shadow(struct bo *bo, struct mapping *mapping, uint8_t *shadow,
+			 uint8_t *uncached);
 int drv_bo_from_format(struct bo *bo, uint32_t stride, uint32_t aligned_height, uint32_t format);
 int drv_bo_from_format_and_padding(struct bo *bo, uint32_t stride, uint32_t aligned_height,
 				   uint32_t format, uint32_t padding[DRV_MAX_PLANES]);
@@ -24,14 +32,56 @@ int drv_dumb_bo_create_ex(struct bo *bo, uint32_t width, uint32_t height, uint32
 			  uint64_t use_flags, uint64_t quirks);
 int drv_dumb_bo_destroy(struct bo *bo);
 int drv_gem_bo_destroy(struct bo *bo);
+int drv_import_cache_init(struct driver *drv);
+void drv_import_cache_destroy(struct driver *drv);
+int drv_get_import_handle(struct driver *drv, int fd, uint32_t *handle);
+int drv_get_export_fd(struct driver *drv, uint32_t handle);
+off_t drv_get_import_size(struct driver *drv, int fd, uint32_t handle);
+bool drv_import_cache_get_layout(struct bo *bo);
+void drv_import_cache_set_layout(struct bo *bo);
+void drv_import_cache_remove(struct bo *bo);
 int drv_prime_bo_import(struct bo *bo, struct drv_import_fd_data *data);
 void *drv_dumb_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags);
 int drv_bo_munmap(struct bo *bo, struct vma *vma);
+int drv_shadow_pool_init(struct driver *drv);
+void drv_shadow_pool_destroy(struct driver *drv);
+void *drv_shadow_alloc(struct driver *drv, size_t size);
+void drv_shadow_free(struct driver *drv, void *addr, size_t size);
+void *drv_dmabuf_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags);
+void *drv_dumb_dmabuf_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags);
+int drv_dmabuf_bo_unmap(struct bo *bo, struct vma *vma);
+int drv_dmabuf_begin_cpu_access(int fd, uint32_t map_flags);
+int drv_dmabuf_end_cpu_access(int fd, uint32_t map_flags);
+int drv_dmabuf_begin_mapping_access(int fd, struct mapping *mapping);
+int drv_dmabuf_end_mapping_access(int fd, struct mapping *mapping);
+int drv_fence_wait(int fence);
+int drv_dmabuf_wait(int fd, uint32_t map_flags);
+bool drv_fence_signaled(int fence);
+int drv_fence_merge(int fence1, int fence2);
+int drv_dmabuf_export_fence(struct driver *drv, int fd, uint32_t map_flags);
+int drv_dmabuf_import_fence(struct driver *drv, int fd, int fence, uint32_t map_flags);
+int drv_dmabuf_bo_invalidate(struct bo *bo, struct mapping *mapping);
+int drv_dmabuf_bo_flush(struct bo *bo, struct mapping *mapping);
+typedef void (*drv_lazy_transfer_t)(struct bo *bo, void *data, const struct rectangle *rect,
+				    bool to_tiled);
+struct drv_lazy_view *drv_lazy_view_create(struct bo *bo, uint8_t *staging, uint32_t map_flags,
+					   uint32_t row_align, drv_lazy_transfer_t transfer,
+					   void *data);
+void *drv_lazy_view_addr(struct drv_lazy_view *view);
+void drv_lazy_view_invalidate(struct drv_lazy_view *view, struct mapping *mapping);
+int drv_lazy_view_flush(struct drv_lazy_view *view, struct mapping *mapping);
+void drv_lazy_view_destroy(struct drv_lazy_view *view);
 int drv_mapping_destroy(struct bo *bo);
 int drv_get_prot(uint32_t map_flags);
 uintptr_t drv_get_reference_count(struct driver *drv, struct bo *bo, size_t plane);
 void drv_increment_reference_count(struct driver *drv, struct bo *bo, size_t plane);
 void drv_decrement_reference_count(struct driver *drv, struct bo *bo, size_t plane);
+int drv_caps_cache_load(struct driver *drv);
+const void *drv_caps_cache_get(struct driver *drv, size_t size);
+void drv_caps_cache_put(struct driver *drv, const void *caps, size_t size);
+void drv_caps_cache_store(struct driver *drv);
+void drv_caps_cache_reject(struct driver *drv);
+void drv_caps_cache_release(struct driver *drv);
 void drv_add_combination(struct driver *drv, uint32_t format, struct format_metadata *metadata,
 			 uint64_t usage);
 void drv_add_combinations(struct driver *drv, const uint32_t *formats, uint32_t num_formats,
@@ -42,4 +92,10 @@ int drv_modify_linear_combinations(struct driver *drv);
 uint64_t drv_pick_modifier(const uint64_t *modifiers, uint32_t count,
 			   const uint64_t *modifier_order, uint32_t order_count);
 bool drv_has_modifier(const uint64_t *list, uint32_t count, uint64_t modifier);
+bool drv_rect_contains(const struct rectangle *outer, const struct rectangle *inner);
+bool drv_rect_intersect(const struct rectangle *a, const struct rectangle *b,
+			struct rectangle *out);
+void drv_rect_list_add(struct rectangle *rects, uint32_t *num_rects, uint32_t max_rects,
+		       const struct rectangle *rect);
+uint32_t drv_mapping_dirty_rects(const struct mapping *mapping, const struct rectangle **rects);
 #endif
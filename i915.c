@@ -7,6 +7,7 @@
 #ifdef DRV_I915
 
 #include <assert.h>
+#include <cpuid.h>
 #include <errno.h>
 #include <i915_drm.h>
 #include <stdbool.h>
@@ -27,6 +28,35 @@
 #define I915_CACHELINE_SIZE 64
 #define I915_CACHELINE_MASK (I915_CACHELINE_SIZE - 1)
 
+#ifndef bit_CLFLUSHOPT
+#define bit_CLFLUSHOPT (1 << 23)
+#endif
+#ifndef bit_CLWB
+#define bit_CLWB (1 << 24)
+#endif
+
+enum i915_cache_flush {
+	I915_CACHE_FLUSH_CLFLUSH = 0,
+	I915_CACHE_FLUSH_CLFLUSHOPT,
+	I915_CACHE_FLUSH_CLWB,
+};
+
+/* All tiles are 4KB: X tiles are 512 bytes x 8 rows, Y tiles 128 bytes x 32 rows. */
+#define I915_TILE_SIZE 4096
+#define I915_X_TILE_WIDTH 512
+#define I915_X_TILE_HEIGHT 8
+#define I915_Y_TILE_WIDTH 128
+#define I915_Y_TILE_HEIGHT 32
+#define I915_Y_TILE_OWORD 16
+
+/* Tiled buffers mapped through a CPU mapping and detiled into a linear shadow. */
+struct i915_detile_map_data {
+	uint8_t *tiled;
+	uint8_t *untiled;
+	uint32_t swizzle;
+	struct drv_lazy_view *lazy;
+};
+
 static const uint32_t scanout_render_formats[] = { DRM_FORMAT_ABGR2101010, DRM_FORMAT_ABGR8888,
 						   DRM_FORMAT_ARGB2101010, DRM_FORMAT_ARGB8888,
 						   DRM_FORMAT_RGB565,	   DRM_FORMAT_XBGR2101010,
@@ -46,6 +76,15 @@ static const uint32_t texture_only_formats[] = { DRM_FORMAT_R8, DRM_FORMAT_NV12,
 struct i915_device {
 	uint32_t gen;
 	int32_t has_llc;
+	enum i915_cache_flush cache_flush;
+	/*
+	 * Bit 6 swizzling is chosen per tiling mode (X, Y) when the kernel boots, so it's only
+	 * queried once: 0 until then, afterwards the swizzle mode + 1, or -1 if the CPU can't
+	 * detile.
+	 */
+	int32_t detile_swizzle[2];
+	/* Set once GEM_MMAP turned out to be gone, as on newer parts; MMAP_OFFSET replaces it. */
+	bool no_legacy_mmap;
 #ifdef USE_GRALLOC1
 	uint64_t cursor_width;
 	uint64_t cursor_height;
@@ -235,29 +274,442 @@ static int i915_align_dimensions(struct bo *bo, uint32_t tiling, uint32_t *strid
 	return 0;
 }
 
-static void i915_clflush(void *start, size_t size)
+static enum i915_cache_flush i915_get_cache_flush(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return I915_CACHE_FLUSH_CLFLUSH;
+
+	/*
+	 * CLWB writes the line back without evicting it, which is all the GPU needs; any later
+	 * CPU access after GPU writes goes through SET_DOMAIN, which invalidates stale lines.
+	 */
+	if (ebx & bit_CLWB)
+		return I915_CACHE_FLUSH_CLWB;
+	if (ebx & bit_CLFLUSHOPT)
+		return I915_CACHE_FLUSH_CLFLUSHOPT;
+
+	return I915_CACHE_FLUSH_CLFLUSH;
+}
+
+static void i915_clflush(void *start, void *end)
 {
-	void *p = (void *)(((uintptr_t)start) & ~I915_CACHELINE_MASK);
-	void *end = (void *)((uintptr_t)start + size);
+	void *p = start;
 
-	__builtin_ia32_mfence();
 	while (p < end) {
 		__builtin_ia32_clflush(p);
 		p = (void *)((uintptr_t)p + I915_CACHELINE_SIZE);
 	}
 }
 
+__attribute__((target("clflushopt"))) static void i915_clflushopt(void *start, void *end)
+{
+	void *p = start;
+
+	while (p < end) {
+		__builtin_ia32_clflushopt(p);
+		p = (void *)((uintptr_t)p + I915_CACHELINE_SIZE);
+	}
+}
+
+__attribute__((target("clwb"))) static void i915_clwb(void *start, void *end)
+{
+	void *p = start;
+
+	while (p < end) {
+		__builtin_ia32_clwb(p);
+		p = (void *)((uintptr_t)p + I915_CACHELINE_SIZE);
+	}
+}
+
+static void i915_flush_lines(struct i915_device *i915, void *start, void *end)
+{
+	switch (i915->cache_flush) {
+	case I915_CACHE_FLUSH_CLWB:
+		i915_clwb(start, end);
+		break;
+	case I915_CACHE_FLUSH_CLFLUSHOPT:
+		i915_clflushopt(start, end);
+		break;
+	default:
+		i915_clflush(start, end);
+		break;
+	}
+}
+
+/*
+ * Flushes the cache lines backing the rows of the mapping's dirty rects, or of its whole rect if
+ * none were reported, in every plane of the mapping. Within a rect, rows are visited in
+ * increasing address order, so lines shared by adjacent rows or planes are only flushed once.
+ */
+static void i915_flush_mapping(struct i915_device *i915, struct bo *bo, struct mapping *mapping)
+{
+	size_t plane;
+	uint32_t i, num_rects, offset, row_bytes, num_rows, row;
+	const struct rectangle *rects;
+	uint8_t *addr = (uint8_t *)mapping->vma->addr;
+	uint8_t *vma_end = addr + mapping->vma->length;
+	uint8_t *flushed;
+
+	/*
+	 * CLFLUSH is ordered against earlier stores, CLFLUSHOPT and CLWB are only ordered by a
+	 * fence, so issue a single one after the last line instead of serializing each line.
+	 */
+	if (i915->cache_flush == I915_CACHE_FLUSH_CLFLUSH)
+		__builtin_ia32_mfence();
+
+	num_rects = drv_mapping_dirty_rects(mapping, &rects);
+	for (i = 0; i < num_rects; i++) {
+		flushed = addr;
+		for (plane = 0; plane < bo->meta.num_planes; plane++) {
+			if (bo->handles[plane].u32 != mapping->vma->handle)
+				continue;
+
+			if (drv_bo_get_plane_rect_span(bo, &rects[i], plane, &offset, &row_bytes,
+						       &num_rows)) {
+				/* Unknown layout, flush the whole mapping. */
+				i915_flush_lines(i915, addr, vma_end);
+				goto out;
+			}
+
+			for (row = 0; row < num_rows; row++) {
+				uint8_t *start = addr + offset + row * bo->meta.strides[plane];
+				uint8_t *end = MIN(start + row_bytes, vma_end);
+
+				start = (uint8_t *)((uintptr_t)start & ~I915_CACHELINE_MASK);
+				if (start < flushed)
+					start = flushed;
+				if (start >= end)
+					continue;
+
+				i915_flush_lines(i915, start, end);
+				flushed = (uint8_t *)ALIGN((uintptr_t)end, I915_CACHELINE_SIZE);
+			}
+		}
+	}
+
+out:
+	if (i915->cache_flush != I915_CACHE_FLUSH_CLFLUSH)
+		__builtin_ia32_sfence();
+}
+
+/*
+ * Returns the byte offset within the buffer of byte x of row y of an X- or Y-tiled plane starting
+ * at plane_offset, including the bit 6 address swizzling the memory controller applies to CPU
+ * accesses. The swizzle depends on address bits 9 and 10, so it's applied to the offset within
+ * the (page aligned) buffer rather than within the plane. Y tiles are made of 16 byte wide
+ * (OWORD) columns, each 32 rows tall.
+ */
+static uint32_t i915_tiled_offset(uint32_t tiling, uint32_t swizzle, uint32_t plane_offset,
+				  uint32_t stride, uint32_t x, uint32_t y)
+{
+	uint32_t offset;
+
+	if (tiling == I915_TILING_X) {
+		offset = (y / I915_X_TILE_HEIGHT * (stride / I915_X_TILE_WIDTH) +
+			  x / I915_X_TILE_WIDTH) *
+			     I915_TILE_SIZE +
+			 y % I915_X_TILE_HEIGHT * I915_X_TILE_WIDTH + x % I915_X_TILE_WIDTH;
+	} else {
+		offset = (y / I915_Y_TILE_HEIGHT * (stride / I915_Y_TILE_WIDTH) +
+			  x / I915_Y_TILE_WIDTH) *
+			     I915_TILE_SIZE +
+			 x % I915_Y_TILE_WIDTH / I915_Y_TILE_OWORD *
+			     (I915_Y_TILE_HEIGHT * I915_Y_TILE_OWORD) +
+			 y % I915_Y_TILE_HEIGHT * I915_Y_TILE_OWORD + x % I915_Y_TILE_OWORD;
+	}
+
+	offset += plane_offset;
+	switch (swizzle) {
+	case I915_BIT_6_SWIZZLE_9:
+		offset ^= (offset >> 3) & 64;
+		break;
+	case I915_BIT_6_SWIZZLE_9_10:
+		offset ^= ((offset >> 3) ^ (offset >> 4)) & 64;
+		break;
+	}
+
+	return offset;
+}
+
+/*
+ * Returns how many bytes starting at byte x of a row of a plane starting at plane_offset are
+ * contiguous in the tiled layout.
+ */
+static uint32_t i915_tiled_run(uint32_t tiling, uint32_t swizzle, uint32_t plane_offset,
+			       uint32_t x)
+{
+	uint32_t run;
+
+	if (tiling == I915_TILING_X)
+		run = I915_X_TILE_WIDTH - x % I915_X_TILE_WIDTH;
+	else
+		run = I915_Y_TILE_OWORD - x % I915_Y_TILE_OWORD;
+
+	/* Swizzling may move every 64 byte block of the buffer independently. */
+	if (swizzle != I915_BIT_6_SWIZZLE_NONE)
+		run = MIN(run, 64 - (plane_offset + x) % 64);
+
+	return run;
+}
+
+/*
+ * Copies the part of each plane covered by rect between a tiled buffer and a linear shadow that
+ * uses the same plane offsets and strides.
+ */
+static void i915_transfer_tiled_rect(struct bo *bo, uint32_t swizzle, uint8_t *tiled,
+				     uint8_t *untiled, const struct rectangle *rect, bool to_tiled)
+{
+	size_t plane;
+	uint32_t offset, row_bytes, num_rows, stride, x0, x, y, len;
+	uint8_t *t, *l;
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		if (drv_bo_get_plane_rect_span(bo, rect, plane, &offset, &row_bytes, &num_rows))
+			continue;
+
+		stride = bo->meta.strides[plane];
+		offset -= bo->meta.offsets[plane];
+		x0 = offset % stride;
+
+		for (y = offset / stride; num_rows--; y++) {
+			for (x = x0; x < x0 + row_bytes; x += len) {
+				len = MIN(i915_tiled_run(bo->meta.tiling, swizzle,
+							 bo->meta.offsets[plane], x),
+					  x0 + row_bytes - x);
+				t = tiled + i915_tiled_offset(bo->meta.tiling, swizzle,
+							      bo->meta.offsets[plane], stride, x, y);
+				l = untiled + bo->meta.offsets[plane] + y * stride + x;
+
+				if (to_tiled)
+					memcpy(t, l, len);
+				else
+					memcpy(l, t, len);
+			}
+		}
+	}
+}
+
+/*
+ * Flushes the tile rows holding the rows of rect after they were retiled through a CPU mapping.
+ */
+static void i915_flush_tiled_rect(struct i915_device *i915, struct bo *bo, uint8_t *tiled,
+				  const struct rectangle *rect)
+{
+	size_t plane;
+	uint32_t offset, row_bytes, num_rows, stride, tile_height, y0, y1;
+	uint8_t *start, *end;
+	uint8_t *tiled_end = tiled + bo->meta.total_size;
+
+	tile_height = bo->meta.tiling == I915_TILING_X ? I915_X_TILE_HEIGHT : I915_Y_TILE_HEIGHT;
+
+	if (i915->cache_flush == I915_CACHE_FLUSH_CLFLUSH)
+		__builtin_ia32_mfence();
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		if (drv_bo_get_plane_rect_span(bo, rect, plane, &offset, &row_bytes, &num_rows))
+			continue;
+
+		stride = bo->meta.strides[plane];
+		y0 = (offset - bo->meta.offsets[plane]) / stride;
+		y1 = y0 + num_rows;
+		y0 = y0 / tile_height * tile_height;
+		y1 = ALIGN(y1, tile_height);
+
+		start = tiled + bo->meta.offsets[plane] + y0 * stride;
+		end = MIN(tiled + bo->meta.offsets[plane] + y1 * stride, tiled_end);
+		if (start < end)
+			i915_flush_lines(i915, start, end);
+	}
+
+	if (i915->cache_flush != I915_CACHE_FLUSH_CLFLUSH)
+		__builtin_ia32_sfence();
+}
+
+/*
+ * Checks whether a tiled buffer can be detiled on the CPU, i.e. its bit 6 swizzling doesn't
+ * depend on physical address bits we can't see.
+ */
+static bool i915_can_detile(struct bo *bo, uint32_t *swizzle)
+{
+	struct i915_device *i915 = bo->drv->priv;
+	struct drm_i915_gem_get_tiling gem_get_tiling;
+	int32_t *cached;
+	int32_t detile_swizzle;
+
+	if (bo->meta.tiling != I915_TILING_X && bo->meta.tiling != I915_TILING_Y)
+		return false;
+
+	cached = &i915->detile_swizzle[bo->meta.tiling - I915_TILING_X];
+	detile_swizzle = __atomic_load_n(cached, __ATOMIC_RELAXED);
+	if (!detile_swizzle) {
+		memset(&gem_get_tiling, 0, sizeof(gem_get_tiling));
+		gem_get_tiling.handle = bo->handles[0].u32;
+
+		/* A failure says nothing about the device, so it isn't cached. */
+		if (drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_GET_TILING, &gem_get_tiling))
+			return false;
+
+		detile_swizzle = -1;
+		if (gem_get_tiling.swizzle_mode == gem_get_tiling.phys_swizzle_mode) {
+			switch (gem_get_tiling.swizzle_mode) {
+			case I915_BIT_6_SWIZZLE_NONE:
+			case I915_BIT_6_SWIZZLE_9:
+			case I915_BIT_6_SWIZZLE_9_10:
+				detile_swizzle = gem_get_tiling.swizzle_mode + 1;
+				break;
+			}
+		}
+
+		/*
+		 * Imports the exporter didn't set tiling on report no swizzling, which isn't the
+		 * device's answer. Racing threads query the same value, so whichever store wins
+		 * is fine.
+		 */
+		if (gem_get_tiling.tiling_mode == bo->meta.tiling)
+			__atomic_store_n(cached, detile_swizzle, __ATOMIC_RELAXED);
+	}
+
+	if (detile_swizzle < 0)
+		return false;
+
+	*swizzle = detile_swizzle - 1;
+	return true;
+}
+
+static void i915_lazy_transfer(struct bo *bo, void *data, const struct rectangle *rect,
+			       bool to_tiled)
+{
+	struct i915_device *i915 = bo->drv->priv;
+	struct i915_detile_map_data *priv = data;
+
+	i915_transfer_tiled_rect(bo, priv->swizzle, priv->tiled, priv->untiled, rect, to_tiled);
+	if (to_tiled && !i915->has_llc)
+		i915_flush_tiled_rect(i915, bo, priv->tiled, rect);
+}
+
+/*
+ * Maps the whole buffer through the CPU's caches, or write-combined, with GEM_MMAP or, where the
+ * kernel dropped that, with MMAP_OFFSET.
+ */
+static void *i915_gem_mmap(struct bo *bo, bool wc)
+{
+	void *addr;
+	struct drm_i915_gem_mmap gem_map;
+	struct drm_i915_gem_mmap_offset gem_mmap_offset;
+	struct i915_device *i915 = bo->drv->priv;
+
+	if (!__atomic_load_n(&i915->no_legacy_mmap, __ATOMIC_RELAXED)) {
+		memset(&gem_map, 0, sizeof(gem_map));
+		gem_map.handle = bo->handles[0].u32;
+		gem_map.offset = 0;
+		gem_map.size = bo->meta.total_size;
+		if (wc)
+			gem_map.flags = I915_MMAP_WC;
+
+		if (!drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_MMAP, &gem_map))
+			return (void *)(uintptr_t)gem_map.addr_ptr;
+		if (errno != ENODEV && errno != EOPNOTSUPP)
+			return MAP_FAILED;
+
+		__atomic_store_n(&i915->no_legacy_mmap, true, __ATOMIC_RELAXED);
+	}
+
+	memset(&gem_mmap_offset, 0, sizeof(gem_mmap_offset));
+	gem_mmap_offset.handle = bo->handles[0].u32;
+	gem_mmap_offset.flags = wc ? I915_MMAP_OFFSET_WC : I915_MMAP_OFFSET_WB;
+
+	if (drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_MMAP_OFFSET, &gem_mmap_offset)) {
+#ifdef I915_MMAP_OFFSET_FIXED
+		/* Discrete parts only take FIXED, which picks the caching for the placement. */
+		gem_mmap_offset.flags = I915_MMAP_OFFSET_FIXED;
+		if (drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_MMAP_OFFSET, &gem_mmap_offset))
+#endif
+			return MAP_FAILED;
+	}
+
+	/* Like GEM_MMAP's, the mapping is always readable and writable. */
+	addr = mmap(0, bo->meta.total_size, PROT_READ | PROT_WRITE, MAP_SHARED, bo->drv->fd,
+		    gem_mmap_offset.offset);
+	return addr;
+}
+
+/*
+ * Maps an X- or Y-tiled buffer write-back through the CPU and hands out a linear shadow instead
+ * of going through the GTT aperture. Invalidate and flush detile and retile the locked rect.
+ */
+static void *i915_bo_map_detiled(struct bo *bo, struct vma *vma, uint32_t map_flags,
+				 uint32_t swizzle)
+{
+	uint8_t *tiled;
+	struct i915_detile_map_data *priv;
+
+	tiled = i915_gem_mmap(bo, false);
+	if (tiled == MAP_FAILED)
+		return MAP_FAILED;
+
+	priv = calloc(1, sizeof(*priv));
+	if (!priv)
+		goto unmap;
+
+	priv->untiled = drv_shadow_alloc(bo->drv, bo->meta.total_size);
+	if (!priv->untiled)
+		goto free_priv;
+
+	priv->tiled = tiled;
+	priv->swizzle = swizzle;
+	vma->priv = priv;
+	vma->length = bo->meta.total_size;
+
+	priv->lazy =
+	    drv_lazy_view_create(bo, priv->untiled, map_flags, 1, i915_lazy_transfer, priv);
+	if (priv->lazy)
+		return drv_lazy_view_addr(priv->lazy);
+
+	return priv->untiled;
+
+free_priv:
+	free(priv);
+unmap:
+	munmap(tiled, bo->meta.total_size);
+	return MAP_FAILED;
+}
+
+/* What i915_init() keeps in the driver's capability cache. */
+struct i915_cached_caps {
+	int32_t device_id;
+	int32_t has_llc;
+	uint64_t cursor_width;
+	uint64_t cursor_height;
+};
+
 static int i915_init(struct driver *drv)
 {
 	int ret;
 	int device_id;
 	struct i915_device *i915;
 	drm_i915_getparam_t get_param;
+	const struct i915_cached_caps *cached;
+	struct i915_cached_caps probed;
 
 	i915 = calloc(1, sizeof(*i915));
 	if (!i915)
 		return -ENOMEM;
 
+	cached = drv_caps_cache_get(drv, sizeof(*cached));
+	if (cached) {
+		i915->gen = i915_get_gen(cached->device_id);
+		i915->cache_flush = i915_get_cache_flush();
+		i915->has_llc = cached->has_llc;
+#ifdef USE_GRALLOC1
+		i915->cursor_width = cached->cursor_width;
+		i915->cursor_height = cached->cursor_height;
+#endif
+		drv->priv = i915;
+		return i915_add_combinations(drv);
+	}
+
 	memset(&get_param, 0, sizeof(get_param));
 	get_param.param = I915_PARAM_CHIPSET_ID;
 	get_param.value = &device_id;
@@ -269,6 +721,7 @@ static int i915_init(struct driver *drv)
 	}
 
 	i915->gen = i915_get_gen(device_id);
+	i915->cache_flush = i915_get_cache_flush();
 
 	memset(&get_param, 0, sizeof(get_param));
 	get_param.param = I915_PARAM_HAS_LLC;
@@ -282,10 +735,18 @@ static int i915_init(struct driver *drv)
 
 	drv->priv = i915;
 
+	memset(&probed, 0, sizeof(probed));
+	probed.device_id = device_id;
+	probed.has_llc = i915->has_llc;
+
 #ifdef USE_GRALLOC1
 	i915_private_init(drv, &i915->cursor_width, &i915->cursor_height);
+	probed.cursor_width = i915->cursor_width;
+	probed.cursor_height = i915->cursor_height;
 #endif
 
+	drv_caps_cache_put(drv, &probed, sizeof(probed));
+
 	return i915_add_combinations(drv);
 }
 
@@ -469,12 +930,20 @@ static int i915_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 	if (ret)
 		return ret;
 
+	/*
+	 * The allocator passed it along. Otherwise the kernel is asked on every import, since the
+	 * tiling of a buffer that's already open can have been changed since.
+	 */
+	if (data->has_layout && data->tiling <= I915_TILING_Y)
+		return 0;
+
 	/* TODO(gsingh): export modifiers and get rid of backdoor tiling. */
 	memset(&gem_get_tiling, 0, sizeof(gem_get_tiling));
 	gem_get_tiling.handle = bo->handles[0].u32;
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_GET_TILING, &gem_get_tiling);
 	if (ret) {
+		drv_import_cache_remove(bo);
 		drv_gem_bo_destroy(bo);
 		drv_log("DRM_IOCTL_I915_GEM_GET_TILING failed.\n");
 		return ret;
@@ -488,13 +957,20 @@ static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 {
 	int ret;
 	void *addr;
+	uint32_t swizzle;
 
+	/* The main surface may be compressed, which the CPU can't decode. */
 	if (bo->meta.format_modifiers[0] == I915_FORMAT_MOD_Y_TILED_CCS)
 		return MAP_FAILED;
 
+	if (bo->meta.tiling != I915_TILING_NONE && i915_can_detile(bo, &swizzle)) {
+		addr = i915_bo_map_detiled(bo, vma, map_flags, swizzle);
+		if (addr != MAP_FAILED)
+			return addr;
+	}
+
 	if (bo->meta.tiling == I915_TILING_NONE) {
-		struct drm_i915_gem_mmap gem_map;
-		memset(&gem_map, 0, sizeof(gem_map));
+		bool wc = false;
 
 		/* TODO(b/118799155): We don't seem to have a good way to
 		 * detect the use cases for which WC mapping is really needed.
@@ -507,19 +983,13 @@ static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 		if ((bo->meta.use_flags & BO_USE_SCANOUT) &&
 		    !(bo->meta.use_flags &
 		      (BO_USE_RENDERSCRIPT | BO_USE_CAMERA_READ | BO_USE_CAMERA_WRITE)))
-			gem_map.flags = I915_MMAP_WC;
-
-		gem_map.handle = bo->handles[0].u32;
-		gem_map.offset = 0;
-		gem_map.size = bo->meta.total_size;
+			wc = true;
 
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_MMAP, &gem_map);
-		if (ret) {
+		addr = i915_gem_mmap(bo, wc);
+		if (addr == MAP_FAILED) {
 			drv_log("DRM_IOCTL_I915_GEM_MMAP failed\n");
 			return MAP_FAILED;
 		}
-
-		addr = (void *)(uintptr_t)gem_map.addr_ptr;
 	} else {
 		struct drm_i915_gem_mmap_gtt gem_map;
 		memset(&gem_map, 0, sizeof(gem_map));
@@ -545,14 +1015,61 @@ static void *i915_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 	return addr;
 }
 
+static int i915_bo_unmap(struct bo *bo, struct vma *vma)
+{
+	struct i915_detile_map_data *priv = vma->priv;
+
+	if (priv) {
+		if (priv->lazy)
+			drv_lazy_view_destroy(priv->lazy);
+		vma->addr = priv->tiled;
+		drv_shadow_free(bo->drv, priv->untiled, bo->meta.total_size);
+		free(priv);
+		vma->priv = NULL;
+	}
+
+	return munmap(vma->addr, vma->length);
+}
+
+/*
+ * SET_DOMAIN waits for the GPU with the object locked, which stalls other clients of the buffer
+ * for the whole wait. Busy buffers are waited for with the lockless GEM_WAIT first; the busy
+ * query makes that a single cheap ioctl for idle ones.
+ */
+static int i915_bo_wait_idle(struct bo *bo)
+{
+	struct drm_i915_gem_busy busy;
+	struct drm_i915_gem_wait wait;
+
+	memset(&busy, 0, sizeof(busy));
+	busy.handle = bo->handles[0].u32;
+	if (!drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_BUSY, &busy) && !busy.busy)
+		return 0;
+
+	memset(&wait, 0, sizeof(wait));
+	wait.bo_handle = bo->handles[0].u32;
+	wait.timeout_ns = -1;
+	if (drmIoctl(bo->drv->fd, DRM_IOCTL_I915_GEM_WAIT, &wait)) {
+		drv_log("DRM_IOCTL_I915_GEM_WAIT failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
 static int i915_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	int ret;
 	struct drm_i915_gem_set_domain set_domain;
+	struct i915_detile_map_data *priv = mapping->vma->priv;
+
+	ret = i915_bo_wait_idle(bo);
+	if (ret)
+		return ret;
 
 	memset(&set_domain, 0, sizeof(set_domain));
 	set_domain.handle = bo->handles[0].u32;
-	if (bo->meta.tiling == I915_TILING_NONE) {
+	if (bo->meta.tiling == I915_TILING_NONE || priv) {
 		set_domain.read_domains = I915_GEM_DOMAIN_CPU;
 		if (mapping->vma->map_flags & BO_MAP_WRITE)
 			set_domain.write_domain = I915_GEM_DOMAIN_CPU;
@@ -568,14 +1085,46 @@ static int i915_bo_invalidate(struct bo *bo, struct mapping *mapping)
 		return ret;
 	}
 
+	/* Tracked views detile on fault or refresh the rect themselves. */
+	if (priv && priv->lazy)
+		drv_lazy_view_invalidate(priv->lazy, mapping);
+	/* Flush writes back the whole rect, so write-only locks start from a cleared one. */
+	else if (priv && (mapping->vma->map_flags & BO_MAP_READ))
+		i915_transfer_tiled_rect(bo, priv->swizzle, priv->tiled, priv->untiled,
+					 &mapping->rect, false);
+	else if (priv)
+		drv_bo_clear_shadow_rect(bo, &mapping->rect, priv->untiled);
+
 	return 0;
 }
 
 static int i915_bo_flush(struct bo *bo, struct mapping *mapping)
 {
+	uint32_t i, num_rects;
+	const struct rectangle *rects;
 	struct i915_device *i915 = bo->drv->priv;
+	struct i915_detile_map_data *priv = mapping->vma->priv;
+
+	if (priv) {
+		if (!(mapping->vma->map_flags & BO_MAP_WRITE))
+			return 0;
+
+		if (priv->lazy)
+			return drv_lazy_view_flush(priv->lazy, mapping);
+
+		num_rects = drv_mapping_dirty_rects(mapping, &rects);
+		for (i = 0; i < num_rects; i++) {
+			i915_transfer_tiled_rect(bo, priv->swizzle, priv->tiled, priv->untiled,
+						 &rects[i], true);
+			if (!i915->has_llc)
+				i915_flush_tiled_rect(i915, bo, priv->tiled, &rects[i]);
+		}
+
+		return 0;
+	}
+
 	if (!i915->has_llc && bo->meta.tiling == I915_TILING_NONE)
-		i915_clflush(mapping->vma->addr, mapping->vma->length);
+		i915_flush_mapping(i915, bo, mapping);
 
 	return 0;
 }
@@ -620,10 +1169,11 @@ const struct backend backend_i915 = {
 	.bo_destroy = drv_gem_bo_destroy,
 	.bo_import = i915_bo_import,
 	.bo_map = i915_bo_map,
-	.bo_unmap = drv_bo_munmap,
+	.bo_unmap = i915_bo_unmap,
 	.bo_invalidate = i915_bo_invalidate,
 	.bo_flush = i915_bo_flush,
 	.resolve_format = i915_resolve_format,
+	.map_unlocked = true,
 };
 
 #endif
@@ -10,7 +10,6 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
-#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -28,6 +27,7 @@
 struct mediatek_private_map_data {
 	void *cached_addr;
 	void *gem_addr;
+	struct drv_lazy_view *lazy;
 	int prime_fd;
 };
 
@@ -163,6 +163,14 @@ static int mediatek_bo_create(struct bo *bo, uint32_t width, uint32_t height, ui
 						 ARRAY_SIZE(modifiers));
 }
 
+static void mediatek_shadow_transfer(struct bo *bo, void *data, const struct rectangle *rect,
+				     bool to_tiled)
+{
+	struct mediatek_private_map_data *priv = data;
+
+	drv_bo_sync_shadow_rect(bo, rect, priv->cached_addr, priv->gem_addr, to_tiled);
+}
+
 static void *mediatek_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret, prime_fd;
@@ -178,7 +186,11 @@ static void *mediatek_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint3
 		return MAP_FAILED;
 	}
 
-	prime_fd = drv_bo_get_plane_fd(bo, 0);
+	/*
+	 * This fd is only used to sync CPU access internally, so don't go through
+	 * drv_bo_get_plane_fd(), which marks the buffer as shared.
+	 */
+	prime_fd = drv_get_export_fd(bo->drv, bo->handles[0].u32);
 	if (prime_fd < 0) {
 		drv_log("Failed to get a prime fd\n");
 		return MAP_FAILED;
@@ -194,9 +206,22 @@ static void *mediatek_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint3
 	vma->priv = priv;
 
 	if (bo->meta.use_flags & BO_USE_RENDERSCRIPT) {
-		priv->cached_addr = calloc(1, bo->meta.total_size);
+		priv->cached_addr = drv_shadow_alloc(bo->drv, bo->meta.total_size);
+		if (!priv->cached_addr) {
+			close(priv->prime_fd);
+			free(priv);
+			vma->priv = NULL;
+			munmap(addr, vma->length);
+			return MAP_FAILED;
+		}
 		priv->gem_addr = addr;
 		addr = priv->cached_addr;
+
+		/* With BO_MAP_TRACKED, flush only copies back the pages that were written. */
+		priv->lazy = drv_lazy_view_create(bo, priv->cached_addr, map_flags, 1,
+						  mediatek_shadow_transfer, priv);
+		if (priv->lazy)
+			addr = drv_lazy_view_addr(priv->lazy);
 	}
 
 	return addr;
@@ -207,9 +232,12 @@ static int mediatek_bo_unmap(struct bo *bo, struct vma *vma)
 	if (vma->priv) {
 		struct mediatek_private_map_data *priv = vma->priv;
 
+		if (priv->lazy)
+			drv_lazy_view_destroy(priv->lazy);
+
 		if (priv->cached_addr) {
 			vma->addr = priv->gem_addr;
-			free(priv->cached_addr);
+			drv_shadow_free(bo->drv, priv->cached_addr, bo->meta.total_size);
 		}
 
 		close(priv->prime_fd);
@@ -225,22 +253,19 @@ static int mediatek_bo_invalidate(struct bo *bo, struct mapping *mapping)
 	struct mediatek_private_map_data *priv = mapping->vma->priv;
 
 	if (priv) {
-		struct pollfd fds = {
-			.fd = priv->prime_fd,
-		};
-
-		if (mapping->vma->map_flags & BO_MAP_WRITE)
-			fds.events |= POLLOUT;
-
-		if (mapping->vma->map_flags & BO_MAP_READ)
-			fds.events |= POLLIN;
-
-		poll(&fds, 1, -1);
-		if (fds.revents != fds.events)
-			drv_log("poll prime_fd failed\n");
-
-		if (priv->cached_addr)
-			memcpy(priv->cached_addr, priv->gem_addr, bo->meta.total_size);
+		/* Waits for device access to finish and invalidates CPU caches if needed. */
+		int ret = drv_dmabuf_begin_mapping_access(priv->prime_fd, mapping);
+		if (ret)
+			return ret;
+
+		/* Flush writes back the whole rect, so write-only locks start from a cleared one. */
+		if (priv->lazy)
+			drv_lazy_view_invalidate(priv->lazy, mapping);
+		else if (priv->cached_addr && (mapping->vma->map_flags & BO_MAP_READ))
+			drv_bo_sync_shadow_rect(bo, &mapping->rect, priv->cached_addr,
+						priv->gem_addr, false);
+		else if (priv->cached_addr)
+			drv_bo_clear_shadow_rect(bo, &mapping->rect, priv->cached_addr);
 	}
 
 	return 0;
@@ -249,10 +274,16 @@ static int mediatek_bo_invalidate(struct bo *bo, struct mapping *mapping)
 static int mediatek_bo_flush(struct bo *bo, struct mapping *mapping)
 {
 	struct mediatek_private_map_data *priv = mapping->vma->priv;
-	if (priv && priv->cached_addr && (mapping->vma->map_flags & BO_MAP_WRITE))
-		memcpy(priv->gem_addr, priv->cached_addr, bo->meta.total_size);
 
-	return 0;
+	if (!priv)
+		return 0;
+
+	if (priv->lazy && (mapping->vma->map_flags & BO_MAP_WRITE))
+		drv_lazy_view_flush(priv->lazy, mapping);
+	else if (priv->cached_addr && (mapping->vma->map_flags & BO_MAP_WRITE))
+		drv_bo_flush_shadow(bo, mapping, priv->cached_addr, priv->gem_addr);
+
+	return drv_dmabuf_end_mapping_access(priv->prime_fd, mapping);
 }
 
 static uint32_t mediatek_resolve_format(struct driver *drv, uint32_t format, uint64_t use_flags)
@@ -298,6 +329,8 @@ const struct backend backend_mediatek = {
 	.bo_invalidate = mediatek_bo_invalidate,
 	.bo_flush = mediatek_bo_flush,
 	.resolve_format = mediatek_resolve_format,
+	.brackets_cpu_access = true,
+	.map_unlocked = true,
 };
 
 #endif
@@ -148,12 +148,8 @@ static void msm_add_ubwc_combinations(struct driver *drv, const uint32_t *format
 				      uint64_t use_flags)
 {
 	for (uint32_t i = 0; i < num_formats; i++) {
-		if (is_ubwc_fmt(formats[i])) {
-			struct combination combo = { .format = formats[i],
-						     .metadata = *metadata,
-						     .use_flags = use_flags };
-			drv_array_append(drv->combos, &combo);
-		}
+		if (is_ubwc_fmt(formats[i]))
+			drv_add_combination(drv, formats[i], metadata, use_flags);
 	}
 }
 
@@ -309,5 +305,6 @@ const struct backend backend_msm = {
 	.bo_map = msm_bo_map,
 	.bo_unmap = drv_bo_munmap,
 	.resolve_format = msm_resolve_format,
+	.map_unlocked = true,
 };
 #endif /* DRV_MSM */
@@ -21,6 +21,7 @@
 struct rockchip_private_map_data {
 	void *cached_addr;
 	void *gem_addr;
+	struct drv_lazy_view *lazy;
 };
 
 static const uint32_t scanout_render_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMAT_ARGB8888,
@@ -184,6 +185,14 @@ static int rockchip_bo_create(struct bo *bo, uint32_t width, uint32_t height, ui
 						 ARRAY_SIZE(modifiers));
 }
 
+static void rockchip_shadow_transfer(struct bo *bo, void *data, const struct rectangle *rect,
+				     bool to_tiled)
+{
+	struct rockchip_private_map_data *priv = data;
+
+	drv_bo_sync_shadow_rect(bo, rect, priv->cached_addr, priv->gem_addr, to_tiled);
+}
+
 static void *rockchip_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret;
@@ -195,6 +204,13 @@ static void *rockchip_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint3
 	if (bo->meta.format_modifiers[0] == DRM_FORMAT_MOD_CHROMEOS_ROCKCHIP_AFBC)
 		return MAP_FAILED;
 
+	/*
+	 * Map everything else through the dma-buf, so CPU access is bracketed with
+	 * DMA_BUF_IOCTL_SYNC and the exporter handles cache maintenance.
+	 */
+	if (!(bo->meta.use_flags & BO_USE_RENDERSCRIPT))
+		return drv_dmabuf_bo_map(bo, vma, plane, map_flags);
+
 	memset(&gem_map, 0, sizeof(gem_map));
 	gem_map.handle = bo->handles[0].u32;
 
@@ -209,12 +225,26 @@ static void *rockchip_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint3
 
 	vma->length = bo->meta.total_size;
 
+	if (addr == MAP_FAILED)
+		return addr;
+
 	if (bo->meta.use_flags & BO_USE_RENDERSCRIPT) {
 		priv = calloc(1, sizeof(*priv));
-		priv->cached_addr = calloc(1, bo->meta.total_size);
+		priv->cached_addr = drv_shadow_alloc(bo->drv, bo->meta.total_size);
+		if (!priv->cached_addr) {
+			free(priv);
+			munmap(addr, vma->length);
+			return MAP_FAILED;
+		}
 		priv->gem_addr = addr;
 		vma->priv = priv;
 		addr = priv->cached_addr;
+
+		/* With BO_MAP_TRACKED, flush only copies back the pages that were written. */
+		priv->lazy = drv_lazy_view_create(bo, priv->cached_addr, map_flags, 1,
+						  rockchip_shadow_transfer, priv);
+		if (priv->lazy)
+			addr = drv_lazy_view_addr(priv->lazy);
 	}
 
 	return addr;
@@ -222,10 +252,15 @@ static void *rockchip_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint3
 
 static int rockchip_bo_unmap(struct bo *bo, struct vma *vma)
 {
+	if (!(bo->meta.use_flags & BO_USE_RENDERSCRIPT))
+		return drv_dmabuf_bo_unmap(bo, vma);
+
 	if (vma->priv) {
 		struct rockchip_private_map_data *priv = vma->priv;
+		if (priv->lazy)
+			drv_lazy_view_destroy(priv->lazy);
 		vma->addr = priv->gem_addr;
-		free(priv->cached_addr);
+		drv_shadow_free(bo->drv, priv->cached_addr, bo->meta.total_size);
 		free(priv);
 		vma->priv = NULL;
 	}
@@ -235,20 +270,40 @@ static int rockchip_bo_unmap(struct bo *bo, struct vma *vma)
 
 static int rockchip_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
-	if (mapping->vma->priv) {
-		struct rockchip_private_map_data *priv = mapping->vma->priv;
-		memcpy(priv->cached_addr, priv->gem_addr, bo->meta.total_size);
+	struct rockchip_private_map_data *priv = mapping->vma->priv;
+
+	if (!(bo->meta.use_flags & BO_USE_RENDERSCRIPT))
+		return drv_dmabuf_bo_invalidate(bo, mapping);
+
+	if (priv && priv->lazy) {
+		drv_lazy_view_invalidate(priv->lazy, mapping);
+		return 0;
 	}
 
+	/* Flush writes back the whole rect, so write-only locks start from a cleared one. */
+	if (priv && (mapping->vma->map_flags & BO_MAP_READ))
+		drv_bo_sync_shadow_rect(bo, &mapping->rect, priv->cached_addr, priv->gem_addr,
+					false);
+	else if (priv)
+		drv_bo_clear_shadow_rect(bo, &mapping->rect, priv->cached_addr);
+
 	return 0;
 }
 
 static int rockchip_bo_flush(struct bo *bo, struct mapping *mapping)
 {
 	struct rockchip_private_map_data *priv = mapping->vma->priv;
-	if (priv && (mapping->vma->map_flags & BO_MAP_WRITE))
-		memcpy(priv->gem_addr, priv->cached_addr, bo->meta.total_size);
 
+	if (!(bo->meta.use_flags & BO_USE_RENDERSCRIPT))
+		return drv_dmabuf_bo_flush(bo, mapping);
+
+	if (!priv || !(mapping->vma->map_flags & BO_MAP_WRITE))
+		return 0;
+
+	if (priv->lazy)
+		return drv_lazy_view_flush(priv->lazy, mapping);
+
+	drv_bo_flush_shadow(bo, mapping, priv->cached_addr, priv->gem_addr);
 	return 0;
 }
 
@@ -280,6 +335,8 @@ const struct backend backend_rockchip = {
 	.bo_invalidate = rockchip_bo_invalidate,
 	.bo_flush = rockchip_bo_flush,
 	.resolve_format = rockchip_resolve_format,
+	.brackets_cpu_access = true,
+	.map_unlocked = true,
 };
 
 #endif
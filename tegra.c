@@ -14,6 +14,12 @@
 #include <tegra_drm.h>
 #include <xf86drm.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "drv_priv.h"
 #include "helpers.h"
 #include "util.h"
@@ -25,6 +31,8 @@
  */
 #define NV_BLOCKLINEAR_GOB_HEIGHT 8
 #define NV_BLOCKLINEAR_GOB_WIDTH 64
+#define NV_BLOCKLINEAR_GOB_SIZE (NV_BLOCKLINEAR_GOB_WIDTH * NV_BLOCKLINEAR_GOB_HEIGHT)
+#define NV_BLOCKLINEAR_SECTOR_SIZE 16
 #define NV_DEFAULT_BLOCK_HEIGHT_LOG2 4
 #define NV_PREFERRED_PAGE_SIZE (128 * 1024)
 
@@ -45,6 +53,7 @@ enum tegra_map_type {
 struct tegra_private_map_data {
 	void *tiled;
 	void *untiled;
+	struct drv_lazy_view *lazy;
 };
 
 static const uint32_t render_target_formats[] = { DRM_FORMAT_ARGB8888, DRM_FORMAT_XRGB8888 };
@@ -101,83 +110,132 @@ static void compute_layout_linear(int width, int height, int format, uint32_t *s
 	*size = *stride * height;
 }
 
-static void transfer_tile(struct bo *bo, uint8_t *tiled, uint8_t *untiled, enum tegra_map_type type,
-			  uint32_t bytes_per_pixel, uint32_t gob_top, uint32_t gob_left,
-			  uint32_t gob_size_pixels, uint8_t *tiled_last)
+/* Byte offset within a GOB of byte x (0-63) of GOB row y (0-7). */
+static inline uint32_t gob_offset(uint32_t x, uint32_t y)
 {
-	uint8_t *tmp;
-	uint32_t x, y, k;
-	for (k = 0; k < gob_size_pixels; k++) {
-		/*
-		 * Given the kth pixel starting from the tile specified by
-		 * gob_top and gob_left, unswizzle to get the standard (x, y)
-		 * representation.
-		 */
-		x = gob_left + (((k >> 3) & 8) | ((k >> 1) & 4) | (k & 3));
-		y = gob_top + ((k >> 7 << 3) | ((k >> 3) & 6) | ((k >> 2) & 1));
-
-		if (tiled >= tiled_last)
-			return;
-
-		if (x >= bo->meta.width || y >= bo->meta.height) {
-			tiled += bytes_per_pixel;
-			continue;
-		}
+	return ((x & 32) << 3) | ((y & 6) << 5) | ((x & 16) << 1) | ((y & 1) << 4) | (x & 15);
+}
 
-		tmp = untiled + y * bo->meta.strides[0] + x * bytes_per_pixel;
+/* GOB rows are made of 16-byte sectors, each contiguous in both layouts. */
+static inline void copy_sector(uint8_t *dst, const uint8_t *src)
+{
+#if defined(__SSE2__)
+	_mm_storeu_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+#elif defined(__ARM_NEON)
+	vst1q_u8(dst, vld1q_u8(src));
+#else
+	memcpy(dst, src, NV_BLOCKLINEAR_SECTOR_SIZE);
+#endif
+}
 
-		if (type == TEGRA_READ_TILED_BUFFER)
-			memcpy(tmp, tiled, bytes_per_pixel);
-		else if (type == TEGRA_WRITE_TILED_BUFFER)
-			memcpy(tiled, tmp, bytes_per_pixel);
+static void transfer_gob(uint8_t *gob, uint8_t *linear, uint32_t stride, enum tegra_map_type type)
+{
+	uint32_t x, y;
+
+	for (y = 0; y < NV_BLOCKLINEAR_GOB_HEIGHT; y++, linear += stride) {
+		for (x = 0; x < NV_BLOCKLINEAR_GOB_WIDTH; x += NV_BLOCKLINEAR_SECTOR_SIZE) {
+			if (type == TEGRA_READ_TILED_BUFFER)
+				copy_sector(linear + x, gob + gob_offset(x, y));
+			else
+				copy_sector(gob + gob_offset(x, y), linear + x);
+		}
+	}
+}
 
-		/* Move on to next pixel. */
-		tiled += bytes_per_pixel;
+/*
+ * Transfers bytes [x0, x1) of rows [y0, y1) of a GOB that is only partially covered by the
+ * rect, or that runs past the end of the buffer.
+ */
+static void transfer_partial_gob(uint8_t *gob, uint8_t *linear, uint32_t stride, uint32_t x0,
+				 uint32_t x1, uint32_t y0, uint32_t y1, const uint8_t *tiled_last,
+				 enum tegra_map_type type)
+{
+	uint32_t x, y, next, len;
+	uint8_t *tmp;
+
+	for (y = y0; y < y1; y++) {
+		for (x = x0; x < x1; x = next) {
+			next = MIN(ALIGN(x + 1, NV_BLOCKLINEAR_SECTOR_SIZE), x1);
+			tmp = gob + gob_offset(x, y);
+			if (tmp >= tiled_last)
+				continue;
+
+			len = MIN(next - x, (uint32_t)(tiled_last - tmp));
+			if (type == TEGRA_READ_TILED_BUFFER)
+				memcpy(linear + y * stride + x, tmp, len);
+			else
+				memcpy(tmp, linear + y * stride + x, len);
+		}
 	}
 }
 
-static void transfer_tiled_memory(struct bo *bo, uint8_t *tiled, uint8_t *untiled,
-				  enum tegra_map_type type)
+/*
+ * Converts the part of the surface covered by rect between the blocklinear buffer and its
+ * linear shadow, which uses the same pitch. Whole GOBs are moved a sector at a time; GOBs on
+ * the edges of the rect or the buffer are handled separately.
+ */
+static void transfer_tiled_rect(struct bo *bo, uint8_t *tiled, uint8_t *untiled,
+				const struct rectangle *rect, enum tegra_map_type type)
 {
-	uint32_t gob_width, gob_height, gob_size_bytes, gob_size_pixels, gob_count_x, gob_count_y,
-	    gob_top, gob_left;
-	uint32_t i, j, offset;
-	uint8_t *tmp, *tiled_last;
+	uint32_t block_height, block_size, blocks_per_row, stride;
+	uint32_t x0, x1, y0, y1, gx, gy, rx0, rx1, ry0, ry1;
+	uint8_t *gob, *linear;
+	const uint8_t *tiled_last = tiled + bo->meta.total_size;
 	uint32_t bytes_per_pixel = drv_stride_from_format(bo->meta.format, 1, 0);
 
 	/*
-	 * The blocklinear format consists of 8*(2^n) x 64 byte sized tiles,
+	 * The blocklinear format consists of 8*(2^n) x 64 byte sized blocks,
 	 * where 0 <= n <= 4.
 	 */
-	gob_width = DIV_ROUND_UP(NV_BLOCKLINEAR_GOB_WIDTH, bytes_per_pixel);
-	gob_height = NV_BLOCKLINEAR_GOB_HEIGHT * (1 << NV_DEFAULT_BLOCK_HEIGHT_LOG2);
-	/* Calculate the height from maximum possible gob height */
-	while (gob_height > NV_BLOCKLINEAR_GOB_HEIGHT && gob_height >= 2 * bo->meta.height)
-		gob_height /= 2;
-
-	gob_size_bytes = gob_height * NV_BLOCKLINEAR_GOB_WIDTH;
-	gob_size_pixels = gob_height * gob_width;
-
-	gob_count_x = DIV_ROUND_UP(bo->meta.strides[0], NV_BLOCKLINEAR_GOB_WIDTH);
-	gob_count_y = DIV_ROUND_UP(bo->meta.height, gob_height);
-
-	tiled_last = tiled + bo->meta.total_size;
-
-	offset = 0;
-	for (j = 0; j < gob_count_y; j++) {
-		gob_top = j * gob_height;
-		for (i = 0; i < gob_count_x; i++) {
-			tmp = tiled + offset;
-			gob_left = i * gob_width;
-
-			transfer_tile(bo, tmp, untiled, type, bytes_per_pixel, gob_top, gob_left,
-				      gob_size_pixels, tiled_last);
-
-			offset += gob_size_bytes;
+	block_height = NV_BLOCKLINEAR_GOB_HEIGHT * (1 << NV_DEFAULT_BLOCK_HEIGHT_LOG2);
+	/* Calculate the height from maximum possible block height */
+	while (block_height > NV_BLOCKLINEAR_GOB_HEIGHT && block_height >= 2 * bo->meta.height)
+		block_height /= 2;
+
+	stride = bo->meta.strides[0];
+	block_size = block_height * NV_BLOCKLINEAR_GOB_WIDTH;
+	blocks_per_row = DIV_ROUND_UP(stride, NV_BLOCKLINEAR_GOB_WIDTH);
+
+	x0 = rect->x * bytes_per_pixel;
+	x1 = MIN(rect->x + rect->width, bo->meta.width) * bytes_per_pixel;
+	y0 = rect->y;
+	y1 = MIN(rect->y + rect->height, bo->meta.height);
+
+	for (gy = y0 - y0 % NV_BLOCKLINEAR_GOB_HEIGHT; gy < y1; gy += NV_BLOCKLINEAR_GOB_HEIGHT) {
+		ry0 = MAX(y0, gy) - gy;
+		ry1 = MIN(y1, gy + NV_BLOCKLINEAR_GOB_HEIGHT) - gy;
+
+		for (gx = x0 - x0 % NV_BLOCKLINEAR_GOB_WIDTH; gx < x1;
+		     gx += NV_BLOCKLINEAR_GOB_WIDTH) {
+			rx0 = MAX(x0, gx) - gx;
+			rx1 = MIN(x1, gx + NV_BLOCKLINEAR_GOB_WIDTH) - gx;
+
+			gob = tiled +
+			      (gy / block_height * blocks_per_row + gx / NV_BLOCKLINEAR_GOB_WIDTH) *
+				  block_size +
+			      gy % block_height * NV_BLOCKLINEAR_GOB_WIDTH;
+			linear = untiled + gy * stride + gx;
+
+			if (rx0 == 0 && rx1 == NV_BLOCKLINEAR_GOB_WIDTH && ry0 == 0 &&
+			    ry1 == NV_BLOCKLINEAR_GOB_HEIGHT &&
+			    gob + NV_BLOCKLINEAR_GOB_SIZE <= tiled_last)
+				transfer_gob(gob, linear, stride, type);
+			else
+				transfer_partial_gob(gob, linear, stride, rx0, rx1, ry0, ry1,
+						     tiled_last, type);
 		}
 	}
 }
 
+static void tegra_lazy_transfer(struct bo *bo, void *data, const struct rectangle *rect,
+				bool to_tiled)
+{
+	struct tegra_private_map_data *priv = data;
+
+	transfer_tiled_rect(bo, priv->tiled, priv->untiled, rect,
+			    to_tiled ? TEGRA_WRITE_TILED_BUFFER : TEGRA_READ_TILED_BUFFER);
+}
+
 static int tegra_init(struct driver *drv)
 {
 	struct format_metadata metadata;
@@ -270,12 +328,24 @@ static int tegra_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 	if (ret)
 		return ret;
 
+	/*
+	 * The allocator passed it along, with the block height the kernel doesn't report.
+	 * Otherwise the kernel is asked on every import, since the tiling of a buffer that's
+	 * already open can have been changed since.
+	 */
+	if (data->has_layout && ((data->tiling & 0xff) == NV_MEM_KIND_PITCH ||
+				 (data->tiling & 0xff) == NV_MEM_KIND_C32_2CRA)) {
+		bo->meta.format_modifiers[0] = fourcc_mod_code(NV, bo->meta.tiling);
+		return 0;
+	}
+
 	/* TODO(gsingh): export modifiers and get rid of backdoor tiling. */
 	memset(&gem_get_tiling, 0, sizeof(gem_get_tiling));
 	gem_get_tiling.handle = bo->handles[0].u32;
 
 	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_TEGRA_GEM_GET_TILING, &gem_get_tiling);
 	if (ret) {
+		drv_import_cache_remove(bo);
 		drv_gem_bo_destroy(bo);
 		return -errno;
 	}
@@ -288,8 +358,10 @@ static int tegra_bo_import(struct bo *bo, struct drv_import_fd_data *data)
 		bo->meta.tiling = NV_MEM_KIND_C32_2CRA;
 	} else {
 		drv_log("%s: unknown tile format %d\n", __func__, gem_get_tiling.mode);
+		drv_import_cache_remove(bo);
 		drv_gem_bo_destroy(bo);
 		assert(0);
+		return -EINVAL;
 	}
 
 	bo->meta.format_modifiers[0] = fourcc_mod_code(NV, bo->meta.tiling);
@@ -316,11 +388,20 @@ static void *tegra_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t
 	vma->length = bo->meta.total_size;
 	if ((bo->meta.tiling & 0xFF) == NV_MEM_KIND_C32_2CRA && addr != MAP_FAILED) {
 		priv = calloc(1, sizeof(*priv));
-		priv->untiled = calloc(1, bo->meta.total_size);
+		priv->untiled = drv_shadow_alloc(bo->drv, bo->meta.total_size);
+		if (!priv->untiled) {
+			free(priv);
+			munmap(addr, vma->length);
+			return MAP_FAILED;
+		}
 		priv->tiled = addr;
 		vma->priv = priv;
-		transfer_tiled_memory(bo, priv->tiled, priv->untiled, TEGRA_READ_TILED_BUFFER);
 		addr = priv->untiled;
+
+		priv->lazy = drv_lazy_view_create(bo, priv->untiled, map_flags,
+						  NV_BLOCKLINEAR_GOB_HEIGHT, tegra_lazy_transfer, priv);
+		if (priv->lazy)
+			addr = drv_lazy_view_addr(priv->lazy);
 	}
 
 	return addr;
@@ -330,8 +411,10 @@ static int tegra_bo_unmap(struct bo *bo, struct vma *vma)
 {
 	if (vma->priv) {
 		struct tegra_private_map_data *priv = vma->priv;
+		if (priv->lazy)
+			drv_lazy_view_destroy(priv->lazy);
 		vma->addr = priv->tiled;
-		free(priv->untiled);
+		drv_shadow_free(bo->drv, priv->untiled, bo->meta.total_size);
 		free(priv);
 		vma->priv = NULL;
 	}
@@ -339,12 +422,46 @@ static int tegra_bo_unmap(struct bo *bo, struct vma *vma)
 	return munmap(vma->addr, vma->length);
 }
 
+/*
+ * drv_bo_map() invalidates every new mapping, so this is also where the shadow gets its initial
+ * contents.
+ */
+static int tegra_bo_invalidate(struct bo *bo, struct mapping *mapping)
+{
+	struct tegra_private_map_data *priv = mapping->vma->priv;
+
+	/* Tracked views detile on fault or refresh the rect themselves. */
+	if (priv && priv->lazy) {
+		drv_lazy_view_invalidate(priv->lazy, mapping);
+		return 0;
+	}
+
+	/* Flush writes back the whole rect, so write-only locks start from a cleared one. */
+	if (priv && (mapping->vma->map_flags & BO_MAP_READ))
+		transfer_tiled_rect(bo, priv->tiled, priv->untiled, &mapping->rect,
+				    TEGRA_READ_TILED_BUFFER);
+	else if (priv)
+		drv_bo_clear_shadow_rect(bo, &mapping->rect, priv->untiled);
+
+	return 0;
+}
+
 static int tegra_bo_flush(struct bo *bo, struct mapping *mapping)
 {
+	uint32_t i, num_rects;
+	const struct rectangle *rects;
 	struct tegra_private_map_data *priv = mapping->vma->priv;
 
-	if (priv && (mapping->vma->map_flags & BO_MAP_WRITE))
-		transfer_tiled_memory(bo, priv->tiled, priv->untiled, TEGRA_WRITE_TILED_BUFFER);
+	if (!priv || !(mapping->vma->map_flags & BO_MAP_WRITE))
+		return 0;
+
+	if (priv->lazy)
+		return drv_lazy_view_flush(priv->lazy, mapping);
+
+	num_rects = drv_mapping_dirty_rects(mapping, &rects);
+	for (i = 0; i < num_rects; i++)
+		transfer_tiled_rect(bo, priv->tiled, priv->untiled, &rects[i],
+				    TEGRA_WRITE_TILED_BUFFER);
 
 	return 0;
 }
@@ -357,7 +474,9 @@ const struct backend backend_tegra = {
 	.bo_import = tegra_bo_import,
 	.bo_map = tegra_bo_map,
 	.bo_unmap = tegra_bo_unmap,
+	.bo_invalidate = tegra_bo_invalidate,
 	.bo_flush = tegra_bo_flush,
+	.map_unlocked = true,
 };
 
 #endif
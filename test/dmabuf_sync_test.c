@@ -0,0 +1,256 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Runs a dumb backend's maps against a fake vgem device whose buffers export as fake dma-bufs,
+ * like udmabuf or dma-heap buffers, and checks how CPU access is bracketed with
+ * DMA_BUF_IOCTL_SYNC.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/dma-buf.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "../drv_priv.h"
+#include "fake_drm.h"
+
+#define FAKE_VGEM_BO_SIZE (1 << 20)
+#define MAX_SYNCS 16
+#define SW_USE_FLAGS (BO_USE_TEXTURE | BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN)
+
+struct fake_vgem {
+	struct fake_drm dev;
+	/* The only buffer's dma-buf, whose DMA_BUF_IOCTL_SYNC flags are logged. */
+	struct fake_drm dmabuf;
+	bool no_export;
+	uint32_t num_bos;
+
+	struct driver *drv;
+	uint64_t syncs[MAX_SYNCS];
+	uint32_t num_syncs;
+	/* Starts issued while driver_lock was held. */
+	uint32_t locked_starts;
+};
+
+static int fake_dmabuf_ioctl(struct fake_drm *dev, unsigned long request, void *arg)
+{
+	struct fake_vgem *vgem = dev->priv;
+	struct dma_buf_sync *sync = arg;
+
+	if (request != DMA_BUF_IOCTL_SYNC)
+		return -ENOTTY;
+	if (vgem->num_syncs == MAX_SYNCS)
+		return -ENOSPC;
+
+	if ((sync->flags & DMA_BUF_SYNC_END) == DMA_BUF_SYNC_START && vgem->drv) {
+		if (pthread_mutex_trylock(&vgem->drv->driver_lock))
+			vgem->locked_starts++;
+		else
+			pthread_mutex_unlock(&vgem->drv->driver_lock);
+	}
+
+	vgem->syncs[vgem->num_syncs++] = sync->flags;
+	return 0;
+}
+
+static int fake_vgem_ioctl(struct fake_drm *dev, unsigned long request, void *arg)
+{
+	struct fake_vgem *vgem = dev->priv;
+
+	switch (request) {
+	case DRM_IOCTL_MODE_CREATE_DUMB: {
+		struct drm_mode_create_dumb *create = arg;
+
+		create->pitch = create->width * ((create->bpp + 7) / 8);
+		create->size = (uint64_t)create->pitch * create->height;
+		if (create->size > FAKE_VGEM_BO_SIZE || vgem->num_bos)
+			return -ENOMEM;
+
+		create->handle = ++vgem->num_bos;
+		return 0;
+	}
+	case DRM_IOCTL_MODE_MAP_DUMB: {
+		struct drm_mode_map_dumb *map = arg;
+
+		map->offset = (uint64_t)map->handle * FAKE_VGEM_BO_SIZE;
+		return 0;
+	}
+	case DRM_IOCTL_PRIME_HANDLE_TO_FD: {
+		struct drm_prime_handle *prime = arg;
+
+		if (vgem->no_export)
+			return -ENOSYS;
+
+		prime->fd = fcntl(vgem->dmabuf.fd, F_DUPFD_CLOEXEC, 0);
+		return prime->fd < 0 ? -errno : 0;
+	}
+	case DRM_IOCTL_MODE_DESTROY_DUMB:
+	case DRM_IOCTL_GEM_CLOSE:
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+struct test_context {
+	struct fake_vgem vgem;
+	struct driver *drv;
+	int fds_before;
+};
+
+static int test_setup(struct test_context *ctx, bool no_export)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fds_before = fake_drm_count_fds();
+
+	ctx->vgem.dev.name = "vgem";
+	ctx->vgem.dev.ioctl = fake_vgem_ioctl;
+	ctx->vgem.dev.priv = &ctx->vgem;
+	ctx->vgem.no_export = no_export;
+	CHECK(!fake_drm_open(&ctx->vgem.dev, 2 * FAKE_VGEM_BO_SIZE));
+
+	ctx->vgem.dmabuf.name = "dmabuf";
+	ctx->vgem.dmabuf.ioctl = fake_dmabuf_ioctl;
+	ctx->vgem.dmabuf.priv = &ctx->vgem;
+	CHECK(!fake_drm_open(&ctx->vgem.dmabuf, FAKE_VGEM_BO_SIZE));
+
+	ctx->drv = drv_create(ctx->vgem.dev.fd);
+	CHECK(ctx->drv);
+	CHECK(!drv_init(ctx->drv, 0));
+	ctx->vgem.drv = ctx->drv;
+	return 1;
+}
+
+static int test_teardown(struct test_context *ctx)
+{
+	drv_destroy(ctx->drv);
+	fake_drm_close(&ctx->vgem.dmabuf);
+	fake_drm_close(&ctx->vgem.dev);
+
+	CHECK(fake_drm_count_fds() == ctx->fds_before);
+	return 1;
+}
+
+static bool synced(struct test_context *ctx, uint32_t index, uint64_t flags)
+{
+	return index < ctx->vgem.num_syncs && ctx->vgem.syncs[index] == flags;
+}
+
+/* Locking, flushing and then unlocking like gralloc starts and ends CPU access once each. */
+static int test_flush_then_unlock(void)
+{
+	uint8_t *addr, value;
+	struct bo *bo;
+	struct mapping *mapping;
+	struct test_context ctx;
+	struct rectangle rect = { 0, 0, 64, 64 };
+
+	CHECK(test_setup(&ctx, false));
+
+	bo = drv_bo_create(ctx.drv, 64, 64, DRM_FORMAT_ARGB8888, SW_USE_FLAGS);
+	CHECK(bo);
+	addr = drv_bo_map(bo, &rect, BO_MAP_READ_WRITE, &mapping, 0);
+	CHECK(addr != MAP_FAILED);
+	CHECK(ctx.vgem.num_syncs == 1);
+	CHECK(synced(&ctx, 0, DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW));
+	CHECK(!ctx.vgem.locked_starts);
+
+	/* The mapping is the dma-buf's. */
+	memset(addr, 0x5a, drv_bo_get_plane_size(bo, 0));
+	CHECK(pread(ctx.vgem.dmabuf.fd, &value, 1, drv_bo_get_plane_size(bo, 0) - 1) == 1);
+	CHECK(value == 0x5a);
+
+	CHECK(!drv_bo_flush(bo, mapping));
+	CHECK(ctx.vgem.num_syncs == 2);
+	CHECK(synced(&ctx, 1, DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW));
+
+	CHECK(!drv_bo_flush_or_unmap(bo, mapping));
+	CHECK(ctx.vgem.num_syncs == 2);
+
+	drv_bo_unmap(bo, mapping);
+	drv_bo_destroy(bo);
+	return test_teardown(&ctx);
+}
+
+/* Another lock of a flushed mapping starts CPU access again, and its flush ends it again. */
+static int test_relock(void)
+{
+	void *addr;
+	struct bo *bo;
+	struct mapping *mapping;
+	struct test_context ctx;
+	struct rectangle rect = { 0, 0, 64, 64 };
+
+	CHECK(test_setup(&ctx, false));
+
+	bo = drv_bo_create(ctx.drv, 64, 64, DRM_FORMAT_ARGB8888, SW_USE_FLAGS);
+	CHECK(bo);
+	addr = drv_bo_map(bo, &rect, BO_MAP_WRITE, &mapping, 0);
+	CHECK(addr != MAP_FAILED);
+
+	/* A second invalidate before the flush doesn't start it twice. */
+	CHECK(!drv_bo_invalidate(bo, mapping));
+	CHECK(!drv_bo_flush(bo, mapping));
+	CHECK(!drv_bo_invalidate(bo, mapping));
+	CHECK(!drv_bo_flush(bo, mapping));
+
+	CHECK(ctx.vgem.num_syncs == 4);
+	CHECK(synced(&ctx, 0, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE));
+	CHECK(synced(&ctx, 1, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE));
+	CHECK(synced(&ctx, 2, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE));
+	CHECK(synced(&ctx, 3, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE));
+
+	drv_bo_unmap(bo, mapping);
+	drv_bo_destroy(bo);
+	return test_teardown(&ctx);
+}
+
+/* Drivers that can't export the buffer still map it, without the bracket. */
+static int test_dumb_fallback(void)
+{
+	uint8_t *addr, value;
+	struct bo *bo;
+	struct mapping *mapping;
+	struct test_context ctx;
+	struct rectangle rect = { 0, 0, 64, 64 };
+
+	CHECK(test_setup(&ctx, true));
+
+	bo = drv_bo_create(ctx.drv, 64, 64, DRM_FORMAT_ARGB8888, SW_USE_FLAGS);
+	CHECK(bo);
+	addr = drv_bo_map(bo, &rect, BO_MAP_READ_WRITE, &mapping, 0);
+	CHECK(addr != MAP_FAILED);
+
+	addr[0] = 0xa5;
+	CHECK(pread(ctx.vgem.dev.fd, &value, 1, (off_t)bo->handles[0].u32 * FAKE_VGEM_BO_SIZE) ==
+	      1);
+	CHECK(value == 0xa5);
+
+	CHECK(!drv_bo_flush(bo, mapping));
+	CHECK(!ctx.vgem.num_syncs);
+
+	drv_bo_unmap(bo, mapping);
+	drv_bo_destroy(bo);
+	return test_teardown(&ctx);
+}
+
+static const struct fake_drm_testcase tests[] = {
+	{ "flush_then_unlock", test_flush_then_unlock },
+	{ "relock", test_relock },
+	{ "dumb_fallback", test_dumb_fallback },
+};
+
+int main(int argc, char *argv[])
+{
+	return fake_drm_run_tests(tests, sizeof(tests) / sizeof(tests[0]), argc, argv);
+}
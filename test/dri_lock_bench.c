@@ -0,0 +1,312 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Measures how many locks per second threads locking their own buffers get through dri.c's
+ * maps, when the maps are serialized like under driver_lock and when they run in parallel on
+ * the context pool. Then measures how long a lock of a small rect takes for a caller using the
+ * buffer's strides, like gralloc, when the whole buffer is mapped and when only the rect is.
+ * Runs against mock_dri.so, whose blits of the whole buffer take as long as given.
+ *
+ * Usage: dri_lock_bench [blit_us [iterations]]
+ */
+
+#include <dlfcn.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../dri.h"
+#include "../drv_priv.h"
+#include "../helpers.h"
+#include "fake_drm.h"
+
+#define MAX_THREADS 8
+#define BO_SIZE 256
+#define RECT_SIZE 64
+
+static pthread_mutex_t serialize_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct bench_thread {
+	pthread_t thread;
+	struct bo *bo;
+	uint32_t iterations;
+	bool serialize;
+	uint32_t mismatches;
+	int failed;
+};
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void *lock_loop(void *arg)
+{
+	uint32_t i;
+	uint8_t *addr;
+	struct vma vma;
+	struct bench_thread *t = arg;
+	size_t size = (size_t)BO_SIZE * BO_SIZE * 4;
+
+	for (i = 0; i < t->iterations; i++) {
+		memset(&vma, 0, sizeof(vma));
+		vma.map_flags = BO_MAP_READ_WRITE;
+		vma.rect.width = BO_SIZE;
+		vma.rect.height = BO_SIZE;
+
+		if (t->serialize)
+			pthread_mutex_lock(&serialize_lock);
+		addr = dri_bo_map(t->bo, &vma, 0, vma.map_flags);
+		if (t->serialize)
+			pthread_mutex_unlock(&serialize_lock);
+
+		if (addr == MAP_FAILED) {
+			t->failed = 1;
+			return NULL;
+		}
+
+		/* The previous lock's writes must have made it to the buffer. */
+		if (addr[0] != (uint8_t)i || addr[size - 1] != (uint8_t)i)
+			t->mismatches++;
+		memset(addr, (uint8_t)(i + 1), size);
+
+		if (t->serialize)
+			pthread_mutex_lock(&serialize_lock);
+		dri_bo_unmap(t->bo, &vma);
+		if (t->serialize)
+			pthread_mutex_unlock(&serialize_lock);
+	}
+
+	return NULL;
+}
+
+static struct bo *bench_bo_create(struct driver *drv)
+{
+	struct bo *bo = calloc(1, sizeof(*bo));
+	struct dri_driver *dri = drv->priv;
+
+	if (!bo)
+		return NULL;
+
+	bo->drv = drv;
+	bo->meta.width = BO_SIZE;
+	bo->meta.height = BO_SIZE;
+	bo->meta.format = DRM_FORMAT_ARGB8888;
+	bo->meta.num_planes = 1;
+	bo->meta.strides[0] = BO_SIZE * 4;
+	bo->meta.sizes[0] = bo->meta.strides[0] * BO_SIZE;
+	bo->meta.total_size = bo->meta.sizes[0];
+	bo->device_visible = true;
+	bo->priv = dri->image_extension->createImage(dri->device, BO_SIZE, BO_SIZE,
+						     __DRI_IMAGE_FORMAT_ARGB8888, 0, NULL);
+	if (!bo->priv) {
+		free(bo);
+		return NULL;
+	}
+
+	return bo;
+}
+
+/* Returns the locks per second, or a negative value on failure. */
+static double run(struct driver *drv, uint32_t num_threads, uint32_t iterations, bool serialize,
+		  uint32_t *mismatches)
+{
+	uint32_t i;
+	int failed = 0;
+	double start, elapsed;
+	struct bench_thread threads[MAX_THREADS];
+	struct dri_driver *dri = drv->priv;
+
+	memset(threads, 0, sizeof(threads));
+	for (i = 0; i < num_threads; i++) {
+		threads[i].bo = bench_bo_create(drv);
+		if (!threads[i].bo)
+			return -1;
+		threads[i].iterations = iterations;
+		threads[i].serialize = serialize;
+	}
+
+	start = now_ms();
+	for (i = 0; i < num_threads; i++)
+		if (pthread_create(&threads[i].thread, NULL, lock_loop, &threads[i]))
+			return -1;
+
+	*mismatches = 0;
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		failed |= threads[i].failed;
+		*mismatches += threads[i].mismatches;
+	}
+	elapsed = now_ms() - start;
+
+	for (i = 0; i < num_threads; i++) {
+		dri->image_extension->destroyImage(threads[i].bo->priv);
+		free(threads[i].bo);
+	}
+
+	return failed ? -1 : num_threads * iterations * 1000.0 / elapsed;
+}
+
+/*
+ * Returns the average time a lock of a RECT_SIZE square takes when indexed with the buffer's
+ * strides, or a negative value on failure. Checks that what the lock wrote made it to the
+ * buffer and nothing else did.
+ */
+static double rect_lock_us(struct driver *drv, uint32_t iterations, bool partial)
+{
+	uint32_t i, x, y;
+	uint8_t *addr, value;
+	double start, total = 0;
+	struct vma vma, check;
+	struct bo *bo = bench_bo_create(drv);
+	struct dri_driver *dri = drv->priv;
+	struct rectangle rect = { BO_SIZE - RECT_SIZE, RECT_SIZE, RECT_SIZE, RECT_SIZE };
+	double ret = -1;
+
+	if (!bo)
+		return -1;
+
+	for (i = 0; i < iterations; i++) {
+		memset(&vma, 0, sizeof(vma));
+		vma.map_flags = BO_MAP_READ_WRITE;
+		vma.rect = rect;
+		if (!partial) {
+			vma.rect.x = vma.rect.y = 0;
+			vma.rect.width = vma.rect.height = BO_SIZE;
+		}
+
+		start = now_ms();
+		addr = dri_bo_map(bo, &vma, 0, vma.map_flags);
+		if (addr == MAP_FAILED)
+			goto out;
+		for (y = rect.y; y < rect.y + rect.height; y++)
+			memset(addr + y * bo->meta.strides[0] + rect.x * 4, (uint8_t)(i + 1),
+			       rect.width * 4);
+		dri_bo_unmap(bo, &vma);
+		total += now_ms() - start;
+	}
+
+	memset(&check, 0, sizeof(check));
+	check.map_flags = BO_MAP_READ;
+	addr = dri_bo_map(bo, &check, 0, check.map_flags);
+	if (addr == MAP_FAILED)
+		goto out;
+
+	for (y = 0; y < BO_SIZE; y++) {
+		for (x = 0; x < BO_SIZE; x++) {
+			bool inside = x >= rect.x && x < rect.x + rect.width && y >= rect.y &&
+				      y < rect.y + rect.height;
+
+			value = inside ? (uint8_t)iterations : 0;
+			if (addr[y * bo->meta.strides[0] + x * 4] != value) {
+				printf("wrong value at %u,%u\n", x, y);
+				dri_bo_unmap(bo, &check);
+				goto out;
+			}
+		}
+	}
+	dri_bo_unmap(bo, &check);
+	ret = total * 1000.0 / iterations;
+
+out:
+	dri->image_extension->destroyImage(bo->priv);
+	free(bo);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	char path[PATH_MAX];
+	ssize_t len;
+	void *mock;
+	uint32_t i, mismatches;
+	uint32_t (*overlaps)(void);
+	void (*set_blit_us)(uint32_t);
+	int ret = EXIT_FAILURE;
+	double serialized, parallel, whole_us, rect_us;
+	struct driver drv;
+	struct fake_drm dev = { .name = "mock" };
+	uint32_t blit_us = argc > 1 ? strtoul(argv[1], NULL, 0) : 200;
+	uint32_t iterations = argc > 2 ? strtoul(argv[2], NULL, 0) : 200;
+
+	/* mock_dri.so is built next to this binary. */
+	len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	if (len < 0)
+		return EXIT_FAILURE;
+	path[len] = '\0';
+	strcpy(strrchr(path, '/') + 1, "mock_dri.so");
+
+	if (fake_drm_open(&dev, 4096))
+		return EXIT_FAILURE;
+
+	memset(&drv, 0, sizeof(drv));
+	drv.fd = dev.fd;
+	if (drv_shadow_pool_init(&drv))
+		goto close_dev;
+	drv.priv = calloc(1, sizeof(struct dri_driver));
+	if (!drv.priv)
+		goto destroy_pool;
+	if (dri_init(&drv, path, "mock"))
+		goto free_priv;
+
+	mock = dlopen(path, RTLD_NOW | RTLD_NOLOAD);
+	set_blit_us = mock ? dlsym(mock, "mock_dri_set_blit_us") : NULL;
+	overlaps = mock ? dlsym(mock, "mock_dri_context_overlaps") : NULL;
+	if (!set_blit_us || !overlaps)
+		goto close_dri;
+	set_blit_us(blit_us);
+
+	printf("blit %u us, %u iterations per thread\n", blit_us, iterations);
+	printf("threads  serialized locks/s  parallel locks/s\n");
+	for (i = 1; i <= MAX_THREADS; i *= 2) {
+		uint32_t serialized_mismatches;
+
+		serialized = run(&drv, i, iterations, true, &serialized_mismatches);
+		parallel = run(&drv, i, iterations, false, &mismatches);
+		if (serialized < 0 || parallel < 0)
+			goto close_dri;
+
+		printf("%7u  %18.0f  %16.0f\n", i, serialized, parallel);
+		if (serialized_mismatches || mismatches) {
+			printf("lost writes: %u serialized, %u parallel\n", serialized_mismatches,
+			       mismatches);
+			goto close_dri;
+		}
+	}
+
+	printf("contexts used by two threads at once: %u\n", overlaps());
+
+	whole_us = rect_lock_us(&drv, iterations, false);
+	rect_us = rect_lock_us(&drv, iterations, true);
+	if (whole_us < 0 || rect_us < 0)
+		goto close_dri;
+
+	printf("write lock of a %ux%u rect with the buffer's strides:\n", RECT_SIZE, RECT_SIZE);
+	printf("whole buffer mapped: %.0f us\n", whole_us);
+	printf("only the rect mapped: %.0f us\n", rect_us);
+	ret = EXIT_SUCCESS;
+
+close_dri:
+	if (mock)
+		dlclose(mock);
+	dri_close(&drv);
+free_priv:
+	free(drv.priv);
+destroy_pool:
+	drv_shadow_pool_destroy(&drv);
+close_dev:
+	fake_drm_close(&dev);
+	return ret;
+}
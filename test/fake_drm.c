@@ -0,0 +1,233 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "fake_drm.h"
+
+#define FAKE_DRM_MAX_DEVICES 8
+
+static pthread_mutex_t fake_drm_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fake_drm *fake_drm_devices[FAKE_DRM_MAX_DEVICES];
+
+/* Inodes of the devices' memfds, so that other fds of a device reach it too, like dma-bufs. */
+static ino_t fake_drm_inodes[FAKE_DRM_MAX_DEVICES];
+
+static struct fake_drm *fake_drm_lookup(int fd)
+{
+	size_t i;
+	struct stat st;
+	struct fake_drm *dev = NULL;
+
+	pthread_mutex_lock(&fake_drm_lock);
+	for (i = 0; i < FAKE_DRM_MAX_DEVICES; i++)
+		if (fake_drm_devices[i] && fake_drm_devices[i]->fd == fd)
+			dev = fake_drm_devices[i];
+	pthread_mutex_unlock(&fake_drm_lock);
+
+	if (dev || fstat(fd, &st))
+		return dev;
+
+	pthread_mutex_lock(&fake_drm_lock);
+	for (i = 0; i < FAKE_DRM_MAX_DEVICES; i++)
+		if (fake_drm_devices[i] && fake_drm_inodes[i] == st.st_ino)
+			dev = fake_drm_devices[i];
+	pthread_mutex_unlock(&fake_drm_lock);
+
+	return dev;
+}
+
+int fake_drm_open(struct fake_drm *dev, size_t size)
+{
+	size_t i;
+	struct stat st;
+
+	memset(dev->calls, 0, sizeof(dev->calls));
+	dev->fd = memfd_create(dev->name, MFD_CLOEXEC);
+	if (dev->fd < 0)
+		return -errno;
+
+	if (ftruncate(dev->fd, size) || fstat(dev->fd, &st)) {
+		close(dev->fd);
+		return -errno;
+	}
+
+	pthread_mutex_lock(&fake_drm_lock);
+	for (i = 0; i < FAKE_DRM_MAX_DEVICES; i++) {
+		if (!fake_drm_devices[i]) {
+			fake_drm_devices[i] = dev;
+			fake_drm_inodes[i] = st.st_ino;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fake_drm_lock);
+
+	if (i == FAKE_DRM_MAX_DEVICES) {
+		close(dev->fd);
+		return -ENOSPC;
+	}
+
+	return 0;
+}
+
+void fake_drm_close(struct fake_drm *dev)
+{
+	size_t i;
+
+	pthread_mutex_lock(&fake_drm_lock);
+	for (i = 0; i < FAKE_DRM_MAX_DEVICES; i++)
+		if (fake_drm_devices[i] == dev)
+			fake_drm_devices[i] = NULL;
+	pthread_mutex_unlock(&fake_drm_lock);
+
+	close(dev->fd);
+	dev->fd = -1;
+}
+
+uint32_t fake_drm_calls(struct fake_drm *dev, unsigned long request)
+{
+	return __atomic_load_n(&dev->calls[_IOC_NR(request)], __ATOMIC_RELAXED);
+}
+
+int fake_drm_count_fds(void)
+{
+	int count = 0;
+	DIR *dir = opendir("/proc/self/fd");
+
+	if (!dir)
+		return -1;
+
+	while (readdir(dir))
+		count++;
+
+	closedir(dir);
+	return count;
+}
+
+/* These take precedence over libdrm's, which still provides everything else. */
+int drmIoctl(int fd, unsigned long request, void *arg)
+{
+	int ret;
+	struct fake_drm *dev = fake_drm_lookup(fd);
+
+	if (!dev) {
+		do {
+			ret = ioctl(fd, request, arg);
+		} while (ret == -1 && (errno == EINTR || errno == EAGAIN));
+		return ret;
+	}
+
+	__atomic_add_fetch(&dev->calls[_IOC_NR(request)], 1, __ATOMIC_RELAXED);
+	ret = dev->ioctl(dev, request, arg);
+	if (ret) {
+		errno = -ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+int drmCommandWriteRead(int fd, unsigned long drmCommandIndex, void *data, unsigned long size)
+{
+	unsigned long request = _IOC(_IOC_READ | _IOC_WRITE, DRM_IOCTL_BASE,
+				     DRM_COMMAND_BASE + drmCommandIndex, size);
+
+	if (drmIoctl(fd, request, data))
+		return -errno;
+
+	return 0;
+}
+
+int drmPrimeHandleToFD(int fd, uint32_t handle, uint32_t flags, int *prime_fd)
+{
+	struct drm_prime_handle args;
+
+	memset(&args, 0, sizeof(args));
+	args.handle = handle;
+	args.flags = flags;
+	args.fd = -1;
+	if (drmIoctl(fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &args))
+		return -errno;
+
+	*prime_fd = args.fd;
+	return 0;
+}
+
+drmVersionPtr drmGetVersion(int fd)
+{
+	drmVersionPtr version;
+	struct fake_drm *dev = fake_drm_lookup(fd);
+
+	if (!dev) {
+		errno = ENOTTY;
+		return NULL;
+	}
+
+	version = calloc(1, sizeof(*version));
+	if (!version)
+		return NULL;
+
+	version->name = strdup(dev->name);
+	version->name_len = strlen(dev->name);
+	return version;
+}
+
+void drmFreeVersion(drmVersionPtr version)
+{
+	if (!version)
+		return;
+
+	free(version->name);
+	free(version);
+}
+
+/* Reopening the device by this name gives another fd of it, like a render node would. */
+char *drmGetRenderDeviceNameFromFd(int fd)
+{
+	char *name;
+
+	if (!fake_drm_lookup(fd))
+		return NULL;
+
+	if (asprintf(&name, "/proc/self/fd/%d", fd) < 0)
+		return NULL;
+
+	return name;
+}
+
+int fake_drm_run_tests(const struct fake_drm_testcase *tests, size_t num_tests, int argc,
+		       char *argv[])
+{
+	int ret = 0;
+	size_t i;
+	const char *name = argc >= 2 ? argv[1] : "all";
+
+	setbuf(stdout, NULL);
+	for (i = 0; i < num_tests; i++) {
+		if (strcmp(tests[i].name, name) && strcmp("all", name))
+			continue;
+
+		printf("[ RUN      ] %s\n", tests[i].name);
+		if (!tests[i].run_test()) {
+			fprintf(stderr, "[  FAILED  ] %s\n", tests[i].name);
+			ret |= 1;
+		} else {
+			printf("[  PASSED  ] %s\n", tests[i].name);
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef FAKE_DRM_H
+#define FAKE_DRM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A DRM device that only exists in the test process. drmIoctl() and drmGetVersion() on its fd
+ * go to the test instead of the kernel, so backends run unchanged against it. The fd is a memfd
+ * of the given size: mmap() offsets handed out for buffers map its pages. Other fds of the memfd
+ * reach the device too, so a device can also stand in for a dma-buf and its ioctls.
+ */
+struct fake_drm {
+	const char *name;
+	/* Returns 0 or a negative errno, like the kernel. */
+	int (*ioctl)(struct fake_drm *dev, unsigned long request, void *arg);
+	void *priv;
+	int fd;
+	/* How often each ioctl nr was called. */
+	uint32_t calls[256];
+};
+
+int fake_drm_open(struct fake_drm *dev, size_t size);
+
+void fake_drm_close(struct fake_drm *dev);
+
+uint32_t fake_drm_calls(struct fake_drm *dev, unsigned long request);
+
+/* Returns how many fds the process has open, to check for leaks. */
+int fake_drm_count_fds(void);
+
+#define CHECK(cond)                                                                                \
+	do {                                                                                       \
+		if (!(cond)) {                                                                     \
+			fprintf(stderr, "[  FAILED  ] check in %s() %s:%d\n", __func__, __FILE__,  \
+				__LINE__);                                                         \
+			return 0;                                                                  \
+		}                                                                                  \
+	} while (0)
+
+struct fake_drm_testcase {
+	const char *name;
+	int (*run_test)(void);
+};
+
+/* Runs the tests named on the command line, or all of them. Returns the exit status. */
+int fake_drm_run_tests(const struct fake_drm_testcase *tests, size_t num_tests, int argc,
+		       char *argv[]);
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <i915_drm.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "fake_i915.h"
+
+/* A Skylake GT2, which has an LLC unless the test says otherwise. */
+#define FAKE_I915_CHIPSET_ID 0x1916
+
+static int fake_i915_getparam(struct fake_i915 *i915, drm_i915_getparam_t *param)
+{
+	switch (param->param) {
+	case I915_PARAM_CHIPSET_ID:
+		*param->value = FAKE_I915_CHIPSET_ID;
+		return 0;
+	case I915_PARAM_HAS_LLC:
+		*param->value = i915->has_llc;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static bool fake_i915_valid(struct fake_i915 *i915, uint32_t handle)
+{
+	return handle && handle <= i915->num_bos;
+}
+
+static int fake_i915_handle_to_fd(struct fake_i915 *i915, struct drm_prime_handle *prime)
+{
+	int *dmabuf;
+
+	if (!fake_i915_valid(i915, prime->handle))
+		return -ENOENT;
+
+	dmabuf = &i915->dmabufs[prime->handle - 1];
+	if (!*dmabuf) {
+		*dmabuf = memfd_create("fake-dmabuf", MFD_CLOEXEC);
+		if (*dmabuf < 0) {
+			*dmabuf = 0;
+			return -errno;
+		}
+	}
+
+	prime->fd = fcntl(*dmabuf, F_DUPFD_CLOEXEC, 0);
+	return prime->fd < 0 ? -errno : 0;
+}
+
+/* Like the kernel, returns the handle the dma-buf already has, or gives it a new one. */
+static int fake_i915_fd_to_handle(struct fake_i915 *i915, struct drm_prime_handle *prime)
+{
+	uint32_t i;
+	struct stat st, dmabuf_st;
+
+	if (fstat(prime->fd, &st))
+		return -errno;
+
+	for (i = 0; i < i915->num_bos; i++) {
+		if (i915->dmabufs[i] && !fstat(i915->dmabufs[i], &dmabuf_st) &&
+		    st.st_ino == dmabuf_st.st_ino) {
+			prime->handle = i + 1;
+			return 0;
+		}
+	}
+
+	if (i915->num_bos == FAKE_I915_MAX_BOS)
+		return -ENOSPC;
+
+	i = i915->num_bos;
+	i915->dmabufs[i] = fcntl(prime->fd, F_DUPFD_CLOEXEC, 0);
+	if (i915->dmabufs[i] < 0) {
+		i915->dmabufs[i] = 0;
+		return -errno;
+	}
+
+	i915->tiling[i] = I915_TILING_NONE;
+	prime->handle = ++i915->num_bos;
+	return 0;
+}
+
+static int fake_i915_ioctl(struct fake_drm *dev, unsigned long request, void *arg)
+{
+	struct fake_i915 *i915 = dev->priv;
+
+	switch (request) {
+	case DRM_IOCTL_I915_GETPARAM:
+		return fake_i915_getparam(i915, arg);
+	case DRM_IOCTL_I915_GEM_CREATE: {
+		struct drm_i915_gem_create *create = arg;
+		if (create->size > FAKE_I915_BO_SIZE)
+			return -ENOMEM;
+		if (i915->num_bos == FAKE_I915_MAX_BOS)
+			return -ENOSPC;
+
+		create->handle = ++i915->num_bos;
+		i915->tiling[create->handle - 1] = I915_TILING_NONE;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_SET_TILING: {
+		struct drm_i915_gem_set_tiling *set_tiling = arg;
+		if (!fake_i915_valid(i915, set_tiling->handle))
+			return -ENOENT;
+
+		i915->tiling[set_tiling->handle - 1] = set_tiling->tiling_mode;
+		i915->stride[set_tiling->handle - 1] = set_tiling->stride;
+		set_tiling->swizzle_mode =
+		    set_tiling->tiling_mode == I915_TILING_NONE ? I915_BIT_6_SWIZZLE_NONE : i915->swizzle;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_GET_TILING: {
+		struct drm_i915_gem_get_tiling *get_tiling = arg;
+		if (!fake_i915_valid(i915, get_tiling->handle))
+			return -ENOENT;
+
+		get_tiling->tiling_mode = i915->tiling[get_tiling->handle - 1];
+		get_tiling->swizzle_mode = get_tiling->tiling_mode == I915_TILING_NONE
+					       ? I915_BIT_6_SWIZZLE_NONE
+					       : i915->swizzle;
+		get_tiling->phys_swizzle_mode = get_tiling->swizzle_mode;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_MMAP: {
+		void *addr;
+		struct drm_i915_gem_mmap *map = arg;
+
+		if (i915->no_legacy_mmap)
+			return -ENODEV;
+		if (!fake_i915_valid(i915, map->handle))
+			return -ENOENT;
+		if (map->offset + map->size > FAKE_I915_BO_SIZE)
+			return -EINVAL;
+
+		addr = mmap(0, map->size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd,
+			    (off_t)map->handle * FAKE_I915_BO_SIZE + map->offset);
+		if (addr == MAP_FAILED)
+			return -errno;
+
+		map->addr_ptr = (uintptr_t)addr;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_MMAP_OFFSET: {
+		struct drm_i915_gem_mmap_offset *map = arg;
+		if (!fake_i915_valid(i915, map->handle))
+			return -ENOENT;
+
+		map->offset = (uint64_t)map->handle * FAKE_I915_BO_SIZE;
+		return 0;
+	}
+	case DRM_IOCTL_PRIME_HANDLE_TO_FD:
+		return fake_i915_handle_to_fd(i915, arg);
+	case DRM_IOCTL_PRIME_FD_TO_HANDLE:
+		return fake_i915_fd_to_handle(i915, arg);
+	case DRM_IOCTL_I915_GEM_BUSY: {
+		struct drm_i915_gem_busy *busy = arg;
+		busy->busy = 0;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_WAIT:
+	case DRM_IOCTL_I915_GEM_SET_DOMAIN:
+	case DRM_IOCTL_GEM_CLOSE:
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+int fake_i915_open(struct fake_i915 *i915)
+{
+	i915->dev.name = "i915";
+	i915->dev.ioctl = fake_i915_ioctl;
+	i915->dev.priv = i915;
+
+	return fake_drm_open(&i915->dev, (FAKE_I915_MAX_BOS + 1) * (size_t)FAKE_I915_BO_SIZE);
+}
+
+void fake_i915_close(struct fake_i915 *i915)
+{
+	uint32_t i;
+
+	for (i = 0; i < i915->num_bos; i++)
+		if (i915->dmabufs[i])
+			close(i915->dmabufs[i]);
+
+	fake_drm_close(&i915->dev);
+}
+
+uint8_t *fake_i915_bo_memory(struct fake_i915 *i915, uint32_t handle)
+{
+	if (!fake_i915_valid(i915, handle))
+		return MAP_FAILED;
+
+	return mmap(0, FAKE_I915_BO_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, i915->dev.fd,
+		    (off_t)handle * FAKE_I915_BO_SIZE);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef FAKE_I915_H
+#define FAKE_I915_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fake_drm.h"
+
+#define FAKE_I915_BO_SIZE (4 << 20)
+#define FAKE_I915_MAX_BOS 8
+
+/*
+ * An i915 device whose buffers live in its memfd, FAKE_I915_BO_SIZE bytes apart, so that tests
+ * can look at the bytes the CPU mapping wrote. Tiled buffers report the given bit 6 swizzling.
+ */
+struct fake_i915 {
+	struct fake_drm dev;
+	int32_t has_llc;
+	uint32_t swizzle;
+	/* Legacy GEM_MMAP fails with ENODEV like on parts that only have MMAP_OFFSET. */
+	bool no_legacy_mmap;
+
+	uint32_t num_bos;
+	uint32_t tiling[FAKE_I915_MAX_BOS];
+	uint32_t stride[FAKE_I915_MAX_BOS];
+	/*
+	 * The dma-bufs of exported and imported buffers, or 0. Exports get memfds that only stand
+	 * for the buffer; imports keep the fd they were imported from.
+	 */
+	int dmabufs[FAKE_I915_MAX_BOS];
+};
+
+int fake_i915_open(struct fake_i915 *i915);
+
+void fake_i915_close(struct fake_i915 *i915);
+
+/* Maps the memory of the buffer with the given GEM handle, or returns MAP_FAILED. */
+uint8_t *fake_i915_bo_memory(struct fake_i915 *i915, uint32_t handle);
+
+#endif
@@ -0,0 +1,261 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "../virgl_hw.h"
+#include "../virtgpu_drm.h"
+#include "fake_virtio_gpu.h"
+
+/* From virglrenderer's virgl_protocol.h, like in virtio_gpu.c. */
+#define VIRGL_PIPE_RES_CREATE_FORMAT 2
+#define VIRGL_PIPE_RES_CREATE_WIDTH 4
+
+static uint32_t fake_virtio_gpu_cpp(uint32_t virgl_format)
+{
+	switch (virgl_format) {
+	case VIRGL_FORMAT_R8_UNORM:
+		return 1;
+	case VIRGL_FORMAT_B5G6R5_UNORM:
+	case VIRGL_FORMAT_R8G8_UNORM:
+		return 2;
+	default:
+		return 4;
+	}
+}
+
+static int fake_virtio_gpu_new_resource(struct fake_virtio_gpu *virtio, uint32_t stride,
+					uint32_t *handle)
+{
+	int fd;
+
+	fd = memfd_create("fake-dmabuf", MFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, FAKE_VIRTIO_RESOURCE_SIZE)) {
+		close(fd);
+		return -errno;
+	}
+
+	pthread_mutex_lock(&virtio->lock);
+	if (virtio->num_resources == FAKE_VIRTIO_MAX_RESOURCES) {
+		pthread_mutex_unlock(&virtio->lock);
+		close(fd);
+		return -ENOSPC;
+	}
+
+	virtio->strides[virtio->num_resources] = stride;
+	virtio->dmabufs[virtio->num_resources] = fd;
+	*handle = ++virtio->num_resources;
+	pthread_mutex_unlock(&virtio->lock);
+
+	return 0;
+}
+
+static int fake_virtio_gpu_execbuffer(struct fake_virtio_gpu *virtio,
+				      struct drm_virtgpu_execbuffer *exbuf)
+{
+	int fds[2];
+
+	if (virtio->fail_execbuffer)
+		return -EINVAL;
+
+	if (exbuf->num_bo_handles)
+		virtio->execbuffer_handle = *(uint32_t *)(uintptr_t)exbuf->bo_handles;
+
+	if (!(exbuf->flags & VIRTGPU_EXECBUF_FENCE_FD_OUT))
+		return 0;
+
+	if (pipe2(fds, O_CLOEXEC))
+		return -errno;
+
+	pthread_mutex_lock(&virtio->lock);
+	if (virtio->num_pending == FAKE_VIRTIO_MAX_FENCES) {
+		pthread_mutex_unlock(&virtio->lock);
+		close(fds[0]);
+		close(fds[1]);
+		return -EBUSY;
+	}
+
+	virtio->pending[virtio->num_pending++] = fds[1];
+	pthread_mutex_unlock(&virtio->lock);
+
+	exbuf->fence_fd = fds[0];
+	return 0;
+}
+
+static int fake_virtio_gpu_resource_info(struct fake_virtio_gpu *virtio,
+					 struct drm_virtgpu_resource_info *info)
+{
+	if (!info->bo_handle || info->bo_handle > virtio->num_resources)
+		return -ENOENT;
+
+	info->res_handle = info->bo_handle;
+	info->size = FAKE_VIRTIO_RESOURCE_SIZE;
+	switch (virtio->blob_layout) {
+	case FAKE_VIRTIO_LAYOUT_REPORTED:
+		info->num_planes = 1;
+		info->strides[0] = virtio->strides[info->bo_handle - 1];
+		break;
+	case FAKE_VIRTIO_LAYOUT_DIFFERENT:
+		info->num_planes = 1;
+		info->strides[0] = virtio->strides[info->bo_handle - 1] + 64;
+		break;
+	case FAKE_VIRTIO_LAYOUT_UPSTREAM:
+		info->strides[0] = VIRTGPU_BLOB_MEM_HOST3D;
+		break;
+	}
+
+	return 0;
+}
+
+static int fake_virtio_gpu_prime_fd_to_handle(struct fake_virtio_gpu *virtio,
+					      struct drm_prime_handle *prime)
+{
+	uint32_t i;
+	struct stat st, resource_st;
+
+	if (fstat(prime->fd, &st))
+		return -errno;
+
+	for (i = 0; i < virtio->num_resources; i++) {
+		if (!fstat(virtio->dmabufs[i], &resource_st) && st.st_ino == resource_st.st_ino) {
+			prime->handle = i + 1;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static int fake_virtio_gpu_ioctl(struct fake_drm *dev, unsigned long request, void *arg)
+{
+	struct fake_virtio_gpu *virtio = dev->priv;
+
+	switch (request) {
+	case DRM_IOCTL_VIRTGPU_GETPARAM: {
+		struct drm_virtgpu_getparam *param = arg;
+		int value = param->param == VIRTGPU_PARAM_3D_FEATURES;
+
+		if (param->param == VIRTGPU_PARAM_RESOURCE_BLOB ||
+		    param->param == VIRTGPU_PARAM_HOST_VISIBLE)
+			value = virtio->blobs;
+
+		*(int *)(uintptr_t)param->value = value;
+		return 0;
+	}
+	case DRM_IOCTL_VIRTGPU_GET_CAPS: {
+		struct drm_virtgpu_get_caps *caps = arg;
+		union virgl_caps *out = (union virgl_caps *)(uintptr_t)caps->addr;
+
+		/* Every format for every use. */
+		memset(out, 0xff, caps->size);
+		out->max_version = 1;
+		return 0;
+	}
+	case DRM_IOCTL_VIRTGPU_RESOURCE_CREATE: {
+		struct drm_virtgpu_resource_create *create = arg;
+		if (create->size > FAKE_VIRTIO_RESOURCE_SIZE)
+			return -ENOMEM;
+
+		return fake_virtio_gpu_new_resource(
+		    virtio, create->width * fake_virtio_gpu_cpp(create->format), &create->bo_handle);
+	}
+	case DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB: {
+		struct drm_virtgpu_resource_create_blob *create = arg;
+		const uint32_t *cmd = (const uint32_t *)(uintptr_t)create->cmd;
+
+		if (!virtio->blobs)
+			return -ENOTTY;
+		if (create->size > FAKE_VIRTIO_RESOURCE_SIZE)
+			return -ENOMEM;
+
+		return fake_virtio_gpu_new_resource(
+		    virtio,
+		    cmd[VIRGL_PIPE_RES_CREATE_WIDTH] *
+			fake_virtio_gpu_cpp(cmd[VIRGL_PIPE_RES_CREATE_FORMAT]),
+		    &create->bo_handle);
+	}
+	case DRM_IOCTL_VIRTGPU_RESOURCE_INFO:
+		return fake_virtio_gpu_resource_info(virtio, arg);
+	case DRM_IOCTL_VIRTGPU_MAP: {
+		struct drm_virtgpu_map *map = arg;
+		if (virtio->map_delay_us)
+			usleep(virtio->map_delay_us);
+
+		map->offset = (uint64_t)map->handle * FAKE_VIRTIO_RESOURCE_SIZE;
+		return 0;
+	}
+	case DRM_IOCTL_PRIME_HANDLE_TO_FD: {
+		struct drm_prime_handle *prime = arg;
+		if (!prime->handle || prime->handle > virtio->num_resources)
+			return -ENOENT;
+
+		prime->fd = fcntl(virtio->dmabufs[prime->handle - 1], F_DUPFD_CLOEXEC, 0);
+		return prime->fd < 0 ? -errno : 0;
+	}
+	case DRM_IOCTL_PRIME_FD_TO_HANDLE:
+		return fake_virtio_gpu_prime_fd_to_handle(virtio, arg);
+	case DRM_IOCTL_VIRTGPU_EXECBUFFER:
+		return fake_virtio_gpu_execbuffer(virtio, arg);
+	case DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST:
+	case DRM_IOCTL_VIRTGPU_TRANSFER_FROM_HOST:
+		if (virtio->transfer_delay_us)
+			usleep(virtio->transfer_delay_us);
+		return 0;
+	case DRM_IOCTL_VIRTGPU_WAIT:
+	case DRM_IOCTL_GEM_CLOSE:
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+int fake_virtio_gpu_open(struct fake_virtio_gpu *virtio)
+{
+	pthread_mutex_init(&virtio->lock, NULL);
+	virtio->dev.name = "virtio_gpu";
+	virtio->dev.ioctl = fake_virtio_gpu_ioctl;
+	virtio->dev.priv = virtio;
+
+	return fake_drm_open(&virtio->dev, (FAKE_VIRTIO_MAX_RESOURCES + 1) *
+					       (size_t)FAKE_VIRTIO_RESOURCE_SIZE);
+}
+
+void fake_virtio_gpu_close(struct fake_virtio_gpu *virtio)
+{
+	uint32_t i;
+
+	fake_virtio_gpu_signal(virtio);
+	for (i = 0; i < virtio->num_resources; i++)
+		close(virtio->dmabufs[i]);
+
+	fake_drm_close(&virtio->dev);
+	pthread_mutex_destroy(&virtio->lock);
+}
+
+void fake_virtio_gpu_signal(struct fake_virtio_gpu *virtio)
+{
+	uint32_t i;
+	char byte = 0;
+
+	pthread_mutex_lock(&virtio->lock);
+	for (i = 0; i < virtio->num_pending; i++) {
+		if (write(virtio->pending[i], &byte, 1) != 1 && errno != EPIPE)
+			perror("write");
+		close(virtio->pending[i]);
+	}
+	virtio->num_pending = 0;
+	pthread_mutex_unlock(&virtio->lock);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef FAKE_VIRTIO_GPU_H
+#define FAKE_VIRTIO_GPU_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fake_drm.h"
+
+#define FAKE_VIRTIO_RESOURCE_SIZE (1 << 20)
+#define FAKE_VIRTIO_MAX_RESOURCES 16
+#define FAKE_VIRTIO_MAX_FENCES 16
+
+enum fake_virtio_blob_layout {
+	/* RESOURCE_INFO reports the guest's layout, like kernels with extended resource info. */
+	FAKE_VIRTIO_LAYOUT_REPORTED,
+	/* RESOURCE_INFO reports a different stride. */
+	FAKE_VIRTIO_LAYOUT_DIFFERENT,
+	/* RESOURCE_INFO reports no planes and the blob's memory type, like upstream kernels. */
+	FAKE_VIRTIO_LAYOUT_UPSTREAM,
+};
+
+/*
+ * A virtio-gpu device with a virgl host that supports every format. Execbuffer out-fences are
+ * pipes that the host signals with fake_virtio_gpu_signal().
+ */
+struct fake_virtio_gpu {
+	struct fake_drm dev;
+	bool blobs;
+	enum fake_virtio_blob_layout blob_layout;
+	bool fail_execbuffer;
+	uint32_t execbuffer_handle;
+	/* Host round trips of mapping a resource and of transfers, for benchmarks. */
+	uint32_t map_delay_us;
+	uint32_t transfer_delay_us;
+
+	pthread_mutex_t lock;
+	uint32_t num_resources;
+	/* The resource's stride in the guest, and a memfd standing in for its dma-buf. */
+	uint32_t strides[FAKE_VIRTIO_MAX_RESOURCES];
+	int dmabufs[FAKE_VIRTIO_MAX_RESOURCES];
+	/* Write ends of the out-fences the host hasn't signalled yet. */
+	int pending[FAKE_VIRTIO_MAX_FENCES];
+	uint32_t num_pending;
+};
+
+int fake_virtio_gpu_open(struct fake_virtio_gpu *virtio);
+
+void fake_virtio_gpu_close(struct fake_virtio_gpu *virtio);
+
+/* The host completes everything that was submitted so far. */
+void fake_virtio_gpu_signal(struct fake_virtio_gpu *virtio);
+
+#endif
@@ -0,0 +1,340 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Runs i915's CPU detiling against a fake i915 device and checks every byte the buffer ends up
+ * with against a reference implementation of the X and Y tile layouts and bit 6 swizzling, with
+ * and without the legacy GEM_MMAP.
+ */
+
+#include <i915_drm.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "../drv_priv.h"
+#include "fake_i915.h"
+
+#define WIDTH 200
+#define HEIGHT 60
+
+struct test_context {
+	struct fake_i915 i915;
+	struct driver *drv;
+	int fds_before;
+};
+
+static int test_setup(struct test_context *ctx, uint32_t swizzle, bool no_legacy_mmap)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fds_before = fake_drm_count_fds();
+	ctx->i915.has_llc = 1;
+	ctx->i915.swizzle = swizzle;
+	ctx->i915.no_legacy_mmap = no_legacy_mmap;
+	CHECK(!fake_i915_open(&ctx->i915));
+
+	ctx->drv = drv_create(ctx->i915.dev.fd);
+	CHECK(ctx->drv);
+	CHECK(!drv_init(ctx->drv, 0));
+	return 1;
+}
+
+static int test_teardown(struct test_context *ctx)
+{
+	drv_destroy(ctx->drv);
+	fake_i915_close(&ctx->i915);
+
+	CHECK(fake_drm_count_fds() == ctx->fds_before);
+	return 1;
+}
+
+/*
+ * Where the GPU keeps byte x of row y of a plane, written from the PRMs independently of
+ * i915.c: X tiles are 512 bytes by 8 rows stored row by row, Y tiles are 128 bytes by 32 rows
+ * stored in 16 byte wide columns. Bit 6 of the address in the buffer is then XORed with bit 9,
+ * or with bits 9 and 10.
+ */
+static uint32_t ref_tiled_address(uint32_t tiling, uint32_t swizzle, uint32_t plane_offset,
+				  uint32_t stride, uint32_t x, uint32_t y)
+{
+	uint32_t tile_width = tiling == I915_TILING_X ? 512 : 128;
+	uint32_t tile_height = tiling == I915_TILING_X ? 8 : 32;
+	uint32_t tile = y / tile_height * (stride / tile_width) + x / tile_width;
+	uint32_t tx = x % tile_width, ty = y % tile_height;
+	uint32_t address, bit6;
+
+	if (tiling == I915_TILING_X)
+		address = ty * 512 + tx;
+	else
+		address = tx / 16 * 512 + ty * 16 + tx % 16;
+	address += plane_offset + tile * 4096;
+
+	bit6 = (address >> 6) & 1;
+	if (swizzle == I915_BIT_6_SWIZZLE_9 || swizzle == I915_BIT_6_SWIZZLE_9_10)
+		bit6 ^= (address >> 9) & 1;
+	if (swizzle == I915_BIT_6_SWIZZLE_9_10)
+		bit6 ^= (address >> 10) & 1;
+
+	return (address & ~64u) | bit6 << 6;
+}
+
+/* Differs between bytes 64 bytes or 4 rows apart, so that a missed swizzle shows. */
+static uint8_t pattern(size_t plane, uint32_t x, uint32_t y, uint32_t seed)
+{
+	return x * 7 + y * 13 + plane * 101 + seed * 37;
+}
+
+/* The bytes of a plane that a rect of pixels covers. */
+static void plane_span(struct bo *bo, size_t plane, const struct rectangle *rect, uint32_t *x0,
+		       uint32_t *x1, uint32_t *y0, uint32_t *y1)
+{
+	bool chroma = bo->meta.format == DRM_FORMAT_NV12 && plane == 1;
+	uint32_t cpp = bo->meta.format == DRM_FORMAT_NV12 ? plane + 1 : 4;
+	uint32_t sub = chroma ? 2 : 1;
+
+	*x0 = rect->x / sub * cpp;
+	*x1 = (rect->x + rect->width) / sub * cpp;
+	*y0 = rect->y / sub;
+	*y1 = (rect->y + rect->height) / sub;
+}
+
+static bool inside(uint32_t x, uint32_t y, uint32_t x0, uint32_t x1, uint32_t y0, uint32_t y1)
+{
+	return x >= x0 && x < x1 && y >= y0 && y < y1;
+}
+
+/*
+ * Fills the buffer through the reference layout, locks rect and checks that it reads the
+ * pattern, writes another one and checks that only the rect changed in the buffer.
+ */
+static int check_rect(struct test_context *ctx, struct bo *bo, const struct rectangle *rect)
+{
+	size_t plane;
+	uint8_t *memory, *addr, *linear;
+	uint32_t x, y, x0, x1, y0, y1, rows, stride, address;
+	struct mapping *mapping;
+	uint32_t swizzle = ctx->i915.swizzle;
+
+	memory = fake_i915_bo_memory(&ctx->i915, bo->handles[0].u32);
+	CHECK(memory != MAP_FAILED);
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		stride = bo->meta.strides[plane];
+		rows = bo->meta.sizes[plane] / stride;
+		for (y = 0; y < rows; y++)
+			for (x = 0; x < stride; x++)
+				memory[ref_tiled_address(bo->meta.tiling, swizzle, bo->meta.offsets[plane],
+							 stride, x, y)] = pattern(plane, x, y, 0);
+	}
+
+	addr = drv_bo_map(bo, rect, BO_MAP_READ_WRITE, &mapping, 0);
+	CHECK(addr != MAP_FAILED);
+	linear = addr - bo->meta.offsets[0];
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		stride = bo->meta.strides[plane];
+		plane_span(bo, plane, rect, &x0, &x1, &y0, &y1);
+		for (y = y0; y < y1; y++) {
+			for (x = x0; x < x1; x++) {
+				uint8_t *pixel = linear + bo->meta.offsets[plane] + y * stride + x;
+
+				CHECK(*pixel == pattern(plane, x, y, 0));
+				*pixel = pattern(plane, x, y, 1);
+			}
+		}
+	}
+
+	CHECK(!drv_bo_flush(bo, mapping));
+	CHECK(!drv_bo_unmap(bo, mapping));
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++) {
+		stride = bo->meta.strides[plane];
+		rows = bo->meta.sizes[plane] / stride;
+		plane_span(bo, plane, rect, &x0, &x1, &y0, &y1);
+		for (y = 0; y < rows; y++) {
+			for (x = 0; x < stride; x++) {
+				address = ref_tiled_address(bo->meta.tiling, swizzle,
+							    bo->meta.offsets[plane], stride, x, y);
+				CHECK(memory[address] ==
+				      pattern(plane, x, y, inside(x, y, x0, x1, y0, y1)));
+			}
+		}
+	}
+
+	munmap(memory, FAKE_I915_BO_SIZE);
+	return 1;
+}
+
+static int check_detile(uint32_t format, uint64_t modifier, uint32_t swizzle, bool no_legacy_mmap)
+{
+	struct bo *bo;
+	struct test_context ctx;
+	/* Starts and ends in the middle of tiles and of 64 byte blocks. */
+	struct rectangle rect = { 14, 6, 100, 40 };
+
+	CHECK(test_setup(&ctx, swizzle, no_legacy_mmap));
+
+	bo = drv_bo_create_with_modifiers(ctx.drv, WIDTH, HEIGHT, format, &modifier, 1);
+	CHECK(bo);
+	CHECK(bo->meta.tiling != I915_TILING_NONE);
+	CHECK(check_rect(&ctx, bo, &rect));
+
+	/*
+	 * GEM_MMAP was tried once and MMAP_OFFSET only used without it. The fake has no GTT, so
+	 * going through the aperture would have failed the map.
+	 */
+	CHECK(fake_drm_calls(&ctx.i915.dev, DRM_IOCTL_I915_GEM_MMAP) == 1);
+	CHECK(fake_drm_calls(&ctx.i915.dev, DRM_IOCTL_I915_GEM_MMAP_OFFSET) == no_legacy_mmap);
+	drv_bo_destroy(bo);
+
+	return test_teardown(&ctx);
+}
+
+static int check_swizzles(uint32_t format, uint64_t modifier)
+{
+	static const uint32_t swizzles[] = { I915_BIT_6_SWIZZLE_NONE, I915_BIT_6_SWIZZLE_9,
+					     I915_BIT_6_SWIZZLE_9_10 };
+	size_t i;
+
+	for (i = 0; i < sizeof(swizzles) / sizeof(swizzles[0]); i++) {
+		CHECK(check_detile(format, modifier, swizzles[i], false));
+		CHECK(check_detile(format, modifier, swizzles[i], true));
+	}
+
+	return 1;
+}
+
+static int test_x_tiled(void)
+{
+	return check_swizzles(DRM_FORMAT_ARGB8888, I915_FORMAT_MOD_X_TILED);
+}
+
+static int test_y_tiled(void)
+{
+	return check_swizzles(DRM_FORMAT_ARGB8888, I915_FORMAT_MOD_Y_TILED);
+}
+
+static int test_y_tiled_nv12(void)
+{
+	return check_swizzles(DRM_FORMAT_NV12, I915_FORMAT_MOD_Y_TILED);
+}
+
+/* The swizzle follows the address in the buffer, also for planes that don't start on a page. */
+static int test_unaligned_plane(void)
+{
+	struct bo *bo, *imported;
+	struct test_context ctx;
+	struct drv_import_fd_data data;
+	uint64_t modifier = I915_FORMAT_MOD_Y_TILED;
+	struct rectangle rect = { 6, 3, 50, 20 };
+
+	CHECK(test_setup(&ctx, I915_BIT_6_SWIZZLE_9_10, false));
+
+	bo = drv_bo_create_with_modifiers(ctx.drv, 128, 64, DRM_FORMAT_ARGB8888, &modifier, 1);
+	CHECK(bo);
+
+	memset(&data, 0, sizeof(data));
+	data.fds[0] = drv_bo_get_plane_fd(bo, 0);
+	data.strides[0] = bo->meta.strides[0];
+	/* Has bits 6 and 9 set. */
+	data.offsets[0] = 0x2240;
+	data.format_modifiers[0] = modifier;
+	data.width = 128;
+	data.height = 32;
+	data.format = DRM_FORMAT_ARGB8888;
+	data.has_layout = true;
+	data.tiling = I915_TILING_Y;
+	data.sizes[0] = data.strides[0] * 32;
+	data.total_size = bo->meta.total_size;
+
+	imported = drv_bo_import(ctx.drv, &data);
+	close(data.fds[0]);
+	CHECK(imported);
+	CHECK(check_rect(&ctx, imported, &rect));
+	drv_bo_destroy(imported);
+
+	drv_bo_destroy(bo);
+	return test_teardown(&ctx);
+}
+
+/*
+ * A write-only lock gets a shadow another buffer just used, writes half its rect and flushes. The
+ * other half must come out cleared rather than with the other buffer's bytes, and the rest of the
+ * buffer untouched.
+ */
+static int test_write_only(void)
+{
+	uint8_t *addr, *memory;
+	uint32_t x, y, address, stride, rows;
+	struct bo *used, *bo;
+	struct mapping *mapping;
+	struct test_context ctx;
+	uint64_t modifier = I915_FORMAT_MOD_Y_TILED;
+	struct rectangle whole = { 0, 0, 128, 64 };
+	struct rectangle rect = { 16, 8, 64, 32 };
+
+	CHECK(test_setup(&ctx, I915_BIT_6_SWIZZLE_9, false));
+
+	used = drv_bo_create_with_modifiers(ctx.drv, 128, 64, DRM_FORMAT_ARGB8888, &modifier, 1);
+	CHECK(used);
+	addr = drv_bo_map(used, &whole, BO_MAP_READ_WRITE, &mapping, 0);
+	CHECK(addr != MAP_FAILED);
+	memset(addr, 0xaa, used->meta.total_size);
+	CHECK(!drv_bo_unmap(used, mapping));
+
+	bo = drv_bo_create_with_modifiers(ctx.drv, 128, 64, DRM_FORMAT_ARGB8888, &modifier, 1);
+	CHECK(bo);
+	stride = bo->meta.strides[0];
+	rows = bo->meta.sizes[0] / stride;
+	memory = fake_i915_bo_memory(&ctx.i915, bo->handles[0].u32);
+	CHECK(memory != MAP_FAILED);
+	for (y = 0; y < rows; y++)
+		for (x = 0; x < stride; x++)
+			memory[ref_tiled_address(I915_TILING_Y, ctx.i915.swizzle, 0, stride, x, y)] =
+			    pattern(0, x, y, 0);
+
+	addr = drv_bo_map(bo, &rect, BO_MAP_WRITE, &mapping, 0);
+	CHECK(addr != MAP_FAILED);
+	for (y = rect.y; y < rect.y + rect.height / 2; y++)
+		for (x = rect.x * 4; x < (rect.x + rect.width) * 4; x++)
+			addr[y * stride + x] = pattern(0, x, y, 1);
+	CHECK(!drv_bo_flush(bo, mapping));
+	CHECK(!drv_bo_unmap(bo, mapping));
+
+	for (y = 0; y < rows; y++) {
+		for (x = 0; x < stride; x++) {
+			uint8_t expected = pattern(0, x, y, 0);
+
+			if (inside(x, y, rect.x * 4, (rect.x + rect.width) * 4, rect.y,
+				   rect.y + rect.height))
+				expected = y < rect.y + rect.height / 2 ? pattern(0, x, y, 1) : 0;
+
+			address = ref_tiled_address(I915_TILING_Y, ctx.i915.swizzle, 0, stride, x, y);
+			CHECK(memory[address] == expected);
+		}
+	}
+
+	munmap(memory, FAKE_I915_BO_SIZE);
+	drv_bo_destroy(bo);
+	drv_bo_destroy(used);
+	return test_teardown(&ctx);
+}
+
+static const struct fake_drm_testcase tests[] = {
+	{ "x_tiled", test_x_tiled },
+	{ "y_tiled", test_y_tiled },
+	{ "y_tiled_nv12", test_y_tiled_nv12 },
+	{ "unaligned_plane", test_unaligned_plane },
+	{ "write_only", test_write_only },
+};
+
+int main(int argc, char *argv[])
+{
+	return fake_drm_run_tests(tests, sizeof(tests) / sizeof(tests[0]), argc, argv);
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Measures how long unlocking a linear buffer written by the CPU takes on an i915 part without
+ * an LLC, for rects and buffers of several sizes. Each flush is compared with flushing the whole
+ * mapping with CLFLUSH, like i915_bo_flush() did before it flushed by rect. Runs against a fake
+ * i915 device, so the lines flushed are in cached memory rather than in a GPU buffer.
+ *
+ * Usage: i915_flush_bench [iterations]
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <xf86drm.h>
+
+#include "../drv_priv.h"
+#include "../util.h"
+#include "fake_i915.h"
+
+#define CACHELINE_SIZE 64
+
+static const uint32_t buffer_sizes[][2] = { { 256, 256 }, { 512, 512 }, { 1024, 768 } };
+static const uint32_t rect_sizes[] = { 16, 64, 256, 1024 };
+
+static double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static void dirty_rect(struct bo *bo, uint8_t *addr, const struct rectangle *rect)
+{
+	uint32_t y;
+	uint32_t stride = drv_bo_get_plane_stride(bo, 0);
+
+	for (y = rect->y; y < rect->y + rect->height; y++)
+		memset(addr + y * stride + rect->x * 4, y, rect->width * 4);
+}
+
+static void clflush_mapping(struct mapping *mapping)
+{
+	uint8_t *p = mapping->vma->addr;
+	uint8_t *end = p + mapping->vma->length;
+
+	__builtin_ia32_mfence();
+	for (; p < end; p += CACHELINE_SIZE)
+		__builtin_ia32_clflush(p);
+}
+
+/* Returns the average time a flush took, or a negative value on failure. */
+static double flush_us(struct bo *bo, const struct rectangle *rect, uint32_t iterations,
+		       bool whole_mapping)
+{
+	uint32_t i;
+	uint8_t *addr;
+	double start, total = 0;
+	struct mapping *mapping;
+
+	addr = drv_bo_map(bo, rect, BO_MAP_WRITE, &mapping, 0);
+	if (addr == MAP_FAILED)
+		return -1;
+
+	for (i = 0; i < iterations; i++) {
+		dirty_rect(bo, addr, rect);
+
+		start = now_us();
+		if (whole_mapping)
+			clflush_mapping(mapping);
+		else if (drv_bo_flush(bo, mapping))
+			return -1;
+		total += now_us() - start;
+	}
+
+	drv_bo_unmap(bo, mapping);
+	return total / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t i, j;
+	int ret = EXIT_FAILURE;
+	double rect_us, whole_us;
+	struct bo *bo;
+	struct driver *drv;
+	struct fake_i915 i915;
+	uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 100;
+
+	memset(&i915, 0, sizeof(i915));
+	if (fake_i915_open(&i915))
+		return EXIT_FAILURE;
+
+	drv = drv_create(i915.dev.fd);
+	if (!drv)
+		goto out;
+	if (drv_init(drv, 0))
+		goto destroy_drv;
+
+	printf("%u iterations, flush by rect / whole mapping with CLFLUSH\n", iterations);
+	for (i = 0; i < ARRAY_SIZE(buffer_sizes); i++) {
+		uint32_t width = buffer_sizes[i][0];
+		uint32_t height = buffer_sizes[i][1];
+
+		bo = drv_bo_create(drv, width, height, DRM_FORMAT_ARGB8888,
+				   BO_USE_TEXTURE | BO_USE_SW_WRITE_OFTEN);
+		if (!bo)
+			goto destroy_drv;
+
+		for (j = 0; j < ARRAY_SIZE(rect_sizes) + 1; j++) {
+			struct rectangle rect = { 0, 0, width, height };
+
+			if (j < ARRAY_SIZE(rect_sizes)) {
+				if (rect_sizes[j] >= MIN(width, height))
+					continue;
+				rect.width = rect.height = rect_sizes[j];
+				rect.x = (width - rect.width) / 2;
+				rect.y = (height - rect.height) / 2;
+			}
+
+			rect_us = flush_us(bo, &rect, iterations, false);
+			whole_us = flush_us(bo, &rect, iterations, true);
+			if (rect_us < 0 || whole_us < 0) {
+				drv_bo_destroy(bo);
+				goto destroy_drv;
+			}
+
+			printf("%4ux%-4u buffer, %4ux%-4u rect: %9.1f us / %9.1f us\n", width, height,
+			       rect.width, rect.height, rect_us, whole_us);
+		}
+
+		drv_bo_destroy(bo);
+	}
+
+	ret = EXIT_SUCCESS;
+destroy_drv:
+	drv_destroy(drv);
+out:
+	fake_i915_close(&i915);
+	return ret;
+}
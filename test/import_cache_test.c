@@ -0,0 +1,156 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Imports i915 buffers again while they're still open, and checks what the import cache lets
+ * skip and what it mustn't.
+ */
+
+#include <i915_drm.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "../drv_priv.h"
+#include "../helpers.h"
+#include "fake_i915.h"
+
+struct test_context {
+	struct fake_i915 i915;
+	struct driver *drv;
+	int fds_before;
+};
+
+static int test_setup(struct test_context *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fds_before = fake_drm_count_fds();
+	ctx->i915.has_llc = 1;
+	CHECK(!fake_i915_open(&ctx->i915));
+
+	ctx->drv = drv_create(ctx->i915.dev.fd);
+	CHECK(ctx->drv);
+	CHECK(!drv_init(ctx->drv, 0));
+	return 1;
+}
+
+static int test_teardown(struct test_context *ctx)
+{
+	drv_destroy(ctx->drv);
+	fake_i915_close(&ctx->i915);
+
+	CHECK(fake_drm_count_fds() == ctx->fds_before);
+	return 1;
+}
+
+static uint32_t calls(struct test_context *ctx, unsigned long request)
+{
+	return fake_drm_calls(&ctx->i915.dev, request);
+}
+
+/* Imports the buffer without its layout, like a client that only passes the dma-buf along. */
+static struct bo *import_bo(struct test_context *ctx, struct bo *bo)
+{
+	struct bo *imported;
+	struct drv_import_fd_data data;
+
+	memset(&data, 0, sizeof(data));
+	data.fds[0] = drv_bo_get_plane_fd(bo, 0);
+	data.strides[0] = drv_bo_get_plane_stride(bo, 0);
+	data.offsets[0] = drv_bo_get_plane_offset(bo, 0);
+	data.width = drv_bo_get_width(bo);
+	data.height = drv_bo_get_height(bo);
+	data.format = drv_bo_get_format(bo);
+	data.use_flags = bo->meta.use_flags;
+
+	imported = drv_bo_import(ctx->drv, &data);
+	close(data.fds[0]);
+	return imported;
+}
+
+/* A handle looked up without a bo to hold it isn't handed out again. */
+static int test_probe_expires(void)
+{
+	int fd;
+	uint32_t handle;
+	struct bo *bo, *imported;
+	struct test_context ctx;
+
+	CHECK(test_setup(&ctx));
+
+	/* A dma-buf from elsewhere, which the device imports as a new handle. */
+	bo = drv_bo_create(ctx.drv, 64, 64, DRM_FORMAT_ARGB8888, BO_USE_TEXTURE);
+	CHECK(bo);
+	fd = drv_bo_get_plane_fd(bo, 0);
+	CHECK(fd >= 0);
+	drv_bo_destroy(bo);
+
+	CHECK(!drv_get_import_handle(ctx.drv, fd, &handle));
+	CHECK(calls(&ctx, DRM_IOCTL_PRIME_FD_TO_HANDLE) == 1);
+
+	/* Whoever probed may have closed the handle, so the import asks the kernel again. */
+	CHECK(!drv_get_import_handle(ctx.drv, fd, &handle));
+	CHECK(calls(&ctx, DRM_IOCTL_PRIME_FD_TO_HANDLE) == 2);
+
+	close(fd);
+
+	/* Handles that a bo holds are reused, like that of a buffer this process exported. */
+	bo = drv_bo_create(ctx.drv, 64, 64, DRM_FORMAT_ARGB8888, BO_USE_TEXTURE);
+	CHECK(bo);
+	imported = import_bo(&ctx, bo);
+	CHECK(imported);
+	CHECK(calls(&ctx, DRM_IOCTL_PRIME_FD_TO_HANDLE) == 2);
+	CHECK(imported->handles[0].u32 == bo->handles[0].u32);
+
+	drv_bo_destroy(imported);
+	drv_bo_destroy(bo);
+	return test_teardown(&ctx);
+}
+
+/* The tiling of a buffer that's still open is asked for again on every import. */
+static int test_reimport_rechecks_tiling(void)
+{
+	uint32_t tiling;
+	struct bo *bo, *first, *second;
+	struct test_context ctx;
+
+	CHECK(test_setup(&ctx));
+
+	bo = drv_bo_create(ctx.drv, 64, 64, DRM_FORMAT_ARGB8888, BO_USE_TEXTURE);
+	CHECK(bo);
+	tiling = bo->meta.tiling == I915_TILING_X ? I915_TILING_Y : I915_TILING_X;
+
+	first = import_bo(&ctx, bo);
+	CHECK(first);
+	CHECK(first->meta.tiling == bo->meta.tiling);
+	CHECK(calls(&ctx, DRM_IOCTL_I915_GEM_GET_TILING) == 1);
+
+	/* Another client retiles the buffer while this process still has it open. */
+	ctx.i915.tiling[bo->handles[0].u32 - 1] = tiling;
+
+	second = import_bo(&ctx, bo);
+	CHECK(second);
+	CHECK(calls(&ctx, DRM_IOCTL_PRIME_FD_TO_HANDLE) == 0);
+	CHECK(calls(&ctx, DRM_IOCTL_I915_GEM_GET_TILING) == 2);
+	CHECK(second->meta.tiling == tiling);
+
+	drv_bo_destroy(second);
+	drv_bo_destroy(first);
+	drv_bo_destroy(bo);
+	return test_teardown(&ctx);
+}
+
+static const struct fake_drm_testcase tests[] = {
+	{ "probe_expires", test_probe_expires },
+	{ "reimport_rechecks_tiling", test_reimport_rechecks_tiling },
+};
+
+int main(int argc, char *argv[])
+{
+	return fake_drm_run_tests(tests, sizeof(tests) / sizeof(tests[0]), argc, argv);
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Measures how long locking a buffer with a pending acquire fence takes, when the lock waits for
+ * the fence before mapping and when it maps while the fence is pending like
+ * cros_gralloc_driver::lock(). Runs against a fake virtio-gpu device whose host round trips take
+ * as long as given.
+ *
+ * Usage: lock_latency_bench [fence_us [map_us [transfer_us [iterations]]]]
+ */
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "../drv.h"
+#include "fake_virtio_gpu.h"
+
+struct fence {
+	int fds[2];
+	uint32_t delay_us;
+	pthread_t signaler;
+};
+
+static void *fence_signal_later(void *arg)
+{
+	char byte = 0;
+	struct fence *fence = arg;
+
+	usleep(fence->delay_us);
+	if (write(fence->fds[1], &byte, 1) != 1)
+		perror("write");
+	return NULL;
+}
+
+static int fence_start(struct fence *fence, uint32_t delay_us)
+{
+	fence->delay_us = delay_us;
+	if (pipe(fence->fds))
+		return -1;
+
+	return pthread_create(&fence->signaler, NULL, fence_signal_later, fence);
+}
+
+static void fence_wait(struct fence *fence)
+{
+	struct pollfd fds = { .fd = fence->fds[0], .events = POLLIN };
+
+	poll(&fds, 1, -1);
+	pthread_join(fence->signaler, NULL);
+	close(fence->fds[0]);
+	close(fence->fds[1]);
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Returns the average time until the mapping could be read, or a negative value on failure. */
+static double lock_latency_ms(struct bo *bo, uint32_t fence_us, uint32_t iterations,
+			      bool overlap)
+{
+	uint32_t i;
+	void *addr;
+	double start, total = 0;
+	struct fence fence;
+	struct mapping *mapping;
+	struct rectangle rect = { 0, 0, drv_bo_get_width(bo), drv_bo_get_height(bo) };
+
+	for (i = 0; i < iterations; i++) {
+		if (fence_start(&fence, fence_us))
+			return -1;
+
+		start = now_ms();
+		if (overlap) {
+			addr = drv_bo_map_unsynced(bo, &rect, BO_MAP_READ, &mapping, 0);
+			fence_wait(&fence);
+			if (addr != MAP_FAILED && drv_bo_invalidate(bo, mapping))
+				return -1;
+		} else {
+			fence_wait(&fence);
+			addr = drv_bo_map(bo, &rect, BO_MAP_READ, &mapping, 0);
+		}
+		total += now_ms() - start;
+
+		if (addr == MAP_FAILED)
+			return -1;
+
+		drv_bo_unmap(bo, mapping);
+	}
+
+	return total / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = EXIT_FAILURE;
+	double serial, overlapped;
+	struct bo *bo;
+	struct driver *drv;
+	struct fake_virtio_gpu virtio;
+	uint32_t fence_us = argc > 1 ? strtoul(argv[1], NULL, 0) : 8000;
+	uint32_t map_us = argc > 2 ? strtoul(argv[2], NULL, 0) : 5000;
+	uint32_t transfer_us = argc > 3 ? strtoul(argv[3], NULL, 0) : 1000;
+	uint32_t iterations = argc > 4 ? strtoul(argv[4], NULL, 0) : 20;
+
+	memset(&virtio, 0, sizeof(virtio));
+	virtio.map_delay_us = map_us;
+	virtio.transfer_delay_us = transfer_us;
+	if (fake_virtio_gpu_open(&virtio))
+		return EXIT_FAILURE;
+
+	drv = drv_create(virtio.dev.fd);
+	if (!drv)
+		goto out;
+	if (drv_init(drv, 0))
+		goto destroy_drv;
+
+	/* Rendered to by the host, so that syncing the mapping transfers from it. */
+	bo = drv_bo_create(drv, 256, 256, DRM_FORMAT_ARGB8888,
+			   BO_USE_RENDERING | BO_USE_TEXTURE | BO_USE_SW_READ_OFTEN);
+	if (!bo)
+		goto destroy_drv;
+
+	serial = lock_latency_ms(bo, fence_us, iterations, false);
+	overlapped = lock_latency_ms(bo, fence_us, iterations, true);
+	if (serial >= 0 && overlapped >= 0) {
+		printf("fence %u us, map %u us, transfer %u us, %u iterations\n", fence_us, map_us,
+		       transfer_us, iterations);
+		printf("map after the fence:  %.2f ms\n", serial);
+		printf("map during the fence: %.2f ms\n", overlapped);
+		ret = EXIT_SUCCESS;
+	}
+
+	drv_bo_destroy(bo);
+destroy_drv:
+	drv_destroy(drv);
+out:
+	fake_virtio_gpu_close(&virtio);
+	return ret;
+}
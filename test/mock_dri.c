@@ -0,0 +1,268 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * A DRI driver with just enough of the interface for dri.c's maps. Mapping an image copies the
+ * mapped rect into a staging buffer and then waits in proportion to its area, like a driver
+ * blitting on the GPU; unmapping a write map copies the staging buffer back. Using a context
+ * from two threads at once is counted, since real contexts aren't thread-safe.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define GL_GLEXT_LEGACY
+#include "GL/internal/dri_interface.h"
+#undef GL_GLEXT_LEGACY
+
+#include "../util.h"
+
+struct __DRIscreenRec {
+	int fd;
+};
+
+struct __DRIcontextRec {
+	bool busy;
+};
+
+struct __DRIimageRec {
+	int width;
+	int height;
+	int cpp;
+	uint8_t *data;
+};
+
+struct mock_dri_map {
+	uint8_t *staging;
+	int x, y, width, height;
+	unsigned int flags;
+};
+
+static uint32_t mock_dri_blit_us;
+static uint32_t mock_dri_overlaps;
+
+/* How long the blit of a map of the whole image takes. */
+PUBLIC void mock_dri_set_blit_us(uint32_t blit_us)
+{
+	mock_dri_blit_us = blit_us;
+}
+
+/* How often a context was used by two threads at once. */
+PUBLIC uint32_t mock_dri_context_overlaps(void)
+{
+	return __atomic_load_n(&mock_dri_overlaps, __ATOMIC_RELAXED);
+}
+
+static void mock_dri_context_enter(__DRIcontext *context)
+{
+	if (__atomic_exchange_n(&context->busy, true, __ATOMIC_ACQUIRE))
+		__atomic_add_fetch(&mock_dri_overlaps, 1, __ATOMIC_RELAXED);
+}
+
+static void mock_dri_context_leave(__DRIcontext *context)
+{
+	__atomic_store_n(&context->busy, false, __ATOMIC_RELEASE);
+}
+
+static void mock_dri_copy(__DRIimage *image, struct mock_dri_map *map, bool to_image)
+{
+	int row;
+	size_t row_size = (size_t)map->width * image->cpp;
+
+	for (row = 0; row < map->height; row++) {
+		uint8_t *pixels = image->data + ((size_t)(map->y + row) * image->width + map->x) *
+						    image->cpp;
+		uint8_t *staging = map->staging + row * row_size;
+
+		if (to_image)
+			memcpy(pixels, staging, row_size);
+		else
+			memcpy(staging, pixels, row_size);
+	}
+}
+
+static void *mock_dri_map_image(__DRIcontext *context, __DRIimage *image, int x0, int y0,
+				int width, int height, unsigned int flags, int *stride, void **data)
+{
+	struct mock_dri_map *map = calloc(1, sizeof(*map));
+
+	if (!map)
+		return NULL;
+
+	map->staging = malloc((size_t)width * height * image->cpp);
+	if (!map->staging) {
+		free(map);
+		return NULL;
+	}
+
+	map->x = x0;
+	map->y = y0;
+	map->width = width;
+	map->height = height;
+	map->flags = flags;
+
+	mock_dri_context_enter(context);
+	if (flags & __DRI_IMAGE_TRANSFER_READ)
+		mock_dri_copy(image, map, false);
+	if (mock_dri_blit_us)
+		usleep((uint64_t)mock_dri_blit_us * width * height / (image->width * image->height));
+	mock_dri_context_leave(context);
+
+	*stride = width * image->cpp;
+	*data = map;
+	return map->staging;
+}
+
+static void mock_dri_unmap_image(__DRIcontext *context, __DRIimage *image, void *data)
+{
+	struct mock_dri_map *map = data;
+
+	mock_dri_context_enter(context);
+	if (map->flags & __DRI_IMAGE_TRANSFER_WRITE)
+		mock_dri_copy(image, map, true);
+	mock_dri_context_leave(context);
+
+	free(map->staging);
+	free(map);
+}
+
+static __DRIimage *mock_dri_create_image(__DRIscreen *screen, int width, int height, int format,
+					 unsigned int use, void *loaderPrivate)
+{
+	__DRIimage *image = calloc(1, sizeof(*image));
+
+	if (!image)
+		return NULL;
+
+	image->width = width;
+	image->height = height;
+	image->cpp = format == __DRI_IMAGE_FORMAT_R8 ? 1 : format == __DRI_IMAGE_FORMAT_RGB565 ||
+							    format == __DRI_IMAGE_FORMAT_GR88
+							? 2
+							: 4;
+	image->data = calloc((size_t)width * height, image->cpp);
+	if (!image->data) {
+		free(image);
+		return NULL;
+	}
+
+	return image;
+}
+
+static void mock_dri_destroy_image(__DRIimage *image)
+{
+	free(image->data);
+	free(image);
+}
+
+static GLboolean mock_dri_query_image(__DRIimage *image, int attrib, int *value)
+{
+	switch (attrib) {
+	case __DRI_IMAGE_ATTRIB_STRIDE:
+		*value = image->width * image->cpp;
+		return 1;
+	case __DRI_IMAGE_ATTRIB_OFFSET:
+		*value = 0;
+		return 1;
+	case __DRI_IMAGE_ATTRIB_NUM_PLANES:
+		*value = 1;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void mock_dri_flush_with_flags(__DRIcontext *ctx, __DRIdrawable *drawable, unsigned flags,
+				      enum __DRI2throttleReason throttle_reason)
+{
+	mock_dri_context_enter(ctx);
+	mock_dri_context_leave(ctx);
+}
+
+static const __DRIimageExtension mock_dri_image_extension = {
+	.base = { __DRI_IMAGE, 12 },
+	.createImage = mock_dri_create_image,
+	.destroyImage = mock_dri_destroy_image,
+	.queryImage = mock_dri_query_image,
+	.mapImage = mock_dri_map_image,
+	.unmapImage = mock_dri_unmap_image,
+};
+
+static const __DRI2flushExtension mock_dri_flush_extension = {
+	.base = { __DRI2_FLUSH, 4 },
+	.flush_with_flags = mock_dri_flush_with_flags,
+};
+
+static const __DRIextension *mock_dri_screen_extensions[] = {
+	&mock_dri_image_extension.base,
+	&mock_dri_flush_extension.base,
+	NULL,
+};
+
+static const __DRIconfig *mock_dri_configs[] = { NULL, NULL };
+
+static __DRIscreen *mock_dri_create_screen(int screen, int fd,
+					   const __DRIextension **loader_extensions,
+					   const __DRIextension **driver_extensions,
+					   const __DRIconfig ***driver_configs, void *loaderPrivate)
+{
+	__DRIscreen *dri_screen = calloc(1, sizeof(*dri_screen));
+
+	if (!dri_screen)
+		return NULL;
+
+	dri_screen->fd = fd;
+	*driver_configs = mock_dri_configs;
+	return dri_screen;
+}
+
+static __DRIcontext *mock_dri_create_context(__DRIscreen *screen, const __DRIconfig *config,
+					     __DRIcontext *shared, void *loaderPrivate)
+{
+	return calloc(1, sizeof(__DRIcontext));
+}
+
+static const __DRIextension **mock_dri_get_extensions(__DRIscreen *screen)
+{
+	return mock_dri_screen_extensions;
+}
+
+static void mock_dri_destroy_screen(__DRIscreen *screen)
+{
+	free(screen);
+}
+
+static void mock_dri_destroy_context(__DRIcontext *context)
+{
+	free(context);
+}
+
+static const __DRIcoreExtension mock_dri_core_extension = {
+	.base = { __DRI_CORE, 2 },
+	.getExtensions = mock_dri_get_extensions,
+	.destroyScreen = mock_dri_destroy_screen,
+	.destroyContext = mock_dri_destroy_context,
+};
+
+static const __DRIdri2Extension mock_dri_dri2_extension = {
+	.base = { __DRI_DRI2, 4 },
+	.createNewContext = mock_dri_create_context,
+	.createNewScreen2 = mock_dri_create_screen,
+};
+
+static const __DRIextension *mock_dri_extensions[] = {
+	&mock_dri_core_extension.base,
+	&mock_dri_dri2_extension.base,
+	NULL,
+};
+
+PUBLIC const __DRIextension **__driDriverGetExtensions_mock(void)
+{
+	return mock_dri_extensions;
+}
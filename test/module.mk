@@ -0,0 +1,74 @@
+# Copyright 2026 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+
+include common.mk
+
+# Host tests that run backends against fake devices, see fake_drm.h. Only the backends that are
+# built get tested.
+
+CC_BINARY(test/dmabuf_sync_test): test/dmabuf_sync_test.o test/fake_drm.o $(C_OBJECTS)
+tests: TEST(CC_BINARY(test/dmabuf_sync_test))
+
+ifdef DRV_VIRTIO_GPU
+CC_BINARY(test/virtio_gpu_blob_test): test/virtio_gpu_blob_test.o test/fake_virtio_gpu.o \
+	test/fake_drm.o $(C_OBJECTS)
+tests: TEST(CC_BINARY(test/virtio_gpu_blob_test))
+
+CC_BINARY(test/virtio_gpu_fence_test): test/virtio_gpu_fence_test.o test/fake_virtio_gpu.o \
+	test/fake_drm.o $(C_OBJECTS)
+tests: TEST(CC_BINARY(test/virtio_gpu_fence_test))
+endif
+
+ifdef DRV_I915
+CC_BINARY(test/i915_detile_test): test/i915_detile_test.o test/fake_i915.o test/fake_drm.o \
+	$(C_OBJECTS)
+tests: TEST(CC_BINARY(test/i915_detile_test))
+
+CC_BINARY(test/import_cache_test): test/import_cache_test.o test/fake_i915.o test/fake_drm.o \
+	$(C_OBJECTS)
+tests: TEST(CC_BINARY(test/import_cache_test))
+endif
+
+ifdef DRV_TEGRA
+CC_BINARY(test/tegra_detile_test): test/tegra_detile_test.o test/fake_drm.o $(C_OBJECTS)
+tests: TEST(CC_BINARY(test/tegra_detile_test))
+endif
+
+ifdef DRV_VC4
+CC_BINARY(test/vc4_detile_test): test/vc4_detile_test.o test/fake_drm.o $(C_OBJECTS)
+tests: TEST(CC_BINARY(test/vc4_detile_test))
+endif
+
+ifdef DRV_VIRTIO_GPU
+ifdef DRV_I915
+CC_BINARY(test/multi_device_test): test/multi_device_test.o test/fake_virtio_gpu.o \
+	test/fake_i915.o test/fake_drm.o $(C_OBJECTS)
+tests: TEST(CC_BINARY(test/multi_device_test))
+endif
+endif
+
+# Benchmarks print their results rather than checking them, so they're only built.
+CC_BINARY(test/shadow_sync_bench): test/shadow_sync_bench.o $(C_OBJECTS)
+benchmarks: CC_BINARY(test/shadow_sync_bench)
+
+ifdef DRV_VIRTIO_GPU
+CC_BINARY(test/lock_latency_bench): test/lock_latency_bench.o test/fake_virtio_gpu.o \
+	test/fake_drm.o $(C_OBJECTS)
+benchmarks: CC_BINARY(test/lock_latency_bench)
+endif
+
+ifdef DRV_I915
+CC_BINARY(test/i915_flush_bench): test/i915_flush_bench.o test/fake_i915.o test/fake_drm.o \
+	$(C_OBJECTS)
+benchmarks: CC_BINARY(test/i915_flush_bench)
+endif
+
+ifdef DRV_AMDGPU
+CC_LIBRARY(test/mock_dri.so): test/mock_dri.o
+
+CC_BINARY(test/dri_lock_bench): test/dri_lock_bench.o test/fake_drm.o $(C_OBJECTS)
+benchmarks: CC_BINARY(test/dri_lock_bench) CC_LIBRARY(test/mock_dri.so)
+endif
+
+.PHONY: benchmarks
@@ -0,0 +1,171 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Shares buffers between a fake virtio-gpu display device and a fake i915 render device, like
+ * gralloc with kmsro, and checks that each device imports a dma-buf once however often it's
+ * imported, and that releasing it on one device leaves the other alone.
+ */
+
+#include <i915_drm.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "../drv_priv.h"
+#include "fake_i915.h"
+#include "fake_virtio_gpu.h"
+
+struct test_context {
+	struct fake_virtio_gpu virtio;
+	struct fake_i915 i915;
+	struct driver *kms;
+	struct driver *render;
+	int fds_before;
+};
+
+static int test_setup(struct test_context *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fds_before = fake_drm_count_fds();
+	ctx->virtio.blobs = true;
+	CHECK(!fake_virtio_gpu_open(&ctx->virtio));
+	ctx->i915.has_llc = 1;
+	CHECK(!fake_i915_open(&ctx->i915));
+
+	ctx->kms = drv_create(ctx->virtio.dev.fd);
+	CHECK(ctx->kms);
+	CHECK(!drv_init(ctx->kms, TWO_GPU_IGPU_VIRTIO));
+	ctx->render = drv_create(ctx->i915.dev.fd);
+	CHECK(ctx->render);
+	CHECK(!drv_init(ctx->render, TWO_GPU_IGPU_VIRTIO));
+	return 1;
+}
+
+static int test_teardown(struct test_context *ctx)
+{
+	drv_destroy(ctx->render);
+	drv_destroy(ctx->kms);
+	fake_i915_close(&ctx->i915);
+	fake_virtio_gpu_close(&ctx->virtio);
+
+	CHECK(fake_drm_count_fds() == ctx->fds_before);
+	return 1;
+}
+
+/* Imports the buffer on drv through a dma-buf fd of its own, like gralloc's retain(). */
+static struct bo *import_bo(struct driver *drv, struct bo *bo)
+{
+	struct bo *imported;
+	struct drv_import_fd_data data;
+
+	memset(&data, 0, sizeof(data));
+	data.fds[0] = drv_bo_get_plane_fd(bo, 0);
+	data.strides[0] = drv_bo_get_plane_stride(bo, 0);
+	data.offsets[0] = drv_bo_get_plane_offset(bo, 0);
+	data.width = drv_bo_get_width(bo);
+	data.height = drv_bo_get_height(bo);
+	data.format = drv_bo_get_format(bo);
+	data.use_flags = bo->meta.use_flags;
+	data.has_layout = true;
+	data.tiling = I915_TILING_NONE;
+	data.sizes[0] = drv_bo_get_plane_size(bo, 0);
+	data.total_size = bo->meta.total_size;
+
+	imported = drv_bo_import(drv, &data);
+	close(data.fds[0]);
+	return imported;
+}
+
+static uint32_t render_imports(struct test_context *ctx)
+{
+	return fake_drm_calls(&ctx->i915.dev, DRM_IOCTL_PRIME_FD_TO_HANDLE);
+}
+
+static uint32_t render_closes(struct test_context *ctx)
+{
+	return fake_drm_calls(&ctx->i915.dev, DRM_IOCTL_GEM_CLOSE);
+}
+
+/* A scanout buffer rendered to: one import on the render device however often it's retained. */
+static int test_import_once_per_device(void)
+{
+	struct bo *bo, *first, *second, *own;
+	struct test_context ctx;
+
+	CHECK(test_setup(&ctx));
+
+	bo = drv_bo_create(ctx.kms, 64, 64, DRM_FORMAT_ARGB8888,
+			   BO_USE_SCANOUT | BO_USE_TEXTURE | BO_USE_SW_READ_OFTEN);
+	CHECK(bo);
+
+	first = import_bo(ctx.render, bo);
+	CHECK(first);
+	second = import_bo(ctx.render, bo);
+	CHECK(second);
+	CHECK(render_imports(&ctx) == 1);
+	CHECK(first->handles[0].u32 == second->handles[0].u32);
+
+	/* The display device knows its own buffer's dma-buf from the export. */
+	own = import_bo(ctx.kms, bo);
+	CHECK(own);
+	CHECK(fake_drm_calls(&ctx.virtio.dev, DRM_IOCTL_PRIME_FD_TO_HANDLE) == 0);
+	CHECK(own->handles[0].u32 == bo->handles[0].u32);
+
+	drv_bo_destroy(own);
+	drv_bo_destroy(second);
+	drv_bo_destroy(first);
+	drv_bo_destroy(bo);
+	return test_teardown(&ctx);
+}
+
+/*
+ * Releasing a buffer on one device keeps it open on the other, and the last release on a device
+ * closes its handle there and forgets the import, so that importing again asks the kernel.
+ */
+static int test_release_per_device(void)
+{
+	struct bo *bo, *first, *second, *again;
+	struct test_context ctx;
+
+	CHECK(test_setup(&ctx));
+
+	bo = drv_bo_create(ctx.kms, 64, 64, DRM_FORMAT_ARGB8888,
+			   BO_USE_SCANOUT | BO_USE_TEXTURE | BO_USE_SW_READ_OFTEN);
+	CHECK(bo);
+	first = import_bo(ctx.render, bo);
+	CHECK(first);
+	second = import_bo(ctx.render, bo);
+	CHECK(second);
+
+	drv_bo_destroy(first);
+	CHECK(render_closes(&ctx) == 0);
+	drv_bo_destroy(second);
+	CHECK(render_closes(&ctx) == 1);
+	CHECK(fake_drm_calls(&ctx.virtio.dev, DRM_IOCTL_GEM_CLOSE) == 0);
+
+	again = import_bo(ctx.render, bo);
+	CHECK(again);
+	CHECK(render_imports(&ctx) == 2);
+	drv_bo_destroy(again);
+
+	/* The display device's buffer outlived everything the render device did with it. */
+	drv_bo_destroy(bo);
+	CHECK(fake_drm_calls(&ctx.virtio.dev, DRM_IOCTL_GEM_CLOSE) == 1);
+	return test_teardown(&ctx);
+}
+
+static const struct fake_drm_testcase tests[] = {
+	{ "import_once_per_device", test_import_once_per_device },
+	{ "release_per_device", test_release_per_device },
+};
+
+int main(int argc, char *argv[])
+{
+	return fake_drm_run_tests(tests, sizeof(tests) / sizeof(tests[0]), argc, argv);
+}
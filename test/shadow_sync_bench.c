@@ -0,0 +1,122 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Measures how long the shadow copies of a RenderScript lock and unlock take on rockchip and
+ * mediatek, for buffers of typical RenderScript sizes. A lock and unlock cycle used to copy the
+ * whole buffer into the shadow and back; it now copies the locked rect, only in the directions
+ * the lock needs. Both buffers are plain cached memory, so this measures how much is copied
+ * rather than the cost of reading uncached memory.
+ *
+ * Usage: shadow_sync_bench [iterations]
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../drv_priv.h"
+#include "../helpers.h"
+#include "../util.h"
+
+struct buffer_size {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	const char *name;
+};
+
+static const struct buffer_size buffer_sizes[] = {
+	{ 640, 480, DRM_FORMAT_ABGR8888, "RGBA" },
+	{ 1280, 720, DRM_FORMAT_ABGR8888, "RGBA" },
+	{ 1920, 1080, DRM_FORMAT_ABGR8888, "RGBA" },
+	{ 1920, 1080, DRM_FORMAT_NV12, "NV12" },
+};
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+ * Returns the average time of a lock and unlock cycle of rect. Cycles that copy the whole buffer
+ * both ways are timed when whole_buffer is set.
+ */
+static double sync_ms(struct bo *bo, uint8_t *shadow, uint8_t *gem,
+		      const struct rectangle *rect, bool read, bool write, bool whole_buffer,
+		      uint32_t iterations)
+{
+	uint32_t i;
+	double start = now_ms();
+
+	for (i = 0; i < iterations; i++) {
+		if (whole_buffer) {
+			memcpy(shadow, gem, bo->meta.total_size);
+			memcpy(gem, shadow, bo->meta.total_size);
+			continue;
+		}
+
+		if (read)
+			drv_bo_sync_shadow_rect(bo, rect, shadow, gem, false);
+		else
+			drv_bo_clear_shadow_rect(bo, rect, shadow);
+		if (write)
+			drv_bo_sync_shadow_rect(bo, rect, shadow, gem, true);
+	}
+
+	return (now_ms() - start) / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t i;
+	uint8_t *shadow, *gem;
+	double before, read_only, centre;
+	uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 200;
+
+	printf("%u iterations, ms per lock and unlock\n", iterations);
+	printf("%-16s %10s %16s %18s\n", "buffer", "before", "read-only full",
+	       "rw, centre quarter");
+
+	for (i = 0; i < ARRAY_SIZE(buffer_sizes); i++) {
+		struct bo bo;
+		const struct buffer_size *size = &buffer_sizes[i];
+		struct rectangle full = { 0, 0, size->width, size->height };
+		struct rectangle quarter = { size->width / 4, size->height / 4, size->width / 2,
+					     size->height / 2 };
+		char name[32];
+
+		memset(&bo, 0, sizeof(bo));
+		bo.meta.width = size->width;
+		bo.meta.height = size->height;
+		bo.meta.format = size->format;
+		bo.meta.num_planes = drv_num_planes_from_format(size->format);
+		if (drv_bo_from_format(&bo, drv_stride_from_format(size->format, size->width, 0),
+				       size->height, size->format))
+			return EXIT_FAILURE;
+
+		shadow = calloc(1, bo.meta.total_size);
+		gem = calloc(1, bo.meta.total_size);
+		if (!shadow || !gem)
+			return EXIT_FAILURE;
+
+		before = sync_ms(&bo, shadow, gem, &full, true, true, true, iterations);
+		read_only = sync_ms(&bo, shadow, gem, &full, true, false, false, iterations);
+		centre = sync_ms(&bo, shadow, gem, &quarter, true, true, false, iterations);
+
+		snprintf(name, sizeof(name), "%ux%u %s", size->width, size->height, size->name);
+		printf("%-16s %10.3f %16.3f %18.3f\n", name, before, read_only, centre);
+
+		free(gem);
+		free(shadow);
+	}
+
+	return EXIT_SUCCESS;
+}
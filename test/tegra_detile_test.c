@@ -0,0 +1,298 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Runs tegra's CPU detiling against a fake tegra device over randomized buffer sizes and rects,
+ * and checks every byte that locking reads and that unlocking writes back against the per-pixel
+ * conversion tegra.c used before it converted whole GOBs.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <tegra_drm.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "../drv_priv.h"
+#include "../util.h"
+#include "fake_drm.h"
+
+#define FAKE_TEGRA_BO_SIZE (1 << 20)
+#define FAKE_TEGRA_HANDLE 1
+#define NUM_CASES 300
+#define SW_USE_FLAGS (BO_USE_TEXTURE | BO_USE_SW_READ_RARELY | BO_USE_SW_WRITE_RARELY)
+
+/* A tegra device with room for one buffer, which every import also gets. */
+struct fake_tegra {
+	struct fake_drm dev;
+	uint32_t tiling_mode;
+};
+
+static int fake_tegra_ioctl(struct fake_drm *dev, unsigned long request, void *arg)
+{
+	struct fake_tegra *tegra = dev->priv;
+
+	switch (request) {
+	case DRM_IOCTL_TEGRA_GEM_CREATE: {
+		struct drm_tegra_gem_create *create = arg;
+
+		if (create->size > FAKE_TEGRA_BO_SIZE)
+			return -ENOMEM;
+
+		create->handle = FAKE_TEGRA_HANDLE;
+		tegra->tiling_mode = DRM_TEGRA_GEM_TILING_MODE_PITCH;
+		return 0;
+	}
+	case DRM_IOCTL_TEGRA_GEM_SET_TILING: {
+		struct drm_tegra_gem_set_tiling *set_tiling = arg;
+
+		tegra->tiling_mode = set_tiling->mode;
+		return 0;
+	}
+	case DRM_IOCTL_TEGRA_GEM_GET_TILING: {
+		struct drm_tegra_gem_get_tiling *get_tiling = arg;
+
+		get_tiling->mode = tegra->tiling_mode;
+		return 0;
+	}
+	case DRM_IOCTL_TEGRA_GEM_MMAP: {
+		struct drm_tegra_gem_mmap *map = arg;
+
+		map->offset = (uint64_t)map->handle * FAKE_TEGRA_BO_SIZE;
+		return 0;
+	}
+	case DRM_IOCTL_PRIME_FD_TO_HANDLE: {
+		struct drm_prime_handle *prime = arg;
+
+		prime->handle = FAKE_TEGRA_HANDLE;
+		return 0;
+	}
+	case DRM_IOCTL_GEM_CLOSE:
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+struct test_context {
+	struct fake_tegra tegra;
+	struct driver *drv;
+	uint8_t *memory;
+	int fds_before;
+};
+
+static int test_setup(struct test_context *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fds_before = fake_drm_count_fds();
+
+	ctx->tegra.dev.name = "tegra";
+	ctx->tegra.dev.ioctl = fake_tegra_ioctl;
+	ctx->tegra.dev.priv = &ctx->tegra;
+	CHECK(!fake_drm_open(&ctx->tegra.dev, 2 * FAKE_TEGRA_BO_SIZE));
+
+	ctx->memory = mmap(0, FAKE_TEGRA_BO_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   ctx->tegra.dev.fd, FAKE_TEGRA_HANDLE * FAKE_TEGRA_BO_SIZE);
+	CHECK(ctx->memory != MAP_FAILED);
+
+	ctx->drv = drv_create(ctx->tegra.dev.fd);
+	CHECK(ctx->drv);
+	CHECK(!drv_init(ctx->drv, 0));
+	return 1;
+}
+
+static int test_teardown(struct test_context *ctx)
+{
+	drv_destroy(ctx->drv);
+	munmap(ctx->memory, FAKE_TEGRA_BO_SIZE);
+	fake_drm_close(&ctx->tegra.dev);
+
+	CHECK(fake_drm_count_fds() == ctx->fds_before);
+	return 1;
+}
+
+static bool inside(const struct rectangle *rect, uint32_t x, uint32_t y)
+{
+	return x >= rect->x && x < rect->x + rect->width && y >= rect->y &&
+	       y < rect->y + rect->height;
+}
+
+/*
+ * The conversion of 4-byte pixels that tegra.c did before it worked by GOB, limited to the
+ * pixels inside rect. Blocks of gob_height rows of one GOB are stored one after the other, row
+ * of blocks by row of blocks, and pixel k of a block comes from the bits of k.
+ */
+static void ref_transfer(struct bo *bo, uint8_t *tiled, uint8_t *linear,
+			 const struct rectangle *rect, bool to_tiled)
+{
+	uint32_t i, j, k, x, y;
+	uint8_t *pixel, *tiled_last = tiled + bo->meta.total_size;
+	uint32_t gob_height = 8 << 4;
+	uint32_t gob_count_x = DIV_ROUND_UP(bo->meta.strides[0], 64);
+
+	while (gob_height > 8 && gob_height >= 2 * bo->meta.height)
+		gob_height /= 2;
+
+	for (j = 0; j < DIV_ROUND_UP(bo->meta.height, gob_height); j++) {
+		for (i = 0; i < gob_count_x; i++) {
+			pixel = tiled + (j * gob_count_x + i) * gob_height * 64;
+			for (k = 0; k < gob_height * 16 && pixel < tiled_last; k++, pixel += 4) {
+				x = i * 16 + (((k >> 3) & 8) | ((k >> 1) & 4) | (k & 3));
+				y = j * gob_height + ((k >> 7 << 3) | ((k >> 3) & 6) | ((k >> 2) & 1));
+				if (x >= bo->meta.width || y >= bo->meta.height || !inside(rect, x, y))
+					continue;
+
+				if (to_tiled)
+					memcpy(pixel, linear + y * bo->meta.strides[0] + x * 4, 4);
+				else
+					memcpy(linear + y * bo->meta.strides[0] + x * 4, pixel, 4);
+			}
+		}
+	}
+}
+
+static void fill_random(uint8_t *data, size_t size, unsigned int *seed)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		data[i] = rand_r(seed);
+}
+
+static uint32_t random_between(uint32_t min, uint32_t max, unsigned int *seed)
+{
+	return min + rand_r(seed) % (max - min + 1);
+}
+
+/*
+ * A blocklinear buffer imported from elsewhere that is shorter than the padded blocklinear
+ * layout, though it still holds every row of the linear layout.
+ */
+static struct bo *import_short_bo(struct test_context *ctx, uint32_t width, uint32_t height,
+				  unsigned int *seed)
+{
+	int fd;
+	struct bo *bo;
+	uint32_t stride = ALIGN(width * 4, 64);
+	struct drv_import_fd_data data;
+
+	fd = memfd_create("fake-dmabuf", MFD_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, ALIGN(stride * height + random_between(0, 16384, seed), 16))) {
+		close(fd);
+		return NULL;
+	}
+
+	memset(&data, 0, sizeof(data));
+	data.fds[0] = fd;
+	data.strides[0] = stride;
+	data.width = width;
+	data.height = height;
+	data.format = DRM_FORMAT_ARGB8888;
+	data.use_flags = SW_USE_FLAGS;
+	ctx->tegra.tiling_mode = DRM_TEGRA_GEM_TILING_MODE_BLOCK;
+
+	bo = drv_bo_import(ctx->drv, &data);
+	close(fd);
+	return bo;
+}
+
+/*
+ * Locks a random rect of a random buffer for reading and checks the rect against the reference,
+ * then locks another one for writing and checks that unlocking wrote back exactly what the
+ * reference would have.
+ */
+static int check_random_case(unsigned int *seed)
+{
+	uint8_t *addr, *expected, *shadow;
+	uint32_t y, row, width, height;
+	struct bo *bo;
+	struct mapping *mapping;
+	struct rectangle rect;
+	struct test_context ctx;
+	bool short_bo = !random_between(0, 3, seed);
+
+	width = random_between(1, 300, seed);
+	height = random_between(1, random_between(0, 1, seed) ? 300 : 40, seed);
+
+	CHECK(test_setup(&ctx));
+	if (short_bo)
+		bo = import_short_bo(&ctx, width, height, seed);
+	else
+		bo = drv_bo_create(ctx.drv, width, height, DRM_FORMAT_ARGB8888, SW_USE_FLAGS);
+	CHECK(bo);
+	CHECK((bo->meta.tiling & 0xff) == 0xdb);
+	CHECK(bo->meta.total_size <= FAKE_TEGRA_BO_SIZE);
+
+	expected = malloc(bo->meta.total_size);
+	shadow = malloc(bo->meta.total_size);
+	CHECK(expected && shadow);
+	fill_random(ctx.memory, bo->meta.total_size, seed);
+
+	rect.x = random_between(0, width - 1, seed);
+	rect.y = random_between(0, height - 1, seed);
+	rect.width = random_between(1, width - rect.x, seed);
+	rect.height = random_between(1, height - rect.y, seed);
+
+	addr = drv_bo_map(bo, &rect, BO_MAP_READ, &mapping, 0);
+	CHECK(addr != MAP_FAILED);
+	memcpy(expected, addr, bo->meta.total_size);
+	ref_transfer(bo, ctx.memory, expected, &rect, false);
+	for (y = rect.y; y < rect.y + rect.height; y++) {
+		row = y * bo->meta.strides[0] + rect.x * 4;
+		CHECK(!memcmp(addr + row, expected + row, rect.width * 4));
+	}
+	CHECK(!drv_bo_unmap(bo, mapping));
+
+	rect.x = random_between(0, width - 1, seed);
+	rect.y = random_between(0, height - 1, seed);
+	rect.width = random_between(1, width - rect.x, seed);
+	rect.height = random_between(1, height - rect.y, seed);
+
+	addr = drv_bo_map(bo, &rect, BO_MAP_WRITE, &mapping, 0);
+	CHECK(addr != MAP_FAILED);
+	fill_random(addr, bo->meta.total_size, seed);
+	memcpy(shadow, addr, bo->meta.total_size);
+	memcpy(expected, ctx.memory, bo->meta.total_size);
+	CHECK(!drv_bo_flush(bo, mapping));
+	ref_transfer(bo, expected, shadow, &rect, true);
+	CHECK(!memcmp(ctx.memory, expected, bo->meta.total_size));
+	CHECK(!drv_bo_unmap(bo, mapping));
+
+	free(shadow);
+	free(expected);
+	drv_bo_destroy(bo);
+	return test_teardown(&ctx);
+}
+
+static int test_random_rects(void)
+{
+	uint32_t i;
+	unsigned int seed = 1;
+
+	for (i = 0; i < NUM_CASES; i++) {
+		if (!check_random_case(&seed)) {
+			fprintf(stderr, "case %u failed\n", i);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static const struct fake_drm_testcase tests[] = {
+	{ "random_rects", test_random_rects },
+};
+
+int main(int argc, char *argv[])
+{
+	return fake_drm_run_tests(tests, sizeof(tests) / sizeof(tests[0]), argc, argv);
+}
@@ -0,0 +1,268 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Runs vc4's CPU detiling of T-tiled buffers against a fake vc4 device over randomized buffer
+ * sizes, formats and rects, and checks every byte that locking reads and that unlocking writes
+ * back against a reference implementation of the T layout.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vc4_drm.h>
+#include <xf86drm.h>
+
+#include "../drv_priv.h"
+#include "fake_drm.h"
+
+#define FAKE_VC4_BO_SIZE (1 << 20)
+#define FAKE_VC4_HANDLE 1
+#define NUM_CASES 300
+#define SW_USE_FLAGS (BO_USE_TEXTURE | BO_USE_SW_READ_RARELY | BO_USE_SW_WRITE_RARELY)
+
+/* A vc4 device with room for one buffer. */
+struct fake_vc4 {
+	struct fake_drm dev;
+	uint64_t modifier;
+};
+
+static int fake_vc4_ioctl(struct fake_drm *dev, unsigned long request, void *arg)
+{
+	struct fake_vc4 *vc4 = dev->priv;
+
+	switch (request) {
+	case DRM_IOCTL_VC4_CREATE_BO: {
+		struct drm_vc4_create_bo *create = arg;
+
+		if (create->size > FAKE_VC4_BO_SIZE)
+			return -ENOMEM;
+
+		create->handle = FAKE_VC4_HANDLE;
+		vc4->modifier = DRM_FORMAT_MOD_LINEAR;
+		return 0;
+	}
+	case DRM_IOCTL_VC4_SET_TILING: {
+		struct drm_vc4_set_tiling *set_tiling = arg;
+
+		vc4->modifier = set_tiling->modifier;
+		return 0;
+	}
+	case DRM_IOCTL_VC4_GET_TILING: {
+		struct drm_vc4_get_tiling *get_tiling = arg;
+
+		get_tiling->modifier = vc4->modifier;
+		return 0;
+	}
+	case DRM_IOCTL_VC4_MMAP_BO: {
+		struct drm_vc4_mmap_bo *map = arg;
+
+		map->offset = (uint64_t)map->handle * FAKE_VC4_BO_SIZE;
+		return 0;
+	}
+	case DRM_IOCTL_GEM_CLOSE:
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+struct test_context {
+	struct fake_vc4 vc4;
+	struct driver *drv;
+	uint8_t *memory;
+	int fds_before;
+};
+
+static int test_setup(struct test_context *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fds_before = fake_drm_count_fds();
+
+	ctx->vc4.dev.name = "vc4";
+	ctx->vc4.dev.ioctl = fake_vc4_ioctl;
+	ctx->vc4.dev.priv = &ctx->vc4;
+	CHECK(!fake_drm_open(&ctx->vc4.dev, 2 * FAKE_VC4_BO_SIZE));
+
+	ctx->memory = mmap(0, FAKE_VC4_BO_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+			   ctx->vc4.dev.fd, FAKE_VC4_HANDLE * FAKE_VC4_BO_SIZE);
+	CHECK(ctx->memory != MAP_FAILED);
+
+	ctx->drv = drv_create(ctx->vc4.dev.fd);
+	CHECK(ctx->drv);
+	CHECK(!drv_init(ctx->drv, 0));
+	return 1;
+}
+
+static int test_teardown(struct test_context *ctx)
+{
+	drv_destroy(ctx->drv);
+	munmap(ctx->memory, FAKE_VC4_BO_SIZE);
+	fake_drm_close(&ctx->vc4.dev);
+
+	CHECK(fake_drm_count_fds() == ctx->fds_before);
+	return 1;
+}
+
+/*
+ * Where the GPU keeps byte x of row y, written from the layout drm_fourcc.h describes
+ * independently of vc4.c. 64 byte utiles hold 4 rows of pixels, or 8 at 8bpp. 1KB subtiles are
+ * 4x4 utiles in raster order. 4KB tiles are 2x2 subtiles, stored bottom left, top left, top
+ * right, bottom right on even tile rows and top right, bottom right, bottom left, top left on
+ * odd ones, with the bottom at the start of memory. Even tile rows go left to right, odd ones
+ * right to left.
+ */
+static uint32_t ref_tiled_address(uint32_t stride, uint32_t cpp, uint32_t x, uint32_t y)
+{
+	/* Subtile positions (x, y) in memory order, y = 0 at the bottom. */
+	static const uint32_t even_order[4][2] = { { 0, 0 }, { 0, 1 }, { 1, 1 }, { 1, 0 } };
+	static const uint32_t odd_order[4][2] = { { 1, 1 }, { 1, 0 }, { 0, 0 }, { 0, 1 } };
+	uint32_t utile_width = cpp == 1 ? 8 : 16, utile_height = 64 / utile_width;
+	uint32_t tiles_per_row = stride / (8 * utile_width);
+	uint32_t ux = x / utile_width, uy = y / utile_height;
+	uint32_t tile_x = ux / 8, tile_y = uy / 8;
+	uint32_t sx = ux % 8 / 4, sy = uy % 8 / 4;
+	const uint32_t(*order)[2] = tile_y % 2 ? odd_order : even_order;
+	uint32_t subtile;
+
+	for (subtile = 0; order[subtile][0] != sx || order[subtile][1] != sy; subtile++)
+		;
+
+	if (tile_y % 2)
+		tile_x = tiles_per_row - 1 - tile_x;
+
+	return (tile_y * tiles_per_row + tile_x) * 4096 + subtile * 1024 +
+	       (uy % 4 * 4 + ux % 4) * 64 + y % utile_height * utile_width + x % utile_width;
+}
+
+/* Copies the bytes of the pixels in rect between the T-tiled memory and a linear copy. */
+static void ref_transfer(struct bo *bo, uint8_t *tiled, uint8_t *linear,
+			 const struct rectangle *rect, bool to_tiled)
+{
+	uint32_t x, y, address;
+	uint32_t stride = bo->meta.strides[0];
+	uint32_t cpp = drv_bytes_per_pixel_from_format(bo->meta.format, 0);
+
+	for (y = rect->y; y < rect->y + rect->height; y++) {
+		for (x = rect->x * cpp; x < (rect->x + rect->width) * cpp; x++) {
+			address = ref_tiled_address(stride, cpp, x, y);
+			if (to_tiled)
+				tiled[address] = linear[y * stride + x];
+			else
+				linear[y * stride + x] = tiled[address];
+		}
+	}
+}
+
+static void fill_random(uint8_t *data, size_t size, unsigned int *seed)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		data[i] = rand_r(seed);
+}
+
+static uint32_t random_between(uint32_t min, uint32_t max, unsigned int *seed)
+{
+	return min + rand_r(seed) % (max - min + 1);
+}
+
+static void random_rect(struct rectangle *rect, uint32_t width, uint32_t height,
+			unsigned int *seed)
+{
+	rect->x = random_between(0, width - 1, seed);
+	rect->y = random_between(0, height - 1, seed);
+	rect->width = random_between(1, width - rect->x, seed);
+	rect->height = random_between(1, height - rect->y, seed);
+}
+
+/*
+ * Locks a random rect of a random T-tiled buffer for reading and checks the rect against the
+ * reference, then locks another one for writing and checks that unlocking wrote back exactly
+ * the bytes of that rect.
+ */
+static int check_random_case(unsigned int *seed)
+{
+	uint8_t *addr, *expected, *shadow;
+	uint32_t y, row, cpp, width, height, format;
+	struct bo *bo;
+	struct mapping *mapping;
+	struct rectangle rect;
+	struct test_context ctx;
+
+	/* Anything up to 4 utiles wide or high would be LT-tiled, which vc4.c keeps linear. */
+	format = random_between(0, 1, seed) ? DRM_FORMAT_ARGB8888 : DRM_FORMAT_RGB565;
+	cpp = drv_bytes_per_pixel_from_format(format, 0);
+	width = random_between(64 / cpp + 1, 300, seed);
+	height = random_between(17, 300, seed);
+
+	CHECK(test_setup(&ctx));
+	bo = drv_bo_create(ctx.drv, width, height, format, SW_USE_FLAGS);
+	CHECK(bo);
+	CHECK(bo->meta.format_modifiers[0] == DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED);
+	CHECK(ctx.vc4.modifier == DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED);
+	CHECK(bo->meta.total_size <= FAKE_VC4_BO_SIZE);
+
+	expected = malloc(bo->meta.total_size);
+	shadow = malloc(bo->meta.total_size);
+	CHECK(expected && shadow);
+	fill_random(ctx.memory, bo->meta.total_size, seed);
+
+	random_rect(&rect, width, height, seed);
+	addr = drv_bo_map(bo, &rect, BO_MAP_READ, &mapping, 0);
+	CHECK(addr != MAP_FAILED);
+	memcpy(expected, addr, bo->meta.total_size);
+	ref_transfer(bo, ctx.memory, expected, &rect, false);
+	for (y = rect.y; y < rect.y + rect.height; y++) {
+		row = y * bo->meta.strides[0] + rect.x * cpp;
+		CHECK(!memcmp(addr + row, expected + row, rect.width * cpp));
+	}
+	CHECK(!drv_bo_unmap(bo, mapping));
+
+	random_rect(&rect, width, height, seed);
+	addr = drv_bo_map(bo, &rect, BO_MAP_WRITE, &mapping, 0);
+	CHECK(addr != MAP_FAILED);
+	fill_random(addr, bo->meta.total_size, seed);
+	memcpy(shadow, addr, bo->meta.total_size);
+	memcpy(expected, ctx.memory, bo->meta.total_size);
+	CHECK(!drv_bo_flush(bo, mapping));
+	ref_transfer(bo, expected, shadow, &rect, true);
+	CHECK(!memcmp(ctx.memory, expected, bo->meta.total_size));
+	CHECK(!drv_bo_unmap(bo, mapping));
+
+	free(shadow);
+	free(expected);
+	drv_bo_destroy(bo);
+	return test_teardown(&ctx);
+}
+
+static int test_random_rects(void)
+{
+	uint32_t i;
+	unsigned int seed = 1;
+
+	for (i = 0; i < NUM_CASES; i++) {
+		if (!check_random_case(&seed)) {
+			fprintf(stderr, "case %u failed\n", i);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static const struct fake_drm_testcase tests[] = {
+	{ "random_rects", test_random_rects },
+};
+
+int main(int argc, char *argv[])
+{
+	return fake_drm_run_tests(tests, sizeof(tests) / sizeof(tests[0]), argc, argv);
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Runs virtio_gpu's mappable blobs against a fake virtio-gpu device, with the layouts that
+ * different kernels report for them.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "../drv_priv.h"
+#include "../virtgpu_drm.h"
+#include "fake_virtio_gpu.h"
+
+#define SW_USE_FLAGS (BO_USE_TEXTURE | BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN)
+
+struct test_context {
+	struct fake_virtio_gpu virtio;
+	struct driver *drv;
+	int fds_before;
+};
+
+static int test_setup(struct test_context *ctx, enum fake_virtio_blob_layout blob_layout)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fds_before = fake_drm_count_fds();
+	ctx->virtio.blobs = true;
+	ctx->virtio.blob_layout = blob_layout;
+	CHECK(!fake_virtio_gpu_open(&ctx->virtio));
+
+	ctx->drv = drv_create(ctx->virtio.dev.fd);
+	CHECK(ctx->drv);
+	CHECK(!drv_init(ctx->drv, 0));
+	return 1;
+}
+
+static int test_teardown(struct test_context *ctx)
+{
+	drv_destroy(ctx->drv);
+	fake_virtio_gpu_close(&ctx->virtio);
+
+	CHECK(fake_drm_count_fds() == ctx->fds_before);
+	return 1;
+}
+
+static uint32_t calls(struct test_context *ctx, unsigned long request)
+{
+	return fake_drm_calls(&ctx->virtio.dev, request);
+}
+
+/* Writes to the whole buffer and returns how many transfers its flush took. */
+static int transfers_on_flush(struct test_context *ctx, struct bo *bo)
+{
+	void *addr;
+	uint32_t before;
+	struct mapping *mapping;
+	struct rectangle rect = { 0, 0, drv_bo_get_width(bo), drv_bo_get_height(bo) };
+
+	addr = drv_bo_map(bo, &rect, BO_MAP_READ_WRITE, &mapping, 0);
+	if (addr == MAP_FAILED)
+		return -1;
+
+	memset(addr, 0x5a, drv_bo_get_plane_size(bo, 0));
+	before = calls(ctx, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST);
+	if (drv_bo_flush(bo, mapping))
+		return -1;
+
+	drv_bo_unmap(bo, mapping);
+	return calls(ctx, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST) - before;
+}
+
+/* Imports the buffer like gralloc does, with or without the layout it was allocated with. */
+static struct bo *import_bo(struct driver *drv, struct bo *bo, bool has_layout)
+{
+	struct bo *imported;
+	struct drv_import_fd_data data;
+
+	memset(&data, 0, sizeof(data));
+	data.fds[0] = drv_bo_get_plane_fd(bo, 0);
+	data.strides[0] = drv_bo_get_plane_stride(bo, 0);
+	data.offsets[0] = drv_bo_get_plane_offset(bo, 0);
+	data.width = drv_bo_get_width(bo);
+	data.height = drv_bo_get_height(bo);
+	data.format = drv_bo_get_format(bo);
+	data.use_flags = bo->meta.use_flags;
+	if (has_layout) {
+		data.has_layout = true;
+		data.tiling = bo->meta.tiling;
+		data.blob_flags = bo->meta.blob_flags;
+		data.sizes[0] = drv_bo_get_plane_size(bo, 0);
+		data.total_size = bo->meta.total_size;
+	}
+
+	imported = drv_bo_import(drv, &data);
+	close(data.fds[0]);
+	return imported;
+}
+
+static int test_reported_layout(void)
+{
+	struct bo *bo;
+	struct test_context ctx;
+
+	CHECK(test_setup(&ctx, FAKE_VIRTIO_LAYOUT_REPORTED));
+
+	bo = drv_bo_create(ctx.drv, 64, 64, DRM_FORMAT_ARGB8888, SW_USE_FLAGS);
+	CHECK(bo);
+	CHECK(calls(&ctx, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB) == 1);
+	CHECK(calls(&ctx, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE) == 0);
+	CHECK(bo->meta.blob_flags & VIRTGPU_BLOB_FLAG_USE_MAPPABLE);
+
+	/* The guest writes straight into the host's memory. */
+	CHECK(transfers_on_flush(&ctx, bo) == 0);
+
+	drv_bo_destroy(bo);
+	return test_teardown(&ctx);
+}
+
+static int test_different_layout(void)
+{
+	struct bo *bo;
+	struct test_context ctx;
+
+	CHECK(test_setup(&ctx, FAKE_VIRTIO_LAYOUT_DIFFERENT));
+
+	bo = drv_bo_create(ctx.drv, 64, 64, DRM_FORMAT_ARGB8888, SW_USE_FLAGS);
+	CHECK(bo);
+	CHECK(calls(&ctx, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB) == 1);
+	CHECK(calls(&ctx, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE) == 1);
+	CHECK(!bo->meta.blob_flags);
+	CHECK(transfers_on_flush(&ctx, bo) == 1);
+
+	drv_bo_destroy(bo);
+	return test_teardown(&ctx);
+}
+
+static int test_upstream_layout(void)
+{
+	struct bo *bo, *row;
+	struct test_context ctx;
+
+	CHECK(test_setup(&ctx, FAKE_VIRTIO_LAYOUT_UPSTREAM));
+
+	/* The host's strides are unknown, so only the first buffer of several rows tries. */
+	bo = drv_bo_create(ctx.drv, 64, 64, DRM_FORMAT_ARGB8888, SW_USE_FLAGS);
+	CHECK(bo);
+	CHECK(calls(&ctx, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB) == 1);
+	CHECK(calls(&ctx, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE) == 1);
+	CHECK(!bo->meta.blob_flags);
+	drv_bo_destroy(bo);
+
+	/* A single row has the same layout everywhere. */
+	row = drv_bo_create(ctx.drv, 4096, 1, DRM_FORMAT_R8, SW_USE_FLAGS);
+	CHECK(row);
+	CHECK(calls(&ctx, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB) == 2);
+	CHECK(calls(&ctx, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE) == 1);
+	CHECK(row->meta.blob_flags);
+	CHECK(transfers_on_flush(&ctx, row) == 0);
+	drv_bo_destroy(row);
+
+	bo = drv_bo_create(ctx.drv, 64, 64, DRM_FORMAT_ARGB8888, SW_USE_FLAGS);
+	CHECK(bo);
+	CHECK(calls(&ctx, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB) == 2);
+	CHECK(calls(&ctx, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE) == 2);
+	drv_bo_destroy(bo);
+
+	return test_teardown(&ctx);
+}
+
+static int test_import_with_layout(void)
+{
+	struct bo *bo, *imported;
+	struct driver *other;
+	struct test_context ctx;
+
+	CHECK(test_setup(&ctx, FAKE_VIRTIO_LAYOUT_REPORTED));
+
+	bo = drv_bo_create(ctx.drv, 64, 64, DRM_FORMAT_ARGB8888, SW_USE_FLAGS);
+	CHECK(bo);
+
+	/* Another process only knows what the gralloc handle carries. */
+	other = drv_create(ctx.virtio.dev.fd);
+	CHECK(other);
+	CHECK(!drv_init(other, 0));
+
+	imported = import_bo(other, bo, true);
+	CHECK(imported);
+	CHECK(imported->meta.blob_flags == bo->meta.blob_flags);
+	CHECK(transfers_on_flush(&ctx, imported) == 0);
+	drv_bo_destroy(imported);
+
+	/* Without it, the blob is treated like a classic resource. */
+	imported = import_bo(other, bo, false);
+	CHECK(imported);
+	CHECK(!imported->meta.blob_flags);
+	CHECK(transfers_on_flush(&ctx, imported) == 1);
+	drv_bo_destroy(imported);
+
+	drv_destroy(other);
+	drv_bo_destroy(bo);
+	return test_teardown(&ctx);
+}
+
+static int test_import_in_process(void)
+{
+	struct bo *bo, *imported;
+	struct test_context ctx;
+
+	CHECK(test_setup(&ctx, FAKE_VIRTIO_LAYOUT_REPORTED));
+
+	bo = drv_bo_create(ctx.drv, 64, 64, DRM_FORMAT_ARGB8888, SW_USE_FLAGS);
+	CHECK(bo);
+
+	/* Like gbm, which doesn't pass the layout. The allocation left it with the dma-buf. */
+	imported = import_bo(ctx.drv, bo, false);
+	CHECK(imported);
+	CHECK(imported->meta.blob_flags == bo->meta.blob_flags);
+	CHECK(transfers_on_flush(&ctx, imported) == 0);
+	drv_bo_destroy(imported);
+
+	drv_bo_destroy(bo);
+	return test_teardown(&ctx);
+}
+
+static const struct fake_drm_testcase tests[] = {
+	{ "reported_layout", test_reported_layout },
+	{ "different_layout", test_different_layout },
+	{ "upstream_layout", test_upstream_layout },
+	{ "import_with_layout", test_import_with_layout },
+	{ "import_in_process", test_import_in_process },
+};
+
+int main(int argc, char *argv[])
+{
+	return fake_drm_run_tests(tests, sizeof(tests) / sizeof(tests[0]), argc, argv);
+}
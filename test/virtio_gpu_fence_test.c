@@ -0,0 +1,240 @@
+/*
+ * Copyright 2026 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Runs virtio_gpu's fenced flushes against a fake virtio-gpu device.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include "../drv.h"
+#include "../virtgpu_drm.h"
+#include "fake_virtio_gpu.h"
+
+#define HOST_DELAY_MS 2
+
+static void *host_signal_later(void *arg)
+{
+	usleep(HOST_DELAY_MS * 1000);
+	fake_virtio_gpu_signal(arg);
+	return NULL;
+}
+
+static bool fence_signaled(int fence)
+{
+	struct pollfd fds = { .fd = fence, .events = POLLIN };
+	return poll(&fds, 1, 0) == 1;
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+struct test_context {
+	struct fake_virtio_gpu virtio;
+	struct driver *drv;
+	struct bo *bo;
+	struct mapping *mapping;
+	int fds_before;
+};
+
+static int test_setup(struct test_context *ctx, uint64_t use_flags)
+{
+	struct rectangle rect = { 0, 0, 64, 64 };
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fds_before = fake_drm_count_fds();
+	CHECK(!fake_virtio_gpu_open(&ctx->virtio));
+
+	ctx->drv = drv_create(ctx->virtio.dev.fd);
+	CHECK(ctx->drv);
+	CHECK(!drv_init(ctx->drv, 0));
+
+	ctx->bo = drv_bo_create(ctx->drv, 64, 64, DRM_FORMAT_ARGB8888, use_flags);
+	CHECK(ctx->bo);
+
+	CHECK(drv_bo_map(ctx->bo, &rect, BO_MAP_READ_WRITE, &ctx->mapping, 0) != MAP_FAILED);
+	return 1;
+}
+
+static int test_teardown(struct test_context *ctx)
+{
+	if (ctx->mapping)
+		drv_bo_unmap(ctx->bo, ctx->mapping);
+	drv_bo_destroy(ctx->bo);
+	drv_destroy(ctx->drv);
+	fake_virtio_gpu_close(&ctx->virtio);
+
+	CHECK(fake_drm_count_fds() == ctx->fds_before);
+	return 1;
+}
+
+static int test_blocking_flush(void)
+{
+	struct test_context ctx;
+
+	CHECK(test_setup(&ctx, BO_USE_TEXTURE | BO_USE_CAMERA_READ));
+
+	CHECK(!drv_bo_flush(ctx.bo, ctx.mapping));
+	CHECK(fake_drm_calls(&ctx.virtio.dev, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST) == 1);
+	CHECK(fake_drm_calls(&ctx.virtio.dev, DRM_IOCTL_VIRTGPU_EXECBUFFER) == 0);
+	CHECK(fake_drm_calls(&ctx.virtio.dev, DRM_IOCTL_VIRTGPU_WAIT) >= 1);
+
+	return test_teardown(&ctx);
+}
+
+static int test_fenced_flush(void)
+{
+	int fence;
+	struct test_context ctx;
+
+	CHECK(test_setup(&ctx, BO_USE_TEXTURE | BO_USE_CAMERA_READ));
+
+	CHECK(!drv_bo_flush_fenced(ctx.bo, ctx.mapping, &fence));
+	CHECK(fence >= 0);
+	CHECK(!fence_signaled(fence));
+	CHECK(fake_drm_calls(&ctx.virtio.dev, DRM_IOCTL_VIRTGPU_WAIT) == 0);
+	CHECK(fake_drm_calls(&ctx.virtio.dev, DRM_IOCTL_VIRTGPU_EXECBUFFER) == 1);
+	CHECK(ctx.virtio.execbuffer_handle == drv_bo_get_plane_handle(ctx.bo, 0).u32);
+
+	fake_virtio_gpu_signal(&ctx.virtio);
+	CHECK(fence_signaled(fence));
+	close(fence);
+
+	return test_teardown(&ctx);
+}
+
+static int test_invalidate_waits_for_flush(void)
+{
+	int fence;
+	double start;
+	pthread_t host;
+	struct test_context ctx;
+
+	CHECK(test_setup(&ctx, BO_USE_TEXTURE | BO_USE_CAMERA_READ));
+
+	CHECK(!drv_bo_flush_fenced(ctx.bo, ctx.mapping, &fence));
+	CHECK(fence >= 0);
+	close(fence);
+
+	start = now_ms();
+	CHECK(!pthread_create(&host, NULL, host_signal_later, &ctx.virtio));
+	CHECK(!drv_bo_invalidate(ctx.bo, ctx.mapping));
+	CHECK(now_ms() - start >= HOST_DELAY_MS);
+	pthread_join(host, NULL);
+
+	return test_teardown(&ctx);
+}
+
+static int test_acquire_fence(void)
+{
+	int fence, acquire_fence;
+	struct test_context ctx;
+
+	CHECK(test_setup(&ctx, BO_USE_TEXTURE | BO_USE_CAMERA_READ));
+
+	/* Nothing pending yet. */
+	CHECK(drv_bo_get_acquire_fence(ctx.bo, -1, BO_MAP_READ) == -1);
+
+	CHECK(!drv_bo_flush_fenced(ctx.bo, ctx.mapping, &fence));
+	CHECK(fence >= 0);
+	close(fence);
+
+	acquire_fence = drv_bo_get_acquire_fence(ctx.bo, -1, BO_MAP_READ);
+	CHECK(acquire_fence >= 0);
+	CHECK(!fence_signaled(acquire_fence));
+
+	fake_virtio_gpu_signal(&ctx.virtio);
+	CHECK(fence_signaled(acquire_fence));
+	close(acquire_fence);
+
+	/* Once the lock waited for the acquire fence, the invalidate doesn't block. */
+	CHECK(!drv_bo_invalidate(ctx.bo, ctx.mapping));
+
+	return test_teardown(&ctx);
+}
+
+static int test_gpu_only_buffer(void)
+{
+	int fence;
+	struct test_context ctx;
+
+	CHECK(test_setup(&ctx, BO_USE_TEXTURE | BO_USE_SW_WRITE_OFTEN));
+
+	CHECK(!drv_bo_flush_fenced(ctx.bo, ctx.mapping, &fence));
+	CHECK(fence == -1);
+	CHECK(fake_drm_calls(&ctx.virtio.dev, DRM_IOCTL_VIRTGPU_EXECBUFFER) == 0);
+	CHECK(fake_drm_calls(&ctx.virtio.dev, DRM_IOCTL_VIRTGPU_WAIT) == 0);
+
+	return test_teardown(&ctx);
+}
+
+static int test_execbuffer_rejected(void)
+{
+	int fence;
+	struct test_context ctx;
+
+	CHECK(test_setup(&ctx, BO_USE_TEXTURE | BO_USE_CAMERA_READ));
+	ctx.virtio.fail_execbuffer = true;
+
+	/* Falls back to waiting, and doesn't try again. */
+	CHECK(!drv_bo_flush_fenced(ctx.bo, ctx.mapping, &fence));
+	CHECK(fence == -1);
+	CHECK(fake_drm_calls(&ctx.virtio.dev, DRM_IOCTL_VIRTGPU_WAIT) >= 1);
+
+	CHECK(!drv_bo_flush_fenced(ctx.bo, ctx.mapping, &fence));
+	CHECK(fence == -1);
+	CHECK(fake_drm_calls(&ctx.virtio.dev, DRM_IOCTL_VIRTGPU_EXECBUFFER) == 1);
+
+	return test_teardown(&ctx);
+}
+
+static int test_unmap_with_pending_fence(void)
+{
+	int fence;
+	struct test_context ctx;
+
+	CHECK(test_setup(&ctx, BO_USE_TEXTURE | BO_USE_CAMERA_READ));
+
+	CHECK(!drv_bo_flush_or_unmap_fenced(ctx.bo, ctx.mapping, &fence));
+	ctx.mapping = NULL;
+	CHECK(fence >= 0);
+	close(fence);
+
+	/* The buffer's copy of the fence goes with it. */
+	return test_teardown(&ctx);
+}
+
+static const struct fake_drm_testcase tests[] = {
+	{ "blocking_flush", test_blocking_flush },
+	{ "fenced_flush", test_fenced_flush },
+	{ "invalidate_waits_for_flush", test_invalidate_waits_for_flush },
+	{ "acquire_fence", test_acquire_fence },
+	{ "gpu_only_buffer", test_gpu_only_buffer },
+	{ "execbuffer_rejected", test_execbuffer_rejected },
+	{ "unmap_with_pending_fence", test_unmap_with_pending_fence },
+};
+
+int main(int argc, char *argv[])
+{
+	/* The host signals fences nobody listens to any more. */
+	signal(SIGPIPE, SIG_IGN);
+	return fake_drm_run_tests(tests, sizeof(tests) / sizeof(tests[0]), argc, argv);
+}
@@ -8,11 +8,16 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <vc4_drm.h>
 #include <xf86drm.h>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "drv_priv.h"
 #include "helpers.h"
 #include "util.h"
@@ -20,12 +25,200 @@
 static const uint32_t render_target_formats[] = { DRM_FORMAT_ARGB8888, DRM_FORMAT_RGB565,
 						  DRM_FORMAT_XRGB8888 };
 
+/*
+ * The T format is made of 64 byte utiles of pixels in raster order (16 bytes x 4 rows, or
+ * 8 bytes x 8 rows at 8bpp), 1KB subtiles of 4x4 utiles in raster order and 4KB tiles of 2x2
+ * subtiles. Tiles are laid out left-to-right on even tile rows and right-to-left on odd ones.
+ */
+#define VC4_UTILE_SIZE 64
+#define VC4_SUBTILE_SIZE 1024
+#define VC4_TILE_SIZE 4096
+#define VC4_TILE_UTILES 8
+#define VC4_SUBTILE_UTILES 4
+
+/* Tiled buffers mapped through a linear shadow, detiled and retiled by rect. */
+struct vc4_detile_map_data {
+	uint8_t *tiled;
+	uint8_t *untiled;
+	struct drv_lazy_view *lazy;
+};
+
 static int vc4_init(struct driver *drv)
 {
+	struct format_metadata metadata;
+
 	drv_add_combinations(drv, render_target_formats, ARRAY_SIZE(render_target_formats),
 			     &LINEAR_METADATA, BO_USE_RENDER_MASK);
 
-	return drv_modify_linear_combinations(drv);
+	drv_modify_linear_combinations(drv);
+
+	/*
+	 * Textures the CPU only touches rarely keep the GPU's T-tiled layout, with CPU access
+	 * detiled in software. vc4_bo_create() only picks this for such textures.
+	 */
+	metadata.tiling = 0;
+	metadata.priority = 2;
+	metadata.modifier = DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED;
+
+	drv_add_combinations(drv, render_target_formats, ARRAY_SIZE(render_target_formats),
+			     &metadata,
+			     BO_USE_TEXTURE | BO_USE_SW_READ_RARELY | BO_USE_SW_WRITE_RARELY);
+
+	return 0;
+}
+
+static uint32_t vc4_utile_width(uint32_t cpp)
+{
+	return cpp == 1 ? 8 : 16;
+}
+
+static uint32_t vc4_utile_height(uint32_t cpp)
+{
+	return VC4_UTILE_SIZE / vc4_utile_width(cpp);
+}
+
+/*
+ * Small images use the LT layout (no 4KB tiles) on the GPU side, which isn't supported here.
+ */
+static bool vc4_size_is_lt(uint32_t width, uint32_t height, uint32_t format)
+{
+	uint32_t cpp = drv_bytes_per_pixel_from_format(format, 0);
+
+	return width * cpp <= VC4_SUBTILE_UTILES * vc4_utile_width(cpp) ||
+	       height <= VC4_SUBTILE_UTILES * vc4_utile_height(cpp);
+}
+
+/*
+ * Returns the byte offset of utile (utile_x, utile_y) in a T-tiled image that is tile_stride
+ * 4KB tiles wide.
+ */
+static uint32_t vc4_t_utile_offset(uint32_t tile_stride, uint32_t utile_x, uint32_t utile_y)
+{
+	/* Subtile order within a tile, indexed by (y << 1) | x with y = 0 at the bottom. */
+	static const uint32_t even_subtile_map[4] = { 0, 3, 1, 2 };
+	static const uint32_t odd_subtile_map[4] = { 2, 1, 3, 0 };
+	uint32_t tile_x = utile_x / VC4_TILE_UTILES;
+	uint32_t tile_y = utile_y / VC4_TILE_UTILES;
+	uint32_t subtile = ((utile_y / VC4_SUBTILE_UTILES) & 1) << 1 |
+			   ((utile_x / VC4_SUBTILE_UTILES) & 1);
+	uint32_t offset;
+
+	if (tile_y & 1) {
+		offset = (tile_y * tile_stride + tile_stride - tile_x - 1) * VC4_TILE_SIZE +
+			 odd_subtile_map[subtile] * VC4_SUBTILE_SIZE;
+	} else {
+		offset = (tile_y * tile_stride + tile_x) * VC4_TILE_SIZE +
+			 even_subtile_map[subtile] * VC4_SUBTILE_SIZE;
+	}
+
+	return offset + ((utile_y % VC4_SUBTILE_UTILES) * VC4_SUBTILE_UTILES +
+			 utile_x % VC4_SUBTILE_UTILES) *
+			    VC4_UTILE_SIZE;
+}
+
+/* Moves a whole utile, which is contiguous in the tiled layout. */
+static inline void vc4_copy_utile(uint8_t *utile, uint8_t *linear, uint32_t stride,
+				  uint32_t utile_width, bool to_tiled)
+{
+	uint32_t row, rows = VC4_UTILE_SIZE / utile_width;
+
+#if defined(__ARM_NEON)
+	if (utile_width == 16) {
+		if (to_tiled) {
+			vst1q_u8(utile, vld1q_u8(linear));
+			vst1q_u8(utile + 16, vld1q_u8(linear + stride));
+			vst1q_u8(utile + 32, vld1q_u8(linear + 2 * stride));
+			vst1q_u8(utile + 48, vld1q_u8(linear + 3 * stride));
+		} else {
+			/* Read the whole utile in one burst; the tiled side is write-combined. */
+			uint8x16_t r0 = vld1q_u8(utile);
+			uint8x16_t r1 = vld1q_u8(utile + 16);
+			uint8x16_t r2 = vld1q_u8(utile + 32);
+			uint8x16_t r3 = vld1q_u8(utile + 48);
+			vst1q_u8(linear, r0);
+			vst1q_u8(linear + stride, r1);
+			vst1q_u8(linear + 2 * stride, r2);
+			vst1q_u8(linear + 3 * stride, r3);
+		}
+		return;
+	}
+
+	for (row = 0; row < rows; row++, utile += utile_width, linear += stride) {
+		if (to_tiled)
+			vst1_u8(utile, vld1_u8(linear));
+		else
+			vst1_u8(linear, vld1_u8(utile));
+	}
+#else
+	for (row = 0; row < rows; row++, utile += utile_width, linear += stride) {
+		if (to_tiled)
+			memcpy(utile, linear, utile_width);
+		else
+			memcpy(linear, utile, utile_width);
+	}
+#endif
+}
+
+/*
+ * Copies the part of rect between a T-tiled buffer and a linear shadow with the same stride.
+ * Utiles fully inside rect are moved whole; the ones on its edges row by row.
+ */
+static void vc4_transfer_tiled_rect(struct bo *bo, uint8_t *tiled, uint8_t *untiled,
+				    const struct rectangle *rect, bool to_tiled)
+{
+	uint32_t offset, row_bytes, num_rows, x0, x1, y0, y1, ux, uy, bx0, bx1, by0, by1, y;
+	uint32_t cpp = drv_bytes_per_pixel_from_format(bo->meta.format, 0);
+	uint32_t utile_width = vc4_utile_width(cpp);
+	uint32_t utile_height = vc4_utile_height(cpp);
+	uint32_t stride = bo->meta.strides[0];
+	uint32_t tile_stride = stride / (utile_width * VC4_TILE_UTILES);
+	uint8_t *utile, *linear;
+
+	if (drv_bo_get_plane_rect_span(bo, rect, 0, &offset, &row_bytes, &num_rows) ||
+	    !row_bytes || !num_rows)
+		return;
+
+	x0 = offset % stride;
+	x1 = x0 + row_bytes;
+	y0 = offset / stride;
+	y1 = y0 + num_rows;
+
+	for (uy = y0 / utile_height; uy * utile_height < y1; uy++) {
+		by0 = MAX(uy * utile_height, y0);
+		by1 = MIN((uy + 1) * utile_height, y1);
+
+		for (ux = x0 / utile_width; ux * utile_width < x1; ux++) {
+			bx0 = MAX(ux * utile_width, x0);
+			bx1 = MIN((ux + 1) * utile_width, x1);
+
+			utile = tiled + vc4_t_utile_offset(tile_stride, ux, uy);
+			linear = untiled + uy * utile_height * stride + ux * utile_width;
+
+			if (bx1 - bx0 == utile_width && by1 - by0 == utile_height) {
+				vc4_copy_utile(utile, linear, stride, utile_width, to_tiled);
+				continue;
+			}
+
+			for (y = by0; y < by1; y++) {
+				uint8_t *t = utile + (y % utile_height) * utile_width +
+					     bx0 % utile_width;
+				uint8_t *l = untiled + y * stride + bx0;
+
+				if (to_tiled)
+					memcpy(t, l, bx1 - bx0);
+				else
+					memcpy(l, t, bx1 - bx0);
+			}
+		}
+	}
+}
+
+static void vc4_lazy_transfer(struct bo *bo, void *data, const struct rectangle *rect,
+			      bool to_tiled)
+{
+	struct vc4_detile_map_data *priv = data;
+
+	vc4_transfer_tiled_rect(bo, priv->tiled, priv->untiled, rect, to_tiled);
 }
 
 static int vc4_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t height,
@@ -33,26 +226,37 @@ static int vc4_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t he
 {
 	int ret;
 	size_t plane;
-	uint32_t stride;
+	uint32_t stride, cpp;
 	struct drm_vc4_create_bo bo_create;
+	struct drm_vc4_set_tiling bo_tiling;
 
 	switch (modifier) {
 	case DRM_FORMAT_MOD_LINEAR:
+		/*
+		 * Since the ARM L1 cache line size is 64 bytes, align to that as a
+		 * performance optimization.
+		 */
+		stride = drv_stride_from_format(format, width, 0);
+		stride = ALIGN(stride, 64);
 		break;
 	case DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED:
-		drv_log("DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED not supported yet\n");
-		return -EINVAL;
+		if (vc4_size_is_lt(width, height, format)) {
+			drv_log("%ux%u is too small for DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED\n",
+				width, height);
+			return -EINVAL;
+		}
+
+		cpp = drv_bytes_per_pixel_from_format(format, 0);
+		stride = drv_stride_from_format(format, width, 0);
+		stride = ALIGN(stride, vc4_utile_width(cpp) * VC4_TILE_UTILES);
+		height = ALIGN(height, vc4_utile_height(cpp) * VC4_TILE_UTILES);
+		break;
 	default:
 		return -EINVAL;
 	}
 
-	/*
-	 * Since the ARM L1 cache line size is 64 bytes, align to that as a
-	 * performance optimization.
-	 */
-	stride = drv_stride_from_format(format, width, 0);
-	stride = ALIGN(stride, 64);
 	drv_bo_from_format(bo, stride, height, format);
+	bo->meta.format_modifiers[0] = modifier;
 
 	memset(&bo_create, 0, sizeof(bo_create));
 	bo_create.size = bo->meta.total_size;
@@ -66,6 +270,21 @@ static int vc4_bo_create_for_modifier(struct bo *bo, uint32_t width, uint32_t he
 	for (plane = 0; plane < bo->meta.num_planes; plane++)
 		bo->handles[plane].u32 = bo_create.handle;
 
+	if (modifier == DRM_FORMAT_MOD_LINEAR)
+		return 0;
+
+	/* Let the kernel know the layout for framebuffers created without modifiers. */
+	memset(&bo_tiling, 0, sizeof(bo_tiling));
+	bo_tiling.handle = bo_create.handle;
+	bo_tiling.modifier = modifier;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VC4_SET_TILING, &bo_tiling);
+	if (ret) {
+		drv_log("DRM_IOCTL_VC4_SET_TILING failed with %d\n", ret);
+		drv_gem_bo_destroy(bo);
+		return -errno;
+	}
+
 	return 0;
 }
 
@@ -73,31 +292,88 @@ static int vc4_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_
 			 uint64_t use_flags)
 {
 	struct combination *combo;
+	uint64_t modifier;
 
 	combo = drv_get_combination(bo->drv, format, use_flags);
 	if (!combo)
 		return -EINVAL;
 
-	return vc4_bo_create_for_modifier(bo, width, height, format, combo->metadata.modifier);
+	modifier = combo->metadata.modifier;
+	if (modifier != DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED)
+		return vc4_bo_create_for_modifier(bo, width, height, format, modifier);
+
+	/* Anything but a texture with rare CPU access stays linear, as does anything too small. */
+	if (!(use_flags & BO_USE_TEXTURE) ||
+	    !(use_flags & (BO_USE_SW_READ_RARELY | BO_USE_SW_WRITE_RARELY)) ||
+	    vc4_size_is_lt(width, height, format))
+		return vc4_bo_create_for_modifier(bo, width, height, format, DRM_FORMAT_MOD_LINEAR);
+
+	/* Older kernels don't have VC4_SET_TILING, so fall back to linear there. */
+	if (vc4_bo_create_for_modifier(bo, width, height, format, modifier))
+		return vc4_bo_create_for_modifier(bo, width, height, format, DRM_FORMAT_MOD_LINEAR);
+
+	return 0;
+}
+
+static int vc4_bo_import(struct bo *bo, struct drv_import_fd_data *data)
+{
+	int ret;
+	size_t plane;
+	struct drm_vc4_get_tiling bo_tiling;
+
+	ret = drv_prime_bo_import(bo, data);
+	if (ret)
+		return ret;
+
+	if (data->format_modifiers[0] != DRM_FORMAT_MOD_INVALID)
+		return 0;
+
+	/*
+	 * Importers that don't know the modifier would map T-tiled memory as linear, so ask the
+	 * kernel. drv_bo_import() takes the modifiers from data.
+	 */
+	memset(&bo_tiling, 0, sizeof(bo_tiling));
+	bo_tiling.handle = bo->handles[0].u32;
+	if (drmIoctl(bo->drv->fd, DRM_IOCTL_VC4_GET_TILING, &bo_tiling))
+		return 0;
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++)
+		data->format_modifiers[plane] = bo_tiling.modifier;
+
+	return 0;
 }
 
 static int vc4_bo_create_with_modifiers(struct bo *bo, uint32_t width, uint32_t height,
 					uint32_t format, const uint64_t *modifiers, uint32_t count)
 {
 	static const uint64_t modifier_order[] = {
+		DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED,
 		DRM_FORMAT_MOD_LINEAR,
 	};
+	int ret;
 	uint64_t modifier;
 
-	modifier = drv_pick_modifier(modifiers, count, modifier_order, ARRAY_SIZE(modifier_order));
+	if (vc4_size_is_lt(width, height, format))
+		modifier = drv_pick_modifier(modifiers, count, &modifier_order[1],
+					     ARRAY_SIZE(modifier_order) - 1);
+	else
+		modifier = drv_pick_modifier(modifiers, count, modifier_order,
+					     ARRAY_SIZE(modifier_order));
+
+	ret = vc4_bo_create_for_modifier(bo, width, height, format, modifier);
+	if (ret && modifier == DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED &&
+	    drv_has_modifier(modifiers, count, DRM_FORMAT_MOD_LINEAR))
+		ret = vc4_bo_create_for_modifier(bo, width, height, format, DRM_FORMAT_MOD_LINEAR);
 
-	return vc4_bo_create_for_modifier(bo, width, height, format, modifier);
+	return ret;
 }
 
 static void *vc4_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret;
+	void *addr;
 	struct drm_vc4_mmap_bo bo_map;
+	struct vc4_detile_map_data *priv;
 
 	memset(&bo_map, 0, sizeof(bo_map));
 	bo_map.handle = bo->handles[0].u32;
@@ -109,8 +385,91 @@ static void *vc4_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t m
 	}
 
 	vma->length = bo->meta.total_size;
-	return mmap(NULL, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
+	addr = mmap(NULL, bo->meta.total_size, drv_get_prot(map_flags), MAP_SHARED, bo->drv->fd,
 		    bo_map.offset);
+	if (addr == MAP_FAILED ||
+	    bo->meta.format_modifiers[0] != DRM_FORMAT_MOD_BROADCOM_VC4_T_TILED)
+		return addr;
+
+	priv = calloc(1, sizeof(*priv));
+	if (!priv)
+		goto unmap;
+
+	priv->untiled = drv_shadow_alloc(bo->drv, bo->meta.total_size);
+	if (!priv->untiled)
+		goto free_priv;
+
+	priv->tiled = addr;
+	vma->priv = priv;
+
+	priv->lazy = drv_lazy_view_create(
+	    bo, priv->untiled, map_flags,
+	    vc4_utile_height(drv_bytes_per_pixel_from_format(bo->meta.format, 0)), vc4_lazy_transfer,
+	    priv);
+	if (priv->lazy)
+		return drv_lazy_view_addr(priv->lazy);
+
+	return priv->untiled;
+
+free_priv:
+	free(priv);
+unmap:
+	munmap(addr, bo->meta.total_size);
+	return MAP_FAILED;
+}
+
+static int vc4_bo_unmap(struct bo *bo, struct vma *vma)
+{
+	struct vc4_detile_map_data *priv = vma->priv;
+
+	if (priv) {
+		if (priv->lazy)
+			drv_lazy_view_destroy(priv->lazy);
+		vma->addr = priv->tiled;
+		drv_shadow_free(bo->drv, priv->untiled, bo->meta.total_size);
+		free(priv);
+		vma->priv = NULL;
+	}
+
+	return munmap(vma->addr, vma->length);
+}
+
+static int vc4_bo_invalidate(struct bo *bo, struct mapping *mapping)
+{
+	struct vc4_detile_map_data *priv = mapping->vma->priv;
+
+	/* Tracked views detile on fault or refresh the rect themselves. */
+	if (priv && priv->lazy) {
+		drv_lazy_view_invalidate(priv->lazy, mapping);
+		return 0;
+	}
+
+	/* Flush writes back the whole rect, so write-only locks start from a cleared one. */
+	if (priv && (mapping->vma->map_flags & BO_MAP_READ))
+		vc4_transfer_tiled_rect(bo, priv->tiled, priv->untiled, &mapping->rect, false);
+	else if (priv)
+		drv_bo_clear_shadow_rect(bo, &mapping->rect, priv->untiled);
+
+	return 0;
+}
+
+static int vc4_bo_flush(struct bo *bo, struct mapping *mapping)
+{
+	uint32_t i, num_rects;
+	const struct rectangle *rects;
+	struct vc4_detile_map_data *priv = mapping->vma->priv;
+
+	if (!priv || !(mapping->vma->map_flags & BO_MAP_WRITE))
+		return 0;
+
+	if (priv->lazy)
+		return drv_lazy_view_flush(priv->lazy, mapping);
+
+	num_rects = drv_mapping_dirty_rects(mapping, &rects);
+	for (i = 0; i < num_rects; i++)
+		vc4_transfer_tiled_rect(bo, priv->tiled, priv->untiled, &rects[i], true);
+
+	return 0;
 }
 
 const struct backend backend_vc4 = {
@@ -118,10 +477,13 @@ const struct backend backend_vc4 = {
 	.init = vc4_init,
 	.bo_create = vc4_bo_create,
 	.bo_create_with_modifiers = vc4_bo_create_with_modifiers,
-	.bo_import = drv_prime_bo_import,
+	.bo_import = vc4_bo_import,
 	.bo_destroy = drv_gem_bo_destroy,
 	.bo_map = vc4_bo_map,
-	.bo_unmap = drv_bo_munmap,
+	.bo_unmap = vc4_bo_unmap,
+	.bo_invalidate = vc4_bo_invalidate,
+	.bo_flush = vc4_bo_flush,
+	.map_unlocked = true,
 };
 
 #endif
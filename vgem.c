@@ -57,7 +57,12 @@ const struct backend backend_vgem = {
 	.bo_create = vgem_bo_create,
 	.bo_destroy = drv_dumb_bo_destroy,
 	.bo_import = drv_prime_bo_import,
-	.bo_map = drv_dumb_bo_map,
-	.bo_unmap = drv_bo_munmap,
+	.bo_map = drv_dumb_dmabuf_bo_map,
+	.bo_unmap = drv_dmabuf_bo_unmap,
+	.bo_invalidate = drv_dmabuf_bo_invalidate,
+	.bo_flush = drv_dmabuf_bo_flush,
 	.resolve_format = vgem_resolve_format,
+	.brackets_cpu_access = true,
+	.implicit_sync = true,
+	.map_unlocked = true,
 };
@@ -6,10 +6,13 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include <xf86drm.h>
 
 #include "drv_priv.h"
@@ -23,6 +26,22 @@
 #endif
 #define PIPE_TEXTURE_2D 2
 
+/* VIRGL_CCMD_PIPE_RESOURCE_CREATE, from virglrenderer's virgl_protocol.h */
+#define VIRGL_CMD0(cmd, obj, len) ((cmd) | ((obj) << 8) | ((len) << 16))
+#define VIRGL_CCMD_PIPE_RESOURCE_CREATE 47
+#define VIRGL_PIPE_RES_CREATE_SIZE 11
+#define VIRGL_PIPE_RES_CREATE_TARGET 1
+#define VIRGL_PIPE_RES_CREATE_FORMAT 2
+#define VIRGL_PIPE_RES_CREATE_BIND 3
+#define VIRGL_PIPE_RES_CREATE_WIDTH 4
+#define VIRGL_PIPE_RES_CREATE_HEIGHT 5
+#define VIRGL_PIPE_RES_CREATE_DEPTH 6
+#define VIRGL_PIPE_RES_CREATE_ARRAY_SIZE 7
+#define VIRGL_PIPE_RES_CREATE_LAST_LEVEL 8
+#define VIRGL_PIPE_RES_CREATE_NR_SAMPLES 9
+#define VIRGL_PIPE_RES_CREATE_FLAGS 10
+#define VIRGL_PIPE_RES_CREATE_BLOB_ID 11
+
 #define MESA_LLVMPIPE_TILE_ORDER 6
 #define MESA_LLVMPIPE_TILE_SIZE (1 << MESA_LLVMPIPE_TILE_ORDER)
 
@@ -35,6 +54,8 @@ struct feature {
 enum feature_id {
 	feat_3d,
 	feat_capset_fix,
+	feat_resource_blob,
+	feat_host_visible,
 	feat_max,
 };
 
@@ -45,7 +66,9 @@ enum feature_id {
 	}
 
 static struct feature features[] = { FEATURE(VIRTGPU_PARAM_3D_FEATURES),
-				     FEATURE(VIRTGPU_PARAM_CAPSET_QUERY_FIX) };
+				     FEATURE(VIRTGPU_PARAM_CAPSET_QUERY_FIX),
+				     FEATURE(VIRTGPU_PARAM_RESOURCE_BLOB),
+				     FEATURE(VIRTGPU_PARAM_HOST_VISIBLE) };
 
 static const uint32_t render_target_formats[] = { DRM_FORMAT_ABGR8888, DRM_FORMAT_ARGB8888,
 						  DRM_FORMAT_RGB565, DRM_FORMAT_XBGR8888,
@@ -64,6 +87,15 @@ struct virtio_gpu_priv {
 	int caps_is_v2;
 	union virgl_caps caps;
 	int host_gbm_enabled;
+	uint32_t next_blob_id;
+	/* Set once the host turned out not to create mappable blobs. */
+	bool blob_unsupported;
+	/* Set once the kernel turned out not to report the host's layout of blobs. */
+	bool blob_layout_unknown;
+	/* Set once an execbuffer to fence a flush with failed. */
+	bool fenced_flush_unsupported;
+	/* Guards the flush fences kept with buffers. */
+	pthread_mutex_t fence_lock;
 };
 
 static uint32_t translate_format(uint32_t drm_fourcc)
@@ -436,6 +468,131 @@ static uint32_t use_flags_to_bind(uint64_t use_flags)
 	return bind;
 }
 
+static bool virtio_gpu_is_blob(const struct bo *bo)
+{
+	return bo->meta.blob_flags & VIRTGPU_BLOB_FLAG_USE_MAPPABLE;
+}
+
+// Whether the buffer should be a host-visible blob, whose memory the guest maps directly so CPU
+// access needs no transfers. That only pays off for buffers the CPU accesses often.
+static bool virtio_gpu_supports_blob(struct driver *drv, uint32_t format, uint32_t height,
+				     uint64_t use_flags)
+{
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+
+	if (!features[feat_resource_blob].enabled || !features[feat_host_visible].enabled)
+		return false;
+
+	// The host allocates blob memory through gbm.
+	if (!priv->host_gbm_enabled || __atomic_load_n(&priv->blob_unsupported, __ATOMIC_RELAXED))
+		return false;
+
+	if (!(use_flags & (BO_USE_SW_READ_OFTEN | BO_USE_SW_WRITE_OFTEN)))
+		return false;
+
+	if (use_flags & (BO_USE_SCANOUT | BO_USE_PROTECTED))
+		return false;
+
+	// Without the host's strides, only buffers of a single row have a layout that can't differ.
+	if (__atomic_load_n(&priv->blob_layout_unknown, __ATOMIC_RELAXED) &&
+	    (height > 1 || drv_num_planes_from_format(format) > 1))
+		return false;
+
+	return virtio_gpu_supports_combination_natively(drv, format, use_flags);
+}
+
+// Creates the buffer as a mappable VIRTGPU_BLOB_MEM_HOST3D blob with the layout already in
+// bo->meta. Fails if the host can't, or if it lays the resource out differently.
+static int virtio_virgl_blob_create(struct bo *bo, uint32_t width, uint32_t height,
+				    uint32_t format, uint64_t use_flags)
+{
+	int ret, fd;
+	uint32_t plane, blob_id;
+	uint32_t cmd[VIRGL_PIPE_RES_CREATE_SIZE + 1] = { 0 };
+	struct drm_virtgpu_resource_create_blob blob_create;
+	struct drm_virtgpu_resource_info res_info;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	blob_id = __atomic_add_fetch(&priv->next_blob_id, 1, __ATOMIC_RELAXED);
+
+	cmd[0] = VIRGL_CMD0(VIRGL_CCMD_PIPE_RESOURCE_CREATE, 0, VIRGL_PIPE_RES_CREATE_SIZE);
+	cmd[VIRGL_PIPE_RES_CREATE_TARGET] = PIPE_TEXTURE_2D;
+	cmd[VIRGL_PIPE_RES_CREATE_FORMAT] = translate_format(format);
+	cmd[VIRGL_PIPE_RES_CREATE_BIND] = use_flags_to_bind(use_flags);
+	cmd[VIRGL_PIPE_RES_CREATE_WIDTH] = width;
+	cmd[VIRGL_PIPE_RES_CREATE_HEIGHT] = height;
+	cmd[VIRGL_PIPE_RES_CREATE_DEPTH] = 1;
+	cmd[VIRGL_PIPE_RES_CREATE_ARRAY_SIZE] = 1;
+	cmd[VIRGL_PIPE_RES_CREATE_BLOB_ID] = blob_id;
+
+	memset(&blob_create, 0, sizeof(blob_create));
+	blob_create.blob_mem = VIRTGPU_BLOB_MEM_HOST3D;
+	blob_create.blob_flags = VIRTGPU_BLOB_FLAG_USE_MAPPABLE | VIRTGPU_BLOB_FLAG_USE_SHAREABLE;
+	blob_create.size = ALIGN(bo->meta.total_size, PAGE_SIZE);
+	blob_create.cmd = (uintptr_t)cmd;
+	blob_create.cmd_size = sizeof(cmd);
+	blob_create.blob_id = blob_id;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB, &blob_create);
+	if (ret) {
+		ret = -errno;
+		drv_log("DRM_IOCTL_VIRTGPU_RESOURCE_CREATE_BLOB failed with %s\n", strerror(errno));
+		// Only a kernel without blob support fails every time. Anything else, like running
+		// out of memory or a format the host can't share, falls back for this buffer only.
+		if (ret == -ENOTTY || ret == -ENOSYS || ret == -EOPNOTSUPP)
+			__atomic_store_n(&priv->blob_unsupported, true, __ATOMIC_RELAXED);
+		return ret;
+	}
+
+	for (plane = 0; plane < bo->meta.num_planes; plane++)
+		bo->handles[plane].u32 = blob_create.bo_handle;
+
+	// The guest maps the host's memory as is, so its layout has to be the one in bo->meta.
+	memset(&res_info, 0, sizeof(res_info));
+	res_info.bo_handle = blob_create.bo_handle;
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_RESOURCE_INFO, &res_info);
+	if (ret) {
+		ret = -errno;
+		drv_log("DRM_IOCTL_VIRTGPU_RESOURCE_INFO failed with %s\n", strerror(errno));
+		drv_gem_bo_destroy(bo);
+		return ret;
+	}
+
+	// Kernels without the extended resource info ioctl don't report the planes. Upstream ones
+	// put the blob's memory type where the first stride would be, so the strides are only
+	// trusted along with the number of planes. Without them, only a single row is safe to use
+	// as is.
+	if (!res_info.num_planes) {
+		__atomic_store_n(&priv->blob_layout_unknown, true, __ATOMIC_RELAXED);
+		if (height > 1 || bo->meta.num_planes > 1) {
+			drv_gem_bo_destroy(bo);
+			return -ENOTSUP;
+		}
+	} else {
+		for (plane = 0; plane < bo->meta.num_planes; plane++) {
+			if (res_info.strides[plane] != bo->meta.strides[plane] ||
+			    res_info.offsets[plane] != bo->meta.offsets[plane]) {
+				drv_log("Host blob layout differs from the guest's\n");
+				drv_gem_bo_destroy(bo);
+				return -EINVAL;
+			}
+		}
+	}
+
+	bo->meta.total_size = blob_create.size;
+	bo->meta.blob_flags = blob_create.blob_flags;
+
+	// gbm imports and old gralloc handles don't carry the blob flags, so keep them with the
+	// dma-buf for imports of the buffer in this process.
+	fd = drv_get_export_fd(bo->drv, blob_create.bo_handle);
+	if (fd >= 0) {
+		close(fd);
+		drv_import_cache_set_layout(bo);
+	}
+
+	return 0;
+}
+
 static int virtio_virgl_bo_create(struct bo *bo, uint32_t width, uint32_t height, uint32_t format,
 				  uint64_t use_flags)
 {
@@ -448,6 +605,11 @@ static int virtio_virgl_bo_create(struct bo *bo, uint32_t width, uint32_t height
 	if (virtio_gpu_supports_combination_natively(bo->drv, format, use_flags)) {
 		stride = drv_stride_from_format(format, width, 0);
 		drv_bo_from_format(bo, stride, height, format);
+
+		// Falls back to a classic resource if the host can't share memory for this one.
+		if (virtio_gpu_supports_blob(bo->drv, format, height, use_flags) &&
+		    !virtio_virgl_blob_create(bo, width, height, format, use_flags))
+			return 0;
 	} else {
 		assert(
 		    virtio_gpu_supports_combination_through_emulation(bo->drv, format, use_flags));
@@ -499,6 +661,11 @@ static int virtio_virgl_bo_create(struct bo *bo, uint32_t width, uint32_t height
 	return 0;
 }
 
+struct virtio_gpu_bo_priv {
+	/* Signals when the last transfer to the host that nobody waited for has landed, or -1. */
+	int flush_fence;
+};
+
 static void *virtio_virgl_bo_map(struct bo *bo, struct vma *vma, size_t plane, uint32_t map_flags)
 {
 	int ret;
@@ -553,10 +720,21 @@ static int virtio_gpu_get_caps(struct driver *drv, union virgl_caps *caps, int *
 	return ret;
 }
 
+// What virtio_gpu_init_features_and_caps() keeps in the driver's capability cache.
+struct virtio_gpu_cached_caps {
+	uint32_t enabled[feat_max];
+	int caps_is_v2;
+	union virgl_caps caps;
+};
+
 static void virtio_gpu_init_features_and_caps(struct driver *drv)
 {
 	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+	const struct virtio_gpu_cached_caps *cached;
+	struct virtio_gpu_cached_caps probed;
 
+	// The kernel answers GETPARAM itself, so it's always queried: features that differ from
+	// the cached ones mean the guest now runs on a different host and the caps are stale.
 	for (uint32_t i = 0; i < ARRAY_SIZE(features); i++) {
 		struct drm_virtgpu_getparam params = { 0 };
 
@@ -567,10 +745,29 @@ static void virtio_gpu_init_features_and_caps(struct driver *drv)
 			drv_log("DRM_IOCTL_VIRTGPU_GET_PARAM failed with %s\n", strerror(errno));
 	}
 
+	memset(&probed, 0, sizeof(probed));
+	for (uint32_t i = 0; i < ARRAY_SIZE(features); i++)
+		probed.enabled[i] = features[i].enabled;
+
+	// Skips the GET_CAPS round trip to the host when a previous process already made it.
+	cached = drv_caps_cache_get(drv, sizeof(*cached));
+	if (cached && !memcmp(cached->enabled, probed.enabled, sizeof(probed.enabled))) {
+		priv->caps_is_v2 = cached->caps_is_v2;
+		priv->caps = cached->caps;
+		goto out;
+	}
+
+	drv_caps_cache_reject(drv);
+
 	if (features[feat_3d].enabled) {
 		virtio_gpu_get_caps(drv, &priv->caps, &priv->caps_is_v2);
 	}
 
+	probed.caps_is_v2 = priv->caps_is_v2;
+	probed.caps = priv->caps;
+	drv_caps_cache_put(drv, &probed, sizeof(probed));
+
+out:
 	// Multi-planar formats are currently only supported in virglrenderer through gbm.
 	priv->host_gbm_enabled =
 	    virtio_gpu_supports_combination_natively(drv, DRM_FORMAT_NV12, BO_USE_TEXTURE);
@@ -582,6 +779,7 @@ static int virtio_gpu_init(struct driver *drv)
 
 	priv = calloc(1, sizeof(*priv));
 	drv->priv = priv;
+	pthread_mutex_init(&priv->fence_lock, NULL);
 
 	virtio_gpu_init_features_and_caps(drv);
 
@@ -648,6 +846,9 @@ static int virtio_gpu_init(struct driver *drv)
 
 static void virtio_gpu_close(struct driver *drv)
 {
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)drv->priv;
+
+	pthread_mutex_destroy(&priv->fence_lock);
 	free(drv->priv);
 	drv->priv = NULL;
 }
@@ -661,8 +862,36 @@ static int virtio_gpu_bo_create(struct bo *bo, uint32_t width, uint32_t height,
 		return virtio_dumb_bo_create(bo, width, height, format, use_flags);
 }
 
+static int virtio_gpu_bo_import(struct bo *bo, struct drv_import_fd_data *data)
+{
+	int ret;
+
+	ret = drv_prime_bo_import(bo, data);
+	if (ret)
+		return ret;
+
+	// Imports without a layout only know the blob flags if the buffer was allocated or imported
+	// with them in this process. Other blobs are treated like classic resources: their
+	// transfers are redundant, as the guest maps the host's memory either way, but harmless.
+	if (data->has_layout)
+		drv_import_cache_set_layout(bo);
+	else
+		drv_import_cache_get_layout(bo);
+
+	return 0;
+}
+
 static int virtio_gpu_bo_destroy(struct bo *bo)
 {
+	struct virtio_gpu_bo_priv *priv = bo->priv;
+
+	if (priv) {
+		if (priv->flush_fence >= 0)
+			close(priv->flush_fence);
+		free(priv);
+		bo->priv = NULL;
+	}
+
 	if (features[feat_3d].enabled)
 		return drv_gem_bo_destroy(bo);
 	else
@@ -677,23 +906,104 @@ static void *virtio_gpu_bo_map(struct bo *bo, struct vma *vma, size_t plane, uin
 		return drv_dumb_bo_map(bo, vma, plane, map_flags);
 }
 
+static int virtio_gpu_bo_unmap(struct bo *bo, struct vma *vma)
+{
+	return drv_bo_munmap(bo, vma);
+}
+
+/*
+ * Takes the buffer's pending flush fence, or with dup, a copy of it. Returns -1 if there is none.
+ */
+static int virtio_gpu_get_flush_fence(struct bo *bo, bool dup)
+{
+	int fence = -1;
+	struct virtio_gpu_bo_priv *bo_priv;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	pthread_mutex_lock(&priv->fence_lock);
+	bo_priv = bo->priv;
+	if (bo_priv && bo_priv->flush_fence >= 0) {
+		if (dup) {
+			fence = fcntl(bo_priv->flush_fence, F_DUPFD_CLOEXEC, 0);
+		} else {
+			fence = bo_priv->flush_fence;
+			bo_priv->flush_fence = -1;
+		}
+	}
+	pthread_mutex_unlock(&priv->fence_lock);
+
+	return fence;
+}
+
+/*
+ * The guest mustn't touch the pages again while a transfer from them may still be reading.
+ */
+static int virtio_gpu_wait_flush(struct bo *bo)
+{
+	return drv_fence_wait(virtio_gpu_get_flush_fence(bo, false));
+}
+
+/*
+ * Lets a lock wait for the transfers of an earlier fenced flush along with its acquire fence,
+ * instead of blocking in the invalidate. That still waits on its own copy, which has signalled
+ * by then.
+ */
+static int virtio_gpu_bo_get_acquire_fence(struct bo *bo, uint32_t map_flags)
+{
+	return virtio_gpu_get_flush_fence(bo, true);
+}
+
+/*
+ * Waits for the host to be done with the buffer, including any transfers queued for it.
+ */
+static int virtio_gpu_wait_host(struct bo *bo, struct mapping *mapping)
+{
+	int ret;
+	struct drm_virtgpu_3d_wait waitcmd;
+
+	// Poll first; only block if the resource is actually busy.
+	memset(&waitcmd, 0, sizeof(waitcmd));
+	waitcmd.handle = mapping->vma->handle;
+	waitcmd.flags = VIRTGPU_WAIT_NOWAIT;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
+	if (!ret)
+		return 0;
+
+	waitcmd.flags = 0;
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
+	if (ret) {
+		drv_log("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
 static int virtio_gpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
 {
 	int ret;
 	size_t i;
 	struct drm_virtgpu_3d_transfer_from_host xfer;
-	struct drm_virtgpu_3d_wait waitcmd;
 	struct virtio_transfers_params xfer_params;
 	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
 
 	if (!features[feat_3d].enabled)
 		return 0;
 
+	ret = virtio_gpu_wait_flush(bo);
+	if (ret)
+		return ret;
+
 	// Invalidate is only necessary if the host writes to the buffer.
 	if ((bo->meta.use_flags & (BO_USE_RENDERING | BO_USE_CAMERA_WRITE |
 				   BO_USE_HW_VIDEO_ENCODER | BO_USE_HW_VIDEO_DECODER)) == 0)
 		return 0;
 
+	// Blobs share their memory with the host, so its writes only need to have landed.
+	if (virtio_gpu_is_blob(bo))
+		return virtio_gpu_wait_host(bo, mapping);
+
 	memset(&xfer, 0, sizeof(xfer));
 	xfer.bo_handle = mapping->vma->handle;
 
@@ -738,33 +1048,128 @@ static int virtio_gpu_bo_invalidate(struct bo *bo, struct mapping *mapping)
 
 	// The transfer needs to complete before invalidate returns so that any host changes
 	// are visible and to ensure the host doesn't overwrite subsequent guest changes.
-	// TODO(b/136733358): Support returning fences from transfers
-	memset(&waitcmd, 0, sizeof(waitcmd));
-	waitcmd.handle = mapping->vma->handle;
-	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
+	return virtio_gpu_wait_host(bo, mapping);
+}
+
+/*
+ * Submits an empty command buffer that references the buffer and returns its out-fence, which
+ * signals once the transfers queued before it have completed.
+ *
+ * That relies on two things. The transfers were issued from this file's 3D context, which they
+ * created if it didn't exist yet, so the execbuffer never creates a context of its own. And the
+ * device processes control queue commands in order and only signals a fence once the commands
+ * before it are done. virglrenderer performs transfers synchronously as it processes them, so
+ * it gives that guarantee. If the execbuffer is rejected, e.g. because the context isn't a
+ * virgl one, fenced flushes are turned off and flushes wait for their transfers instead.
+ */
+static int virtio_gpu_fence_after_transfers(struct bo *bo, uint32_t handle)
+{
+	int ret;
+	uint32_t nop = 0; /* VIRGL_CCMD_NOP with no payload */
+	struct drm_virtgpu_execbuffer exbuf;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	if (__atomic_load_n(&priv->fenced_flush_unsupported, __ATOMIC_RELAXED))
+		return -ENOTSUP;
+
+	memset(&exbuf, 0, sizeof(exbuf));
+	exbuf.flags = VIRTGPU_EXECBUF_FENCE_FD_OUT;
+	exbuf.command = (uintptr_t)&nop;
+	exbuf.size = sizeof(nop);
+	exbuf.bo_handles = (uintptr_t)&handle;
+	exbuf.num_bo_handles = 1;
+	exbuf.fence_fd = -1;
+
+	ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_EXECBUFFER, &exbuf);
 	if (ret) {
-		drv_log("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
-		return -errno;
+		ret = -errno;
+		drv_log("Fenced flushes disabled, execbuffer failed with %s\n", strerror(errno));
+		__atomic_store_n(&priv->fenced_flush_unsupported, true, __ATOMIC_RELAXED);
+		return ret;
 	}
 
-	return 0;
+	return exbuf.fence_fd;
 }
 
-static int virtio_gpu_bo_flush(struct bo *bo, struct mapping *mapping)
+/*
+ * Returns true if *release_fence is now a fence for the transfers just queued. The next CPU
+ * access of the buffer waits for a copy of it.
+ */
+static bool virtio_gpu_fence_flush(struct bo *bo, struct mapping *mapping, int *release_fence)
+{
+	int fence, copy;
+	struct virtio_gpu_bo_priv *bo_priv;
+	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
+
+	fence = virtio_gpu_fence_after_transfers(bo, mapping->vma->handle);
+	if (fence < 0)
+		return false;
+
+	copy = fcntl(fence, F_DUPFD_CLOEXEC, 0);
+	if (copy < 0) {
+		close(fence);
+		return false;
+	}
+
+	pthread_mutex_lock(&priv->fence_lock);
+	bo_priv = bo->priv;
+	if (!bo_priv) {
+		bo_priv = calloc(1, sizeof(*bo_priv));
+		if (bo_priv) {
+			bo_priv->flush_fence = -1;
+			bo->priv = bo_priv;
+		}
+	}
+
+	/* Earlier transfers have landed once these have. */
+	if (bo_priv) {
+		if (bo_priv->flush_fence >= 0)
+			close(bo_priv->flush_fence);
+		bo_priv->flush_fence = copy;
+		copy = -1;
+	}
+	pthread_mutex_unlock(&priv->fence_lock);
+
+	if (copy >= 0) {
+		close(copy);
+		close(fence);
+		return false;
+	}
+
+	*release_fence = fence;
+	return true;
+}
+
+static int virtio_gpu_bo_flush_fenced(struct bo *bo, struct mapping *mapping, int *release_fence)
 {
 	int ret;
-	size_t i;
+	size_t i, j;
+	uint32_t num_dirty_rects, num_transfers = 0;
+	const struct rectangle *dirty_rects;
 	struct drm_virtgpu_3d_transfer_to_host xfer;
-	struct drm_virtgpu_3d_wait waitcmd;
 	struct virtio_transfers_params xfer_params;
+	struct rectangle boxes[DRV_MAX_PLANES][DRV_MAX_DIRTY_RECTS];
+	uint32_t num_boxes[DRV_MAX_PLANES] = { 0 };
 	struct virtio_gpu_priv *priv = (struct virtio_gpu_priv *)bo->drv->priv;
 
+	if (release_fence)
+		*release_fence = -1;
+
 	if (!features[feat_3d].enabled)
 		return 0;
 
 	if (!(mapping->vma->map_flags & BO_MAP_WRITE))
 		return 0;
 
+	// The guest wrote straight into the host's memory, there's nothing to transfer.
+	if (virtio_gpu_is_blob(bo))
+		return 0;
+
+	/* These transfers can't overtake earlier ones, but a CPU write since might have. */
+	ret = virtio_gpu_wait_flush(bo);
+	if (ret)
+		return ret;
+
 	memset(&xfer, 0, sizeof(xfer));
 	xfer.bo_handle = mapping->vma->handle;
 
@@ -775,50 +1180,64 @@ static int virtio_gpu_bo_flush(struct bo *bo, struct mapping *mapping)
 		xfer.level = bo->meta.strides[0];
 	}
 
-	if (virtio_gpu_supports_combination_natively(bo->drv, bo->meta.format,
-						     bo->meta.use_flags)) {
-		xfer_params.xfers_needed = 1;
-		xfer_params.xfer_boxes[0] = mapping->rect;
-	} else {
-		assert(virtio_gpu_supports_combination_through_emulation(bo->drv, bo->meta.format,
-									 bo->meta.use_flags));
+	// Only transfer what the guest reported writing. Each dirty rect expands to one box per
+	// emulated plane, and boxes in the same plane are coalesced before they're sent.
+	num_dirty_rects = drv_mapping_dirty_rects(mapping, &dirty_rects);
+	for (i = 0; i < num_dirty_rects; i++) {
+		if (virtio_gpu_supports_combination_natively(bo->drv, bo->meta.format,
+							     bo->meta.use_flags)) {
+			xfer_params.xfers_needed = 1;
+			xfer_params.xfer_boxes[0] = dirty_rects[i];
+		} else {
+			assert(virtio_gpu_supports_combination_through_emulation(
+			    bo->drv, bo->meta.format, bo->meta.use_flags));
+
+			virtio_gpu_get_emulated_transfers_params(bo, &dirty_rects[i], &xfer_params);
+		}
 
-		virtio_gpu_get_emulated_transfers_params(bo, &mapping->rect, &xfer_params);
+		for (j = 0; j < xfer_params.xfers_needed; j++)
+			drv_rect_list_add(boxes[j], &num_boxes[j], DRV_MAX_DIRTY_RECTS,
+					  &xfer_params.xfer_boxes[j]);
 	}
 
-	for (i = 0; i < xfer_params.xfers_needed; i++) {
-		xfer.box.x = xfer_params.xfer_boxes[i].x;
-		xfer.box.y = xfer_params.xfer_boxes[i].y;
-		xfer.box.w = xfer_params.xfer_boxes[i].width;
-		xfer.box.h = xfer_params.xfer_boxes[i].height;
-		xfer.box.d = 1;
-
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, &xfer);
-		if (ret) {
-			drv_log("DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST failed with %s\n",
-				strerror(errno));
-			return -errno;
+	for (i = 0; i < DRV_MAX_PLANES; i++) {
+		for (j = 0; j < num_boxes[i]; j++) {
+			xfer.box.x = boxes[i][j].x;
+			xfer.box.y = boxes[i][j].y;
+			xfer.box.w = boxes[i][j].width;
+			xfer.box.h = boxes[i][j].height;
+			xfer.box.d = 1;
+
+			ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST, &xfer);
+			if (ret) {
+				drv_log("DRM_IOCTL_VIRTGPU_TRANSFER_TO_HOST failed with %s\n",
+					strerror(errno));
+				return -errno;
+			}
+
+			num_transfers++;
 		}
 	}
 
 	// If the buffer is only accessed by the host GPU, then the flush is ordered
 	// with subsequent commands. However, if other host hardware can access the
-	// buffer, we need to wait for the transfer to complete for consistency.
-	// TODO(b/136733358): Support returning fences from transfers
+	// buffer, the transfer has to complete first: either the caller takes a fence
+	// that signals then, or we wait for it here.
 	if (bo->meta.use_flags & BO_USE_NON_GPU_HW) {
-		memset(&waitcmd, 0, sizeof(waitcmd));
-		waitcmd.handle = mapping->vma->handle;
+		if (release_fence && num_transfers && virtio_gpu_fence_flush(bo, mapping, release_fence))
+			return 0;
 
-		ret = drmIoctl(bo->drv->fd, DRM_IOCTL_VIRTGPU_WAIT, &waitcmd);
-		if (ret) {
-			drv_log("DRM_IOCTL_VIRTGPU_WAIT failed with %s\n", strerror(errno));
-			return -errno;
-		}
+		return virtio_gpu_wait_host(bo, mapping);
 	}
 
 	return 0;
 }
 
+static int virtio_gpu_bo_flush(struct bo *bo, struct mapping *mapping)
+{
+	return virtio_gpu_bo_flush_fenced(bo, mapping, NULL);
+}
+
 static uint32_t virtio_gpu_resolve_format(struct driver *drv, uint32_t format, uint64_t use_flags)
 {
 	switch (format) {
@@ -879,11 +1298,14 @@ const struct backend backend_virtio_gpu = {
 	.close = virtio_gpu_close,
 	.bo_create = virtio_gpu_bo_create,
 	.bo_destroy = virtio_gpu_bo_destroy,
-	.bo_import = drv_prime_bo_import,
+	.bo_import = virtio_gpu_bo_import,
 	.bo_map = virtio_gpu_bo_map,
-	.bo_unmap = drv_bo_munmap,
+	.bo_unmap = virtio_gpu_bo_unmap,
 	.bo_invalidate = virtio_gpu_bo_invalidate,
 	.bo_flush = virtio_gpu_bo_flush,
+	.bo_flush_fenced = virtio_gpu_bo_flush_fenced,
+	.bo_get_acquire_fence = virtio_gpu_bo_get_acquire_fence,
 	.resolve_format = virtio_gpu_resolve_format,
 	.resource_info = virtio_gpu_resource_info,
+	.map_unlocked = true,
 };